@@ -36,7 +36,31 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <ipxe/xfer.h>
 #include <ipxe/open.h>
 #include <ipxe/process.h>
+#include <ipxe/list.h>
 #include <pxe.h>
+#include <config/general.h>
+
+/* Disambiguate the various error causes */
+#define EPROTO_OUT_OF_ORDER __einfo_error ( EINFO_EPROTO_OUT_OF_ORDER )
+#define EINFO_EPROTO_OUT_OF_ORDER \
+	__einfo_uniqify ( EINFO_EPROTO, 0x01, "Out-of-order data" )
+
+/** Use buffered TFTP reads for PXENV_TFTP_READ */
+#ifdef PXE_TFTP_BUFFERED
+#define PXE_TFTP_BUFFERED_ENABLED 1
+#else
+#define PXE_TFTP_BUFFERED_ENABLED 0
+#endif
+
+/** Maximum amount of data to buffer ahead of the NBP
+ *
+ * TFTP is lock-step, so ceasing to poll the network once this much
+ * data is buffered stops the server until the NBP catches up.
+ */
+#define PXE_TFTP_READAHEAD_MAX ( 64 * 1024 )
+
+/** Maximum packet size that may be presented to the NBP */
+#define PXE_TFTP_MAX_PACKET_SIZE 65464
 
 /** A PXE TFTP connection */
 struct pxe_tftp_connection {
@@ -58,6 +82,22 @@ struct pxe_tftp_connection {
 	unsigned int blkidx;
 	/** Overall return status code */
 	int rc;
+
+	/** Data is buffered rather than copied directly to the NBP */
+	int buffered;
+	/** Packet size presented to the NBP (when buffered) */
+	size_t pktsize;
+	/** File position of next expected data (when buffered)
+	 *
+	 * This is advanced only by delivered data, since seeks
+	 * (e.g. for the TFTP size option) also move the file
+	 * position and maximum file position.
+	 */
+	size_t expected;
+	/** Buffered data queue */
+	struct list_head data;
+	/** Length of buffered data */
+	size_t queued;
 };
 
 /**
@@ -71,6 +111,22 @@ static void pxe_tftp_close ( struct pxe_tftp_connection *pxe_tftp, int rc ) {
 	pxe_tftp->rc = rc;
 }
 
+/**
+ * Discard buffered data
+ *
+ * @v pxe_tftp		PXE TFTP connection
+ */
+static void pxe_tftp_discard ( struct pxe_tftp_connection *pxe_tftp ) {
+	struct io_buffer *iobuf;
+	struct io_buffer *tmp;
+
+	list_for_each_entry_safe ( iobuf, tmp, &pxe_tftp->data, list ) {
+		list_del ( &iobuf->list );
+		free_iob ( iobuf );
+	}
+	pxe_tftp->queued = 0;
+}
+
 /**
  * Check flow control window
  *
@@ -101,6 +157,27 @@ static int pxe_tftp_xfer_deliver ( struct pxe_tftp_connection *pxe_tftp,
 		pxe_tftp->offset = 0;
 	pxe_tftp->offset += meta->offset;
 
+	/* Queue data block, if buffering.  TFTP delivers blocks in
+	 * order, so anything other than the next block is an error.
+	 */
+	if ( pxe_tftp->buffered && len ) {
+		if ( pxe_tftp->offset != pxe_tftp->expected ) {
+			DBG ( " out-of-order data at %zx (expected %zx)",
+			      pxe_tftp->offset, pxe_tftp->expected );
+			rc = -EPROTO_OUT_OF_ORDER;
+			pxe_tftp_close ( pxe_tftp, rc );
+			free_iob ( iobuf );
+			return rc;
+		}
+		pxe_tftp->offset += len;
+		pxe_tftp->expected = pxe_tftp->offset;
+		if ( pxe_tftp->max_offset < pxe_tftp->offset )
+			pxe_tftp->max_offset = pxe_tftp->offset;
+		pxe_tftp->queued += len;
+		list_add_tail ( &iobuf->list, &pxe_tftp->data );
+		return 0;
+	}
+
 	/* Copy data block to buffer */
 	if ( len == 0 ) {
 		/* No data (pure seek); treat as success */
@@ -151,6 +228,7 @@ static struct interface_descriptor pxe_tftp_xfer_desc =
 /** The PXE TFTP connection */
 static struct pxe_tftp_connection pxe_tftp = {
 	.xfer = INTF_INIT ( pxe_tftp_xfer_desc ),
+	.data = LIST_HEAD_INIT ( pxe_tftp.data ),
 };
 
 /**
@@ -168,20 +246,35 @@ static struct pxe_tftp_connection pxe_tftp = {
  * @v port		TFTP server port
  * @v filename		File name
  * @v blksize		Requested block size
+ * @v sizeonly		Fetch only the file size
+ * @v buffered		Buffer data rather than copying directly to NBP
  * @ret rc		Return status code
+ *
+ * When buffered, the largest possible blksize is negotiated with the
+ * server regardless of the requested block size, and data is held in
+ * a local buffer to be read out in blocks of the requested size.
  */
 static int pxe_tftp_open ( uint32_t ipaddress, unsigned int port,
 			   const unsigned char *filename, size_t blksize,
-			   int sizeonly ) {
+			   int sizeonly, int buffered ) {
 	char uri_string[PXE_TFTP_URI_LEN];
 	struct in_addr address;
 	int rc;
 
 	/* Reset PXE TFTP connection structure */
+	pxe_tftp_discard ( &pxe_tftp );
 	memset ( &pxe_tftp, 0, sizeof ( pxe_tftp ) );
 	intf_init ( &pxe_tftp.xfer, &pxe_tftp_xfer_desc, NULL );
+	INIT_LIST_HEAD ( &pxe_tftp.data );
 	if ( blksize < TFTP_DEFAULT_BLKSIZE )
 		blksize = TFTP_DEFAULT_BLKSIZE;
+	if ( buffered ) {
+		if ( blksize > PXE_TFTP_MAX_PACKET_SIZE )
+			blksize = PXE_TFTP_MAX_PACKET_SIZE;
+		pxe_tftp.buffered = 1;
+		pxe_tftp.pktsize = blksize;
+		blksize = TFTP_MAX_BLKSIZE;
+	}
 	pxe_tftp.blksize = blksize;
 	pxe_tftp.rc = -EINPROGRESS;
 
@@ -259,8 +352,8 @@ static PXENV_EXIT_t pxenv_tftp_open ( struct s_PXENV_TFTP_OPEN *tftp_open ) {
 	if ( ( rc = pxe_tftp_open ( tftp_open->ServerIPAddress,
 				    tftp_open->TFTPPort,
 				    tftp_open->FileName,
-				    tftp_open->PacketSize,
-				    0) ) != 0 ) {
+				    tftp_open->PacketSize, 0,
+				    PXE_TFTP_BUFFERED_ENABLED ) ) != 0 ) {
 		tftp_open->Status = PXENV_STATUS ( rc );
 		return PXENV_EXIT_FAILURE;
 	}
@@ -271,7 +364,8 @@ static PXENV_EXIT_t pxenv_tftp_open ( struct s_PXENV_TFTP_OPEN *tftp_open ) {
 		step();
 	}
 	pxe_tftp.blksize = xfer_window ( &pxe_tftp.xfer );
-	tftp_open->PacketSize = pxe_tftp.blksize;
+	tftp_open->PacketSize = ( pxe_tftp.buffered ? pxe_tftp.pktsize :
+				  pxe_tftp.blksize );
 	DBG ( " blksize=%d", tftp_open->PacketSize );
 
 	/* EINPROGRESS is normal; we don't wait for the whole transfer */
@@ -303,10 +397,64 @@ static PXENV_EXIT_t pxenv_tftp_close ( struct s_PXENV_TFTP_CLOSE *tftp_close ) {
 	DBG ( "PXENV_TFTP_CLOSE" );
 
 	pxe_tftp_close ( &pxe_tftp, 0 );
+	pxe_tftp_discard ( &pxe_tftp );
 	tftp_close->Status = PXENV_STATUS_SUCCESS;
 	return PXENV_EXIT_SUCCESS;
 }
 
+/**
+ * Read a single packet from local buffer
+ *
+ * @v pxe_tftp		PXE TFTP connection
+ * @ret rc		Return status code
+ *
+ * Copies up to one NBP-sized packet of buffered data to the NBP's
+ * buffer, and records the length copied in @c pxe_tftp->size.  A
+ * packet shorter than the NBP's packet size marks the end of the
+ * file.
+ */
+static int pxe_tftp_read_buffered ( struct pxe_tftp_connection *pxe_tftp ) {
+	struct io_buffer *iobuf;
+	struct io_buffer *tmp;
+	size_t len;
+	int rc;
+
+	/* Keep the transfer running unless the buffer is full */
+	if ( pxe_tftp->queued < PXE_TFTP_READAHEAD_MAX )
+		step();
+
+	/* Wait for a full packet, or for the end of the file */
+	while ( ( ( rc = pxe_tftp->rc ) == -EINPROGRESS ) &&
+		( pxe_tftp->queued < pxe_tftp->pktsize ) ) {
+		step();
+	}
+
+	/* Fail on error */
+	if ( ( rc != 0 ) && ( rc != -EINPROGRESS ) )
+		return rc;
+
+	/* Copy out one packet */
+	pxe_tftp->size = 0;
+	list_for_each_entry_safe ( iobuf, tmp, &pxe_tftp->data, list ) {
+		len = iob_len ( iobuf );
+		if ( len > ( pxe_tftp->pktsize - pxe_tftp->size ) )
+			len = ( pxe_tftp->pktsize - pxe_tftp->size );
+		copy_to_user ( pxe_tftp->buffer, pxe_tftp->size,
+			       iobuf->data, len );
+		iob_pull ( iobuf, len );
+		if ( ! iob_len ( iobuf ) ) {
+			list_del ( &iobuf->list );
+			free_iob ( iobuf );
+		}
+		pxe_tftp->size += len;
+		if ( pxe_tftp->size == pxe_tftp->pktsize )
+			break;
+	}
+	pxe_tftp->queued -= pxe_tftp->size;
+
+	return 0;
+}
+
 /**
  * TFTP READ
  *
@@ -374,6 +522,18 @@ static PXENV_EXIT_t pxenv_tftp_read ( struct s_PXENV_TFTP_READ *tftp_read ) {
 	DBG ( "PXENV_TFTP_READ to %04x:%04x",
 	      tftp_read->Buffer.segment, tftp_read->Buffer.offset );
 
+	/* Serve from local buffer, if applicable */
+	if ( pxe_tftp.buffered ) {
+		pxe_tftp.buffer = real_to_user ( tftp_read->Buffer.segment,
+						 tftp_read->Buffer.offset );
+		rc = pxe_tftp_read_buffered ( &pxe_tftp );
+		pxe_tftp.buffer = UNULL;
+		tftp_read->BufferSize = pxe_tftp.size;
+		tftp_read->PacketNumber = ++pxe_tftp.blkidx;
+		tftp_read->Status = PXENV_STATUS ( rc );
+		return ( rc ? PXENV_EXIT_FAILURE : PXENV_EXIT_SUCCESS );
+	}
+
 	/* Read single block into buffer */
 	pxe_tftp.buffer = real_to_user ( tftp_read->Buffer.segment,
 					 tftp_read->Buffer.offset );
@@ -481,9 +641,13 @@ PXENV_EXIT_t pxenv_tftp_read_file ( struct s_PXENV_TFTP_READ_FILE
 	DBG ( "PXENV_TFTP_READ_FILE to %08x+%x", tftp_read_file->Buffer,
 	      tftp_read_file->BufferSize );
 
-	/* Open TFTP file */
+	/* Open TFTP file.  The whole file is read in one call, so the
+	 * largest blksize may be used if buffered mode is enabled.
+	 */
 	if ( ( rc = pxe_tftp_open ( tftp_read_file->ServerIPAddress, 0,
-				    tftp_read_file->FileName, 0, 0 ) ) != 0 ) {
+				    tftp_read_file->FileName,
+				    ( PXE_TFTP_BUFFERED_ENABLED ?
+				      TFTP_MAX_BLKSIZE : 0 ), 0, 0 ) ) != 0 ) {
 		tftp_read_file->Status = PXENV_STATUS ( rc );
 		return PXENV_EXIT_FAILURE;
 	}
@@ -553,7 +717,7 @@ static PXENV_EXIT_t pxenv_tftp_get_fsize ( struct s_PXENV_TFTP_GET_FSIZE
 
 	/* Open TFTP file */
 	if ( ( rc = pxe_tftp_open ( tftp_get_fsize->ServerIPAddress, 0,
-				    tftp_get_fsize->FileName, 0, 1 ) ) != 0 ) {
+				    tftp_get_fsize->FileName, 0, 1, 0 ) ) != 0 ) {
 		tftp_get_fsize->Status = PXENV_STATUS ( rc );
 		return PXENV_EXIT_FAILURE;
 	}
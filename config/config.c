@@ -293,6 +293,9 @@ REQUIRE_OBJECT ( ipstat_cmd );
 #ifdef PROFSTAT_CMD
 REQUIRE_OBJECT ( profstat_cmd );
 #endif
+#ifdef NETBENCH_CMD
+REQUIRE_OBJECT ( netbench_cmd );
+#endif
 
 /*
  * Drag in miscellaneous objects
@@ -323,6 +326,7 @@ REQUIRE_OBJECT ( embedded );
 /* linux drivers aren't picked up by the parserom utility so drag them in here */
 #ifdef DRIVERS_LINUX
 REQUIRE_OBJECT ( tap );
+REQUIRE_OBJECT ( pipe );
 #endif
 
 /*
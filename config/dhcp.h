@@ -0,0 +1,34 @@
+#ifndef CONFIG_DHCP_H
+#define CONFIG_DHCP_H
+
+/** @file
+ *
+ * DHCP configuration
+ *
+ */
+
+FILE_LICENCE ( GPL2_OR_LATER );
+
+/*
+ * DHCP exchange policy
+ *
+ * DHCP_RAPID_COMMIT_MODE adds the Rapid Commit option (RFC 4039) to
+ * each DHCPDISCOVER, allowing a server that supports it to complete
+ * the lease with a single DHCPACK rather than a DHCPOFFER /
+ * DHCPREQUEST / DHCPACK exchange.
+ *
+ * DHCP_FAST_OFFER_MODE commits immediately to a DHCPOFFER that
+ * already carries a boot filename, rather than waiting up to
+ * PROXYDHCP_MAX_TIMEOUT for ProxyDHCP offers to arrive.  Do not
+ * enable this on networks where a separate ProxyDHCP server is
+ * expected to override the boot filename.
+ */
+#undef	DHCP_RAPID_COMMIT_MODE	/* Request two-message exchange */
+#undef	DHCP_FAST_OFFER_MODE	/* Commit to a complete offer immediately */
+
+#include <config/named.h>
+#include NAMED_CONFIG(dhcp.h)
+#include <config/local/dhcp.h>
+#include LOCAL_NAMED_CONFIG(dhcp.h)
+
+#endif /* CONFIG_DHCP_H */
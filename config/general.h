@@ -70,6 +70,9 @@ FILE_LICENCE ( GPL2_OR_LATER );
  */
 //#undef	PXE_STACK		/* PXE stack in iPXE - you want this! */
 //#undef	PXE_MENU		/* PXE menu booting */
+#undef	PXE_TFTP_BUFFERED	/* Serve PXENV_TFTP_READ from a local
+				 * buffer filled using the largest
+				 * TFTP blksize */
 
 /*
  * Download protocols
@@ -160,6 +163,7 @@ FILE_LICENCE ( GPL2_OR_LATER );
 //#define CONSOLE_CMD		/* Console command */
 #define IPSTAT_CMD		/* IP statistics commands */
 //#define PROFSTAT_CMD		/* Profiling commands */
+//#define NETBENCH_CMD		/* Network benchmarking commands */
 
 /*
  * ROM-specific options
@@ -181,6 +185,11 @@ FILE_LICENCE ( GPL2_OR_LATER );
  */
 
 #define	NETDEV_DISCARD_RATE 0	/* Drop every N packets (0=>no drop) */
+#undef	PROFILE_HISTOGRAMS	/* Record latency histograms for
+				 * profstat percentiles */
+#undef	AUTOBOOT_CONCURRENT	/* Configure all network devices
+				 * concurrently and boot from the first
+				 * to complete configuration */
 #undef	BUILD_SERIAL		/* Include an automatic build serial
 				 * number.  Add "bs" to the list of
 				 * make targets.  For example:
@@ -24,6 +24,8 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <ipxe/tables.h>
 #include <ipxe/init.h>
 #include <ipxe/interface.h>
+#include <ipxe/process.h>
+#include <ipxe/pending.h>
 #include <ipxe/device.h>
 
 /**
@@ -39,6 +41,9 @@ static LIST_HEAD ( devices );
 /** Device removal inhibition counter */
 int device_keep_count = 0;
 
+/** Device probes still in progress */
+static struct pending_operation device_probes;
+
 /**
  * Probe a root device
  *
@@ -87,6 +92,50 @@ static void probe_devices ( void ) {
 	}
 }
 
+/**
+ * Mark device probe as in progress
+ *
+ * @v dev		Device
+ *
+ * A driver may complete its probe asynchronously (e.g. in order to
+ * wait for a hardware reset without blocking the probing of other
+ * devices).  The bus layer calls this function when the driver
+ * reports that its probe is still in progress, and the driver must
+ * eventually call device_probe_end(), including when the device is
+ * removed before the probe has completed.
+ */
+void device_probe_begin ( struct device *dev ) {
+
+	DBG ( "Device %s probe in progress\n", dev->name );
+	pending_get ( &device_probes );
+}
+
+/**
+ * Mark device probe as complete
+ *
+ * @v dev		Device
+ * @v rc		Probe status code
+ */
+void device_probe_end ( struct device *dev, int rc ) {
+
+	if ( rc == 0 ) {
+		DBG ( "Device %s probe complete\n", dev->name );
+	} else {
+		DBG ( "Device %s probe failed: %s\n", dev->name, strerror ( rc ) );
+	}
+	pending_put ( &device_probes );
+}
+
+/**
+ * Wait for all device probes to complete
+ *
+ */
+void device_probe_wait ( void ) {
+
+	while ( is_pending ( &device_probes ) )
+		step();
+}
+
 /**
  * Remove all devices
  *
@@ -89,6 +89,12 @@ static LIST_HEAD ( free_blocks );
 /** Total amount of free memory */
 size_t freemem;
 
+/** Total amount of used memory */
+size_t usedmem;
+
+/** Maximum amount of used memory */
+size_t maxusedmem;
+
 /**
  * Heap size
  *
@@ -288,8 +294,11 @@ void * alloc_memblock ( size_t size, size_t align, size_t offset ) {
 				 */
 				if ( pre_size < MIN_MEMBLOCK_SIZE )
 					list_del ( &pre->list );
-				/* Update total free memory */
+				/* Update memory usage statistics */
 				freemem -= size;
+				usedmem += size;
+				if ( usedmem > maxusedmem )
+					maxusedmem = usedmem;
 				/* Return allocated block */
 				DBG ( "Allocated [%p,%p)\n", block,
 				      ( ( ( void * ) block ) + size ) );
@@ -380,8 +389,9 @@ void free_memblock ( void *ptr, size_t size ) {
 		list_del ( &block->list );
 	}
 
-	/* Update free memory counter */
+	/* Update memory usage statistics */
 	freemem += size;
+	usedmem -= size;
 
 	valgrind_make_blocks_noaccess();
 }
@@ -511,10 +521,17 @@ void * zalloc ( size_t size ) {
  * @c start must be aligned to at least a multiple of sizeof(void*).
  */
 void mpopulate ( void *start, size_t len ) {
+
 	/* Prevent free_memblock() from rounding up len beyond the end
 	 * of what we were actually given...
 	 */
-	free_memblock ( start, ( len & ~( MIN_MEMBLOCK_SIZE - 1 ) ) );
+	len &= ~( MIN_MEMBLOCK_SIZE - 1 );
+
+	/* Add to allocation pool */
+	free_memblock ( start, len );
+
+	/* Fix up memory usage statistics */
+	usedmem += len;
 }
 
 /**
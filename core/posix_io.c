@@ -59,6 +59,8 @@ struct posix_file {
 	size_t filesize;
 	/** Received data queue */
 	struct list_head data;
+	/** Length of data in received data queue */
+	size_t queued;
 };
 
 /** List of open files */
@@ -113,6 +115,7 @@ static int posix_file_xfer_deliver ( struct posix_file *file,
 		file->filesize = file->pos;
 
 	if ( iob_len ( iobuf ) ) {
+		file->queued += iob_len ( iobuf );
 		list_add_tail ( &iobuf->list, &file->data );
 	} else {
 		free_iob ( iobuf );
@@ -121,9 +124,24 @@ static int posix_file_xfer_deliver ( struct posix_file *file,
 	return 0;
 }
 
+/**
+ * Check flow control window
+ *
+ * @v file		POSIX file
+ * @ret len		Length of window
+ */
+static size_t posix_file_xfer_window ( struct posix_file *file ) {
+
+	/* Allow data to be queued up to the read-ahead limit */
+	if ( file->queued >= POSIX_READAHEAD_MAX )
+		return 0;
+	return ( POSIX_READAHEAD_MAX - file->queued );
+}
+
 /** POSIX file data transfer interface operations */
 static struct interface_operation posix_file_xfer_operations[] = {
 	INTF_OP ( xfer_deliver, struct posix_file *, posix_file_xfer_deliver ),
+	INTF_OP ( xfer_window, struct posix_file *, posix_file_xfer_window ),
 	INTF_OP ( intf_close, struct posix_file *, posix_file_finished ),
 };
 
@@ -257,35 +275,56 @@ int select ( fd_set *readfds, int wait ) {
  *
  * This call is non-blocking; if no data is available to read then
  * -EWOULDBLOCK will be returned.
+ *
+ * The data transfer is stepped on every call while less than
+ * POSIX_READAHEAD_MAX bytes are queued, so that the transport keeps
+ * streaming between calls.  As many queued I/O buffers as will fit
+ * are returned by a single call.
  */
 ssize_t read_user ( int fd, userptr_t buffer, off_t offset, size_t max_len ) {
 	struct posix_file *file;
 	struct io_buffer *iobuf;
+	struct io_buffer *tmp;
+	size_t total = 0;
 	size_t len;
+	int was_full;
 
 	/* Identify file */
 	file = posix_fd_to_file ( fd );
 	if ( ! file )
 		return -EBADF;
 
-	/* Try to fetch more data if none available */
-	if ( list_empty ( &file->data ) )
+	/* Keep the transfer streaming unless the read-ahead window
+	 * is full.
+	 */
+	if ( file->queued < POSIX_READAHEAD_MAX )
 		step();
+	was_full = ( file->queued >= POSIX_READAHEAD_MAX );
 
-	/* Dequeue at most one received I/O buffer into user buffer */
-	list_for_each_entry ( iobuf, &file->data, list ) {
+	/* Dequeue as many received I/O buffers as will fit into
+	 * user buffer.
+	 */
+	list_for_each_entry_safe ( iobuf, tmp, &file->data, list ) {
+		if ( total == max_len )
+			break;
 		len = iob_len ( iobuf );
-		if ( len > max_len )
-			len = max_len;
-		copy_to_user ( buffer, offset, iobuf->data, len );
+		if ( len > ( max_len - total ) )
+			len = ( max_len - total );
+		copy_to_user ( buffer, ( offset + total ), iobuf->data, len );
 		iob_pull ( iobuf, len );
 		if ( ! iob_len ( iobuf ) ) {
 			list_del ( &iobuf->list );
 			free_iob ( iobuf );
 		}
-		file->pos += len;
 		assert ( len != 0 );
-		return len;
+		total += len;
+	}
+	if ( total ) {
+		file->pos += total;
+		file->queued -= total;
+		if ( was_full && ( file->rc == -EINPROGRESS ) )
+			xfer_window_changed ( &file->xfer );
+		return total;
 	}
 
 	/* If file has completed, return (after returning all data) */
@@ -21,6 +21,7 @@ FILE_LICENCE ( GPL2_OR_LATER );
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <assert.h>
 #include <ipxe/isqrt.h>
@@ -38,6 +39,11 @@ FILE_LICENCE ( GPL2_OR_LATER );
  * The algorithm for updating the mean and variance estimators is from
  * The Art of Computer Programming (via Wikipedia), with adjustments
  * to avoid the use of floating-point instructions.
+ *
+ * If PROFILE_HISTOGRAMS is enabled, samples are also counted in a
+ * log-linear histogram from which approximate percentiles can be
+ * read.  Each reported percentile is the upper bound of the bucket
+ * that contains it, so it overestimates by at most one bucket width.
  */
 
 /** Accumulated time excluded from profiling */
@@ -96,6 +102,55 @@ static inline unsigned int profile_accvar_shift ( struct profiler *profiler ) {
 		 - profiler->accvar_msb );
 }
 
+/**
+ * Calculate histogram bucket for a sample value
+ *
+ * @v sample		Sample value
+ * @ret index		Bucket index
+ */
+unsigned int profile_hist_index ( unsigned long sample ) {
+	unsigned int msb;
+
+	/* Small samples each have their own bucket */
+	if ( sample < ( 1UL << ( PROFILE_HIST_SUB_BITS + 1 ) ) )
+		return sample;
+
+	/* Clamp large samples into the final bucket */
+	msb = ( flsl ( sample ) - 1 );
+	if ( msb > PROFILE_HIST_MAX_MSB )
+		return ( PROFILE_HIST_MAX_BUCKETS - 1 );
+
+	return ( ( ( msb - PROFILE_HIST_SUB_BITS + 1 )
+		   << PROFILE_HIST_SUB_BITS ) |
+		 ( ( sample >> ( msb - PROFILE_HIST_SUB_BITS ) ) &
+		   ( ( 1UL << PROFILE_HIST_SUB_BITS ) - 1 ) ) );
+}
+
+/**
+ * Calculate upper bound of histogram bucket
+ *
+ * @v index		Bucket index
+ * @ret limit		Largest sample value counted in this bucket
+ */
+unsigned long profile_hist_limit ( unsigned int index ) {
+	unsigned int msb;
+	unsigned long sub;
+
+	/* Small samples each have their own bucket */
+	if ( index < ( 1U << ( PROFILE_HIST_SUB_BITS + 1 ) ) )
+		return index;
+
+	/* Final bucket is unbounded */
+	if ( index == ( PROFILE_HIST_MAX_BUCKETS - 1 ) )
+		return ~0UL;
+
+	msb = ( ( index >> PROFILE_HIST_SUB_BITS ) + PROFILE_HIST_SUB_BITS
+		- 1 );
+	sub = ( index & ( ( 1U << PROFILE_HIST_SUB_BITS ) - 1 ) );
+	return ( ( ( ( ( 1UL << PROFILE_HIST_SUB_BITS ) | sub ) + 1 )
+		   << ( msb - PROFILE_HIST_SUB_BITS ) ) - 1 );
+}
+
 /**
  * Update profiler with a new sample
  *
@@ -121,6 +176,12 @@ void profile_update ( struct profiler *profiler, unsigned long sample ) {
 	/* Update sample count */
 	profiler->count++;
 
+	/* Update maximum and histogram */
+	if ( profiler->max < sample )
+		profiler->max = sample;
+	if ( PROFILE_HIST_BUCKETS )
+		profiler->hist[ profile_hist_index ( sample ) ]++;
+
 	/* Adjust mean sample value scale if necessary.  Skip if
 	 * sample is zero (in which case flsl(sample)-1 would
 	 * underflow): in the case of a zero sample we have no need to
@@ -270,3 +331,75 @@ unsigned long profile_stddev ( struct profiler *profiler ) {
 
 	return isqrt ( profile_variance ( profiler ) );
 }
+
+/**
+ * Get approximate percentile from a histogram
+ *
+ * @v hist		Histogram
+ * @v buckets		Number of histogram buckets
+ * @v count		Number of samples
+ * @v max		Maximum sample value
+ * @v percent		Percentile (0-100)
+ * @ret value		Percentile value, or zero if not available
+ */
+unsigned long profile_hist_percentile ( const unsigned int *hist,
+					unsigned int buckets,
+					unsigned long count, unsigned long max,
+					unsigned int percent ) {
+	unsigned long long target;
+	unsigned long long seen = 0;
+	unsigned long limit;
+	unsigned int index;
+
+	/* Calculate rank of percentile sample, rounding up */
+	target = ( ( ( ( unsigned long long ) count ) * percent + 99 ) / 100 );
+	if ( ! target )
+		return 0;
+
+	/* Find bucket containing this sample */
+	for ( index = 0 ; index < buckets ; index++ ) {
+		seen += hist[index];
+		if ( seen >= target ) {
+			limit = profile_hist_limit ( index );
+			return ( ( limit < max ) ? limit : max );
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Get approximate sample percentile
+ *
+ * @v profiler		Profiler
+ * @v percent		Percentile (0-100)
+ * @ret value		Percentile value, or zero if not available
+ *
+ * Percentiles are available only if PROFILE_HISTOGRAMS is enabled.
+ */
+unsigned long profile_percentile ( struct profiler *profiler,
+				   unsigned int percent ) {
+
+	return profile_hist_percentile ( profiler->hist, PROFILE_HIST_BUCKETS,
+					 profiler->count, profiler->max,
+					 percent );
+}
+
+/**
+ * Reset profiler
+ *
+ * @v profiler		Profiler
+ *
+ * Discards all recorded samples.  Any profiling currently in
+ * progress is unaffected.
+ */
+void profile_reset ( struct profiler *profiler ) {
+
+	profiler->count = 0;
+	profiler->mean = 0;
+	profiler->mean_msb = 0;
+	profiler->accvar = 0;
+	profiler->accvar_msb = 0;
+	profiler->max = 0;
+	memset ( profiler->hist, 0, sizeof ( profiler->hist ) );
+}
@@ -295,7 +295,14 @@ int pci_probe ( struct pci_device *pci ) {
 	DBGC ( pci, PCI_FMT " has mem %lx io %lx irq %d\n",
 	       PCI_ARGS ( pci ), pci->membase, pci->ioaddr, pci->irq );
 
-	if ( ( rc = pci->driver->probe ( pci ) ) != 0 ) {
+	rc = pci->driver->probe ( pci );
+	pci->probe_rc = rc;
+	if ( rc == -EINPROGRESS ) {
+		DBGC ( pci, PCI_FMT " probe in progress\n", PCI_ARGS ( pci ) );
+		device_probe_begin ( &pci->dev );
+		return 0;
+	}
+	if ( rc != 0 ) {
 		DBGC ( pci, PCI_FMT " probe failed: %s\n",
 		       PCI_ARGS ( pci ), strerror ( rc ) );
 		return rc;
@@ -304,6 +311,28 @@ int pci_probe ( struct pci_device *pci ) {
 	return 0;
 }
 
+/**
+ * Complete asynchronous probe of a PCI device
+ *
+ * @v pci		PCI device
+ * @v rc		Probe status code
+ *
+ * A device whose asynchronous probe fails remains in the device
+ * hierarchy until it is removed; the driver's remove() method must
+ * therefore cope with a device that failed to probe.
+ */
+void pci_probe_complete ( struct pci_device *pci, int rc ) {
+
+	if ( rc == 0 ) {
+		DBGC ( pci, PCI_FMT " probe complete\n", PCI_ARGS ( pci ) );
+	} else {
+		DBGC ( pci, PCI_FMT " probe failed: %s\n",
+		       PCI_ARGS ( pci ), strerror ( rc ) );
+	}
+	pci->probe_rc = rc;
+	device_probe_end ( &pci->dev, rc );
+}
+
 /**
  * Remove a PCI device
  *
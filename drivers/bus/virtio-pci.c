@@ -11,8 +11,11 @@
  *
  */
 
+#include "errno.h"
+#include "byteswap.h"
 #include "etherboot.h"
 #include "ipxe/io.h"
+#include "ipxe/pci.h"
 #include "ipxe/virtio-ring.h"
 #include "ipxe/virtio-pci.h"
 
@@ -62,3 +65,240 @@ int vp_find_vq(unsigned int ioaddr, int queue_index,
 
    return num;
 }
+
+/*
+ * virtio_pci_find_capability
+ *
+ * find the first vendor-specific PCI capability of a given virtio
+ * configuration type
+ *
+ */
+
+int virtio_pci_find_capability(struct pci_device *pci, uint8_t cfg_type)
+{
+   int pos;
+   uint8_t type, bar;
+
+   for (pos = pci_find_capability(pci, PCI_CAP_ID_VNDR);
+        pos > 0;
+        pos = pci_find_next_capability(pci, pos, PCI_CAP_ID_VNDR)) {
+
+           pci_read_config_byte(pci, pos + offsetof(struct virtio_pci_cap,
+                                cfg_type), &type);
+           pci_read_config_byte(pci, pos + offsetof(struct virtio_pci_cap,
+                                bar), &bar);
+
+           /* Ignore structures with reserved BAR values */
+           if (bar > 0x5) {
+                   continue;
+           }
+
+           if (type == cfg_type) {
+                   return pos;
+           }
+   }
+   return 0;
+}
+
+/*
+ * virtio_pci_map_capability
+ *
+ * map the region described by a virtio PCI capability, starting
+ * at offset start within the region and at most size bytes long
+ *
+ */
+
+int virtio_pci_map_capability(struct pci_device *pci, int cap, size_t minlen,
+                              u32 align, u32 start, u32 size,
+                              struct virtio_pci_region *region)
+{
+   u8 bar;
+   u32 offset, length, base_raw;
+   unsigned long base;
+
+   pci_read_config_byte(pci, cap + offsetof(struct virtio_pci_cap, bar), &bar);
+   pci_read_config_dword(pci, cap + offsetof(struct virtio_pci_cap, offset),
+                         &offset);
+   pci_read_config_dword(pci, cap + offsetof(struct virtio_pci_cap, length),
+                         &length);
+
+   if (length <= start) {
+           DBG("VIRTIO-PCI bad capability len %d (>%d expected)\n",
+               length, start);
+           return -EINVAL;
+   }
+   if (length - start < minlen) {
+           DBG("VIRTIO-PCI bad capability len %d (>=%zd expected)\n",
+               length, minlen);
+           return -EINVAL;
+   }
+   length -= start;
+   if (start + offset < offset) {
+           DBG("VIRTIO-PCI map wrap-around %d+%d\n", start, offset);
+           return -EINVAL;
+   }
+   offset += start;
+   if (offset & (align - 1)) {
+           DBG("VIRTIO-PCI offset %d not aligned to %d\n", offset, align);
+           return -EINVAL;
+   }
+   if (length > size) {
+           length = size;
+   }
+
+   if (minlen + offset < minlen ||
+       minlen + offset > pci_bar_size(pci, PCI_BASE_ADDRESS_0 + 4 * bar)) {
+           DBG("VIRTIO-PCI map virtio %zd@%d out of range on bar %i\n",
+               minlen, offset, bar);
+           return -EINVAL;
+   }
+
+   region->base = NULL;
+   region->length = length;
+   region->bar = bar;
+
+   base = pci_bar_start(pci, PCI_BASE_ADDRESS_0 + 4 * bar);
+   if (!base) {
+           DBG("VIRTIO-PCI bar %i is not assigned\n", bar);
+           return -ENODEV;
+   }
+
+   pci_read_config_dword(pci, PCI_BASE_ADDRESS_0 + 4 * bar, &base_raw);
+   if (base_raw & PCI_BASE_ADDRESS_SPACE_IO) {
+           /* Region accessed using port I/O */
+           region->base = (void *)(base + offset);
+           region->flags = VIRTIO_PCI_REGION_PORT;
+   } else {
+           /* Region mapped into memory space */
+           region->base = ioremap(base + offset, length);
+           region->flags = VIRTIO_PCI_REGION_MEMORY;
+   }
+   if (!region->base) {
+           DBG("VIRTIO-PCI could not map bar %i\n", bar);
+           return -ENOMEM;
+   }
+   return 0;
+}
+
+/*
+ * virtio_pci_unmap_capability
+ *
+ * release a region mapped by virtio_pci_map_capability
+ *
+ */
+
+void virtio_pci_unmap_capability(struct virtio_pci_region *region)
+{
+   if ((region->flags & VIRTIO_PCI_REGION_TYPE_MASK) ==
+       VIRTIO_PCI_REGION_MEMORY) {
+           iounmap(region->base);
+   }
+   region->base = NULL;
+   region->flags = 0;
+}
+
+/*
+ * vpm_notify
+ *
+ * tell a virtio 1.0 device that new buffers are available
+ *
+ */
+
+void vpm_notify(struct vring_virtqueue *vq)
+{
+   vpm_iowrite16(&vq->notification, (u16)vq->queue_index, 0);
+}
+
+/*
+ * vpm_find_vqs
+ *
+ * set up and enable the first nvqs virtqueues of a virtio 1.0 device
+ *
+ */
+
+int vpm_find_vqs(struct virtio_pci_modern_device *vdev,
+                 unsigned nvqs, struct vring_virtqueue *vqs)
+{
+   struct vring_virtqueue *vq;
+   struct vring *vr;
+   unsigned i;
+   u16 size, off;
+   u32 notify_offset_multiplier;
+   int err;
+
+   if (nvqs > vpm_ioread16(&vdev->common, COMMON_OFFSET(num_queues))) {
+           return -ENOENT;
+   }
+
+   /* Read notify_off_multiplier from config space. */
+   pci_read_config_dword(vdev->pci,
+                         vdev->notify_cap_pos +
+                         offsetof(struct virtio_pci_notify_cap,
+                         notify_off_multiplier),
+                         &notify_offset_multiplier);
+
+   for (i = 0; i < nvqs; i++) {
+           /* Select the queue we're interested in */
+           vpm_iowrite16(&vdev->common, (u16)i, COMMON_OFFSET(queue_select));
+
+           /* Check if queue is available */
+           size = vpm_ioread16(&vdev->common, COMMON_OFFSET(queue_size));
+           if (!size) {
+                   return -ENOENT;
+           }
+           if (size & (size - 1)) {
+                   DBG("VIRTIO-PCI %p: bad queue size %d\n", vdev, size);
+                   return -EINVAL;
+           }
+
+           /* Our rings are statically sized, so use a smaller queue
+            * if the device offers a larger one
+            */
+           if (size > MAX_QUEUE_NUM) {
+                   size = MAX_QUEUE_NUM;
+           }
+
+           vq = &vqs[i];
+           vr = &vq->vring;
+           vq->queue_index = i;
+
+           /* get offset of notification word for this vq */
+           off = vpm_ioread16(&vdev->common, COMMON_OFFSET(queue_notify_off));
+
+           vring_init(vr, size, (unsigned char *)&vq->queue);
+
+           /* activate the queue */
+           vpm_iowrite16(&vdev->common, size, COMMON_OFFSET(queue_size));
+
+           vpm_iowrite64(&vdev->common, (u64)virt_to_phys(vr->desc),
+                         COMMON_OFFSET(queue_desc_lo),
+                         COMMON_OFFSET(queue_desc_hi));
+           vpm_iowrite64(&vdev->common, (u64)virt_to_phys(vr->avail),
+                         COMMON_OFFSET(queue_avail_lo),
+                         COMMON_OFFSET(queue_avail_hi));
+           vpm_iowrite64(&vdev->common, (u64)virt_to_phys(vr->used),
+                         COMMON_OFFSET(queue_used_lo),
+                         COMMON_OFFSET(queue_used_hi));
+
+           err = virtio_pci_map_capability(vdev->pci,
+                                           vdev->notify_cap_pos, 2, 2,
+                                           off * notify_offset_multiplier, 2,
+                                           &vq->notification);
+           if (err) {
+                   while (i--)
+                           virtio_pci_unmap_capability(&vqs[i].notification);
+                   return err;
+           }
+   }
+
+   /* Select and activate all queues. Has to be done last: once we do
+    * this, there's no way to go back except reset.
+    */
+   for (i = 0; i < nvqs; i++) {
+           vq = &vqs[i];
+           vpm_iowrite16(&vdev->common, (u16)vq->queue_index,
+                         COMMON_OFFSET(queue_select));
+           vpm_iowrite16(&vdev->common, 1, COMMON_OFFSET(queue_enable));
+   }
+   return 0;
+}
@@ -80,6 +80,11 @@ void *vring_get_buf(struct vring_virtqueue *vq, unsigned int *len)
 
    vq->last_used_idx++;
 
+   /* keep asking for interrupts, if they are wanted */
+
+   if (vq->event_idx && !(vr->avail->flags & VRING_AVAIL_F_NO_INTERRUPT))
+           vring_used_event(vr) = vq->last_used_idx;
+
    return opaque;
 }
 
@@ -122,15 +127,37 @@ void vring_add_buf(struct vring_virtqueue *vq,
    wmb();
 }
 
-void vring_kick(unsigned int ioaddr, struct vring_virtqueue *vq, int num_added)
+/*
+ * vring_kick
+ *
+ * make num_added buffers available to the device, and notify it
+ * unless it has told us that it does not need to know
+ *
+ */
+
+void vring_kick(struct virtio_pci_modern_device *vdev, unsigned int ioaddr,
+                struct vring_virtqueue *vq, int num_added)
 {
    struct vring *vr = &vq->vring;
+   u16 old_idx, new_idx;
+   int notify;
+
+   old_idx = vr->avail->idx;
+   new_idx = old_idx + num_added;
 
    wmb();
-   vr->avail->idx += num_added;
+   vr->avail->idx = new_idx;
 
    mb();
-   if (!(vr->used->flags & VRING_USED_F_NO_NOTIFY))
+   if (vq->event_idx)
+           notify = vring_need_event(vring_avail_event(vr), new_idx, old_idx);
+   else
+           notify = !(vr->used->flags & VRING_USED_F_NO_NOTIFY);
+   if (!notify)
+           return;
+
+   if (vdev)
+           vpm_notify(vq);
+   else
            vp_notify(ioaddr, vq->queue_index);
 }
-
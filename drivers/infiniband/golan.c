@@ -27,9 +27,18 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <ipxe/ib_smc.h>
 #include <ipxe/iobuf.h>
 #include <ipxe/netdevice.h>
+#include <ipxe/profile.h>
 
 #include "golan.h"
 
+/** Command latency profiler */
+static struct profiler golan_cmd_profiler __profiler =
+	{ .name = "golan.cmd" };
+
+/** Page provisioning profiler */
+static struct profiler golan_pages_profiler __profiler =
+	{ .name = "golan.pages" };
+
 inline int golan_check_rc_and_cmd_status ( struct golan_cmd_layout *cmd, int rc ) {
 	struct golan_outbox_hdr *out_hdr = ( struct golan_outbox_hdr * ) ( cmd->out );
 	if ( rc == -EBUSY ) {
@@ -197,6 +206,78 @@ static inline uint32_t is_command_finished( struct golan *golan, int idx)
 	return !(get_cmd( golan , idx )->status_own & CMD_OWNER_HW);
 }
 
+/**
+ * Record command latency
+ *
+ * @v golan		Golan device
+ * @v idx		Command index
+ */
+static void golan_cmd_record ( struct golan *golan, int idx )
+{
+	struct golan_cmd_stats *stats;
+	uint16_t opcode = golan->cmd_opcode[idx];
+	unsigned long elapsed;
+	unsigned int i;
+
+	/* Record in overall profiler */
+	elapsed = ( profile_timestamp() - golan->cmd_started[idx] );
+	profile_update ( &golan_cmd_profiler, elapsed );
+
+	/* Find (or allocate) per-opcode statistics */
+	for ( i = 0 ; i < GOLAN_NUM_CMD_STATS ; i++ ) {
+		stats = &golan->cmd_stats[i];
+		if ( stats->count && ( stats->opcode != opcode ) )
+			continue;
+		stats->opcode = opcode;
+		stats->count++;
+		stats->total += elapsed;
+		if ( elapsed > stats->max )
+			stats->max = elapsed;
+		return;
+	}
+}
+
+/**
+ * Dump command latency statistics
+ *
+ * @v golan		Golan device
+ */
+static void golan_cmd_stats_dump ( struct golan *golan )
+{
+	struct golan_cmd_stats *stats;
+	unsigned int i;
+
+	for ( i = 0 ; i < GOLAN_NUM_CMD_STATS ; i++ ) {
+		stats = &golan->cmd_stats[i];
+		if ( ! stats->count )
+			break;
+		DBGC ( golan, "%s command %#04x: %ld issued, mean %ld max %ld "
+		       "ticks\n", __FUNCTION__, stats->opcode, stats->count,
+		       ( stats->total / stats->count ), stats->max );
+	}
+}
+
+/**
+ * Check for Golan command completion
+ *
+ * @v golan		Golan device
+ * @v idx		Command index
+ * @ret rc		Command status, or -EINPROGRESS if still outstanding
+ */
+static int golan_cmd_poll ( struct golan *golan, int idx )
+{
+	int rc;
+
+	if ( ! is_command_finished ( golan, idx ) )
+		return -EINPROGRESS;
+	rc = CMD_STATUS ( golan, idx );
+	rmb();
+
+	golan_cmd_record ( golan, idx );
+	golan->cmd_bm &= ~( 1 << idx );
+	return rc;
+}
+
 /**
  * Wait for Golan command completion
  *
@@ -209,36 +290,39 @@ static inline int golan_cmd_wait(struct golan *golan, int idx, const char *comma
 	int	rc = -EBUSY;
 
 	for ( wait = GOLAN_HCR_MAX_WAIT_MS ; wait ; --wait ) {
-		if (is_command_finished(golan, idx)) {
-			rc = CMD_STATUS(golan, idx);
-			rmb();
+		if ( ( rc = golan_cmd_poll ( golan, idx ) ) != -EINPROGRESS )
 			break;
-		} else {
-			mdelay ( 1 );
-		}
+		mdelay ( 1 );
+	}
+	if ( rc == -EINPROGRESS ) {
+		rc = -EBUSY;
+		golan->cmd_bm &= ~(1 << idx);
 	}
 	if (rc) {
 		printf ("[%s]RC is %s[%x]\n", command, cmd_status_str(rc), rc);
 	}
 
-	golan->cmd_bm &= ~(1 << idx);
 	return rc;
 }
 
 /**
-  * Notify the HW that commands are ready
+  * Notify the HW that a command is ready
+  *
+  * Only the doorbell bit for the specified command is rung, so that
+  * commands already outstanding in other slots are not reissued.
   */
-static inline void send_command(struct golan *golan)
+static inline void send_command(struct golan *golan, uint32_t cmd_idx)
 {
 	wmb(); //Make sure the command is visible in "memory".
-	writel(cpu_to_be32(golan->cmd_bm) , &golan->iseg->cmd_dbell);
+	golan->cmd_started[cmd_idx] = profile_timestamp();
+	writel(cpu_to_be32(1 << cmd_idx) , &golan->iseg->cmd_dbell);
 }
 
 static inline int send_command_and_wait(struct golan *golan, uint32_t cmd_idx,
 					uint32_t inbox_idx, uint32_t outbox_idx, const char *command)
 {
 	golan_calc_sig(golan, cmd_idx, inbox_idx, outbox_idx);
-	send_command(golan);
+	send_command(golan, cmd_idx);
 	return golan_cmd_wait(golan, cmd_idx, command);
 }
 
@@ -265,6 +349,7 @@ static inline struct golan_cmd_layout *write_cmd(struct golan *golan, int idx,
 	cmd->inlen		= cpu_to_be32(inlen);
 	hdr->opcode		= cpu_to_be16(opcode);
 	hdr->opmod		= cpu_to_be16(opmod);
+	golan->cmd_opcode[idx]	= opcode;
 
 	if (inbox_idx != NO_MBOX) {
 		memset(GET_INBOX(golan, inbox_idx), 0, MAILBOX_SIZE);
@@ -361,40 +446,133 @@ err_query_hca_cap:
 	return rc;
 }
 
+/**
+ * Prepare chained mailboxes for a command
+ *
+ * @v golan		Golan device
+ * @v cmd		Command
+ * @v len		Length of data carried in mailboxes
+ * @ret ptr		Bus address of first mailbox (big-endian)
+ *
+ * Page lists too large for a single mailbox are carried in a chain
+ * of mailboxes, allowing a single MANAGE_PAGES command to transfer
+ * up to GOLAN_MAX_PAGES_CMD pages.
+ */
+static __be64 golan_chain_mboxes ( struct golan *golan,
+				   struct golan_cmd_layout *cmd, size_t len )
+{
+	struct mbox *mailbox = golan->mboxes.chain;
+	unsigned int count = DIV_ROUND_UP ( len, GOLAN_CMD_DATA_BLOCK_SIZE );
+	unsigned int i;
+
+	assert ( count <= GOLAN_CHAIN_MBOX );
+	for ( i = 0 ; i < count ; i++, mailbox++ ) {
+		memset ( mailbox, 0, MAILBOX_SIZE );
+		if ( ( i + 1 ) < count )
+			mailbox->mblock.next = VIRT_2_BE64_BUS ( mailbox + 1 );
+		mailbox->mblock.block_num = cpu_to_be32 ( i );
+		mailbox->mblock.token = cmd->token;
+		mailbox->mblock.ctrl_sig = ~xor8_buf ( mailbox->mblock.rsvd0,
+						       CTRL_SIG_SZ );
+	}
+	return VIRT_2_BE64_BUS ( golan->mboxes.chain );
+}
+
+/**
+ * Get page address entry within chained mailboxes
+ *
+ * @v golan		Golan device
+ * @v idx		Entry index
+ * @ret pas		Page address entry
+ */
+static inline __be64 * golan_chain_pas ( struct golan *golan,
+					 unsigned int idx )
+{
+	struct mbox *mailbox = golan->mboxes.chain;
+
+	return &mailbox[ idx / GOLAN_CMD_PAS_CNT ].mblock.data[ idx % GOLAN_CMD_PAS_CNT ];
+}
+
+/**
+ * Allocate contiguous region of pages
+ *
+ * @v count		Maximum number of pages
+ * @ret region		Page region, or NULL
+ *
+ * If the full region cannot be allocated then successively smaller
+ * regions are tried, so that a fragmented heap degrades gracefully
+ * rather than failing the whole request.
+ */
+static struct golan_page_region * golan_alloc_region ( unsigned int count )
+{
+	struct golan_page_region *region;
+
+	region = malloc ( sizeof ( *region ) );
+	if ( ! region )
+		return NULL;
+	for ( ; count ; count /= 2 ) {
+		region->addr = umalloc ( count * GOLAN_PAGE_SIZE );
+		if ( ! region->addr )
+			continue;
+		if ( GOLAN_PAGE_MASK & user_to_phys ( region->addr, 0 ) ) {
+			printf ( "Addr not Page alligned [%lx %lx]\n",
+				 user_to_phys ( region->addr, 0 ),
+				 region->addr );
+		}
+		region->count = count;
+		return region;
+	}
+	free ( region );
+	return NULL;
+}
+
+/**
+ * Free page regions
+ *
+ * @v list		List of page regions
+ * @v release		Release the pages themselves
+ *
+ * Pages that may still be owned by the firmware (e.g. after a failed
+ * or timed out command) must be leaked rather than released.
+ */
+static void golan_free_regions ( struct list_head *list, int release )
+{
+	struct golan_page_region *region;
+	struct golan_page_region *tmp;
+
+	list_for_each_entry_safe ( region, tmp, list, list ) {
+		list_del ( &region->list );
+		if ( release )
+			ufree ( region->addr );
+		free ( region );
+	}
+}
+
 static inline int golan_take_pages ( struct golan *golan, uint32_t pages, __be16 func_id ) {
 	uint32_t out_num_entries = 0;
-	int size_ibox =  sizeof(struct golan_manage_pages_inbox);
-	int size_obox = sizeof(struct golan_manage_pages_outbox);
 	int rc = 0;
 
 	DBGC(golan, "%s\n", __FUNCTION__);
 
 	while ( pages > 0 ) {
-		uint32_t pas_num = min(pages, MAX_PASE_MBOX);
-		unsigned i;
+		uint32_t pas_num = min(pages, GOLAN_MAX_PAGES_CMD);
 		struct golan_cmd_layout	*cmd;
 		struct golan_manage_pages_inbox *in;
-		struct golan_manage_pages_outbox_data *out;
-
-		size_ibox += (pas_num * GOLAN_PAS_SIZE);
-		size_obox += (pas_num * GOLAN_PAS_SIZE);
 
 		cmd = write_cmd(golan, MEM_CMD_IDX, GOLAN_CMD_OP_MANAGE_PAGES, GOLAN_PAGES_TAKE,
-				MEM_MBOX, MEM_MBOX,
-				size_ibox,
-				size_obox);
+				NO_MBOX, NO_MBOX,
+				sizeof(struct golan_manage_pages_inbox),
+				(sizeof(struct golan_manage_pages_outbox) +
+				 (pas_num * GOLAN_PAS_SIZE)));
 
 		in = (struct golan_manage_pages_inbox *)cmd->in; /* Warning (WE CANT USE THE LAST 2 FIELDS) */
 
 		in->func_id 	= func_id; /* Already BE */
 		in->num_entries = cpu_to_be32(pas_num);
+		cmd->out_ptr	= golan_chain_mboxes(golan, cmd, (pas_num * GOLAN_PAS_SIZE));
 
-		if ( ( rc = send_command_and_wait(golan, MEM_CMD_IDX, MEM_MBOX, MEM_MBOX, __FUNCTION__) ) == 0 ) {
-			out = (struct golan_manage_pages_outbox_data *)GET_OUTBOX(golan, MEM_MBOX);
+		if ( ( rc = send_command_and_wait(golan, MEM_CMD_IDX, NO_MBOX, NO_MBOX, __FUNCTION__) ) == 0 ) {
 			out_num_entries = be32_to_cpu(((struct golan_manage_pages_outbox *)(cmd->out))->num_entries);
-			for (i = 0; i < out_num_entries; ++i) {
-				ufree(BE64_BUS_2_USR(out->pas[i]));
-			}
 		} else {
 			if ( rc == -EBUSY ) {
 				printf ( "HCA is busy (rc = -EBUSY)\n" );
@@ -405,81 +583,130 @@ static inline int golan_take_pages ( struct golan *golan, uint32_t pages, __be16
 						get_cmd( golan , MEM_CMD_IDX )->status_own,
 						be32_to_cpu(CMD_SYND(golan, MEM_CMD_IDX)), pas_num);
 			}
+			/* Firmware may still own some pages; leak them */
+			golan_free_regions(&golan->pages, 0);
 			return rc;
 		}
 
 		/* TODO: validate RC */
 		pages -= out_num_entries;
 	}
+
+	/* All pages have been returned; release the regions */
+	golan_free_regions(&golan->pages, 1);
 	DBGC( golan , "%s Pages handled\n", __FUNCTION__);
 	return 0;
 }
 
-static inline int golan_provide_pages ( struct golan *golan , uint32_t pages, __be16 func_id ) {
-	struct mbox *mailbox;
-	int size_ibox =  sizeof(struct golan_manage_pages_inbox);
-	int size_obox = sizeof(struct golan_manage_pages_outbox);
-	int rc = 0;
-
-	DBGC(golan, "%s\n", __FUNCTION__);
+/**
+ * Issue command to give pages to firmware
+ *
+ * @v golan		Golan device
+ * @v pages		Number of pages requested
+ * @v func_id		Function ID (big-endian)
+ * @ret count		Number of pages given, or negative error
+ *
+ * The command is issued but not waited for.  Pages are allocated in
+ * as few contiguous regions as possible and recorded as pending
+ * until golan_give_pages_complete() is called.
+ */
+static int golan_give_pages_issue ( struct golan *golan, uint32_t pages,
+				    __be16 func_id )
+{
+	uint32_t pas_num = min ( pages, GOLAN_MAX_PAGES_CMD );
+	struct golan_page_region *region;
+	struct golan_cmd_layout *cmd;
+	struct golan_manage_pages_inbox *in;
+	unsigned int i;
+	unsigned int j;
+
+	cmd = write_cmd ( golan, MEM_CMD_IDX, GOLAN_CMD_OP_MANAGE_PAGES,
+			  GOLAN_PAGES_GIVE, NO_MBOX, NO_MBOX,
+			  ( sizeof ( struct golan_manage_pages_inbox ) +
+			    ( pas_num * GOLAN_PAS_SIZE ) ),
+			  sizeof ( struct golan_manage_pages_outbox ) );
+	in = ( struct golan_manage_pages_inbox * ) cmd->in;
+	in->func_id = func_id; /* Already BE */
+	in->num_entries = cpu_to_be32 ( pas_num );
+	cmd->in_ptr = golan_chain_mboxes ( golan, cmd,
+					   ( pas_num * GOLAN_PAS_SIZE ) );
+
+	/* Allocate pages */
+	for ( i = MANAGE_PAGES_PSA_OFFSET ;
+	      i < ( MANAGE_PAGES_PSA_OFFSET + pas_num ) ; ) {
+		region = golan_alloc_region ( MANAGE_PAGES_PSA_OFFSET +
+					      pas_num - i );
+		if ( ! region ) {
+			printf ( "Couldnt allocated page \n" );
+			golan_free_regions ( &golan->pages_new, 1 );
+			golan->cmd_bm &= ~( 1 << MEM_CMD_IDX );
+			return -ENOMEM;
+		}
+		list_add_tail ( &region->list, &golan->pages_new );
+		for ( j = 0 ; j < region->count ; j++, i++ ) {
+			*golan_chain_pas ( golan, i ) =
+				cpu_to_be64 ( user_to_phys ( region->addr,
+						( j * GOLAN_PAGE_SIZE ) ) );
+		}
+	}
 
-	while ( pages > 0 ) {
-		uint32_t pas_num = min(pages, MAX_PASE_MBOX);
-		unsigned i, j;
-		struct golan_cmd_layout	*cmd;
-		struct golan_manage_pages_inbox *in;
-		userptr_t addr = 0;
+	/* Issue command */
+	golan_calc_sig ( golan, MEM_CMD_IDX, NO_MBOX, NO_MBOX );
+	send_command ( golan, MEM_CMD_IDX );
 
-		mailbox = GET_INBOX(golan, MEM_MBOX);
-		size_ibox += (pas_num * GOLAN_PAS_SIZE);
-		size_obox += (pas_num * GOLAN_PAS_SIZE);
+	return pas_num;
+}
 
-		cmd = write_cmd(golan, MEM_CMD_IDX, GOLAN_CMD_OP_MANAGE_PAGES, GOLAN_PAGES_GIVE,
-				MEM_MBOX, MEM_MBOX,
-				size_ibox,
-				size_obox);
+/**
+ * Complete command to give pages to firmware
+ *
+ * @v golan		Golan device
+ * @v pages		Number of pages given
+ * @v rc		Command status
+ */
+static void golan_give_pages_complete ( struct golan *golan, uint32_t pages,
+					int rc )
+{
+	if ( rc == 0 ) {
+		/* Firmware now owns the pages */
+		list_splice_tail_init ( &golan->pages_new, &golan->pages );
+		golan->total_dma_pages += pages;
+	} else if ( rc == -EBUSY ) {
+		/* Leak the pages rather than risk corruption */
+		golan_free_regions ( &golan->pages_new, 0 );
+	} else {
+		printf ("%s: rc =0x%x[%s]<%x> syn 0x%x[0x%x] for %d pages\n",
+			__FUNCTION__, rc, cmd_status_str(rc),
+			CMD_SYND(golan, MEM_CMD_IDX),
+			get_cmd( golan , MEM_CMD_IDX )->status_own,
+			be32_to_cpu(CMD_SYND(golan, MEM_CMD_IDX)), pages);
+		/* Firmware has rejected the pages; free them */
+		golan_free_regions ( &golan->pages_new, 1 );
+	}
+}
 
-		in = (struct golan_manage_pages_inbox *)cmd->in; /* Warning (WE CANT USE THE LAST 2 FIELDS) */
+static inline int golan_provide_pages ( struct golan *golan , uint32_t pages, __be16 func_id ) {
+	int count;
+	int rc = 0;
 
-		in->func_id 	= func_id; /* Already BE */
-		in->num_entries = cpu_to_be32(pas_num);
+	DBGC(golan, "%s\n", __FUNCTION__);
 
-		for ( i = 0 , j = MANAGE_PAGES_PSA_OFFSET; i < pas_num; ++i ,++j ) {
-			if (!(addr = umalloc(GOLAN_PAGE_SIZE))) {
-				rc = -ENOMEM;
-				printf ("Couldnt allocated page \n");
-				goto malloc_dma_failed;
-			}
-			if (GOLAN_PAGE_MASK & user_to_phys(addr, 0)) {
-				printf ("Addr not Page alligned [%lx %lx]\n", user_to_phys(addr, 0), addr);
-			}
-			mailbox->mblock.data[j]	= USR_2_BE64_BUS(addr);
+	while ( pages > 0 ) {
+		if ( ( count = golan_give_pages_issue(golan, pages, func_id) ) < 0 ) {
+			rc = count;
+			goto err_issue;
 		}
-
-		if ( ( rc = send_command_and_wait(golan, MEM_CMD_IDX, MEM_MBOX, MEM_MBOX, __FUNCTION__) ) == 0 ) {
-			pages -= pas_num;
-			golan->total_dma_pages += pas_num;
-		} else {
-			if ( rc == -EBUSY ) {
-				printf ( "HCA is busy (rc = -EBUSY)\n" );
-			} else {
-				printf ("%s: rc =0x%x[%s]<%x> syn 0x%x[0x%x] for %d pages\n",
-						__FUNCTION__, rc, cmd_status_str(rc),
-						CMD_SYND(golan, MEM_CMD_IDX),
-						get_cmd( golan , MEM_CMD_IDX )->status_own,
-						be32_to_cpu(CMD_SYND(golan, MEM_CMD_IDX)), pas_num);
-			}
-			ufree ( addr );
+		rc = golan_cmd_wait(golan, MEM_CMD_IDX, __FUNCTION__);
+		golan_give_pages_complete(golan, count, rc);
+		if ( rc )
 			goto err_send_command;
-		}
+		pages -= count;
 	}
 	DBGC( golan , "%s Pages handled\n", __FUNCTION__);
 	return 0;
 
 err_send_command:
-malloc_dma_failed:
-	/* Go over In box and free pages */
-	/* Send Error to FW */
+err_issue:
 	/* What is next - Disable HCA? */
 	printf("%s Failed (rc = 0x%x)\n", __FUNCTION__, rc);
 	return rc;
@@ -498,6 +725,8 @@ static inline int golan_handle_pages(struct golan *golan,
 
 	DBGC(golan, "%s\n", __FUNCTION__);
 
+	profile_start ( &golan_pages_profiler );
+
 	cmd = write_cmd(golan, MEM_CMD_IDX, GOLAN_CMD_OP_QUERY_PAGES, qry,
 			NO_MBOX, NO_MBOX,
 			sizeof(struct golan_query_pages_inbox),
@@ -527,6 +756,10 @@ static inline int golan_handle_pages(struct golan *golan,
 		return rc;
 	}
 
+	profile_stop ( &golan_pages_profiler );
+	DBGC ( golan, "%s %s %d pages in %ld ticks\n", __FUNCTION__,
+	       ( ( mode == GOLAN_PAGES_GIVE ) ? "gave" : "took" ),
+	       total_pages, profile_elapsed ( &golan_pages_profiler ) );
 	return 0;
 
 err_handle_pages_query:
@@ -534,6 +767,109 @@ err_handle_pages_query:
 	return rc;
 }
 
+/**
+ * Complete page provisioning command
+ *
+ * @v golan		Golan device
+ * @v rc		Command status
+ */
+static void golan_pages_complete ( struct golan *golan, int rc )
+{
+	golan_give_pages_complete ( golan, golan->pages_inflight, rc );
+	if ( rc != 0 )
+		golan->pages_pending = 0;
+	golan->pages_inflight = 0;
+}
+
+/**
+ * Issue page provisioning command for requested pages
+ *
+ * @v golan		Golan device
+ * @ret rc		Return status code
+ *
+ * The command is not waited for; completion is detected via the
+ * command completion event (or by polling from the page request
+ * process).
+ */
+static int golan_pages_issue ( struct golan *golan )
+{
+	int count;
+
+	count = golan_give_pages_issue ( golan, golan->pages_pending,
+					 golan->pages_func_id );
+	if ( count < 0 )
+		return count;
+	golan->pages_issued = currticks();
+	golan->pages_inflight = count;
+	golan->pages_pending -= count;
+
+	return 0;
+}
+
+/**
+ * Provide pages requested by firmware
+ *
+ * @v golan		Golan device
+ *
+ * Pages requested via the event queue are provided by a background
+ * process, one MANAGE_PAGES command at a time, so that other
+ * processes may run while the firmware consumes each batch.
+ */
+static void golan_pages_step ( struct golan *golan )
+{
+	int rc;
+
+	/* Check for completion of outstanding command */
+	if ( golan->pages_inflight ) {
+		rc = golan_cmd_poll ( golan, MEM_CMD_IDX );
+		if ( rc == -EINPROGRESS ) {
+			if ( ( currticks() - golan->pages_issued ) <
+			     GOLAN_HCR_MAX_WAIT_TICKS )
+				return;
+			printf ( "%s timed out providing %d pages\n",
+				 __FUNCTION__, golan->pages_inflight );
+			golan->cmd_bm &= ~( 1 << MEM_CMD_IDX );
+			golan_pages_complete ( golan, -EBUSY );
+		} else {
+			golan_pages_complete ( golan, rc );
+		}
+	}
+
+	/* Stop once all requested pages have been provided */
+	if ( ! golan->pages_pending ) {
+		process_del ( &golan->pages_process );
+		return;
+	}
+
+	/* Issue next command */
+	if ( ( rc = golan_pages_issue ( golan ) ) != 0 ) {
+		printf ( "%s Failed (rc = 0x%x)\n", __FUNCTION__, rc );
+		golan->pages_pending = 0;
+	}
+}
+
+/** Page request process descriptor */
+static struct process_descriptor golan_pages_process_desc =
+	PROC_DESC ( struct golan, pages_process, golan_pages_step );
+
+/**
+ * Complete any outstanding page requests
+ *
+ * @v golan		Golan device
+ */
+static void golan_pages_flush ( struct golan *golan )
+{
+	int rc;
+
+	process_del ( &golan->pages_process );
+	golan->pages_pending = 0;
+	if ( golan->pages_inflight ) {
+		rc = golan_cmd_wait ( golan, MEM_CMD_IDX, __FUNCTION__ );
+		golan_pages_complete ( golan, rc );
+	}
+}
+
+
 static inline int golan_set_access_reg ( struct golan *golan __attribute__ (( unused )), uint32_t reg __attribute__ (( unused )))
 {
 #if 0
@@ -550,6 +886,7 @@ static inline int golan_set_access_reg ( struct golan *golan __attribute__ (( un
 
 static inline void golan_cmd_uninit ( struct golan *golan )
 {
+	free_dma(golan->mboxes.chain, GOLAN_CHAIN_SIZE);
 	free_dma(golan->mboxes.outbox, GOLAN_PAGE_SIZE);
 	free_dma(golan->mboxes.inbox, GOLAN_PAGE_SIZE);
 	free_dma(golan->cmd.addr, GOLAN_PAGE_SIZE);
@@ -579,6 +916,10 @@ static inline int golan_cmd_init ( struct golan *golan )
 		rc = -ENOMEM;
 		goto malloc_dma_outbox_failed;
 	}
+	if (!(golan->mboxes.chain = malloc_dma(GOLAN_CHAIN_SIZE , GOLAN_PAGE_SIZE))) {
+		rc = -ENOMEM;
+		goto malloc_dma_chain_failed;
+	}
 	addr_l_sz	= be32_to_cpu(readl(&golan->iseg->cmdq_addr_l_sz));
 
 	golan->cmd.log_stride	= addr_l_sz & 0xf;
@@ -594,6 +935,8 @@ static inline int golan_cmd_init ( struct golan *golan )
 	DBGC( golan , "%s Command interface was initialized\n", __FUNCTION__);
 	return 0;
 
+malloc_dma_chain_failed:
+	free_dma(golan->mboxes.outbox, GOLAN_PAGE_SIZE);
 malloc_dma_outbox_failed:
 	free_dma(golan->mboxes.inbox, GOLAN_PAGE_SIZE);
 malloc_dma_inbox_failed:
@@ -893,10 +1236,14 @@ static inline void golan_pci_init(struct golan *golan)
 
 static inline struct golan *golan_alloc()
 {
-	void *golan = zalloc(sizeof(struct golan));
+	struct golan *golan = zalloc(sizeof(struct golan));
 	if ( !golan )
 		goto err_zalloc;
 
+	INIT_LIST_HEAD ( &golan->pages );
+	INIT_LIST_HEAD ( &golan->pages_new );
+	process_init_stopped ( &golan->pages_process,
+			       &golan_pages_process_desc, NULL );
 	return golan;
 
 err_zalloc:
@@ -928,6 +1275,12 @@ static int golan_create_cq(struct ib_device *ibdev,
 		goto err_create_cq;
 	}
 	golan_cq->size 			= sizeof(golan_cq->cqes[0]) * cq->num_cqes;
+	if (golan_cq->size > GOLAN_PAGE_SIZE) {
+		DBGC (golan ,"%s CQ size [%d] > page size [%d]\n", __FUNCTION__,
+				golan_cq->size, GOLAN_PAGE_SIZE);
+		rc = -EINVAL;
+		goto err_create_cq_size;
+	}
 	golan_cq->doorbell_record 	= malloc_dma(GOLAN_CQ_DB_RECORD_SIZE,
 							GOLAN_CQ_DB_RECORD_SIZE);
 	if (!golan_cq->doorbell_record) {
@@ -979,6 +1332,7 @@ err_create_cq_cmd:
 err_create_cq_cqe_alloc:
 	free_dma(golan_cq->doorbell_record, GOLAN_CQ_DB_RECORD_SIZE);
 err_create_cq_db_alloc:
+err_create_cq_size:
 	free ( golan_cq );
 err_create_cq:
 	printf("%s out rc = 0x%x\n", __FUNCTION__, rc);
@@ -1087,6 +1441,12 @@ static int golan_create_qp_aux(struct ib_device *ibdev,
 	}
 
 	golan_qp->size = golan_qp->sq.size + golan_qp->rq.size;
+	if (golan_qp->size > GOLAN_PAGE_SIZE) {
+		DBGC (golan ,"%s wq size [%d] > page size [%d]\n", __FUNCTION__,
+				golan_qp->size, GOLAN_PAGE_SIZE);
+		rc = -EINVAL;
+		goto err_create_qp_size;
+	}
 
 	/* allocate dma memory for WQEs (1 page is enough) - should change it */
 	addr = umalloc(GOLAN_PAGE_SIZE);
@@ -1153,6 +1513,7 @@ err_create_qp_cmd:
 err_create_qp_db_alloc:
 	ufree((userptr_t)golan_qp->wqes);
 err_create_qp_wqe_alloc:
+err_create_qp_size:
 err_create_qp_sq_size:
 err_create_qp_rq_size:
 	free ( golan_qp );
@@ -1441,16 +1802,41 @@ static int golan_post_send(struct ib_device *ibdev,
 	datagram->grh_gid_fl	= cpu_to_be32(av->gid_present << 30);
 	memcpy(datagram->rgid, av->gid.bytes, 16 /* sizeof(datagram->rgid) */);
 
+	++(qp->send.next_idx);
+	golan_qp->sq.next_idx = (golan_qp->sq.next_idx + GOLAN_WQEBBS_PER_SEND_WQE);
+	return 0;
+}
+
+/**
+ * Notify hardware of new send work queue entries
+ *
+ * @v ibdev		Infiniband device
+ * @v qp		Queue pair
+ *
+ * The doorbell is rung with the control segment of the most
+ * recently posted WQE, which covers all WQEs posted before it.
+ */
+static void golan_ring_send(struct ib_device *ibdev,
+				struct ib_queue_pair *qp)
+{
+	struct golan			*golan		= ib_get_drvdata(ibdev);
+	struct golan_queue_pair		*golan_qp	= ib_qp_get_drvdata(qp);
+	struct golan_send_wqe_ud	*wqe;
+	unsigned long			wqebb_idx_mask;
+
+	wqebb_idx_mask	= (GOLAN_WQEBBS_PER_SEND_WQE * qp->send.num_wqes) - 1;
+	wqe		= golan_qp->sq.wqes +
+			  (((golan_qp->sq.next_idx - GOLAN_WQEBBS_PER_SEND_WQE) &
+			    wqebb_idx_mask) * GOLAN_SEND_WQE_BB_SIZE);
+
 	/*
 	* Make sure that descriptors are written before
 	* updating doorbell record and ringing the doorbell
 	*/
-	++(qp->send.next_idx);
-	golan_qp->sq.next_idx = (golan_qp->sq.next_idx + GOLAN_WQEBBS_PER_SEND_WQE);
+	wmb();
 	golan_qp->doorbell_record->send_db = cpu_to_be16(golan_qp->sq.next_idx);
-	writeq(*((__be64 *)ctrl), (uint32_t)golan->uar.virt + 0x800);// +
-//			((toggle++ & 0x1) ? 0x100 : 0x0));
-	return 0;
+	wmb();
+	writeq(*((__be64 *)&wqe->ctrl), (uint32_t)golan->uar.virt + 0x800);
 }
 
 /**
@@ -1489,14 +1875,26 @@ static int golan_post_recv(struct ib_device *ibdev,
 	wqe->data.addr		= VIRT_2_BE64_BUS(iobuf->data);
 	++wq->next_idx;
 
+	return 0;
+}
+
+/**
+ * Notify hardware of new receive work queue entries
+ *
+ * @v ibdev		Infiniband device
+ * @v qp		Queue pair
+ */
+static void golan_ring_recv(struct ib_device *ibdev __unused,
+				struct ib_queue_pair *qp)
+{
+	struct golan_queue_pair	*golan_qp	= ib_qp_get_drvdata(qp);
+
 	/*
 	* Make sure that descriptors are written before
 	* updating doorbell record and ringing the doorbell
 	*/
 	wmb();
 	golan_qp->doorbell_record->recv_db = cpu_to_be16(qp->recv.next_idx & 0xffff);
-
-	return 0;
 }
 
 /**
@@ -1848,7 +2246,12 @@ static void golan_poll_eq(struct ib_device *ibdev)
 				   golan_eqe_type_str(eqe->type), eqe->type);
 			break;
 		case GOLAN_EVENT_TYPE_CMD:
-//			golan_cmd_comp_handler(be32_to_cpu(eqe->data.cmd.vector));
+			/* Complete page provisioning command, if applicable */
+			if ( golan->pages_inflight &&
+			     ( be32_to_cpu ( eqe->data.cmd.vector ) &
+			       ( 1 << MEM_CMD_IDX ) ) ) {
+				golan_pages_step ( golan );
+			}
 			break;
 		case GOLAN_EVENT_TYPE_PORT_CHANGE:
 			golan_handle_port_event(golan, eqe);
@@ -1868,7 +2271,13 @@ static void golan_poll_eq(struct ib_device *ibdev)
 
 				printf("%s page request for func 0x%x, napges %d\n",
 					   __FUNCTION__, func_id, npages);
-				golan_provide_pages(golan, npages, func_id);
+				/* Provide pages from the page request process */
+				if ( npages > 0 ) {
+					golan->pages_func_id =
+						eqe->data.req_pages.func_id;
+					golan->pages_pending += npages;
+					process_add ( &golan->pages_process );
+				}
 			}
 			break;
 		default:
@@ -1964,6 +2373,35 @@ static int golan_inform_sma(struct ib_device *ibdev,
 	return 0;
 }
 
+/**
+ * Record queue depth limits
+ *
+ * @v golan		Golan device
+ * @v ibdev		Infiniband device
+ *
+ * Each completion queue, and both work queues of each queue pair,
+ * live within a single page.  The page is split equally between the
+ * send and receive work queues, each of which is further limited by
+ * the device's maximum work queue size.
+ */
+static void golan_set_queue_limits(struct golan *golan,
+				   struct ib_device *ibdev)
+{
+	unsigned int sq_size = be16_to_cpu(golan->caps.max_wqe_sz_sq);
+	unsigned int rq_size = be16_to_cpu(golan->caps.max_wqe_sz_rq);
+
+	if (sq_size > (GOLAN_PAGE_SIZE / 2))
+		sq_size = (GOLAN_PAGE_SIZE / 2);
+	if (rq_size > (GOLAN_PAGE_SIZE / 2))
+		rq_size = (GOLAN_PAGE_SIZE / 2);
+
+	ibdev->max_send_wqes	= (sq_size / (GOLAN_WQEBBS_PER_SEND_WQE *
+					      GOLAN_SEND_WQE_BB_SIZE));
+	ibdev->max_recv_wqes	= (rq_size / GOALN_RECV_WQE_SIZE);
+	ibdev->max_cqes		= (GOLAN_PAGE_SIZE /
+				   sizeof(struct golan_cqe64));
+}
+
 static int golan_register_ibdev(struct golan_port *port)
 {
 	struct ib_device *ibdev = port->ibdev;
@@ -1989,6 +2427,7 @@ static inline void golan_bring_down(struct golan *golan)
 	if (~golan->flags & GOLAN_OPEN)
 		return;
 
+	golan_pages_flush(golan);
 	golan_destroy_mkey(golan);
 	golan_dealloc_pd(golan);
 	golan_destory_eq(golan);
@@ -2111,7 +2550,9 @@ static struct ib_device_operations golan_ib_operations = {
 	.modify_qp	= golan_modify_qp,
 	.destroy_qp	= golan_destroy_qp,
 	.post_send	= golan_post_send,
+	.ring_send	= golan_ring_send,
 	.post_recv	= golan_post_recv,
+	.ring_recv	= golan_ring_recv,
 	.poll_cq	= golan_poll_cq,
 	.poll_eq	= golan_poll_eq,
 	.open		= golan_ib_open,
@@ -2165,6 +2606,7 @@ static int golan_probe(struct pci_device *pci)
 		ibdev->op = &golan_ib_operations;
 		ibdev->dev = &pci->dev;
 		ibdev->port = (GOLAN_PORT_BASE + i);
+		golan_set_queue_limits(golan, ibdev);
 		ib_set_drvdata(ibdev, golan);
 	}
 
@@ -2221,6 +2663,7 @@ static void golan_remove(struct pci_device *pci)
 	}
 
 	golan_bring_down(golan);
+	golan_cmd_stats_dump(golan);
 	free(golan);
 }
 
@@ -27,6 +27,8 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <byteswap.h>
 #include <errno.h>
 #include <ipxe/io.h>
+#include <ipxe/process.h>
+#include <ipxe/uaccess.h>
 #include <stdio.h>
 #include <unistd.h>
 
@@ -51,6 +53,8 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #define GOLAN_HCA_BAR	PCI_BASE_ADDRESS_0	//BAR 0
 
 #define GOLAN_HCR_MAX_WAIT_MS	10000
+#define GOLAN_HCR_MAX_WAIT_TICKS \
+	( ( GOLAN_HCR_MAX_WAIT_MS * TICKS_PER_SEC ) / 1000 )
 
 #define min(a,b) ((a)<(b)?(a):(b))
 
@@ -61,6 +65,7 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #define MAX_MBOX	( GOLAN_PAGE_SIZE / MAILBOX_STRIDE )
 #define DEF_CMD_IDX	1
 #define MEM_CMD_IDX	0
+#define NUM_CMD_IDX	2
 #define NO_MBOX		0xffff
 #define MEM_MBOX	MEM_CMD_IDX
 #define GEN_MBOX	DEF_CMD_IDX
@@ -69,6 +74,12 @@ FILE_LICENCE ( GPL2_OR_LATER );
 
 #define MAX_PASE_MBOX	((GOLAN_CMD_PAS_CNT) - 2)
 
+/** Number of chained mailboxes available for page provisioning */
+#define GOLAN_CHAIN_MBOX	16
+#define GOLAN_CHAIN_SIZE	( GOLAN_CHAIN_MBOX * MAILBOX_STRIDE )
+/** Maximum number of pages transferred by one MANAGE_PAGES command */
+#define GOLAN_MAX_PAGES_CMD	( GOLAN_CHAIN_MBOX * GOLAN_CMD_PAS_CNT )
+
 #define CMD_STATUS( golan , idx )		((struct golan_outbox_hdr *)(get_cmd( (golan) , (idx) )->out))->status
 #define CMD_SYND( golan , idx )		((struct golan_outbox_hdr *)(get_cmd( (golan) , (idx) )->out))->syndrome
 #define QRY_PAGES_OUT( golan, idx )		((struct golan_query_pages_outbox *)(get_cmd( (golan) , (idx) )->out))
@@ -297,10 +308,37 @@ struct golan_port {
 struct golan_mboxes {
 	void 	*inbox;
 	void	*outbox;
+	/** Chained mailboxes for page provisioning commands */
+	void	*chain;
+};
+
+/** A contiguous region of pages given to firmware */
+struct golan_page_region {
+	/** List of page regions */
+	struct list_head list;
+	/** Start of region */
+	userptr_t addr;
+	/** Number of pages */
+	unsigned int count;
 };
 
 #define GOLAN_OPEN	0x1
 
+/** Golan command latency statistics */
+struct golan_cmd_stats {
+	/** Command opcode */
+	uint16_t opcode;
+	/** Number of commands issued */
+	unsigned long count;
+	/** Total latency */
+	unsigned long total;
+	/** Maximum latency */
+	unsigned long max;
+};
+
+/** Number of distinct opcodes for which statistics are recorded */
+#define GOLAN_NUM_CMD_STATS 32
+
 struct golan {
 	struct pci_device		*pci;
 	struct golan_hca_init_seg	*iseg;
@@ -316,6 +354,29 @@ struct golan {
 	u32				flags;
 
 	struct golan_port		ports[GOLAN_MAX_PORTS];
+
+	/** Opcode of last command issued in each command slot */
+	uint16_t			cmd_opcode[NUM_CMD_IDX];
+	/** Timestamp at which each command slot was last issued */
+	unsigned long			cmd_started[NUM_CMD_IDX];
+	/** Command latency statistics */
+	struct golan_cmd_stats		cmd_stats[GOLAN_NUM_CMD_STATS];
+
+	/** Page regions owned by firmware */
+	struct list_head		pages;
+	/** Page regions in outstanding MANAGE_PAGES command */
+	struct list_head		pages_new;
+
+	/** Page request process */
+	struct process			pages_process;
+	/** Number of pages requested by firmware and not yet provided */
+	uint32_t			pages_pending;
+	/** Function ID for requested pages (big-endian) */
+	__be16				pages_func_id;
+	/** Number of pages in outstanding MANAGE_PAGES command */
+	uint32_t			pages_inflight;
+	/** Time at which outstanding MANAGE_PAGES command was issued */
+	unsigned long			pages_issued;
 };
 
 #endif /* _GOLAN_H_*/
@@ -37,6 +37,9 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <ipxe/in.h>
 #include <ipxe/netdevice.h>
 #include <ipxe/process.h>
+#include <ipxe/retry.h>
+#include <ipxe/timer.h>
+#include <ipxe/profile.h>
 #include <ipxe/infiniband.h>
 #include <ipxe/ib_smc.h>
 #include <ipxe/if_ether.h>
@@ -189,6 +192,10 @@ static void hermon_bitmask_free ( hermon_bitmask_t *bits,
  ***************************************************************************
  */
 
+/** Command latency profiler */
+static struct profiler hermon_cmd_profiler __profiler =
+	{ .name = "hermon.cmd" };
+
 /**
  * Wait for ConnectX3 command completion
  *
@@ -239,31 +246,95 @@ static u8 hermon_cmd_get_function ( struct hermon *hermon,
 }
 
 /**
- * Issue HCA command
+ * Record command latency
+ *
+ * @v hermon		ConnectX3 device
+ * @v opcode		HCA command opcode
+ * @v started		Timestamp at which command was issued
+ */
+static void hermon_cmd_record ( struct hermon *hermon, unsigned int opcode,
+				unsigned long started ) {
+	struct hermon_cmd_stats *stats;
+	unsigned long elapsed;
+	unsigned int i;
+
+	/* Record in overall profiler */
+	elapsed = ( profile_timestamp() - started );
+	profile_update ( &hermon_cmd_profiler, elapsed );
+
+	/* Find (or allocate) per-opcode statistics */
+	for ( i = 0 ; i < HERMON_NUM_CMD_STATS ; i++ ) {
+		stats = &hermon->cmd_stats[i];
+		if ( stats->count && ( stats->opcode != opcode ) )
+			continue;
+		stats->opcode = opcode;
+		stats->count++;
+		stats->total += elapsed;
+		if ( elapsed > stats->max )
+			stats->max = elapsed;
+		return;
+	}
+}
+
+/**
+ * Dump command latency statistics
+ *
+ * @v hermon		ConnectX3 device
+ */
+static void hermon_cmd_stats_dump ( struct hermon *hermon ) {
+	struct hermon_cmd_stats *stats;
+	unsigned int i;
+
+	for ( i = 0 ; i < HERMON_NUM_CMD_STATS ; i++ ) {
+		stats = &hermon->cmd_stats[i];
+		if ( ! stats->count )
+			break;
+		DBGC ( hermon, "ConnectX3 %p command %#03x: %ld issued, mean "
+		       "%ld max %ld ticks\n", hermon, stats->opcode,
+		       stats->count, ( stats->total / stats->count ),
+		       stats->max );
+	}
+}
+
+/**
+ * Allocate command completion event token
+ *
+ * @v hermon		ConnectX3 device
+ * @ret token		Completion event token (never zero)
+ */
+static unsigned int hermon_cmd_next_token ( struct hermon *hermon ) {
+
+	hermon->cmd_token = ( ( hermon->cmd_token + 1 ) &
+			      HERMON_CMD_TOKEN_MASK );
+	if ( ! hermon->cmd_token )
+		hermon->cmd_token = 1;
+	return hermon->cmd_token;
+}
+
+/**
+ * Issue HCA command without waiting for completion
  *
  * @v hermon		ConnectX3 device
  * @v command		Command opcode, flags and input/output lengths
  * @v op_mod		Opcode modifier (0 if no modifier applicable)
  * @v in		Input parameters
  * @v in_mod		Input modifier (0 if no modifier applicable)
- * @v out		Output parameters
- * @event		if true, command will complete with event
+ * @v out_mbox		Output mailbox
+ * @v token		Completion event token, or zero for no event
  * @ret rc		Return status code
  */
-static int hermon_cmd ( struct hermon *hermon, unsigned long command,
-			unsigned int op_mod, const void *in,
-			unsigned int in_mod, void *out, int event) {
+static int hermon_cmd_issue ( struct hermon *hermon, unsigned long command,
+			      unsigned int op_mod, const void *in,
+			      unsigned int in_mod, void *out_mbox,
+			      unsigned int token ) {
 	struct hermonprm_hca_command_register hcr;
 	unsigned int opcode = HERMON_HCR_OPCODE ( command );
 	size_t in_len = HERMON_HCR_IN_LEN ( command );
 	size_t out_len = HERMON_HCR_OUT_LEN ( command );
 	u8 physical_function;
 	void *in_buffer;
-	void *out_buffer;
-	unsigned int status;
 	unsigned int i;
 	int rc;
-	u32 evw;
 
 	assert ( in_len <= HERMON_MBOX_SIZE );
 	assert ( out_len <= HERMON_MBOX_SIZE );
@@ -299,18 +370,18 @@ static int hermon_cmd ( struct hermon *hermon, unsigned long command,
 		MLX_FILL_1 ( &hcr, 1, in_param_l, physical_function );
 	memcpy ( in_buffer, in, in_len );
 	MLX_FILL_1 ( &hcr, 2, input_modifier, in_mod );
-	out_buffer = &hcr.u.dwords[3];
 	if ( out_len && ( command & HERMON_HCR_OUT_MBOX ) ) {
-		out_buffer = hermon->mailbox_out;
 		MLX_FILL_H ( &hcr, 3, out_param_h,
-			     virt_to_bus ( out_buffer ) );
+			     virt_to_bus ( out_mbox ) );
 		MLX_FILL_1 ( &hcr, 4, out_param_l,
-			     virt_to_bus ( out_buffer ) );
+			     virt_to_bus ( out_mbox ) );
 	}
-	MLX_FILL_4 ( &hcr, 6,
+	MLX_FILL_1 ( &hcr, 5, token, token );
+	MLX_FILL_5 ( &hcr, 6,
 		     opcode, opcode,
 		     opcode_modifier, op_mod,
 		     go, 1,
+		     e, ( token ? 1 : 0 ),
 		     t, hermon->toggle );
 
 	DBGC2 ( hermon, "ConnectX3 %p issuing command %04x\n",
@@ -323,12 +394,6 @@ static int hermon_cmd ( struct hermon *hermon, unsigned long command,
 			    ( ( in_len < 512 ) ? in_len : 512 ) );
 	}
 
-	if ( event ) {
-		evw = be32_to_cpu ( hcr.u.dwords[6] );
-		evw |= 0x400000;
-		hcr.u.dwords[6] = cpu_to_be32 ( evw );
-	}
-
 	/* Issue command */
 	for ( i = 0 ; i < ( sizeof ( hcr ) / sizeof ( hcr.u.dwords[0] ) ) ;
 	      i++ ) {
@@ -337,6 +402,64 @@ static int hermon_cmd ( struct hermon *hermon, unsigned long command,
 		barrier();
 	}
 
+	return 0;
+}
+
+/**
+ * Report failed HCA command
+ *
+ * @v hermon		ConnectX3 device
+ * @v opcode		HCA command opcode
+ * @v op_mod		Opcode modifier
+ * @v status		Command status
+ * @ret rc		Return status code
+ */
+static int hermon_cmd_failed ( struct hermon *hermon, unsigned int opcode,
+			       unsigned int op_mod, unsigned int status ) {
+
+	if ( ( ( opcode == HERMON_HCR_MOD_STAT_CFG ) && ( op_mod == 0xe ) ) ||
+	     ( opcode == HERMON_HCR_INIT_DIAG_BUFFER ) ) {
+		/* Could be as a result of missing TLV - print it as debug */
+		DBGC ( hermon, "ConnectX3 %p command 0x%x failed with status %02x:\n",
+			hermon, opcode, status );
+	} else {
+		printf ( "ConnectX3 %p command 0x%x failed with status %02x:\n",
+			hermon, opcode, status );
+	}
+	return -EIO;
+}
+
+/**
+ * Issue HCA command
+ *
+ * @v hermon		ConnectX3 device
+ * @v command		Command opcode, flags and input/output lengths
+ * @v op_mod		Opcode modifier (0 if no modifier applicable)
+ * @v in		Input parameters
+ * @v in_mod		Input modifier (0 if no modifier applicable)
+ * @v out		Output parameters
+ * @event		if true, command will complete with event
+ * @ret rc		Return status code
+ */
+static int hermon_cmd ( struct hermon *hermon, unsigned long command,
+			unsigned int op_mod, const void *in,
+			unsigned int in_mod, void *out, int event) {
+	struct hermonprm_hca_command_register hcr;
+	unsigned int opcode = HERMON_HCR_OPCODE ( command );
+	size_t out_len = HERMON_HCR_OUT_LEN ( command );
+	void *out_buffer;
+	unsigned long started;
+	unsigned int status;
+	int rc;
+
+	/* Issue command */
+	started = profile_timestamp();
+	if ( ( rc = hermon_cmd_issue ( hermon, command, op_mod, in, in_mod,
+				       hermon->mailbox_out,
+				       ( event ? hermon_cmd_next_token ( hermon ) :
+					 0 ) ) )
+	     != 0 )
+		return rc;
 	if ( event )
 		return 0;
 
@@ -349,26 +472,21 @@ static int hermon_cmd ( struct hermon *hermon, unsigned long command,
 			   &hcr, sizeof ( hcr ) );
 		return rc;
 	}
+	hermon_cmd_record ( hermon, opcode, started );
 
 	/* Check command status */
 	status = MLX_GET ( &hcr, status );
 	if ( status != 0 ) {
-		if ( ( ( opcode == HERMON_HCR_MOD_STAT_CFG ) && ( op_mod == 0xe ) ) ||
-		     ( opcode == HERMON_HCR_INIT_DIAG_BUFFER ) ) {
-			/* Could be as a result of missing TLV - print it as debug */
-			DBGC ( hermon, "ConnectX3 %p command 0x%x failed with status %02x:\n",
-				hermon, opcode, status );
-		} else {
-			printf ( "ConnectX3 %p command 0x%x failed with status %02x:\n",
-				hermon, opcode, status );
-		}
 		DBGC_HDA ( hermon,
 			   virt_to_phys ( hermon->config + HERMON_HCR_BASE ),
 			   &hcr, sizeof ( hcr ) );
-		return -EIO;
+		return hermon_cmd_failed ( hermon, opcode, op_mod, status );
 	}
 
 	/* Read output parameters, if any */
+	out_buffer = &hcr.u.dwords[3];
+	if ( out_len && ( command & HERMON_HCR_OUT_MBOX ) )
+		out_buffer = hermon->mailbox_out;
 	hcr.u.dwords[3] = readl ( hermon->config + HERMON_HCR_REG ( 3 ) );
 	hcr.u.dwords[4] = readl ( hermon->config + HERMON_HCR_REG ( 4 ) );
 	memcpy ( out, out_buffer, out_len );
@@ -382,6 +500,142 @@ static int hermon_cmd ( struct hermon *hermon, unsigned long command,
 	return 0;
 }
 
+/**
+ * Complete asynchronous HCA command
+ *
+ * @v hermon		ConnectX3 device
+ * @v status		Command status
+ * @v out_param		Immediate output parameters (as read from HCR)
+ */
+static void hermon_cmd_async_complete ( struct hermon *hermon,
+					unsigned int status,
+					const uint32_t *out_param ) {
+	struct hermon_command *cmd = hermon->cmd_async;
+	unsigned int opcode = HERMON_HCR_OPCODE ( cmd->command );
+	size_t out_len = HERMON_HCR_OUT_LEN ( cmd->command );
+
+	/* Record latency and status */
+	hermon_cmd_record ( hermon, opcode, cmd->started );
+	hermon->cmd_async = NULL;
+	if ( status != 0 ) {
+		cmd->rc = hermon_cmd_failed ( hermon, opcode, 0, status );
+		return;
+	}
+
+	/* Copy output parameters, if any */
+	if ( out_len && ( cmd->command & HERMON_HCR_OUT_MBOX ) ) {
+		memcpy ( cmd->out, hermon->mailbox_async, out_len );
+	} else {
+		memcpy ( cmd->out, out_param, out_len );
+	}
+	cmd->rc = 0;
+}
+
+/**
+ * Issue asynchronous HCA command
+ *
+ * @v hermon		ConnectX3 device
+ * @v cmd		Asynchronous command
+ * @v command		Command opcode, flags and input/output lengths
+ * @v in		Input parameters
+ * @v in_mod		Input modifier (0 if no modifier applicable)
+ * @v out		Output parameters
+ * @ret rc		Return status code
+ *
+ * The command completes via a command completion event on the event
+ * queue, at which point @c cmd->rc will be updated.  Output
+ * parameters are written to @c out upon successful completion, which
+ * must therefore remain valid until the command completes.
+ *
+ * Only one asynchronous command may be outstanding at any time.
+ * Synchronous commands may still be issued in the meantime: each
+ * will wait for the command interface to become free, and the
+ * asynchronous command uses a dedicated output mailbox.
+ */
+static int hermon_cmd_async ( struct hermon *hermon,
+			      struct hermon_command *cmd,
+			      unsigned long command, const void *in,
+			      unsigned int in_mod, void *out ) {
+	int rc;
+
+	/* Fail if event queue is not available */
+	if ( ! hermon->eq.eqe )
+		return -ENOTCONN;
+
+	/* Fail if another asynchronous command is outstanding */
+	if ( hermon->cmd_async )
+		return -EBUSY;
+
+	/* Issue command */
+	cmd->command = command;
+	cmd->out = out;
+	cmd->token = hermon_cmd_next_token ( hermon );
+	cmd->started = profile_timestamp();
+	cmd->issued = currticks();
+	if ( ( rc = hermon_cmd_issue ( hermon, command, 0, in, in_mod,
+				       hermon->mailbox_async,
+				       cmd->token ) ) != 0 )
+		return rc;
+	cmd->rc = -EINPROGRESS;
+	hermon->cmd_async = cmd;
+
+	return 0;
+}
+
+/**
+ * Check for completion of asynchronous HCA command by polling
+ *
+ * @v hermon		ConnectX3 device
+ * @v timeout		Time (in ticks) to allow for completion event
+ *
+ * This is a fallback used only if the completion event has not
+ * arrived within the expected time, or when the event queue is
+ * about to be destroyed.
+ */
+static void hermon_cmd_async_poll ( struct hermon *hermon,
+				    unsigned long timeout ) {
+	struct hermon_command *cmd = hermon->cmd_async;
+	struct hermonprm_hca_command_register hcr;
+	uint32_t out_param[2];
+
+	/* Do nothing unless an overdue command is outstanding */
+	if ( ! cmd )
+		return;
+	if ( ( currticks() - cmd->issued ) < timeout )
+		return;
+
+	/* Wait for command interface to become free */
+	if ( hermon_cmd_wait ( hermon, &hcr ) != 0 ) {
+		DBGC ( hermon, "ConnectX3 %p timed out waiting for "
+		       "asynchronous command\n", hermon );
+		hermon->cmd_async = NULL;
+		cmd->rc = -ETIMEDOUT;
+		return;
+	}
+	DBGC ( hermon, "ConnectX3 %p missed completion event for command "
+	       "%#03lx\n", hermon, HERMON_HCR_OPCODE ( cmd->command ) );
+
+	/* The HCR status is meaningful only if the HCR has not since
+	 * been reused by a synchronous command.
+	 */
+	hcr.u.dwords[5] = readl ( hermon->config + HERMON_HCR_REG ( 5 ) );
+	if ( ( MLX_GET ( &hcr, go ) != 0 ) ||
+	     ( MLX_GET ( &hcr, token ) != cmd->token ) ) {
+		DBGC ( hermon, "ConnectX3 %p lost status of asynchronous "
+		       "command %#03lx\n", hermon,
+		       HERMON_HCR_OPCODE ( cmd->command ) );
+		hermon->cmd_async = NULL;
+		cmd->rc = -ETIMEDOUT;
+		return;
+	}
+
+	/* Complete command based on HCR status */
+	out_param[0] = readl ( hermon->config + HERMON_HCR_REG ( 3 ) );
+	out_param[1] = readl ( hermon->config + HERMON_HCR_REG ( 4 ) );
+	hermon_cmd_async_complete ( hermon, MLX_GET ( &hcr, status ),
+				    out_param );
+}
+
 static inline int
 hermon_cmd_query_dev_cap ( struct hermon *hermon,
 			   struct hermonprm_query_dev_cap *dev_cap ) {
@@ -1790,12 +2044,10 @@ static int hermon_post_send ( struct ib_device *ibdev,
 	struct ib_work_queue *wq = &qp->send;
 	struct hermon_send_work_queue *hermon_send_wq = &hermon_qp->send;
 	union hermon_send_wqe *wqe;
-	union hermonprm_doorbell_register db_reg;
 	unsigned long wqe_idx_mask;
 	unsigned long wqe_idx;
 	unsigned int owner;
 	unsigned int opcode;
-	int rc;
 
 	/* Allocate work queue entry */
 	wqe_idx = ( wq->next_idx & ( hermon_send_wq->num_wqes - 1 ) );
@@ -1824,6 +2076,30 @@ static int hermon_post_send ( struct ib_device *ibdev,
 		hermon, qp->qpn, wqe_idx );
 	DBGCP_HDA ( hermon, virt_to_phys ( wqe ), wqe, sizeof ( *wqe ) );
 
+	/* Update work queue's index */
+	wq->next_idx++;
+
+	return 0;
+}
+
+/**
+ * Notify hardware of new send work queue entries
+ *
+ * @v ibdev		Infiniband device
+ * @v qp		Queue pair
+ *
+ * The send doorbell carries only the queue pair number, so a
+ * single doorbell covers every work queue entry posted since the
+ * previous one.
+ */
+static void hermon_ring_send ( struct ib_device *ibdev,
+			       struct ib_queue_pair *qp ) {
+	struct hermon *hermon = ib_get_drvdata ( ibdev );
+	struct hermon_queue_pair *hermon_qp = ib_qp_get_drvdata ( qp );
+	struct hermon_send_work_queue *hermon_send_wq = &hermon_qp->send;
+	union hermonprm_doorbell_register db_reg;
+	int rc;
+
 	/* Ring doorbell register */
 	MLX_FILL_1 ( &db_reg.send, 0, qn, qp->qpn );
 	barrier();
@@ -1831,16 +2107,10 @@ static int hermon_post_send ( struct ib_device *ibdev,
 		if ( (rc = hermon_cmd_post_sqp_doorbell ( hermon, qp->qpn ) ) != 0 ) {
 			printf ( "Failed to post doorbell command on ConnectX3 %p QPN %#lx ",
 				hermon, qp->qpn );
-			return rc;
 		}
 	} else {
 		writel ( db_reg.dword[0], hermon_send_wq->doorbell );
 	}
-
-	/* Update work queue's index */
-	wq->next_idx++;
-
-	return 0;
 }
 
 /**
@@ -1882,12 +2152,24 @@ static int hermon_post_recv ( struct ib_device *ibdev,
 	/* Update work queue's index */
 	wq->next_idx++;
 
+	return 0;
+}
+
+/**
+ * Notify hardware of new receive work queue entries
+ *
+ * @v ibdev		Infiniband device
+ * @v qp		Queue pair
+ */
+static void hermon_ring_recv ( struct ib_device *ibdev __unused,
+			       struct ib_queue_pair *qp ) {
+	struct hermon_queue_pair *hermon_qp = ib_qp_get_drvdata ( qp );
+	struct hermon_recv_work_queue *hermon_recv_wq = &hermon_qp->recv;
+
 	/* Update doorbell record */
 	barrier();
 	MLX_FILL_1 ( hermon_recv_wq->doorbell, 0, receive_wqe_counter,
-		     ( wq->next_idx & 0xffff ) );
-
-	return 0;
+		     ( qp->recv.next_idx & 0xffff ) );
 }
 
 /**
@@ -2487,6 +2769,9 @@ static void hermon_destroy_eq ( struct hermon *hermon ) {
 	struct hermonprm_event_mask mask;
 	int rc;
 
+	/* Complete any outstanding asynchronous command */
+	hermon_cmd_async_poll ( hermon, 0 );
+
 	/* Unmap events from event queue */
 	memset ( &mask, 0xff, sizeof ( mask ) );
 	if ( ( rc = hermon_cmd_map_eq ( hermon,
@@ -2526,9 +2811,12 @@ static void hermon_event_completion ( struct hermon *hermon,
 		if ( ! ( hermon->port_mask & ( i + HERMON_PORT_BASE ) ) )
 			continue;
 		port = &hermon->port[i];
-		cq = port->eth_cq;
-		if ( ( port->ibdev->protocol == HERMON_PROT_ETH ) &&
-		     ( cq != NULL ) && ( cq->cqn == cqn ) ) {
+		if ( port->ibdev->protocol != HERMON_PROT_ETH )
+			continue;
+		cq = port->eth_recv_cq;
+		if ( ! ( cq && ( cq->cqn == cqn ) ) )
+			cq = port->eth_send_cq;
+		if ( cq && ( cq->cqn == cqn ) ) {
 			if ( ( hcq = ib_cq_get_drvdata ( cq ) ) ) {
 				++hcq->arm_sn;
 				break;
@@ -2681,6 +2969,85 @@ static void hermon_clr_int ( struct hermon *hermon ) {
 	barrier();
 }
 
+/**
+ * Handle command completion event
+ *
+ * @v hermon		ConnectX3 device
+ * @v eqe		Command completion event queue entry
+ */
+static void hermon_event_cmd_completion ( struct hermon *hermon,
+					  union hermonprm_event_entry *eqe ) {
+	struct hermon_command *cmd = hermon->cmd_async;
+	unsigned int token;
+	uint32_t out_param[2];
+
+	/* Identify command */
+	token = MLX_GET ( &eqe->cmd_completion, data.token );
+	if ( ( ! cmd ) || ( token != cmd->token ) ) {
+		DBGC ( hermon, "ConnectX3 %p unexpected completion event for "
+		       "token %#04x\n", hermon, token );
+		return;
+	}
+
+	/* Complete command */
+	out_param[0] = cpu_to_be32 ( MLX_GET ( &eqe->cmd_completion,
+					       data.out_param_h ) );
+	out_param[1] = cpu_to_be32 ( MLX_GET ( &eqe->cmd_completion,
+					       data.out_param_l ) );
+	hermon_cmd_async_complete ( hermon,
+				    MLX_GET ( &eqe->cmd_completion,
+					      data.status ), out_param );
+}
+
+/**
+ * Poll Ethernet link state
+ *
+ * @v hermon		ConnectX3 device
+ * @v ibdev		Infiniband device
+ * @v netdev		Network device
+ *
+ * No event is generated when the Ethernet link comes up, so the port
+ * state must be queried while the link is down.  The query is issued
+ * as an asynchronous command, so that polling does not block while
+ * waiting for the firmware.
+ */
+static void hermon_eth_poll_link ( struct hermon *hermon,
+				   struct ib_device *ibdev,
+				   struct net_device *netdev ) {
+	struct hermon_port *port = &hermon->port[ ibdev->port - HERMON_PORT_BASE ];
+	struct hermon_command *cmd = &port->link_cmd;
+	int rc;
+
+	/* Wait for any outstanding query to complete */
+	if ( cmd->rc == -EINPROGRESS )
+		return;
+
+	/* Process result of any completed query */
+	if ( cmd->command ) {
+		cmd->command = 0;
+		if ( cmd->rc != 0 ) {
+			printf ( "ConnectX3 %p port %d could not "
+			       "query port: %s\n", hermon, ibdev->port,
+			       strerror ( cmd->rc ) );
+		} else if ( MLX_GET ( &port->link_query, link_state ) ) {
+			netdev->link_rc = 0;
+			return;
+		}
+	}
+
+	/* Start a new query */
+	if ( ( rc = hermon_cmd_async ( hermon, cmd,
+				       HERMON_HCR_OUT_CMD ( HERMON_HCR_QUERY_PORT,
+							    1, sizeof ( port->link_query ) ),
+				       NULL, ibdev->port,
+				       &port->link_query ) ) != 0 ) {
+		/* Retry on next poll */
+		DBGC2 ( hermon, "ConnectX3 %p port %d could not start link "
+			"query: %s\n", hermon, ibdev->port, strerror ( rc ) );
+		cmd->command = 0;
+	}
+}
+
 /**
  * Poll event queue
  *
@@ -2690,7 +3057,6 @@ static void hermon_poll_eq ( struct ib_device *ibdev ) {
 	struct hermon *hermon = ib_get_drvdata ( ibdev );
 	struct hermon_event_queue *hermon_eq = &hermon->eq;
 	struct net_device *netdev = ib_get_ownerdata ( ibdev );
-	struct hermonprm_query_port_cap query_port;
 	union hermonprm_event_entry *eqe;
 	union hermonprm_doorbell_register db_reg;
 	unsigned int eqe_idx_mask;
@@ -2729,9 +3095,7 @@ static void hermon_poll_eq ( struct ib_device *ibdev ) {
 			hermon_event_completion ( hermon, eqe );
 			break;
 		case HERMON_EV_CMD_COMPLETION:
-			/* currently only NOP uses event and it does not need further processing.
-			 * If the command needs further processing it needs to be done here
-			 */
+			hermon_event_cmd_completion ( hermon, eqe );
 			break;
 		case HERMON_EV_PORT_STATE_CHANGE:
 			hermon_event_port_state_change ( hermon, eqe );
@@ -2769,18 +3133,11 @@ static void hermon_poll_eq ( struct ib_device *ibdev ) {
 		}
 	}
 
-	if ( ibdev->protocol == HERMON_PROT_ETH && netdev->link_rc ) {
-		if ( ( rc = hermon_cmd_query_port ( hermon,
-					    ibdev->port,
-					    &query_port ) ) != 0 ) {
-			printf ( "ConnectX3 %p port %d could not "
-			       "query port: %s\n", hermon, ibdev->port,
-			       strerror ( rc ) );
-		} else {
-			if ( MLX_GET ( &query_port, link_state ) )
-				netdev->link_rc = 0;
-		}
-	}
+	/* Fall back to polling for overdue command completions */
+	hermon_cmd_async_poll ( hermon, HERMON_CMD_EVENT_TIMEOUT );
+
+	if ( ibdev->protocol == HERMON_PROT_ETH && netdev->link_rc )
+		hermon_eth_poll_link ( hermon, ibdev, netdev );
 }
 
 /***************************************************************************
@@ -2799,6 +3156,9 @@ static void hermon_poll_eq ( struct ib_device *ibdev ) {
  * @v pa		Physical address
  * @v len		Length of region
  * @ret rc		Return status code
+ *
+ * The region is mapped using the largest blocks permitted by the
+ * alignment of both the physical and the virtual address.
  */
 static int hermon_map_vpm ( struct hermon *hermon,
 			    int ( *map ) ( struct hermon *hermon,
@@ -2825,6 +3185,14 @@ static int hermon_map_vpm ( struct hermon *hermon,
 	assert ( start < low );
 	assert ( high <= end );
 
+	/* Limit block size to the alignment of the virtual address.
+	 * Blocks are mapped at consecutive virtual addresses in
+	 * descending order of size, so the virtual address remains
+	 * aligned to each subsequent block size.
+	 */
+	while ( va & ( size - 1 ) )
+		size >>= 1;
+
 	/* These mappings tend to generate huge volumes of
 	 * uninteresting debug data, which basically makes it
 	 * impossible to use debugging otherwise.
@@ -3062,6 +3430,49 @@ static uint64_t icm_align ( uint64_t icm_offset, size_t len ) {
 	return ( ( icm_offset + len - 1 ) & ~( ( ( uint64_t ) len ) - 1 ) );
 }
 
+/**
+ * Add ICM region to be mapped
+ *
+ * @v hermon		ConnectX3 device
+ * @v offset		Offset of ICM table
+ * @v num		Number of entries actually used
+ * @v entry_size	Size of each entry
+ *
+ * Only the pages covering the entries actually used (i.e. those
+ * reserved by the firmware plus those that the driver may allocate)
+ * are mapped; the remainder of each power-of-two sized table is left
+ * unmapped.  Regions are added in order of increasing offset, and
+ * overlapping or adjacent regions are merged.
+ */
+static void hermon_icm_region ( struct hermon *hermon, uint64_t offset,
+				unsigned int num, size_t entry_size ) {
+	struct hermon_icm_map *map;
+	uint64_t start;
+	uint64_t end;
+
+	/* Calculate page-aligned region */
+	start = ( offset & ~( ( uint64_t ) HERMON_PAGE_SIZE - 1 ) );
+	end = ( ( offset + ( num * ( ( uint64_t ) entry_size ) ) +
+		  HERMON_PAGE_SIZE - 1 ) &
+		~( ( uint64_t ) HERMON_PAGE_SIZE - 1 ) );
+
+	/* Merge with previous region, if possible */
+	if ( hermon->icm_num_regions ) {
+		map = &hermon->icm_map[ hermon->icm_num_regions - 1 ];
+		if ( start <= ( map->offset + map->len ) ) {
+			if ( end > ( map->offset + map->len ) )
+				map->len = ( end - map->offset );
+			return;
+		}
+	}
+
+	/* Add new region */
+	assert ( hermon->icm_num_regions < HERMON_ICM_MAX_REGIONS );
+	map = &hermon->icm_map[ hermon->icm_num_regions++ ];
+	map->offset = start;
+	map->len = ( end - start );
+}
+
 /**
  * Map ICM (allocating if necessary)
  *
@@ -3076,11 +3487,12 @@ static int hermon_map_icm ( struct hermon *hermon,
 	uint64_t icm_offset = 0;
 	unsigned int log_num_qps, log_num_srqs, log_num_cqs, log_num_eqs;
 	unsigned int log_num_mtts, log_num_mpts, log_num_mcs;
+	unsigned int num_qps, num_cqs, num_mtts;
 	size_t cmpt_max_len;
-	size_t icm_len, icm_aux_len;
+	size_t icm_len, icm_aux_len, icm_virt_len;
 	size_t len;
 	physaddr_t icm_phys;
-	int i;
+	unsigned int i;
 	int rc;
 
 	/*
@@ -3098,32 +3510,45 @@ static int hermon_map_icm ( struct hermon *hermon,
 	log_num_mpts = fls ( hermon->cap.reserved_mrws + 1 - 1 );
 	log_num_mcs = HERMON_LOG_MULTICAST_HASH_SIZE;
 
+	/* Calculate number of each object type actually used.  The
+	 * driver's own objects are allocated immediately above those
+	 * reserved by the firmware, so only the low end of each
+	 * (power-of-two sized) table ever needs to be mapped.
+	 */
+	num_qps = ( hermon->cap.reserved_qps + HERMON_RSVD_SPECIAL_QPS +
+		    HERMON_MAX_QPS );
+	if ( ( 1UL << log_num_qps ) > ( HERMON_QPN_RANDOM_MASK &
+					-HERMON_QPN_RANDOM_MASK ) ) {
+		/* Randomised QPNs may then fall anywhere in the table */
+		num_qps = ( 1 << log_num_qps );
+	}
+	num_cqs = ( hermon->cap.reserved_cqs + HERMON_MAX_CQS );
+	num_mtts = ( hermon->cap.reserved_mtts + HERMON_MAX_MTTS );
+	hermon->icm_num_regions = 0;
+	icm_virt_len = 0;
+
 	/* ICM starts with the cMPT tables, which are sparse */
 	cmpt_max_len = ( HERMON_CMPT_MAX_ENTRIES *
 			 ( ( uint64_t ) hermon->cap.cmpt_entry_size ) );
-	len = ( ( ( ( 1 << log_num_qps ) * hermon->cap.cmpt_entry_size ) +
-		  HERMON_PAGE_SIZE - 1 ) & ~( HERMON_PAGE_SIZE - 1 ) );
-	hermon->icm_map[HERMON_ICM_QP_CMPT].offset = icm_offset;
-	hermon->icm_map[HERMON_ICM_QP_CMPT].len = len;
+	hermon_icm_region ( hermon, icm_offset, num_qps,
+			    hermon->cap.cmpt_entry_size );
+	icm_virt_len += ( ( 1 << log_num_qps ) * hermon->cap.cmpt_entry_size );
 	icm_offset += cmpt_max_len;
-	len = ( ( ( ( 1 << log_num_srqs ) * hermon->cap.cmpt_entry_size ) +
-		  HERMON_PAGE_SIZE - 1 ) & ~( HERMON_PAGE_SIZE - 1 ) );
-	hermon->icm_map[HERMON_ICM_SRQ_CMPT].offset = icm_offset;
-	hermon->icm_map[HERMON_ICM_SRQ_CMPT].len = len;
+	hermon_icm_region ( hermon, icm_offset,
+			    ( 1 << log_num_srqs ),
+			    hermon->cap.cmpt_entry_size );
+	icm_virt_len += ( ( 1 << log_num_srqs ) * hermon->cap.cmpt_entry_size );
 	icm_offset += cmpt_max_len;
-	len = ( ( ( ( 1 << log_num_cqs ) * hermon->cap.cmpt_entry_size ) +
-		  HERMON_PAGE_SIZE - 1 ) & ~( HERMON_PAGE_SIZE - 1 ) );
-	hermon->icm_map[HERMON_ICM_CQ_CMPT].offset = icm_offset;
-	hermon->icm_map[HERMON_ICM_CQ_CMPT].len = len;
+	hermon_icm_region ( hermon, icm_offset, num_cqs,
+			    hermon->cap.cmpt_entry_size );
+	icm_virt_len += ( ( 1 << log_num_cqs ) * hermon->cap.cmpt_entry_size );
 	icm_offset += cmpt_max_len;
-	len = ( ( ( ( 1 << log_num_eqs ) * hermon->cap.cmpt_entry_size ) +
-		  HERMON_PAGE_SIZE - 1 ) & ~( HERMON_PAGE_SIZE - 1 ) );
-	hermon->icm_map[HERMON_ICM_EQ_CMPT].offset = icm_offset;
-	hermon->icm_map[HERMON_ICM_EQ_CMPT].len = len;
+	hermon_icm_region ( hermon, icm_offset,
+			    ( 1 << log_num_eqs ),
+			    hermon->cap.cmpt_entry_size );
+	icm_virt_len += ( ( 1 << log_num_eqs ) * hermon->cap.cmpt_entry_size );
 	icm_offset += cmpt_max_len;
 
-	hermon->icm_map[HERMON_ICM_OTHER].offset = icm_offset;
-
 	/* Queue pair contexts */
 	len = ( ( 1 << log_num_qps ) * hermon->cap.qpc_entry_size );
 	icm_offset = icm_align ( icm_offset, len );
@@ -3138,6 +3563,9 @@ static int hermon_map_icm ( struct hermon *hermon,
 	DBGC ( hermon, "ConnectX3 %p ICM QPC is %d x %#zx at [%08llx,%08llx)\n",
 	       hermon, ( 1 << log_num_qps ), hermon->cap.qpc_entry_size,
 	       icm_offset, ( icm_offset + len ) );
+	hermon_icm_region ( hermon, icm_offset, num_qps,
+			    hermon->cap.qpc_entry_size );
+	icm_virt_len += len;
 	icm_offset += len;
 
 	/* Extended alternate path contexts */
@@ -3152,6 +3580,9 @@ static int hermon_map_icm ( struct hermon *hermon,
 	DBGC ( hermon, "ConnectX3 %p ICM ALTC is %d x %#zx at [%08llx,%08llx)\n",
 	       hermon, ( 1 << log_num_qps ), hermon->cap.altc_entry_size,
 	       icm_offset, ( icm_offset + len ) );
+	hermon_icm_region ( hermon, icm_offset, num_qps,
+			    hermon->cap.altc_entry_size );
+	icm_virt_len += len;
 	icm_offset += len;
 
 	/* Extended auxiliary contexts */
@@ -3166,6 +3597,9 @@ static int hermon_map_icm ( struct hermon *hermon,
 	DBGC ( hermon, "ConnectX3 %p ICM AUXC is %d x %#zx at [%08llx,%08llx)\n",
 	       hermon, ( 1 << log_num_qps ), hermon->cap.auxc_entry_size,
 	       icm_offset, ( icm_offset + len ) );
+	hermon_icm_region ( hermon, icm_offset, num_qps,
+			    hermon->cap.auxc_entry_size );
+	icm_virt_len += len;
 	icm_offset += len;
 
 	/* Shared receive queue contexts */
@@ -3182,6 +3616,9 @@ static int hermon_map_icm ( struct hermon *hermon,
 	DBGC ( hermon, "ConnectX3 %p ICM SRQC is %d x %#zx at [%08llx,%08llx)\n",
 	       hermon, ( 1 << log_num_srqs ), hermon->cap.srqc_entry_size,
 	       icm_offset, ( icm_offset + len ) );
+	hermon_icm_region ( hermon, icm_offset, ( 1 << log_num_srqs ),
+			    hermon->cap.srqc_entry_size );
+	icm_virt_len += len;
 	icm_offset += len;
 
 	/* Completion queue contexts */
@@ -3198,6 +3635,9 @@ static int hermon_map_icm ( struct hermon *hermon,
 	DBGC ( hermon, "ConnectX3 %p ICM CQC is %d x %#zx at [%08llx,%08llx)\n",
 	       hermon, ( 1 << log_num_cqs ), hermon->cap.cqc_entry_size,
 	       icm_offset, ( icm_offset + len ) );
+	hermon_icm_region ( hermon, icm_offset, num_cqs,
+			    hermon->cap.cqc_entry_size );
+	icm_virt_len += len;
 	icm_offset += len;
 
 	/* Event queue contexts */
@@ -3214,6 +3654,9 @@ static int hermon_map_icm ( struct hermon *hermon,
 	DBGC ( hermon, "ConnectX3 %p ICM EQC is %d x %#zx at [%08llx,%08llx)\n",
 	       hermon, ( 1 << log_num_eqs ), hermon->cap.eqc_entry_size,
 	       icm_offset, ( icm_offset + len ) );
+	hermon_icm_region ( hermon, icm_offset, ( 1 << log_num_eqs ),
+			    hermon->cap.eqc_entry_size );
+	icm_virt_len += len;
 	icm_offset += len;
 
 	/* Memory translation table */
@@ -3226,6 +3669,9 @@ static int hermon_map_icm ( struct hermon *hermon,
 	DBGC ( hermon, "ConnectX3 %p ICM MTT is %d x %#zx at [%08llx,%08llx)\n",
 	       hermon, ( 1 << log_num_mtts ), hermon->cap.mtt_entry_size,
 	       icm_offset, ( icm_offset + len ) );
+	hermon_icm_region ( hermon, icm_offset, num_mtts,
+			    hermon->cap.mtt_entry_size );
+	icm_virt_len += len;
 	icm_offset += len;
 
 	/* Memory protection table */
@@ -3240,6 +3686,9 @@ static int hermon_map_icm ( struct hermon *hermon,
 	DBGC ( hermon, "ConnectX3 %p ICM DMPT is %d x %#zx at [%08llx,%08llx)\n",
 	       hermon, ( 1 << log_num_mpts ), hermon->cap.dmpt_entry_size,
 	       icm_offset, ( icm_offset + len ) );
+	hermon_icm_region ( hermon, icm_offset, ( 1 << log_num_mpts ),
+			    hermon->cap.dmpt_entry_size );
+	icm_virt_len += len;
 	icm_offset += len;
 
 	/* Multicast table */
@@ -3264,24 +3713,24 @@ static int hermon_map_icm ( struct hermon *hermon,
 	       hermon, ( 1 << log_num_mcs ),
 	       sizeof ( struct hermonprm_mcg_entry ),
 	       icm_offset, ( icm_offset + len ) );
+	hermon_icm_region ( hermon, icm_offset,
+			    ( 1 << log_num_mcs ),
+			    sizeof ( struct hermonprm_mcg_entry ) );
+	icm_virt_len += len;
 	icm_offset += len;
 
-
-	hermon->icm_map[HERMON_ICM_OTHER].len =
-		( icm_offset - hermon->icm_map[HERMON_ICM_OTHER].offset );
-
 	/*
 	 * Allocate and map physical memory for (portions of) ICM
 	 *
 	 * Map is:
 	 *   ICM AUX area (aligned to its own size)
-	 *   cMPT areas
-	 *   Other areas
+	 *   Used portions of cMPT areas
+	 *   Used portions of other areas
 	 */
 
 	/* Calculate physical memory required for ICM */
 	icm_len = 0;
-	for ( i = 0 ; i < HERMON_ICM_NUM_REGIONS ; i++ ) {
+	for ( i = 0 ; i < hermon->icm_num_regions ; i++ ) {
 		icm_len += hermon->icm_map[i].len;
 	}
 
@@ -3298,8 +3747,10 @@ static int hermon_map_icm ( struct hermon *hermon,
 	icm_aux_len = ( MLX_GET ( &icm_aux_size, value ) * HERMON_PAGE_SIZE );
 
 	/* Allocate ICM data and auxiliary area */
-	DBGC ( hermon, "ConnectX3 %p requires %zd kB ICM and %zd kB AUX ICM\n",
-	       hermon, ( icm_len / 1024 ), ( icm_aux_len / 1024 ) );
+	DBGC ( hermon, "ConnectX3 %p requires %zd kB ICM (of %zd kB in ICM "
+	       "tables) in %d regions and %zd kB AUX ICM\n", hermon,
+	       ( icm_len / 1024 ), ( icm_virt_len / 1024 ),
+	       hermon->icm_num_regions, ( icm_aux_len / 1024 ) );
 	if ( ! hermon->icm ) {
 		hermon->icm_len = icm_len;
 		hermon->icm_aux_len = icm_aux_len;
@@ -3328,7 +3779,7 @@ static int hermon_map_icm ( struct hermon *hermon,
 	icm_phys += icm_aux_len;
 
 	/* MAP ICM area */
-	for ( i = 0 ; i < HERMON_ICM_NUM_REGIONS ; i++ ) {
+	for ( i = 0 ; i < hermon->icm_num_regions ; i++ ) {
 		DBGC ( hermon, "ConnectX3 %p mapping ICM %llx+%zx => %08lx\n",
 		       hermon, hermon->icm_map[i].offset,
 		       hermon->icm_map[i].len, icm_phys );
@@ -3363,7 +3814,7 @@ static void hermon_unmap_icm ( struct hermon *hermon ) {
 	struct hermonprm_scalar_parameter unmap_icm;
 	int i;
 
-	for ( i = ( HERMON_ICM_NUM_REGIONS - 1 ) ; i >= 0 ; i-- ) {
+	for ( i = ( hermon->icm_num_regions - 1 ) ; i >= 0 ; i-- ) {
 		memset ( &unmap_icm, 0, sizeof ( unmap_icm ) );
 		MLX_FILL_1 ( &unmap_icm, 0, value_hi,
 			     ( hermon->icm_map[i].offset >> 32 ) );
@@ -3387,9 +3838,117 @@ static void hermon_unmap_icm ( struct hermon *hermon ) {
 #define HERMON_TLV_ACCESS_WRITE		0x2
 #define HERMON_TLV_ACCESS_INVALIDATE	0x3
 
+/**
+ * Find cached TLV read
+ *
+ * @v hermon		ConnectX3 device
+ * @v tlv_header	TLV header
+ * @ret cache		Cached TLV read, or NULL if not found
+ */
+static struct hermon_tlv_cache *
+hermon_tlv_cache_find ( struct hermon *hermon,
+			struct hermon_tlv_header *tlv_header ) {
+	struct hermon_tlv_cache *cache;
+
+	list_for_each_entry ( cache, &hermon->tlv_cache, list ) {
+		if ( ( cache->type == tlv_header->type ) &&
+		     ( cache->type_mod == ( tlv_header->type_mod & 0xff ) ) &&
+		     ( cache->length == tlv_header->length ) )
+			return cache;
+	}
+	return NULL;
+}
+
+/**
+ * Discard cached TLV reads
+ *
+ * @v hermon		ConnectX3 device
+ * @v tlv_header	TLV header
+ *
+ * Discards all cached reads of the TLV, whatever the length
+ * requested.
+ */
+static void hermon_tlv_cache_discard ( struct hermon *hermon,
+				       struct hermon_tlv_header *tlv_header ) {
+	struct hermon_tlv_cache *cache;
+	struct hermon_tlv_cache *tmp;
+
+	list_for_each_entry_safe ( cache, tmp, &hermon->tlv_cache, list ) {
+		if ( ( cache->type == tlv_header->type ) &&
+		     ( cache->type_mod == ( tlv_header->type_mod & 0xff ) ) ) {
+			list_del ( &cache->list );
+			free ( cache );
+		}
+	}
+}
+
+/**
+ * Record TLV read in cache
+ *
+ * @v hermon		ConnectX3 device
+ * @v tlv_header	TLV header
+ * @v register_access	Register access data returned by firmware
+ *
+ * Failure to allocate a cache entry is not an error; the TLV will
+ * simply be read from the firmware again next time.
+ */
+static void
+hermon_tlv_cache_add ( struct hermon *hermon,
+		       struct hermon_tlv_header *tlv_header,
+		       struct hermonprm_register_access *register_access ) {
+	struct hermon_tlv_cache *cache;
+	size_t len;
+
+	/* Cache only the header and the data actually returned */
+	len = ( HERMON_REGISTER_ACCESS_DATA_OFFSET +
+		( MLX_GET ( register_access, tlv_hdr_length ) *
+		  sizeof ( uint32_t ) ) );
+	if ( len > sizeof ( *register_access ) )
+		len = sizeof ( *register_access );
+
+	cache = malloc ( sizeof ( *cache ) + len );
+	if ( ! cache )
+		return;
+	cache->type = tlv_header->type;
+	cache->type_mod = ( tlv_header->type_mod & 0xff );
+	cache->length = tlv_header->length;
+	cache->len = len;
+	memcpy ( cache->data, register_access, len );
+	list_add ( &cache->list, &hermon->tlv_cache );
+}
+
+/**
+ * Free all cached TLV reads
+ *
+ * @v hermon		ConnectX3 device
+ */
+static void hermon_tlv_cache_free ( struct hermon *hermon ) {
+	struct hermon_tlv_cache *cache;
+	struct hermon_tlv_cache *tmp;
+
+	list_for_each_entry_safe ( cache, tmp, &hermon->tlv_cache, list ) {
+		list_del ( &cache->list );
+		free ( cache );
+	}
+}
+
+/**
+ * Access NV configuration TLV
+ *
+ * @v hermon		ConnectX3 device
+ * @v tlv_header	TLV header
+ * @v access_method	Access method
+ * @ret rc		Return status code
+ *
+ * Reads are served from the per-device TLV cache where possible, so
+ * that each TLV is read from the firmware at most once.  Writes and
+ * invalidations always go through to the firmware, and discard any
+ * cached copy of the TLV.
+ */
 static int hermon_access_tlv ( struct hermon *hermon,
 		struct hermon_tlv_header *tlv_header,
 		uint8_t access_method) {
+	struct hermon_tlv_cache *cache = NULL;
 	int rc, op, reg_id;
 	unsigned int i, length = 0;
 	uint32_t *u32ptr;
@@ -3432,10 +3991,21 @@ static int hermon_access_tlv ( struct hermon *hermon,
 			method, op,
 			register_id, reg_id);
 
-	if  ( ( rc = hermon_cmd_register_access ( hermon ,
+	if (access_method == HERMON_TLV_ACCESS_READ) {
+		cache = hermon_tlv_cache_find ( hermon, tlv_header );
+	} else {
+		hermon_tlv_cache_discard ( hermon, tlv_header );
+	}
+
+	if ( cache ) {
+		memset ( &register_access, 0, sizeof ( register_access ) );
+		memcpy ( &register_access, cache->data, cache->len );
+	} else if  ( ( rc = hermon_cmd_register_access ( hermon ,
 					&register_access ) ) != 0 ) {
 		DBGC(hermon, "Error %s:%d [%x] - Failed to run 'Register Access' command\n", __FUNCTION__, __LINE__,rc);
 		return rc;
+	} else if (access_method == HERMON_TLV_ACCESS_READ) {
+		hermon_tlv_cache_add ( hermon, tlv_header, &register_access );
 	}
 
 	if ( MLX_GET ( &register_access, status ) != 0 ) {
@@ -4287,28 +4857,119 @@ int hermon_get_ini_and_defaults ( struct hermon *hermon ) {
  */
 
 
+/** Device reset time profiler */
+static struct profiler hermon_reset_profiler __profiler =
+	{ .name = "hermon.reset" };
+
+/** Port sensing time profiler */
+static struct profiler hermon_sense_profiler __profiler =
+	{ .name = "hermon.sense" };
+
+/** PCI configuration registers not preserved across device reset */
+static const uint8_t hermon_backup_exclude[] =
+	PCI_CONFIG_BACKUP_EXCLUDE ( 0x58, 0x5c );
+
 /**
- * Reset device
+ * Check if command interface is idle
  *
  * @v hermon		ConnectX3 device
+ * @ret is_idle		No command is in progress
  */
-static void hermon_reset ( struct hermon *hermon,
-			   unsigned int reset_type ) {
+static int hermon_reset_idle ( struct hermon *hermon ) {
+	struct hermonprm_hca_command_register hcr;
+
+	hcr.u.dwords[6] = readl ( hermon->config + HERMON_HCR_REG ( 6 ) );
+	return ( MLX_GET ( &hcr, go ) == 0 );
+}
+
+/**
+ * Check if device has come out of reset
+ *
+ * @v hermon		ConnectX3 device
+ * @ret is_ready	Device is responding to configuration cycles
+ */
+static int hermon_reset_ready ( struct hermon *hermon ) {
 	struct pci_device *pci = hermon->pci;
-	struct pci_config_backup backup;
-	static const uint8_t backup_exclude[] =
-		PCI_CONFIG_BACKUP_EXCLUDE ( 0x58, 0x5c );
+	uint16_t vendor;
+
+	pci_read_config_word ( pci, PCI_VENDOR_ID, &vendor );
+	return ( vendor == pci->vendor );
+}
+
+/**
+ * Assert device reset
+ *
+ * @v hermon		ConnectX3 device
+ * @v reset_type	Reset type
+ */
+static void hermon_reset_assert ( struct hermon *hermon,
+				  unsigned int reset_type ) {
 
-	mdelay ( HERMON_RESET_WAIT_TIME_MS );
 	/* Perform device reset and preserve PCI configuration */
-	pci_backup ( pci, &backup, backup_exclude );
+	pci_backup ( hermon->pci, &hermon->backup, hermon_backup_exclude );
 	writel ( reset_type,
 		 ( hermon->config + HERMON_RESET_OFFSET ) );
-	mdelay ( HERMON_RESET_WAIT_TIME_MS );
-	pci_restore ( pci, &backup, backup_exclude );
+	hermon->reset_asserted = currticks();
+}
+
+/**
+ * Complete device reset
+ *
+ * @v hermon		ConnectX3 device
+ */
+static void hermon_reset_complete ( struct hermon *hermon ) {
+	unsigned long elapsed;
+
+	/* Restore PCI configuration */
+	pci_restore ( hermon->pci, &hermon->backup, hermon_backup_exclude );
 
 	/* Reset command interface toggle */
 	hermon->toggle = 0;
+
+	/* Record time spent */
+	profile_update ( &hermon_reset_profiler,
+			 ( profile_timestamp() - hermon->reset_stamp ) );
+	elapsed = ( ( ( currticks() - hermon->reset_started ) * 1000 ) /
+		    TICKS_PER_SEC );
+	DBGC ( hermon, "ConnectX3 %p reset took %ldms\n", hermon, elapsed );
+}
+
+/**
+ * Reset device
+ *
+ * @v hermon		ConnectX3 device
+ *
+ * Rather than sleeping for a fixed period, this polls for the
+ * command interface to become idle before the reset and for the
+ * device to respond to configuration cycles after the reset, waiting
+ * no longer than the fixed periods previously used.
+ */
+static void hermon_reset ( struct hermon *hermon,
+			   unsigned int reset_type ) {
+	unsigned int i;
+
+	/* Wait for any command in progress to complete */
+	hermon->reset_started = currticks();
+	hermon->reset_stamp = profile_timestamp();
+	for ( i = 0 ; i < HERMON_RESET_WAIT_TIME_MS ; i++ ) {
+		if ( hermon_reset_idle ( hermon ) )
+			break;
+		mdelay ( 1 );
+	}
+
+	/* Reset device */
+	hermon_reset_assert ( hermon, reset_type );
+
+	/* Wait for device to come out of reset */
+	mdelay ( HERMON_RESET_MIN_WAIT_MS );
+	for ( i = HERMON_RESET_MIN_WAIT_MS ; i < HERMON_RESET_WAIT_TIME_MS ;
+	      i++ ) {
+		if ( hermon_reset_ready ( hermon ) )
+			break;
+		mdelay ( 1 );
+	}
+
+	hermon_reset_complete ( hermon );
 }
 
 /**
@@ -4364,9 +5025,9 @@ static int hermon_unmap_mpt ( struct hermon *hermon )
 
 static void hermon_arm_cq ( struct hermon *hermon, struct net_device *netdev ) {
 	struct hermon_port *port = netdev->priv;
-	struct ib_completion_queue *cq = port->eth_cq;
 
-	arm_cq ( hermon, cq );
+	arm_cq ( hermon, port->eth_send_cq );
+	arm_cq ( hermon, port->eth_recv_cq );
 }
 
 /**
@@ -4675,7 +5336,9 @@ static struct ib_device_operations hermon_ib_operations = {
 	.modify_qp	= hermon_modify_qp,
 	.destroy_qp	= hermon_destroy_qp,
 	.post_send	= hermon_post_send,
+	.ring_send	= hermon_ring_send,
 	.post_recv	= hermon_post_recv,
+	.ring_recv	= hermon_ring_recv,
 	.poll_cq	= hermon_poll_cq,
 	.poll_eq	= hermon_poll_eq,
 	.open		= hermon_ib_open,
@@ -4779,11 +5442,26 @@ static struct hermon_port_type hermon_port_type_ib = {
 /** Number of ConnectX3 Ethernet send work queue entries */
 #define HERMON_ETH_NUM_SEND_WQES 64
 
-/** Number of ConnectX3 Ethernet receive work queue entries */
-#define HERMON_ETH_NUM_RECV_WQES 64
+/** Number of ConnectX3 Ethernet receive work queue entries
+ *
+ * A 64-entry ring is too shallow to absorb TCP bursts at 40/56GbE.
+ */
+#define HERMON_ETH_NUM_RECV_WQES 256
+
+/** Number of ConnectX3 Ethernet send completion entries */
+#define HERMON_ETH_NUM_SEND_CQES HERMON_ETH_NUM_SEND_WQES
 
-/** Number of ConnectX3 Ethernet completion entries */
-#define HERMON_ETH_NUM_CQES (HERMON_ETH_NUM_SEND_WQES + HERMON_ETH_NUM_RECV_WQES)
+/** Number of ConnectX3 Ethernet receive completion entries */
+#define HERMON_ETH_NUM_RECV_CQES HERMON_ETH_NUM_RECV_WQES
+
+/** ConnectX3 Ethernet send queue fill level at which completions are reaped */
+#define HERMON_ETH_SEND_WATERMARK ( HERMON_ETH_NUM_SEND_WQES / 2 )
+
+/** Maximum number of polls for which send completions may be deferred */
+#define HERMON_ETH_SEND_MAX_DEFER 16
+
+/** ConnectX3 Ethernet send queue fill level at which doorbells are coalesced */
+#define HERMON_ETH_SEND_BATCH_FILL 4
 
 int hermon_eth_add_steer ( struct ib_device *ibdev,
 			   struct ib_queue_pair *eth_qp )
@@ -4888,6 +5566,21 @@ static int hermon_eth_transmit ( struct net_device *netdev,
 	struct hermon *hermon = ib_get_drvdata ( ibdev );
 	int rc;
 
+	/* Reap send completions if the send queue is full */
+	if ( port->eth_qp->send.fill >= port->eth_qp->send.num_wqes ) {
+		ib_commit_send ( ibdev, port->eth_qp );
+		ib_poll_cq ( ibdev, port->eth_send_cq );
+	}
+
+	/* Coalesce doorbells while the send queue is busy.  Batched
+	 * packets are notified to the hardware on the next poll.
+	 */
+	if ( port->eth_qp->send.fill >= HERMON_ETH_SEND_BATCH_FILL ) {
+		ib_begin_send ( port->eth_qp );
+	} else {
+		ib_commit_send ( ibdev, port->eth_qp );
+	}
+
 	/* Transmit packet */
 	if ( ( rc = ib_post_send ( ibdev, port->eth_qp, NULL,
 				   iobuf ) ) != 0 ) {
@@ -4981,7 +5674,25 @@ static void hermon_eth_poll ( struct net_device *netdev ) {
 	struct hermon_port *port = netdev->priv;
 	struct ib_device *ibdev = port->ibdev;
 
-	ib_poll_eq ( ibdev );
+	/* Notify hardware of any batched sends */
+	ib_commit_send ( ibdev, port->eth_qp );
+
+	/* Poll event queue */
+	hermon_poll_eq ( ibdev );
+
+	/* Poll receive completions.  This also refills the receive
+	 * work queue in a single batch via ib_refill_recv().
+	 */
+	ib_poll_cq ( ibdev, port->eth_recv_cq );
+
+	/* Defer send completions until the send queue passes its
+	 * watermark, or until they have been deferred for too long.
+	 */
+	if ( ( port->eth_qp->send.fill >= HERMON_ETH_SEND_WATERMARK ) ||
+	     ( ++port->eth_send_deferred >= HERMON_ETH_SEND_MAX_DEFER ) ) {
+		ib_poll_cq ( ibdev, port->eth_send_cq );
+		port->eth_send_deferred = 0;
+	}
 }
 
 /**
@@ -5001,22 +5712,35 @@ static int hermon_eth_open ( struct net_device *netdev ) {
 	if ( ( rc = hermon_open ( hermon ) ) != 0 )
 		goto err_open;
 
-	/* Allocate completion queue */
-	port->eth_cq = ib_create_cq ( ibdev, HERMON_ETH_NUM_CQES,
-				      &hermon_eth_cq_op );
-	if ( ! port->eth_cq ) {
-		printf ( "ConnectX3 %p port %d could not create completion "
-		       "queue\n", hermon, ibdev->port );
+	/* Allocate send completion queue */
+	port->eth_send_cq = ib_create_cq ( ibdev, HERMON_ETH_NUM_SEND_CQES,
+					   &hermon_eth_cq_op );
+	if ( ! port->eth_send_cq ) {
+		printf ( "ConnectX3 %p port %d could not create send "
+		       "completion queue\n", hermon, ibdev->port );
 		rc = -ENOMEM;
-		goto err_create_cq;
+		goto err_create_send_cq;
+	}
+
+	/* Allocate receive completion queue */
+	port->eth_recv_cq = ib_create_cq ( ibdev, HERMON_ETH_NUM_RECV_CQES,
+					   &hermon_eth_cq_op );
+	if ( ! port->eth_recv_cq ) {
+		printf ( "ConnectX3 %p port %d could not create receive "
+		       "completion queue\n", hermon, ibdev->port );
+		rc = -ENOMEM;
+		goto err_create_recv_cq;
 	}
 
 	hermon_arm_cq ( hermon, netdev );
+	port->eth_send_deferred = 0;
 
 	/* Allocate queue pair */
 	port->eth_qp = ib_create_qp ( ibdev, IB_QPT_ETH,
-				      HERMON_ETH_NUM_SEND_WQES, port->eth_cq,
-				      HERMON_ETH_NUM_RECV_WQES, port->eth_cq,
+				      HERMON_ETH_NUM_SEND_WQES,
+				      port->eth_send_cq,
+				      HERMON_ETH_NUM_RECV_WQES,
+				      port->eth_recv_cq,
 				      &hermon_eth_qp_op );
 	if ( ! port->eth_qp ) {
 		printf ( "ConnectX3 %p port %d could not create queue "
@@ -5106,8 +5830,10 @@ static int hermon_eth_open ( struct net_device *netdev ) {
  err_modify_qp:
 	ib_destroy_qp ( ibdev, port->eth_qp );
  err_create_qp:
-	ib_destroy_cq ( ibdev, port->eth_cq );
- err_create_cq:
+	ib_destroy_cq ( ibdev, port->eth_recv_cq );
+ err_create_recv_cq:
+	ib_destroy_cq ( ibdev, port->eth_send_cq );
+ err_create_send_cq:
 	hermon_close ( hermon );
  err_open:
 	return rc;
@@ -5137,7 +5863,8 @@ static void hermon_eth_close ( struct net_device *netdev ) {
 	hermon_eth_release_steer ( ibdev, port->eth_qp );
 	/* Tear down the queues */
 	ib_destroy_qp ( ibdev, port->eth_qp );
-	ib_destroy_cq ( ibdev, port->eth_cq );
+	ib_destroy_cq ( ibdev, port->eth_recv_cq );
+	ib_destroy_cq ( ibdev, port->eth_send_cq );
 
 	/* Close hardware */
 	hermon_close ( hermon );
@@ -5340,6 +6067,10 @@ static int hermon_set_port_type ( struct hermon *hermon,
 	struct hermonprm_query_port_cap query_port;
 	int ib_supported, eth_supported, port_type, rc;
 	u8 is_connectx2 = 0;
+	unsigned long started;
+	unsigned long stamp;
+	unsigned long elapsed;
+	unsigned int waited;
 
 	/* Check to see which types are supported */
 	if ( ( rc = hermon_cmd_query_port ( hermon, ibdev->port,
@@ -5374,11 +6105,26 @@ static int hermon_set_port_type ( struct hermon *hermon,
 	} else if ( ib_supported && eth_supported ) {
 		is_connectx2 = ( cpu_to_be32 ( readl ( hermon->config + 0xf0014 ) )
 				== 0x100b190 ? 1 : 0 );
-		/* Sense network, if applicable */
-		if ( is_connectx2 )
-			mdelay ( 2000 );
-		/* Try sensing port */
+		/* Try sensing port.  ConnectX-2 may take some time to
+		 * sense the network, so keep polling until the port
+		 * type is known.
+		 */
+		started = currticks();
+		stamp = profile_timestamp();
 		port_type = hermon_sense_port_type ( hermon, port );
+		for ( waited = 0 ; ( is_connectx2 && hermon->cap.dpdp &&
+				     ( port_type == HERMON_PORT_TYPE_UNKNOWN ) &&
+				     ( waited < HERMON_SENSE_PORT_MAX_WAIT_MS ) ) ;
+		      waited += HERMON_SENSE_PORT_POLL_MS ) {
+			mdelay ( HERMON_SENSE_PORT_POLL_MS );
+			port_type = hermon_sense_port_type ( hermon, port );
+		}
+		profile_update ( &hermon_sense_profiler,
+				 ( profile_timestamp() - stamp ) );
+		elapsed = ( ( ( currticks() - started ) * 1000 ) /
+			    TICKS_PER_SEC );
+		DBGC ( hermon, "ConnectX3 %p port %d sensing took %ldms\n",
+		       hermon, ibdev->port, elapsed );
 		if ( port_type == HERMON_PORT_TYPE_UNKNOWN ) {
 			/* Check to see which types are supported */
 			if ( ( rc = hermon_cmd_query_port ( hermon, ibdev->port,
@@ -5833,9 +6579,18 @@ static struct hermon * hermon_alloc ( void ) {
 					   HERMON_MBOX_ALIGN );
 	if ( ! hermon->mailbox_out )
 		goto err_mailbox_out;
+	hermon->mailbox_async = malloc_dma ( HERMON_MBOX_SIZE,
+					     HERMON_MBOX_ALIGN );
+	if ( ! hermon->mailbox_async )
+		goto err_mailbox_async;
+
+	/* Initialise NV configuration TLV cache */
+	INIT_LIST_HEAD ( &hermon->tlv_cache );
 
 	return hermon;
 
+	free_dma ( hermon->mailbox_async, HERMON_MBOX_SIZE );
+ err_mailbox_async:
 	free_dma ( hermon->mailbox_out, HERMON_MBOX_SIZE );
  err_mailbox_out:
 	free_dma ( hermon->mailbox_in, HERMON_MBOX_SIZE );
@@ -5852,8 +6607,10 @@ static struct hermon * hermon_alloc ( void ) {
  */
 static void hermon_free ( struct hermon *hermon ) {
 
+	hermon_tlv_cache_free ( hermon );
 	ufree ( hermon->icm );
 	ufree ( hermon->firmware_area );
+	free_dma ( hermon->mailbox_async, HERMON_MBOX_SIZE );
 	free_dma ( hermon->mailbox_out, HERMON_MBOX_SIZE );
 	free_dma ( hermon->mailbox_in, HERMON_MBOX_SIZE );
 	free ( hermon );
@@ -5917,15 +6674,16 @@ static void copy_netdev_settings_to_netdev ( struct net_device *src, struct net_
 }
 
 /**
- * Probe PCI device
+ * Complete probe of PCI device
  *
- * @v pci		PCI device
- * @v id		PCI ID
+ * @v hermon		ConnectX3 device
  * @ret rc		Return status code
+ *
+ * This is called once the device reset has completed.  On failure,
+ * the device is freed.
  */
-static int hermon_probe ( struct pci_device *pci )
-{
-	struct hermon *hermon;
+static int hermon_probe_continue ( struct hermon *hermon ) {
+	struct pci_device *pci = hermon->pci;
 	struct ib_device *ibdev;
 	struct net_device *vlan;
 	struct hermon_port *port;
@@ -5933,21 +6691,6 @@ static int hermon_probe ( struct pci_device *pci )
 	unsigned int i;
 	int rc;
 
-	/* Allocate ConnectX3 device */
-	hermon = hermon_alloc();
-	if ( ! hermon ) {
-		rc = -ENOMEM;
-		goto err_alloc;
-	}
-	pci_set_drvdata ( pci, hermon );
-	hermon->pci = pci;
-
-	/* Initialise PCI parameters */
-	hermon_pci_init ( hermon );
-
-	/* Reset device */
-	hermon_reset ( hermon, HERMON_RESET_START );
-
 	/* Start firmware */
 	if ( ( rc = hermon_start_firmware ( hermon ) ) != 0 )
 		goto err_start_firmware;
@@ -6078,10 +6821,86 @@ static int hermon_probe ( struct pci_device *pci )
 	hermon_stop_firmware ( hermon );
  err_start_firmware:
 	hermon_free ( hermon );
- err_alloc:
+	pci_set_drvdata ( pci, NULL );
 	return rc;
 }
 
+/**
+ * Handle device reset timer expiry during probe
+ *
+ * @v timer		Device reset timer
+ * @v over		Failure indicator
+ */
+static void hermon_probe_expired ( struct retry_timer *timer,
+				   int over __unused ) {
+	struct hermon *hermon =
+		container_of ( timer, struct hermon, probe_timer );
+	struct pci_device *pci = hermon->pci;
+	int rc;
+
+	/* Assert device reset once the command interface is idle */
+	if ( ! hermon->probe_reset ) {
+		if ( ( ! hermon_reset_idle ( hermon ) ) &&
+		     ( ( currticks() - hermon->reset_started ) <
+		       HERMON_RESET_WAIT_TICKS ) ) {
+			start_timer_fixed ( &hermon->probe_timer, 1 );
+			return;
+		}
+		hermon_reset_assert ( hermon, HERMON_RESET_START );
+		hermon->probe_reset = 1;
+		start_timer_fixed ( &hermon->probe_timer,
+				    HERMON_RESET_MIN_WAIT_TICKS );
+		return;
+	}
+
+	/* Wait for device to come out of reset */
+	if ( ( ! hermon_reset_ready ( hermon ) ) &&
+	     ( ( currticks() - hermon->reset_asserted ) <
+	       HERMON_RESET_WAIT_TICKS ) ) {
+		start_timer_fixed ( &hermon->probe_timer, 1 );
+		return;
+	}
+
+	/* Complete device reset and the remainder of the probe */
+	hermon_reset_complete ( hermon );
+	rc = hermon_probe_continue ( hermon );
+	pci_probe_complete ( pci, rc );
+}
+
+/**
+ * Probe PCI device
+ *
+ * @v pci		PCI device
+ * @v id		PCI ID
+ * @ret rc		Return status code
+ *
+ * The device reset delays are spent waiting on a timer rather than
+ * busy-waiting, so that other devices may be probed (and the user
+ * prompted) in the meantime.  The probe completes asynchronously.
+ */
+static int hermon_probe ( struct pci_device *pci )
+{
+	struct hermon *hermon;
+
+	/* Allocate ConnectX3 device */
+	hermon = hermon_alloc();
+	if ( ! hermon )
+		return -ENOMEM;
+	pci_set_drvdata ( pci, hermon );
+	hermon->pci = pci;
+
+	/* Initialise PCI parameters */
+	hermon_pci_init ( hermon );
+
+	/* Start device reset */
+	timer_init ( &hermon->probe_timer, hermon_probe_expired, NULL );
+	hermon->reset_started = currticks();
+	hermon->reset_stamp = profile_timestamp();
+	start_timer_nodelay ( &hermon->probe_timer );
+
+	return -EINPROGRESS;
+}
+
 /**
  * Remove PCI device
  *
@@ -6092,6 +6911,19 @@ static void hermon_remove ( struct pci_device *pci ) {
 	struct hermon_port *port;
 	int i;
 
+	/* Do nothing if probe failed */
+	if ( ! hermon )
+		return;
+
+	/* Abort probe if still in progress */
+	if ( timer_running ( &hermon->probe_timer ) ) {
+		stop_timer ( &hermon->probe_timer );
+		hermon_free ( hermon );
+		pci_set_drvdata ( pci, NULL );
+		pci_probe_complete ( pci, -ECANCELED );
+		return;
+	}
+
 	/* Deallocate all driver settings */
 	if ( hermon->cap.nv_mem_access_supported )
 		destroy_driver_settings ();
@@ -6110,6 +6942,7 @@ static void hermon_remove ( struct pci_device *pci ) {
 			continue;
 		ibdev_put ( hermon->port[i].ibdev );
 	}
+	hermon_cmd_stats_dump ( hermon );
 	hermon_free ( hermon );
 }
 
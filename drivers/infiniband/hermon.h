@@ -11,6 +11,9 @@ FILE_LICENCE ( GPL2_OR_LATER );
 
 #include <stdint.h>
 #include <ipxe/uaccess.h>
+#include <ipxe/retry.h>
+#include <ipxe/pci.h>
+#include <ipxe/pcibackup.h>
 #include <ipxe/ib_packet.h>
 #include <ipxe/bofm.h>
 #include <ipxe/nvsvpd.h>
@@ -44,6 +47,16 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #define HERMON_RESET_START		0x03000000UL
 #define HERMON_RESET_END		0x80000001UL
 #define HERMON_RESET_WAIT_TIME_MS	500
+#define HERMON_RESET_WAIT_TICKS \
+	( ( HERMON_RESET_WAIT_TIME_MS * TICKS_PER_SEC ) / 1000 )
+/** Minimum time after reset before accessing PCI configuration space */
+#define HERMON_RESET_MIN_WAIT_MS	100
+#define HERMON_RESET_MIN_WAIT_TICKS \
+	( ( HERMON_RESET_MIN_WAIT_MS * TICKS_PER_SEC ) / 1000 )
+
+/* Port sensing (ConnectX-2 dual-protocol ports) */
+#define HERMON_SENSE_PORT_MAX_WAIT_MS	2000
+#define HERMON_SENSE_PORT_POLL_MS	100
 
 /* Work queue entry and completion queue entry opcodes */
 #define HERMON_OPCODE_NOP		0x00
@@ -281,6 +294,12 @@ struct hermonprm_completion_event_st {
 	struct hermonprm_completion_event_data_st data;
 } __attribute__ (( packed ));
 
+struct hermonprm_cmd_completion_event_st {
+	pseudo_bit_t reserved[0x00020];
+/* -------------- */
+	struct hermonprm_hcr_completion_event_st data;
+} __attribute__ (( packed ));
+
 struct hermonprm_port_mgmt_change_event_st {
 	pseudo_bit_t reserved[0x00020];
 /* -------------- */
@@ -756,6 +775,7 @@ struct MLX_DECLARE_STRUCT ( hermonprm_mpt );
 struct MLX_DECLARE_STRUCT ( hermonprm_mtt );
 struct MLX_DECLARE_STRUCT ( hermonprm_port_state_change_event );
 struct MLX_DECLARE_STRUCT ( hermonprm_completion_event );
+struct MLX_DECLARE_STRUCT ( hermonprm_cmd_completion_event );
 struct MLX_DECLARE_STRUCT ( hermonprm_port_mgmt_change_event );
 struct MLX_DECLARE_STRUCT ( hermonprm_qp_db_record );
 struct MLX_DECLARE_STRUCT ( hermonprm_qp_ee_state_transitions );
@@ -842,6 +862,7 @@ union hermonprm_event_entry {
 	struct hermonprm_port_state_change_event port_state_change;
 	struct hermonprm_port_mgmt_change_event port_mgmt_change;
 	struct hermonprm_completion_event completion;
+	struct hermonprm_cmd_completion_event cmd_completion;
 } __attribute__ (( packed ));
 
 union hermonprm_doorbell_register {
@@ -944,6 +965,22 @@ struct hermon_tlv_header {
 	void 		*data;
 };
 
+/** A cached NV configuration TLV read */
+struct hermon_tlv_cache {
+	/** List of cached TLVs */
+	struct list_head list;
+	/** TLV type */
+	uint32_t type;
+	/** TLV type modifier */
+	uint32_t type_mod;
+	/** Requested TLV length */
+	uint32_t length;
+	/** Length of cached register access data */
+	size_t len;
+	/** Register access data returned by firmware */
+	uint8_t data[0];
+};
+
 struct hermon_wake_on_lan_conf {
 	uint32_t			: 9;
 	uint32_t	en_wol_phy	: 1;
@@ -1212,15 +1249,12 @@ struct hermon_icm_map {
 	size_t len;
 };
 
-/** Discontiguous regions within Hermon ICM */
-enum hermon_icm_map_regions {
-	HERMON_ICM_QP_CMPT = 0,
-	HERMON_ICM_SRQ_CMPT,
-	HERMON_ICM_CQ_CMPT,
-	HERMON_ICM_EQ_CMPT,
-	HERMON_ICM_OTHER,
-	HERMON_ICM_NUM_REGIONS
-};
+/** Maximum number of discontiguous mapped regions within Hermon ICM
+ *
+ * Each of the four cMPT tables and each of the nine other ICM tables
+ * may require a separate region.
+ */
+#define HERMON_ICM_MAX_REGIONS 13
 
 /** UAR page for doorbell accesses
  *
@@ -1436,16 +1470,65 @@ struct hermon_port_type {
 };
 
 
+/** An asynchronous Hermon command */
+struct hermon_command {
+	/** Command opcode, flags and input/output lengths */
+	unsigned long command;
+	/** Output parameters */
+	void *out;
+	/** Completion event token */
+	unsigned int token;
+	/** Timestamp at which command was issued (for profiling) */
+	unsigned long started;
+	/** Time at which command was issued (in ticks) */
+	unsigned long issued;
+	/** Command status, or -EINPROGRESS if still outstanding */
+	int rc;
+};
+
+/** Hermon command latency statistics */
+struct hermon_cmd_stats {
+	/** Command opcode */
+	unsigned int opcode;
+	/** Number of commands issued */
+	unsigned long count;
+	/** Total latency */
+	unsigned long total;
+	/** Maximum latency */
+	unsigned long max;
+};
+
+/** Number of distinct opcodes for which statistics are recorded */
+#define HERMON_NUM_CMD_STATS 32
+
+/** Time allowed for an asynchronous command completion event
+ *
+ * If no event arrives within this time, the command interface will
+ * be polled instead.
+ */
+#define HERMON_CMD_EVENT_TIMEOUT ( TICKS_PER_SEC / 2 )
+
+/** Command completion event token mask
+ *
+ * The token fields in the HCR and in the command completion event
+ * are only 16 bits wide.
+ */
+#define HERMON_CMD_TOKEN_MASK 0xffff
+
 /** A Hermon port */
 struct hermon_port {
 	/** Infiniband device */
 	struct ib_device *ibdev;
 	/** Network device */
 	struct net_device *netdev;
-	/** Ethernet completion queue */
-	struct ib_completion_queue *eth_cq;
+	/** Ethernet send completion queue */
+	struct ib_completion_queue *eth_send_cq;
+	/** Ethernet receive completion queue */
+	struct ib_completion_queue *eth_recv_cq;
 	/** Ethernet queue pair */
 	struct ib_queue_pair *eth_qp;
+	/** Number of polls since Ethernet send completions were reaped */
+	unsigned int eth_send_deferred;
 	/** VEP number */
 	u8 vep_number;
 	/** Ethernet MAC */
@@ -1461,6 +1544,10 @@ struct hermon_port {
 	int hermon_is_port_open;
 	/** Port default configurations */
 	struct hermon_port_conf_defaults defaults;
+	/** Ethernet link state query */
+	struct hermon_command link_cmd;
+	/** Ethernet link state query result */
+	struct hermonprm_query_port_cap link_query;
 };
 
 /** A Hermon device */
@@ -1474,12 +1561,33 @@ struct hermon {
 	/** PCI clear interrupt register */
 	void *clr_int;
 
+	/** Device reset timer used during probe */
+	struct retry_timer probe_timer;
+	/** Device reset has been asserted during probe */
+	int probe_reset;
+	/** Time at which device reset was started */
+	unsigned long reset_started;
+	/** Profiling timestamp at which device reset was started */
+	unsigned long reset_stamp;
+	/** Time at which device reset was asserted */
+	unsigned long reset_asserted;
+	/** PCI configuration preserved across device reset */
+	struct pci_config_backup backup;
+
 	/** Command toggle */
 	unsigned int toggle;
 	/** Command input mailbox */
 	void *mailbox_in;
 	/** Command output mailbox */
 	void *mailbox_out;
+	/** Asynchronous command output mailbox */
+	void *mailbox_async;
+	/** Last used command completion event token */
+	unsigned int cmd_token;
+	/** Outstanding asynchronous command, if any */
+	struct hermon_command *cmd_async;
+	/** Command latency statistics */
+	struct hermon_cmd_stats cmd_stats[HERMON_NUM_CMD_STATS];
 
 	/** Device open request counter */
 	unsigned int open_count;
@@ -1502,7 +1610,9 @@ struct hermon {
 	u8  intapin;
 
 	/** ICM map */
-	struct hermon_icm_map icm_map[HERMON_ICM_NUM_REGIONS];
+	struct hermon_icm_map icm_map[HERMON_ICM_MAX_REGIONS];
+	/** Number of mapped ICM regions */
+	unsigned int icm_num_regions;
 	/** ICM size */
 	size_t icm_len;
 	/** ICM AUX size */
@@ -1557,6 +1667,8 @@ struct hermon {
 	unsigned int mcg_aux_index;
 	/** List of multicast GIDs */
 	struct list_head ncsi_mgids;
+	/** Cached NV configuration TLV reads */
+	struct list_head tlv_cache;
 	/** Hermon default configurations */
 	struct hermon_conf_defaults defaults;
 	/** Hermon ini configurations */
@@ -2338,6 +2338,12 @@ static int linda_probe ( struct pci_device *pci ) {
 	ibdev->dev = &pci->dev;
 	ibdev->port = 1;
 
+	/* Limit the send work queue depth of any single queue pair
+	 * so that the remaining send buffers are left for the
+	 * management queue pairs.
+	 */
+	ibdev->max_send_wqes = ( LINDA_MAX_SEND_BUFS / 2 );
+
 	/* Fix up PCI device */
 	adjust_pci_device ( pci );
 
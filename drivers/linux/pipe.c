@@ -0,0 +1,694 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+FILE_LICENCE ( GPL2_OR_LATER );
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <byteswap.h>
+#include <linux_api.h>
+#include <ipxe/list.h>
+#include <ipxe/linux.h>
+#include <ipxe/device.h>
+#include <ipxe/netdevice.h>
+#include <ipxe/if_ether.h>
+#include <ipxe/ethernet.h>
+#include <ipxe/iobuf.h>
+#include <ipxe/timer.h>
+
+/** @file
+ *
+ * Paired pipe network devices
+ *
+ * Each "--net pipe" request creates two Ethernet network devices
+ * connected back to back, entirely in memory.  Packets transmitted
+ * on one end are received on the other after passing through a
+ * simple link emulator, configured by the request:
+ *
+ *   latency=<ms>	One-way delay
+ *   rate=<kbps>	Link bandwidth (0 for unlimited)
+ *   loss=<n>		Packets lost, per thousand
+ *   reorder=<n>	Packets reordered, per thousand
+ *   seed=<n>		Random number seed
+ *
+ * The emulator uses its own pseudo-random number generator, so that
+ * a given seed always produces the same pattern of loss and
+ * reordering.  Remaining settings (e.g. "mac") are applied to the
+ * first network device of the pair.
+ *
+ * A pipe may instead connect two processes, by specifying
+ *
+ *   path=<prefix>	Prefix of FIFO pair (created using mkfifo)
+ *   end=<n>		Pipe end (0 or 1)
+ *
+ * in which case a single network device is created, which receives
+ * from "<prefix>.<end>" and transmits to the other FIFO of the pair.
+ * Each packet is written as a two-byte length (in network byte
+ * order) followed by the Ethernet frame, using a single write so
+ * that it cannot be interleaved with other packets.  Two iPXE
+ * processes may be joined in this way, as may any program (e.g. a
+ * benchmark responder) that implements the same framing.  The link
+ * emulator is applied to transmitted packets before they are
+ * written to the FIFO.
+ */
+
+/* Disambiguate the various error causes */
+#define EIO_LOSS __einfo_error ( EINFO_EIO_LOSS )
+#define EINFO_EIO_LOSS \
+	__einfo_uniqify ( EINFO_EIO, 0x01, "Emulated packet loss" )
+#define ENOBUFS_QUEUE __einfo_error ( EINFO_ENOBUFS_QUEUE )
+#define EINFO_ENOBUFS_QUEUE \
+	__einfo_uniqify ( EINFO_ENOBUFS, 0x01, "Pipe queue full" )
+#define ENOTCONN_PEER __einfo_error ( EINFO_ENOTCONN_PEER )
+#define EINFO_ENOTCONN_PEER \
+	__einfo_uniqify ( EINFO_ENOTCONN, 0x01, "Pipe peer closed" )
+#define EIO_FRAME __einfo_error ( EINFO_EIO_FRAME )
+#define EINFO_EIO_FRAME \
+	__einfo_uniqify ( EINFO_EIO, 0x02, "Truncated pipe frame" )
+#define ENXIO_FIFO __einfo_error ( EINFO_ENXIO_FIFO )
+#define EINFO_ENXIO_FIFO \
+	__einfo_uniqify ( EINFO_ENXIO, 0x01, "Could not open pipe FIFO" )
+
+/** Maximum number of packets in flight in each direction */
+#define PIPE_MAX_QUEUE 256
+
+/** A pipe FIFO frame header */
+struct pipe_frame {
+	/** Length of Ethernet frame */
+	uint16_t len;
+} __attribute__ (( packed ));
+
+/** Maximum length of Ethernet frame carried via a FIFO
+ *
+ * Writes of up to PIPE_BUF (4096 bytes on Linux) to a FIFO are
+ * atomic, so each frame must fit within a single such write.
+ */
+#define PIPE_MAX_FRAME ( 4096 - sizeof ( struct pipe_frame ) )
+
+/** A paired pipe */
+struct pipe_device {
+	/** Network devices */
+	struct net_device *netdev[2];
+	/** Number of network devices (one, if the peer is remote) */
+	unsigned int count;
+	/** One-way latency (in ticks) */
+	unsigned long latency;
+	/** Link bandwidth (in kbps, or zero for unlimited) */
+	unsigned long rate;
+	/** Packet loss (per thousand) */
+	unsigned int loss;
+	/** Packet reordering (per thousand) */
+	unsigned int reorder;
+	/** Pseudo-random number generator state */
+	uint32_t seed;
+};
+
+/** A pipe network device */
+struct pipe_nic {
+	/** Pipe */
+	struct pipe_device *pipe;
+	/** Network device at the other end of the pipe, or NULL if remote */
+	struct net_device *peer;
+	/** Packets in flight, in order of arrival
+	 *
+	 * For a local peer, these are the packets in flight towards
+	 * this end.  For a remote peer, these are the packets
+	 * transmitted by this end that are awaiting their departure
+	 * time before being written to the transmit FIFO.
+	 */
+	struct list_head queue;
+	/** Number of packets in flight */
+	unsigned int fill;
+	/** Time at which the transmit link becomes idle (in us) */
+	uint64_t busy;
+	/** Receive FIFO path (remote peer only) */
+	char *rx_path;
+	/** Transmit FIFO path (remote peer only) */
+	char *tx_path;
+	/** Receive FIFO file descriptor */
+	int rx_fd;
+	/** Transmit FIFO file descriptor */
+	int tx_fd;
+	/** Number of packets lost writing to the transmit FIFO
+	 *
+	 * Transmission has already been completed by the time a
+	 * packet is written to the FIFO, so these losses are not
+	 * included in the transmit statistics.
+	 */
+	unsigned int tx_lost;
+};
+
+/** A packet in flight */
+struct pipe_header {
+	/** Arrival time (in ticks) */
+	unsigned long arrival;
+};
+
+/** Number of pipes created */
+static unsigned int pipe_count;
+
+/**
+ * Generate pseudo-random number
+ *
+ * @v pipe		Pipe
+ * @ret n		Pseudo-random number in the range [0,1000)
+ */
+static unsigned int pipe_random ( struct pipe_device *pipe ) {
+
+	/* Linear congruential generator (as used by glibc's rand_r()) */
+	pipe->seed = ( ( pipe->seed * 1103515245 ) + 12345 );
+	return ( ( pipe->seed >> 16 ) % 1000 );
+}
+
+/**
+ * Discard all packets in flight towards a pipe end
+ *
+ * @v nic		Pipe NIC
+ */
+static void pipe_flush ( struct pipe_nic *nic ) {
+	struct io_buffer *iobuf;
+	struct io_buffer *tmp;
+
+	list_for_each_entry_safe ( iobuf, tmp, &nic->queue, list ) {
+		list_del ( &iobuf->list );
+		free_iob ( iobuf );
+	}
+	nic->fill = 0;
+}
+
+/**
+ * Open FIFO
+ *
+ * @v nic		Pipe NIC
+ * @v path		FIFO path
+ * @ret fd		File descriptor, or negative error
+ *
+ * The FIFO is opened for both reading and writing, so that opening
+ * does not block (or fail) while the other process is absent.
+ */
+static int pipe_open_fifo ( struct pipe_nic *nic, const char *path ) {
+	int fd;
+
+	fd = linux_open ( path, ( O_RDWR | O_NONBLOCK ) );
+	if ( fd < 0 ) {
+		DBGC ( nic, "PIPE %p could not open %s: %s\n",
+		       nic, path, linux_strerror ( linux_errno ) );
+		return -ENXIO_FIFO;
+	}
+	return fd;
+}
+
+/**
+ * Open pipe end
+ *
+ * @v netdev		Network device
+ * @ret rc		Return status code
+ */
+static int pipe_open ( struct net_device *netdev ) {
+	struct pipe_nic *nic = netdev->priv;
+	int rc;
+
+	/* Nothing to do unless the peer is remote */
+	if ( nic->peer )
+		return 0;
+
+	/* Open FIFOs */
+	nic->rx_fd = pipe_open_fifo ( nic, nic->rx_path );
+	if ( nic->rx_fd < 0 ) {
+		rc = nic->rx_fd;
+		goto err_rx;
+	}
+	nic->tx_fd = pipe_open_fifo ( nic, nic->tx_path );
+	if ( nic->tx_fd < 0 ) {
+		rc = nic->tx_fd;
+		goto err_tx;
+	}
+
+	return 0;
+
+	linux_close ( nic->tx_fd );
+ err_tx:
+	linux_close ( nic->rx_fd );
+ err_rx:
+	return rc;
+}
+
+/**
+ * Close pipe end
+ *
+ * @v netdev		Network device
+ */
+static void pipe_close ( struct net_device *netdev ) {
+	struct pipe_nic *nic = netdev->priv;
+
+	/* Discard anything still in flight */
+	pipe_flush ( nic );
+
+	/* Close FIFOs, if applicable */
+	if ( ! nic->peer ) {
+		linux_close ( nic->tx_fd );
+		linux_close ( nic->rx_fd );
+	}
+}
+
+/**
+ * Drop packet transmitted via pipe
+ *
+ * @v netdev		Transmitting network device
+ * @v iobuf		I/O buffer being transmitted
+ * @v copy		Copy of I/O buffer, or NULL
+ * @v rc		Reason for drop
+ *
+ * Drops between two local pipe ends are recorded as receive errors
+ * on the far end, and transmission is completed successfully.  A
+ * remote far end is in another process, so drops on a remote pipe
+ * are recorded by completing the transmission with an error instead.
+ */
+static void pipe_drop ( struct net_device *netdev, struct io_buffer *iobuf,
+			struct io_buffer *copy, int rc ) {
+	struct pipe_nic *nic = netdev->priv;
+
+	if ( nic->peer ) {
+		netdev_tx_complete ( netdev, iobuf );
+		netdev_rx_err ( nic->peer, copy, rc );
+	} else {
+		free_iob ( copy );
+		netdev_tx_complete_err ( netdev, iobuf, rc );
+	}
+}
+
+/**
+ * Transmit packet
+ *
+ * @v netdev		Network device
+ * @v iobuf		I/O buffer
+ * @ret rc		Return status code
+ *
+ * The packet is copied, stamped with its arrival time and queued for
+ * the peer (or, if the peer is remote, for writing to the transmit
+ * FIFO), and transmission is completed immediately.
+ */
+static int pipe_transmit ( struct net_device *netdev,
+			   struct io_buffer *iobuf ) {
+	struct pipe_nic *nic = netdev->priv;
+	struct pipe_device *pipe = nic->pipe;
+	struct net_device *peer = nic->peer;
+	struct pipe_nic *dest = ( peer ? peer->priv : nic );
+	struct pipe_header *header;
+	struct pipe_header *pos_header;
+	struct io_buffer *copy;
+	struct io_buffer *pos;
+	size_t len;
+	unsigned long arrival;
+	uint64_t now;
+	uint64_t start;
+
+	/* Pad packet */
+	iob_pad ( iobuf, ETH_ZLEN );
+	len = iob_len ( iobuf );
+
+	/* Copy packet */
+	copy = alloc_iob ( sizeof ( *header ) + len );
+	if ( ! copy ) {
+		pipe_drop ( netdev, iobuf, NULL, -ENOMEM );
+		return 0;
+	}
+	header = iob_put ( copy, sizeof ( *header ) );
+	memcpy ( iob_put ( copy, len ), iobuf->data, len );
+
+	/* Drop packet if the other end is not listening */
+	if ( peer && ( ! netdev_is_open ( peer ) ) ) {
+		pipe_drop ( netdev, iobuf, copy, -ENOTCONN_PEER );
+		return 0;
+	}
+
+	/* Drop packet if the queue is full */
+	if ( dest->fill >= PIPE_MAX_QUEUE ) {
+		pipe_drop ( netdev, iobuf, copy, -ENOBUFS_QUEUE );
+		return 0;
+	}
+
+	/* Emulate packet loss */
+	if ( pipe_random ( pipe ) < pipe->loss ) {
+		pipe_drop ( netdev, iobuf, copy, -EIO_LOSS );
+		return 0;
+	}
+
+	/* Complete transmission */
+	netdev_tx_complete ( netdev, iobuf );
+
+	/* Emulate link bandwidth by serialising transmissions */
+	now = ( ( currticks() * 1000000ULL ) / TICKS_PER_SEC );
+	start = ( ( nic->busy > now ) ? nic->busy : now );
+	if ( pipe->rate )
+		start += ( ( len * 8 * 1000ULL ) / pipe->rate );
+	nic->busy = start;
+
+	/* Calculate arrival time */
+	arrival = ( ( ( start * TICKS_PER_SEC ) / 1000000 ) + pipe->latency );
+	if ( pipe_random ( pipe ) < pipe->reorder )
+		arrival += ( pipe->latency + 1 );
+	header->arrival = arrival;
+
+	/* Queue in order of arrival time */
+	list_for_each_entry_reverse ( pos, &dest->queue, list ) {
+		pos_header = pos->data;
+		if ( ( signed long ) ( arrival - pos_header->arrival ) >= 0 )
+			break;
+	}
+	list_add ( &copy->list, &pos->list );
+	dest->fill++;
+
+	return 0;
+}
+
+/**
+ * Write packet to transmit FIFO
+ *
+ * @v netdev		Network device
+ * @v iobuf		I/O buffer
+ */
+static void pipe_write ( struct net_device *netdev,
+			 struct io_buffer *iobuf ) {
+	struct pipe_nic *nic = netdev->priv;
+	struct pipe_frame *frame;
+	__kernel_ssize_t len;
+
+	/* Prepend frame header (reusing the space occupied by the
+	 * packet header), and write frame using a single write.
+	 */
+	assert ( iob_len ( iobuf ) <= PIPE_MAX_FRAME );
+	frame = iob_push ( iobuf, sizeof ( *frame ) );
+	frame->len = htons ( iob_len ( iobuf ) - sizeof ( *frame ) );
+	len = linux_write ( nic->tx_fd, iobuf->data, iob_len ( iobuf ) );
+	if ( len != ( ( __kernel_ssize_t ) iob_len ( iobuf ) ) ) {
+		nic->tx_lost++;
+		DBGC ( nic, "PIPE %p could not write to %s (%d lost): %s\n",
+		       nic, nic->tx_path, nic->tx_lost,
+		       linux_strerror ( linux_errno ) );
+	}
+	free_iob ( iobuf );
+}
+
+/**
+ * Read packets from receive FIFO
+ *
+ * @v netdev		Network device
+ */
+static void pipe_read ( struct net_device *netdev ) {
+	struct pipe_nic *nic = netdev->priv;
+	struct pipe_frame frame;
+	struct io_buffer *iobuf;
+	size_t len;
+
+	while ( 1 ) {
+
+		/* Allocate I/O buffer */
+		iobuf = alloc_iob ( PIPE_MAX_FRAME );
+		if ( ! iobuf ) {
+			/* Non-fatal; leave data in the FIFO */
+			return;
+		}
+
+		/* Read frame header, if any */
+		if ( linux_read ( nic->rx_fd, &frame,
+				  sizeof ( frame ) ) != sizeof ( frame ) ) {
+			free_iob ( iobuf );
+			return;
+		}
+
+		/* Read frame.  The whole frame was written atomically,
+		 * so it must be available in its entirety.
+		 */
+		len = ntohs ( frame.len );
+		if ( ( len > PIPE_MAX_FRAME ) ||
+		     ( linux_read ( nic->rx_fd, iob_put ( iobuf, len ),
+				    len ) != ( ( __kernel_ssize_t ) len ) ) ) {
+			DBGC ( nic, "PIPE %p truncated frame (length %zd) "
+			       "on %s\n", nic, len, nic->rx_path );
+			netdev_rx_err ( netdev, iobuf, -EIO_FRAME );
+			continue;
+		}
+
+		/* Hand off to network stack */
+		netdev_rx ( netdev, iobuf );
+	}
+}
+
+/**
+ * Poll for received packets
+ *
+ * @v netdev		Network device
+ */
+static void pipe_poll ( struct net_device *netdev ) {
+	struct pipe_nic *nic = netdev->priv;
+	struct pipe_header *header;
+	struct io_buffer *iobuf;
+	unsigned long now = currticks();
+
+	/* Deliver (or write out) all packets that have arrived */
+	while ( ( iobuf = list_first_entry ( &nic->queue, struct io_buffer,
+					     list ) ) != NULL ) {
+		header = iobuf->data;
+		if ( ( signed long ) ( now - header->arrival ) < 0 )
+			break;
+		list_del ( &iobuf->list );
+		nic->fill--;
+		iob_pull ( iobuf, sizeof ( *header ) );
+		if ( nic->peer ) {
+			netdev_rx ( netdev, iobuf );
+		} else {
+			pipe_write ( netdev, iobuf );
+		}
+	}
+
+	/* Read packets from remote peer, if applicable */
+	if ( ! nic->peer )
+		pipe_read ( netdev );
+}
+
+/**
+ * Enable or disable interrupts
+ *
+ * @v netdev		Network device
+ * @v enable		Interrupts should be enabled
+ */
+static void pipe_irq ( struct net_device *netdev __unused,
+		       int enable __unused ) {
+
+	/* Nothing to do */
+}
+
+/** Pipe network device operations */
+static struct net_device_operations pipe_operations = {
+	.open		= pipe_open,
+	.close		= pipe_close,
+	.transmit	= pipe_transmit,
+	.poll		= pipe_poll,
+	.irq		= pipe_irq,
+};
+
+/**
+ * Parse numeric request setting
+ *
+ * @v request		Device request
+ * @v name		Setting name
+ * @v value		Value to fill in (left unchanged if setting is absent)
+ * @ret rc		Return status code
+ */
+static int pipe_setting ( struct linux_device_request *request,
+			  const char *name, unsigned long *value ) {
+	struct linux_setting *setting;
+	char *endp;
+
+	/* Find setting, if present */
+	setting = linux_find_setting ( ( char * ) name, &request->settings );
+	if ( ! setting )
+		return 0;
+
+	/* Parse value */
+	*value = strtoul ( setting->value, &endp, 0 );
+	if ( *endp ) {
+		printf ( "pipe invalid %s \"%s\"\n", name, setting->value );
+		return -EINVAL;
+	}
+	setting->applied = 1;
+
+	return 0;
+}
+
+/**
+ * Probe pipe
+ *
+ * @v device		Linux device
+ * @v request		Device request
+ * @ret rc		Return status code
+ */
+static int pipe_probe ( struct linux_device *device,
+			struct linux_device_request *request ) {
+	struct pipe_device *pipe;
+	struct net_device *netdev;
+	struct pipe_nic *nic;
+	struct linux_setting *path;
+	unsigned long latency = 0;
+	unsigned long loss = 0;
+	unsigned long reorder = 0;
+	unsigned long seed = 1;
+	unsigned long end = 0;
+	unsigned int index = pipe_count++;
+	unsigned int i;
+	int rc;
+
+	/* Allocate and initialise structure */
+	pipe = zalloc ( sizeof ( *pipe ) );
+	if ( ! pipe ) {
+		rc = -ENOMEM;
+		goto err_alloc;
+	}
+	linux_set_drvdata ( device, pipe );
+	snprintf ( device->dev.name, sizeof ( device->dev.name ), "pipe%d",
+		   index );
+	device->dev.desc.bus_type = BUS_TYPE_PIPE;
+	device->dev.desc.location = index;
+
+	/* Parse link emulation parameters */
+	if ( ( ( rc = pipe_setting ( request, "latency", &latency ) ) != 0 ) ||
+	     ( ( rc = pipe_setting ( request, "rate", &pipe->rate ) ) != 0 ) ||
+	     ( ( rc = pipe_setting ( request, "loss", &loss ) ) != 0 ) ||
+	     ( ( rc = pipe_setting ( request, "reorder", &reorder ) ) != 0 ) ||
+	     ( ( rc = pipe_setting ( request, "seed", &seed ) ) != 0 ) ||
+	     ( ( rc = pipe_setting ( request, "end", &end ) ) != 0 ) )
+		goto err_settings;
+	pipe->latency = ( ( latency * TICKS_PER_SEC ) / 1000 );
+	pipe->loss = loss;
+	pipe->reorder = reorder;
+	pipe->seed = seed;
+	if ( end > 1 ) {
+		printf ( "pipe invalid end \"%ld\"\n", end );
+		rc = -EINVAL;
+		goto err_settings;
+	}
+
+	/* Use a single network device if the peer is remote */
+	path = linux_find_setting ( ( char * ) "path", &request->settings );
+	if ( path )
+		path->applied = 1;
+	pipe->count = ( path ? 1 : 2 );
+
+	/* Allocate network devices */
+	for ( i = 0 ; i < pipe->count ; i++ ) {
+		netdev = alloc_etherdev ( sizeof ( *nic ) );
+		if ( ! netdev ) {
+			rc = -ENOMEM;
+			goto err_alloc_netdev;
+		}
+		netdev_init ( netdev, &pipe_operations );
+		netdev->dev = &device->dev;
+		netdev->hw_addr[0] = 0x02;
+		netdev->hw_addr[4] = index;
+		netdev->hw_addr[5] = i;
+		nic = netdev->priv;
+		nic->pipe = pipe;
+		INIT_LIST_HEAD ( &nic->queue );
+		pipe->netdev[i] = netdev;
+	}
+
+	/* Connect pipe ends */
+	if ( path ) {
+		nic = pipe->netdev[0]->priv;
+		if ( ( asprintf ( &nic->rx_path, "%s.%ld", path->value,
+				  end ) < 0 ) ||
+		     ( asprintf ( &nic->tx_path, "%s.%ld", path->value,
+				  ( end ^ 1 ) ) < 0 ) ) {
+			rc = -ENOMEM;
+			goto err_path;
+		}
+		pipe->netdev[0]->hw_addr[5] = end;
+	} else {
+		for ( i = 0 ; i < 2 ; i++ ) {
+			nic = pipe->netdev[i]->priv;
+			nic->peer = pipe->netdev[ i ^ 1 ];
+		}
+	}
+
+	/* Apply remaining settings to the first network device */
+	linux_apply_settings ( &request->settings,
+			       netdev_settings ( pipe->netdev[0] ) );
+
+	/* Register network devices */
+	for ( i = 0 ; i < pipe->count ; i++ ) {
+		if ( ( rc = register_netdev ( pipe->netdev[i] ) ) != 0 )
+			goto err_register;
+		netdev_link_up ( pipe->netdev[i] );
+	}
+
+	return 0;
+
+ err_register:
+	while ( i-- )
+		unregister_netdev ( pipe->netdev[i] );
+ err_path:
+	if ( path ) {
+		nic = pipe->netdev[0]->priv;
+		free ( nic->tx_path );
+		free ( nic->rx_path );
+	}
+	i = pipe->count;
+ err_alloc_netdev:
+	while ( i-- ) {
+		netdev_nullify ( pipe->netdev[i] );
+		netdev_put ( pipe->netdev[i] );
+	}
+ err_settings:
+	free ( pipe );
+ err_alloc:
+	return rc;
+}
+
+/**
+ * Remove pipe
+ *
+ * @v device		Linux device
+ */
+static void pipe_remove ( struct linux_device *device ) {
+	struct pipe_device *pipe = linux_get_drvdata ( device );
+	struct pipe_nic *nic;
+	unsigned int i;
+
+	for ( i = 0 ; i < pipe->count ; i++ )
+		unregister_netdev ( pipe->netdev[i] );
+	for ( i = 0 ; i < pipe->count ; i++ ) {
+		nic = pipe->netdev[i]->priv;
+		free ( nic->tx_path );
+		free ( nic->rx_path );
+		netdev_nullify ( pipe->netdev[i] );
+		netdev_put ( pipe->netdev[i] );
+	}
+	free ( pipe );
+}
+
+/** Pipe Linux driver */
+struct linux_driver pipe_driver __linux_driver = {
+	.name = "pipe",
+	.probe = pipe_probe,
+	.remove = pipe_remove,
+	.can_probe = 1,
+};
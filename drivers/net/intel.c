@@ -21,6 +21,7 @@ FILE_LICENCE ( GPL2_OR_LATER );
 
 #include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <errno.h>
 #include <byteswap.h>
@@ -31,6 +32,7 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <ipxe/malloc.h>
 #include <ipxe/pci.h>
 #include <ipxe/profile.h>
+#include <ipxe/settings.h>
 #include "intel.h"
 
 /** @file
@@ -39,6 +41,14 @@ FILE_LICENCE ( GPL2_OR_LATER );
  *
  */
 
+/** Descriptor ring size setting */
+const struct setting ring_size_setting __setting ( SETTING_NETDEV_EXTRA,
+						   ring-size ) = {
+	.name = "ring-size",
+	.description = "Descriptor ring size",
+	.type = &setting_type_uint16,
+};
+
 /** VM transmit profiler */
 static struct profiler intel_vm_tx_profiler __profiler =
 	{ .name = "intel.vm_tx" };
@@ -376,6 +386,54 @@ static void intel_check_link ( struct net_device *netdev ) {
  ******************************************************************************
  */
 
+/**
+ * Choose descriptor ring sizes
+ *
+ * @v netdev		Network device
+ * @v count		Default number of descriptors for this device family
+ *
+ * The ring size is taken from the "ring-size" setting if present,
+ * otherwise from the device family default (which reflects the
+ * maximum link speed).  The receive fill level is then limited so
+ * that posted receive buffers cannot consume more than a fixed
+ * fraction of the remaining free memory.
+ */
+void intel_size_rings ( struct net_device *netdev, unsigned int count ) {
+	struct intel_nic *intel = netdev->priv;
+	unsigned long configured;
+	unsigned int fill;
+	size_t budget;
+
+	/* Use configured ring size, if any */
+	configured = fetch_uintz_setting ( netdev_settings ( netdev ),
+					   &ring_size_setting );
+	if ( configured )
+		count = configured;
+
+	/* Round down to a supported power of two */
+	if ( count < INTEL_MIN_DESC )
+		count = INTEL_MIN_DESC;
+	if ( count > INTEL_MAX_DESC )
+		count = INTEL_MAX_DESC;
+	count = ( 1U << ( fls ( count ) - 1 ) );
+
+	/* Limit receive fill level according to available memory */
+	fill = ( ( count * 3 ) / 4 );
+	budget = ( freemem / INTEL_RX_MEM_FRACTION );
+	while ( ( fill > INTEL_MIN_RX_FILL ) &&
+		( ( fill * INTEL_RX_MAX_LEN ) > budget ) ) {
+		fill /= 2;
+	}
+
+	/* Resize rings */
+	intel_init_ring ( &intel->tx, count, intel->tx.reg );
+	intel_init_ring ( &intel->rx, count, intel->rx.reg );
+	intel->rx.fill = fill;
+
+	DBGC ( intel, "INTEL %p using %d descriptors per ring, RX fill %d\n",
+	       intel, count, fill );
+}
+
 /**
  * Create descriptor ring
  *
@@ -464,7 +522,7 @@ void intel_refill_rx ( struct intel_nic *intel ) {
 	unsigned int refilled = 0;
 
 	/* Refill ring */
-	while ( ( intel->rx.prod - intel->rx.cons ) < INTEL_RX_FILL ) {
+	while ( ( intel->rx.prod - intel->rx.cons ) < intel->rx.fill ) {
 
 		/* Allocate I/O buffer */
 		iobuf = alloc_iob ( INTEL_RX_MAX_LEN );
@@ -474,7 +532,7 @@ void intel_refill_rx ( struct intel_nic *intel ) {
 		}
 
 		/* Get next receive descriptor */
-		rx_idx = ( intel->rx.prod++ % INTEL_NUM_RX_DESC );
+		rx_idx = ( intel->rx.prod++ % intel->rx.count );
 		rx = &intel->rx.desc[rx_idx];
 
 		/* Populate receive descriptor */
@@ -497,7 +555,7 @@ void intel_refill_rx ( struct intel_nic *intel ) {
 	/* Push descriptors to card, if applicable */
 	if ( refilled ) {
 		wmb();
-		rx_tail = ( intel->rx.prod % INTEL_NUM_RX_DESC );
+		rx_tail = ( intel->rx.prod % intel->rx.count );
 		profile_start ( &intel_vm_refill_profiler );
 		writel ( rx_tail, intel->regs + intel->rx.reg + INTEL_xDT );
 		profile_stop ( &intel_vm_refill_profiler );
@@ -513,7 +571,7 @@ void intel_refill_rx ( struct intel_nic *intel ) {
 void intel_empty_rx ( struct intel_nic *intel ) {
 	unsigned int i;
 
-	for ( i = 0 ; i < INTEL_NUM_RX_DESC ; i++ ) {
+	for ( i = 0 ; i < INTEL_MAX_DESC ; i++ ) {
 		if ( intel->rx_iobuf[i] )
 			free_iob ( intel->rx_iobuf[i] );
 		intel->rx_iobuf[i] = NULL;
@@ -533,6 +591,9 @@ static int intel_open ( struct net_device *netdev ) {
 	uint32_t rctl;
 	int rc;
 
+	/* Choose descriptor ring sizes */
+	intel_size_rings ( netdev, INTEL_NUM_DESC );
+
 	/* Create transmit descriptor ring */
 	if ( ( rc = intel_create_ring ( intel, &intel->tx ) ) != 0 )
 		goto err_create_tx;
@@ -619,12 +680,12 @@ int intel_transmit ( struct net_device *netdev, struct io_buffer *iobuf ) {
 	physaddr_t address;
 
 	/* Get next transmit descriptor */
-	if ( ( intel->tx.prod - intel->tx.cons ) >= INTEL_TX_FILL ) {
+	if ( ( intel->tx.prod - intel->tx.cons ) >= intel->tx.fill ) {
 		DBGC ( intel, "INTEL %p out of transmit descriptors\n", intel );
 		return -ENOBUFS;
 	}
-	tx_idx = ( intel->tx.prod++ % INTEL_NUM_TX_DESC );
-	tx_tail = ( intel->tx.prod % INTEL_NUM_TX_DESC );
+	tx_idx = ( intel->tx.prod++ % intel->tx.count );
+	tx_tail = ( intel->tx.prod % intel->tx.count );
 	tx = &intel->tx.desc[tx_idx];
 
 	/* Populate transmit descriptor */
@@ -663,7 +724,7 @@ void intel_poll_tx ( struct net_device *netdev ) {
 	while ( intel->tx.cons != intel->tx.prod ) {
 
 		/* Get next transmit descriptor */
-		tx_idx = ( intel->tx.cons % INTEL_NUM_TX_DESC );
+		tx_idx = ( intel->tx.cons % intel->tx.count );
 		tx = &intel->tx.desc[tx_idx];
 
 		/* Stop if descriptor is still in use */
@@ -688,13 +749,14 @@ void intel_poll_rx ( struct net_device *netdev ) {
 	struct intel_descriptor *rx;
 	struct io_buffer *iobuf;
 	unsigned int rx_idx;
+	unsigned int consumed = 0;
 	size_t len;
 
 	/* Check for received packets */
 	while ( intel->rx.cons != intel->rx.prod ) {
 
 		/* Get next receive descriptor */
-		rx_idx = ( intel->rx.cons % INTEL_NUM_RX_DESC );
+		rx_idx = ( intel->rx.cons % intel->rx.count );
 		rx = &intel->rx.desc[rx_idx];
 
 		/* Stop if descriptor is still in use */
@@ -719,7 +781,16 @@ void intel_poll_rx ( struct net_device *netdev ) {
 			netdev_rx ( netdev, iobuf );
 		}
 		intel->rx.cons++;
+		consumed++;
 	}
+
+	/* Report exhausted receive ring, if this poll consumed the
+	 * last posted buffer.  The hardware will drop packets until
+	 * the ring is refilled; a persistent count here suggests
+	 * that the ring size or fill level is too small.
+	 */
+	if ( consumed )
+		netdev_rx_err ( netdev, NULL, -ENOBUFS_RX_EMPTY );
 }
 
 /**
@@ -749,7 +820,7 @@ static void intel_poll ( struct net_device *netdev ) {
 
 	/* Report receive overruns */
 	if ( icr & INTEL_IRQ_RXO )
-		netdev_rx_err ( netdev, NULL, -ENOBUFS );
+		netdev_rx_err ( netdev, NULL, -ENOBUFS_RX_OVERRUN );
 
 	/* Check link state, if applicable */
 	if ( icr & INTEL_IRQ_LSC )
@@ -817,8 +888,8 @@ static int intel_probe ( struct pci_device *pci ) {
 	memset ( intel, 0, sizeof ( *intel ) );
 	intel->port = PCI_FUNC ( pci->busdevfn );
 	intel->flags = pci->id->driver_data;
-	intel_init_ring ( &intel->tx, INTEL_NUM_TX_DESC, INTEL_TD );
-	intel_init_ring ( &intel->rx, INTEL_NUM_RX_DESC, INTEL_RD );
+	intel_init_ring ( &intel->tx, INTEL_NUM_DESC, INTEL_TD );
+	intel_init_ring ( &intel->rx, INTEL_NUM_DESC, INTEL_RD );
 
 	/* Fix up PCI device */
 	adjust_pci_device ( pci );
@@ -10,8 +10,20 @@
 FILE_LICENCE ( GPL2_OR_LATER );
 
 #include <stdint.h>
+#include <errno.h>
 #include <ipxe/if_ether.h>
 #include <ipxe/nvs.h>
+#include <ipxe/settings.h>
+
+/** Receive overrun (packets dropped by hardware) */
+#define ENOBUFS_RX_OVERRUN __einfo_error ( EINFO_ENOBUFS_RX_OVERRUN )
+#define EINFO_ENOBUFS_RX_OVERRUN \
+	__einfo_uniqify ( EINFO_ENOBUFS, 0x01, "Receive overrun" )
+
+/** Receive descriptor ring exhausted */
+#define ENOBUFS_RX_EMPTY __einfo_error ( EINFO_ENOBUFS_RX_EMPTY )
+#define EINFO_ENOBUFS_RX_EMPTY \
+	__einfo_uniqify ( EINFO_ENOBUFS, 0x02, "Receive ring empty" )
 
 /** Intel BAR size */
 #define INTEL_BAR_SIZE ( 128 * 1024 )
@@ -133,15 +145,28 @@ enum intel_descriptor_status {
 /** Receive Descriptor register block */
 #define INTEL_RD 0x02800UL
 
-/** Number of receive descriptors
+/** Minimum number of descriptors per ring
+ *
+ * Descriptor ring length must be a multiple of 128.  ICH8/9/10
+ * requires a minimum of 16 TX descriptors.
+ */
+#define INTEL_MIN_DESC 16
+
+/** Maximum number of descriptors per ring */
+#define INTEL_MAX_DESC 256
+
+/** Default number of descriptors per ring for gigabit devices
  *
- * Minimum value is 8, since the descriptor ring length must be a
- * multiple of 128.
+ * Must be a power of two between INTEL_MIN_DESC and INTEL_MAX_DESC,
+ * since each ring is aligned on its own size.
  */
-#define INTEL_NUM_RX_DESC 16
+#define INTEL_NUM_DESC 32
+
+/** Minimum receive descriptor ring fill level */
+#define INTEL_MIN_RX_FILL 8
 
-/** Receive descriptor ring fill level */
-#define INTEL_RX_FILL 8
+/** Fraction of free memory that may be held in posted receive buffers */
+#define INTEL_RX_MEM_FRACTION 8
 
 /** Receive buffer length */
 #define INTEL_RX_MAX_LEN 2048
@@ -149,16 +174,6 @@ enum intel_descriptor_status {
 /** Transmit Descriptor register block */
 #define INTEL_TD 0x03800UL
 
-/** Number of transmit descriptors
- *
- * Descriptor ring length must be a multiple of 16.  ICH8/9/10
- * requires a minimum of 16 TX descriptors.
- */
-#define INTEL_NUM_TX_DESC 16
-
-/** Transmit descriptor ring maximum fill level */
-#define INTEL_TX_FILL ( INTEL_NUM_TX_DESC - 1 )
-
 /** Receive/Transmit Descriptor Base Address Low (offset) */
 #define INTEL_xDBAL 0x00
 
@@ -205,6 +220,10 @@ struct intel_ring {
 
 	/** Register block */
 	unsigned int reg;
+	/** Number of descriptors */
+	unsigned int count;
+	/** Maximum fill level */
+	unsigned int fill;
 	/** Length (in bytes) */
 	size_t len;
 };
@@ -215,10 +234,16 @@ struct intel_ring {
  * @v ring		Descriptor ring
  * @v count		Number of descriptors
  * @v reg		Descriptor register block
+ *
+ * The maximum fill level defaults to one less than the number of
+ * descriptors, since a completely full ring is indistinguishable
+ * from an empty ring.
  */
 static inline __attribute__ (( always_inline)) void
 intel_init_ring ( struct intel_ring *ring, unsigned int count,
 		  unsigned int reg ) {
+	ring->count = count;
+	ring->fill = ( count - 1 );
 	ring->len = ( count * sizeof ( ring->desc[0] ) );
 	ring->reg = reg;
 }
@@ -244,7 +269,7 @@ struct intel_nic {
 	/** Receive descriptor ring */
 	struct intel_ring rx;
 	/** Receive I/O buffers */
-	struct io_buffer *rx_iobuf[INTEL_NUM_RX_DESC];
+	struct io_buffer *rx_iobuf[INTEL_MAX_DESC];
 };
 
 /** Driver flags */
@@ -253,6 +278,11 @@ enum intel_flags {
 	INTEL_PBS_ERRATA = 0x0001,
 };
 
+extern const struct setting
+ring_size_setting __setting ( SETTING_NETDEV_EXTRA, ring-size );
+
+extern void intel_size_rings ( struct net_device *netdev,
+			       unsigned int count );
 extern int intel_create_ring ( struct intel_nic *intel,
 			       struct intel_ring *ring );
 extern void intel_destroy_ring ( struct intel_nic *intel,
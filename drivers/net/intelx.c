@@ -181,6 +181,9 @@ static int intelx_open ( struct net_device *netdev ) {
 	uint32_t dca_rxctrl;
 	int rc;
 
+	/* Choose descriptor ring sizes */
+	intel_size_rings ( netdev, INTELX_NUM_DESC );
+
 	/* Create transmit descriptor ring */
 	if ( ( rc = intel_create_ring ( intel, &intel->tx ) ) != 0 )
 		goto err_create_tx;
@@ -324,7 +327,7 @@ static void intelx_poll ( struct net_device *netdev ) {
 
 	/* Report receive overruns */
 	if ( eicr & INTELX_EIRQ_RXO )
-		netdev_rx_err ( netdev, NULL, -ENOBUFS );
+		netdev_rx_err ( netdev, NULL, -ENOBUFS_RX_OVERRUN );
 
 	/* Check link state, if applicable */
 	if ( eicr & INTELX_EIRQ_LSC )
@@ -392,8 +395,8 @@ static int intelx_probe ( struct pci_device *pci ) {
 	netdev->dev = &pci->dev;
 	memset ( intel, 0, sizeof ( *intel ) );
 	intel->port = PCI_FUNC ( pci->busdevfn );
-	intel_init_ring ( &intel->tx, INTEL_NUM_TX_DESC, INTELX_TD );
-	intel_init_ring ( &intel->rx, INTEL_NUM_RX_DESC, INTELX_RD );
+	intel_init_ring ( &intel->tx, INTELX_NUM_DESC, INTELX_TD );
+	intel_init_ring ( &intel->rx, INTELX_NUM_DESC, INTELX_RD );
 
 	/* Fix up PCI device */
 	adjust_pci_device ( pci );
@@ -71,6 +71,9 @@ FILE_LICENCE ( GPL2_OR_LATER );
 /** Receive Descriptor register block */
 #define INTELX_RD 0x01000UL
 
+/** Default number of descriptors per ring for 10 gigabit devices */
+#define INTELX_NUM_DESC 128
+
 /** Split Receive Control Register */
 #define INTELX_SRRCTL 0x02100UL
 #define INTELX_SRRCTL_BSIZE(kb)	( (kb) << 0 )	/**< Receive buffer size */
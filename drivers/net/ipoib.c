@@ -25,6 +25,7 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <byteswap.h>
 #include <errno.h>
 #include <ipxe/errortab.h>
@@ -34,6 +35,7 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <ipxe/ethernet.h>
 #include <ipxe/iobuf.h>
 #include <ipxe/netdevice.h>
+#include <ipxe/settings.h>
 #include <ipxe/infiniband.h>
 #include <ipxe/ib_pathrec.h>
 #include <ipxe/ib_mcast.h>
@@ -45,14 +47,51 @@ FILE_LICENCE ( GPL2_OR_LATER );
  * IP over Infiniband
  */
 
-/** Number of IPoIB send work queue entries */
-#define IPOIB_NUM_SEND_WQES 8
-/** Number of IPoIB receive work queue entries */
-#define IPOIB_NUM_RECV_WQES 16
-/** Number of IPoIB send completion entries */
-#define IPOIB_NUM_SEND_CQES IPOIB_NUM_SEND_WQES
-/** Number of IPoIB recieve completion entries */
-#define IPOIB_NUM_RECV_CQES IPOIB_NUM_RECV_WQES
+/** Minimum number of IPoIB send work queue entries */
+#define IPOIB_MIN_SEND_WQES 8
+/** Maximum number of IPoIB send work queue entries */
+#define IPOIB_MAX_SEND_WQES 64
+/** Minimum number of IPoIB receive work queue entries */
+#define IPOIB_MIN_RECV_WQES 16
+/** Maximum number of IPoIB receive work queue entries */
+#define IPOIB_MAX_RECV_WQES 256
+/** Number of IPoIB receive work queue entries when link rate is unknown */
+#define IPOIB_DEFAULT_RECV_WQES 64
+/** Number of IPoIB receive work queue entries per Gbps of link rate */
+#define IPOIB_RECV_WQES_PER_GBPS 2
+
+/** Number of outstanding sends above which doorbells are coalesced
+ *
+ * While fewer sends than this are outstanding, each packet is
+ * notified to the hardware immediately to minimise latency.  Beyond
+ * this, the hardware is already busy and further packets are posted
+ * as a batch which is committed on the next poll.
+ */
+#define IPOIB_SEND_BATCH_FILL 4
+
+/** Maximum fraction of free memory to be used for receive buffers
+ *
+ * Receive buffers are allocated up front for every receive work
+ * queue entry, so the queue depth is limited to avoid starving the
+ * heap on small-memory systems.
+ */
+#define IPOIB_RX_MEM_FRACTION 4
+
+/** IPoIB send queue depth setting */
+const struct setting ipoib_send_depth_setting __setting ( SETTING_NETDEV_EXTRA,
+							  ipoib-send-depth ) = {
+	.name = "ipoib-send-depth",
+	.description = "IPoIB send queue depth",
+	.type = &setting_type_uint16,
+};
+
+/** IPoIB receive queue depth setting */
+const struct setting ipoib_recv_depth_setting __setting ( SETTING_NETDEV_EXTRA,
+							  ipoib-recv-depth ) = {
+	.name = "ipoib-recv-depth",
+	.description = "IPoIB receive queue depth",
+	.type = &setting_type_uint16,
+};
 
 /** An IPoIB device */
 struct ipoib_device {
@@ -600,6 +639,7 @@ static int ipoib_transmit ( struct net_device *netdev,
 
 	/** Poll for free IO buffer */
 	if ( wq->iobufs[wq->next_idx & ( wq->num_wqes - 1 )] ) {
+		ib_commit_send ( ibdev, ipoib->qp );
 		end_timer = currticks() +
 			( ticks_per_sec() * POLL_SEND_IOBUFFER_TIMEOUT );
 		while ( wq->iobufs[wq->next_idx & ( wq->num_wqes - 1 )] &&
@@ -608,6 +648,13 @@ static int ipoib_transmit ( struct net_device *netdev,
 		}
 	}
 
+	/* Coalesce doorbells while the send queue is busy */
+	if ( wq->fill >= IPOIB_SEND_BATCH_FILL ) {
+		ib_begin_send ( ipoib->qp );
+	} else {
+		ib_commit_send ( ibdev, ipoib->qp );
+	}
+
 	return ib_post_send ( ibdev, ipoib->qp, &dest, iobuf );
 }
 
@@ -761,6 +808,9 @@ static void ipoib_poll ( struct net_device *netdev ) {
 	struct ipoib_device *ipoib = netdev->priv;
 	struct ib_device *ibdev = ipoib->ibdev;
 
+	/* Notify hardware of any batched sends */
+	ib_commit_send ( ibdev, ipoib->qp );
+
 	/* Poll Infiniband device */
 	ib_poll_eq ( ibdev );
 
@@ -824,6 +874,249 @@ static void ipoib_leave_broadcast_group ( struct ipoib_device *ipoib ) {
 	}
 }
 
+/**
+ * Calculate active Infiniband link rate
+ *
+ * @v ibdev		Infiniband device
+ * @ret gbps		Link rate in Gbps, or zero if unknown
+ *
+ * Extended (FDR/EDR) link speeds are not visible in the port
+ * information, so such links will be reported at the QDR rate.
+ */
+static unsigned int ipoib_link_rate ( struct ib_device *ibdev ) {
+	unsigned int lanes;
+	unsigned int lane_gbps_x2;
+
+	switch ( ibdev->link_width_active ) {
+	case IB_LINK_WIDTH_1X:	lanes = 1;	break;
+	case IB_LINK_WIDTH_4X:	lanes = 4;	break;
+	case IB_LINK_WIDTH_8X:	lanes = 8;	break;
+	case IB_LINK_WIDTH_12X:	lanes = 12;	break;
+	default:		return 0;
+	}
+	switch ( ibdev->link_speed_active ) {
+	case IB_LINK_SPEED_SDR:	lane_gbps_x2 = 5;	break;
+	case IB_LINK_SPEED_DDR:	lane_gbps_x2 = 10;	break;
+	case IB_LINK_SPEED_QDR:	lane_gbps_x2 = 20;	break;
+	default:		return 0;
+	}
+	return ( ( lanes * lane_gbps_x2 ) / 2 );
+}
+
+/**
+ * Round and clamp queue depth to a power of two
+ *
+ * @v depth		Requested depth
+ * @v min		Minimum depth (must be a power of two)
+ * @v max		Maximum depth (must be a power of two)
+ * @ret depth		Actual depth
+ */
+static unsigned int ipoib_clamp_depth ( unsigned int depth, unsigned int min,
+					unsigned int max ) {
+
+	if ( depth < min )
+		return min;
+	if ( depth > max )
+		return max;
+	return ( 1U << ( fls ( depth - 1 ) ) );
+}
+
+/**
+ * Limit queue depth to device capabilities
+ *
+ * @v depth		Requested depth (must be a power of two)
+ * @v max_wqes		Maximum number of work queue entries, or zero
+ * @v max_cqes		Maximum number of completion queue entries, or zero
+ * @ret depth		Actual depth
+ *
+ * The device limits take precedence over the IPoIB minimum depths.
+ */
+static unsigned int ipoib_limit_depth ( unsigned int depth,
+					unsigned int max_wqes,
+					unsigned int max_cqes ) {
+
+	while ( ( depth > 1 ) &&
+		( ( max_wqes && ( depth > max_wqes ) ) ||
+		  ( max_cqes && ( depth > max_cqes ) ) ) ) {
+		depth /= 2;
+	}
+	return depth;
+}
+
+/**
+ * Choose IPoIB queue depths
+ *
+ * @v ipoib		IPoIB device
+ * @v send		Number of send work queue entries to fill in
+ * @v recv		Number of receive work queue entries to fill in
+ *
+ * The depths are taken from the "ipoib-send-depth" and
+ * "ipoib-recv-depth" settings if present, otherwise from the active
+ * link rate.  The receive depth is then limited so that posted
+ * receive buffers cannot consume more than a fixed fraction of the
+ * remaining free memory.
+ */
+static void ipoib_size_queues ( struct ipoib_device *ipoib,
+				unsigned int *send, unsigned int *recv ) {
+	struct settings *settings = netdev_settings ( ipoib->netdev );
+	struct ib_device *ibdev = ipoib->ibdev;
+	unsigned long configured;
+	unsigned int gbps;
+	size_t budget;
+
+	/* Calculate default depths from link rate */
+	gbps = ipoib_link_rate ( ibdev );
+	*recv = ( gbps ? ( gbps * IPOIB_RECV_WQES_PER_GBPS ) :
+		  IPOIB_DEFAULT_RECV_WQES );
+	*recv = ipoib_clamp_depth ( *recv, IPOIB_MIN_RECV_WQES,
+				    IPOIB_MAX_RECV_WQES );
+	*send = ( *recv / 2 );
+
+	/* Use configured depths, if any */
+	configured = fetch_uintz_setting ( settings, &ipoib_recv_depth_setting );
+	if ( configured ) {
+		*recv = ipoib_clamp_depth ( configured, IPOIB_MIN_RECV_WQES,
+					    IPOIB_MAX_RECV_WQES );
+	}
+	configured = fetch_uintz_setting ( settings, &ipoib_send_depth_setting );
+	if ( configured )
+		*send = configured;
+	*send = ipoib_clamp_depth ( *send, IPOIB_MIN_SEND_WQES,
+				    IPOIB_MAX_SEND_WQES );
+
+	/* Limit receive depth according to available memory */
+	budget = ( freemem / IPOIB_RX_MEM_FRACTION );
+	while ( ( *recv > IPOIB_MIN_RECV_WQES ) &&
+		( ( *recv * IB_MAX_PAYLOAD_SIZE ) > budget ) ) {
+		*recv /= 2;
+	}
+
+	/* Limit depths according to device capabilities */
+	*send = ipoib_limit_depth ( *send, ibdev->max_send_wqes,
+				    ibdev->max_cqes );
+	*recv = ipoib_limit_depth ( *recv, ibdev->max_recv_wqes,
+				    ibdev->max_cqes );
+
+	DBGC ( ipoib, "IPoIB %p using %d send and %d receive WQEs (link %d "
+	       "Gbps)\n", ipoib, *send, *recv, gbps );
+}
+
+/**
+ * Destroy IPoIB queues
+ *
+ * @v ipoib		IPoIB device
+ */
+static void ipoib_destroy_queues ( struct ipoib_device *ipoib ) {
+	struct ib_device *ibdev = ipoib->ibdev;
+
+	/* Do nothing if queues do not exist */
+	if ( ! ipoib->qp )
+		return;
+
+	/* Tear down the queues */
+	ib_destroy_qp ( ibdev, ipoib->qp );
+	ipoib->qp = NULL;
+	ib_destroy_cq ( ibdev, ipoib->rx_cq );
+	ib_destroy_cq ( ibdev, ipoib->tx_cq );
+}
+
+/**
+ * Create IPoIB queues
+ *
+ * @v ipoib		IPoIB device
+ * @v num_send_wqes	Number of send work queue entries
+ * @v num_recv_wqes	Number of receive work queue entries
+ * @ret rc		Return status code
+ *
+ * Any existing queues are replaced only once the new queues have
+ * been created successfully, and are left untouched on failure.
+ */
+static int ipoib_create_queues ( struct ipoib_device *ipoib,
+				 unsigned int num_send_wqes,
+				 unsigned int num_recv_wqes ) {
+	struct ib_device *ibdev = ipoib->ibdev;
+	struct ib_completion_queue *tx_cq;
+	struct ib_completion_queue *rx_cq;
+	struct ib_queue_pair *qp;
+	int rc;
+
+	/* Allocate send and receive completion queue */
+	tx_cq = ib_create_cq ( ibdev, num_send_wqes, &ipoib_cq_op );
+	if ( ! tx_cq ) {
+		DBGC ( ipoib, "IPoIB %p could not allocate send completion queue\n", ipoib );
+		rc = -ENOMEM;
+		goto err_create_tx_cq;
+	}
+	rx_cq = ib_create_cq ( ibdev, num_recv_wqes, &ipoib_cq_op );
+	if ( ! rx_cq ) {
+		DBGC ( ipoib, "IPoIB %p could not allocate recieve completion queue\n", ipoib );
+		rc = -ENOMEM;
+		goto err_create_rx_cq;
+	}
+
+	/* Allocate queue pair */
+	qp = ib_create_qp ( ibdev, IB_QPT_UD, num_send_wqes, tx_cq,
+			    num_recv_wqes, rx_cq, &ipoib_qp_op );
+	if ( ! qp ) {
+		DBGC ( ipoib, "IPoIB %p could not allocate queue pair\n",
+		       ipoib );
+		rc = -ENOMEM;
+		goto err_create_qp;
+	}
+	ib_qp_set_ownerdata ( qp, ipoib );
+
+	/* Replace any existing queues */
+	ipoib_destroy_queues ( ipoib );
+	ipoib->tx_cq = tx_cq;
+	ipoib->rx_cq = rx_cq;
+	ipoib->qp = qp;
+
+	/* Update MAC address with QPN */
+	ipoib->mac.flags__qpn = htonl ( qp->qpn );
+
+	/* Fill receive rings */
+	ib_refill_recv ( ibdev, qp );
+
+	return 0;
+
+	ib_destroy_qp ( ibdev, qp );
+ err_create_qp:
+	ib_destroy_cq ( ibdev, rx_cq );
+ err_create_rx_cq:
+	ib_destroy_cq ( ibdev, tx_cq );
+ err_create_tx_cq:
+	return rc;
+}
+
+/**
+ * Resize IPoIB queues to suit the current link
+ *
+ * @v ipoib		IPoIB device
+ *
+ * The queues are first created when the device is opened, at which
+ * point the link rate is usually not yet known.  They are recreated
+ * if the depths chosen for the now-active link differ.
+ */
+static void ipoib_resize_queues ( struct ipoib_device *ipoib ) {
+	unsigned int num_send_wqes;
+	unsigned int num_recv_wqes;
+	int rc;
+
+	/* Do nothing if depths are unchanged */
+	ipoib_size_queues ( ipoib, &num_send_wqes, &num_recv_wqes );
+	if ( ( num_send_wqes == ipoib->qp->send.num_wqes ) &&
+	     ( num_recv_wqes == ipoib->qp->recv.num_wqes ) )
+		return;
+
+	/* Recreate queues */
+	if ( ( rc = ipoib_create_queues ( ipoib, num_send_wqes,
+					  num_recv_wqes ) ) != 0 ) {
+		DBGC ( ipoib, "IPoIB %p could not resize queues: %s\n",
+		       ipoib, strerror ( rc ) );
+		/* Non-fatal; continue using the existing queues */
+	}
+}
+
 /**
  * Handle link status change
  *
@@ -832,6 +1125,7 @@ static void ipoib_leave_broadcast_group ( struct ipoib_device *ipoib ) {
 static void ipoib_link_state_changed ( struct ib_device *ibdev ) {
 	struct net_device *netdev = ib_get_ownerdata ( ibdev );
 	struct ipoib_device *ipoib = netdev->priv;
+	struct ib_address_vector av;
 	union ib_guid *guid;
 	int rc;
 
@@ -855,14 +1149,32 @@ static void ipoib_link_state_changed ( struct ib_device *ibdev ) {
 	rc = ib_link_rc ( ibdev );
 	netdev_link_err ( netdev, ( rc ? rc : -EINPROGRESS_JOINING ) );
 
+	/* Do nothing further unless link is up and the network device
+	 * is open (the Infiniband device may be held open by another
+	 * user).
+	 */
+	if ( ! ( ipoib->qp && ib_is_open ( ibdev ) && ib_link_ok ( ibdev ) ) )
+		return;
+
+	/* Resize queues to suit the link rate */
+	ipoib_resize_queues ( ipoib );
+
 	/* Join new broadcast group */
-	if ( ib_is_open ( ibdev ) && ib_link_ok ( ibdev ) &&
-	     ( ( rc = ipoib_join_broadcast_group ( ipoib ) ) != 0 ) ) {
+	if ( ( rc = ipoib_join_broadcast_group ( ipoib ) ) != 0 ) {
 		DBGC ( ipoib, "IPoIB %p could not rejoin broadcast group: "
 		       "%s\n", ipoib, strerror ( rc ) );
 		netdev_link_err ( netdev, rc );
 		return;
 	}
+
+	/* Resolve path to broadcast group in parallel with joining
+	 * it, so that the first broadcast transmission (typically a
+	 * DHCP discovery) is not dropped while the path is looked up.
+	 */
+	memset ( &av, 0, sizeof ( av ) );
+	av.gid_present = 1;
+	memcpy ( &av.gid, &ipoib->broadcast.gid, sizeof ( av.gid ) );
+	ib_resolve_path ( ibdev, &av );
 }
 
 /**
@@ -874,6 +1186,8 @@ static void ipoib_link_state_changed ( struct ib_device *ibdev ) {
 static int ipoib_open ( struct net_device *netdev ) {
 	struct ipoib_device *ipoib = netdev->priv;
 	struct ib_device *ibdev = ipoib->ibdev;
+	unsigned int num_send_wqes;
+	unsigned int num_recv_wqes;
 	int rc;
 
 	/* Open IB device */
@@ -883,49 +1197,21 @@ static int ipoib_open ( struct net_device *netdev ) {
 		goto err_ib_open;
 	}
 
-	/* Allocate send and receive completion queue */
-	ipoib->tx_cq = ib_create_cq ( ibdev, IPOIB_NUM_SEND_CQES, &ipoib_cq_op );
-	if ( ! ipoib->tx_cq ) {
-		DBGC ( ipoib, "IPoIB %p could not allocate send completion queue\n", ipoib );
-		rc = -ENOMEM;
-		goto err_create_tx_cq;
-	}
-	ipoib->rx_cq = ib_create_cq ( ibdev, IPOIB_NUM_RECV_CQES, &ipoib_cq_op );
-	if ( ! ipoib->rx_cq ) {
-		DBGC ( ipoib, "IPoIB %p could not allocate recieve completion queue\n", ipoib );
-		rc = -ENOMEM;
-		goto err_create_rx_cq;
-	}
+	/* Choose queue depths */
+	ipoib_size_queues ( ipoib, &num_send_wqes, &num_recv_wqes );
 
-	/* Allocate queue pair */
-	ipoib->qp = ib_create_qp ( ibdev, IB_QPT_UD, IPOIB_NUM_SEND_WQES,
-				   ipoib->tx_cq, IPOIB_NUM_RECV_WQES, ipoib->rx_cq,
-				   &ipoib_qp_op );
-	if ( ! ipoib->qp ) {
-		DBGC ( ipoib, "IPoIB %p could not allocate queue pair\n",
-		       ipoib );
-		rc = -ENOMEM;
-		goto err_create_qp;
-	}
-	ib_qp_set_ownerdata ( ipoib->qp, ipoib );
-
-	/* Update MAC address with QPN */
-	ipoib->mac.flags__qpn = htonl ( ipoib->qp->qpn );
-
-	/* Fill receive rings */
-	ib_refill_recv ( ibdev, ipoib->qp );
+	/* Create queues */
+	if ( ( rc = ipoib_create_queues ( ipoib, num_send_wqes,
+					  num_recv_wqes ) ) != 0 )
+		goto err_create_queues;
 
 	/* Fake a link status change to join the broadcast group */
 	ipoib_link_state_changed ( ibdev );
 
 	return 0;
 
-	ib_destroy_qp ( ibdev, ipoib->qp );
- err_create_qp:
-	ib_destroy_cq ( ibdev, ipoib->rx_cq );
- err_create_rx_cq:
-	ib_destroy_cq ( ibdev, ipoib->tx_cq );
- err_create_tx_cq:
+	ipoib_destroy_queues ( ipoib );
+ err_create_queues:
 	ib_close ( ibdev );
  err_ib_open:
 	return rc;
@@ -950,10 +1236,7 @@ static void ipoib_close ( struct net_device *netdev ) {
 	ipoib->mac.flags__qpn = 0;
 
 	/* Tear down the queues */
-	ib_destroy_qp ( ibdev, ipoib->qp );
-
-	ib_destroy_cq ( ibdev, ipoib->rx_cq );
-	ib_destroy_cq ( ibdev, ipoib->tx_cq );
+	ipoib_destroy_queues ( ipoib );
 
 	/* Close IB device */
 	ib_close ( ibdev );
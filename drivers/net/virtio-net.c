@@ -24,6 +24,9 @@ FILE_LICENCE ( GPL2_OR_LATER );
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <byteswap.h>
 #include <ipxe/list.h>
 #include <ipxe/iobuf.h>
 #include <ipxe/netdevice.h>
@@ -42,7 +45,9 @@ FILE_LICENCE ( GPL2_OR_LATER );
  *
  * The virtio network device is supported by Linux virtualization software
  * including QEMU/KVM and lguest.  This driver supports the virtio over PCI
- * transport; virtual machines have one virtio-net PCI adapter per NIC.
+ * transport; virtual machines have one virtio-net PCI adapter per NIC.  Both
+ * the legacy I/O port interface and the virtio 1.0 PCI capability interface
+ * are supported.
  *
  * Virtio-net is different from hardware NICs because virtio devices
  * communicate with the hypervisor via virtqueues, not traditional descriptor
@@ -59,6 +64,12 @@ FILE_LICENCE ( GPL2_OR_LATER );
  * than space, it is heavy-weight and allocated like traditional descriptor
  * rings in the open() function of the driver and not in probe().
  *
+ * Where the device supports VIRTIO_NET_F_MRG_RXBUF, each receive buffer is
+ * a single descriptor with the virtio net header placed inline, so that the
+ * ring holds twice as many receive buffers.  Where the device supports
+ * VIRTIO_RING_F_EVENT_IDX, the device is notified only when it has asked to
+ * be, and a receive ring refill is made visible with a single notification.
+ *
  * There is no true interrupt enable/disable.  Virtqueues have callback
  * enable/disable flags but these are only hints.  The hypervisor may still
  * raise an interrupt.  Nevertheless, this driver disables callbacks in the
@@ -78,16 +89,27 @@ enum {
 
 enum {
 	/** Max number of pending rx packets */
-	NUM_RX_BUF = 8,
+	NUM_RX_BUF = 64,
 
 	/** Max Ethernet frame length, including FCS and VLAN tag */
 	RX_BUF_SIZE = 1522,
 };
 
+/** Features which this driver can make use of */
+#define VIRTNET_FEATURES ( ( 1ULL << VIRTIO_NET_F_MAC ) |		\
+			   ( 1ULL << VIRTIO_NET_F_MRG_RXBUF ) |	\
+			   ( 1ULL << VIRTIO_RING_F_EVENT_IDX ) )
+
 struct virtnet_nic {
 	/** Base pio register address */
 	unsigned long ioaddr;
 
+	/** 0 for legacy, 1 for virtio 1.0 */
+	int virtio_version;
+
+	/** Virtio 1.0 device data */
+	struct virtio_pci_modern_device vdev;
+
 	/** RX/TX virtqueues */
 	struct vring_virtqueue *virtqueue;
 
@@ -97,8 +119,23 @@ struct virtnet_nic {
 	/** Pending rx packet count */
 	unsigned int rx_num_iobufs;
 
+	/** Maximum pending rx packet count */
+	unsigned int rx_max_iobufs;
+
+	/** Receive buffers are mergeable */
+	int mrg_rxbuf;
+
+	/** Length of virtio net packet header */
+	size_t hdr_len;
+
+	/** Packet being gathered from several mergeable rx buffers */
+	struct io_buffer *rx_merge;
+
+	/** Number of mergeable rx buffers still to be gathered */
+	unsigned int rx_merge_remaining;
+
 	/** Virtio net packet header, we only need one */
-	struct virtio_net_hdr empty_header;
+	struct virtio_net_hdr_modern empty_header;
 };
 
 /** Add an iobuf to a virtqueue
@@ -106,36 +143,55 @@ struct virtnet_nic {
  * @v netdev		Network device
  * @v vq_idx		Virtqueue index (RX_INDEX or TX_INDEX)
  * @v iobuf		I/O buffer
+ * @v num_added		Number of buffers added since the last kick
  *
- * The virtqueue is kicked after the iobuf has been added.
+ * The iobuf does not become visible to the device until the
+ * virtqueue is next kicked.
  */
 static void virtnet_enqueue_iob ( struct net_device *netdev,
-				  int vq_idx, struct io_buffer *iobuf ) {
+				  int vq_idx, struct io_buffer *iobuf,
+				  int num_added ) {
 	struct virtnet_nic *virtnet = netdev->priv;
 	struct vring_virtqueue *vq = &virtnet->virtqueue[vq_idx];
-	unsigned int out = ( vq_idx == TX_INDEX ) ? 2 : 0;
-	unsigned int in = ( vq_idx == TX_INDEX ) ? 0 : 2;
-	struct vring_list list[] = {
-		{
-			/* Share a single zeroed virtio net header between all
-			 * rx and tx packets.  This works because this driver
-			 * does not use any advanced features so none of the
-			 * header fields get used.
-			 */
-			.addr = ( char* ) &virtnet->empty_header,
-			.length = sizeof ( virtnet->empty_header ),
-		},
-		{
-			.addr = ( char* ) iobuf->data,
-			.length = iob_len ( iobuf ),
-		},
-	};
+	struct vring_list list[2];
+	unsigned int count = 0;
+
+	/* Share a single zeroed virtio net header between all rx and
+	 * tx packets.  This works because this driver does not use
+	 * any advanced features so none of the header fields get
+	 * used.  Mergeable rx buffers carry their header inline.
+	 */
+	if ( ! ( ( vq_idx == RX_INDEX ) && virtnet->mrg_rxbuf ) ) {
+		list[count].addr = ( char * ) &virtnet->empty_header;
+		list[count].length = virtnet->hdr_len;
+		count++;
+	}
+	list[count].addr = ( char * ) iobuf->data;
+	list[count].length = iob_len ( iobuf );
+	count++;
 
 	DBGC ( virtnet, "VIRTIO-NET %p enqueuing iobuf %p on vq %d\n",
 	       virtnet, iobuf, vq_idx );
 
-	vring_add_buf ( vq, list, out, in, iobuf, 0 );
-	vring_kick ( virtnet->ioaddr, vq, 1 );
+	if ( vq_idx == TX_INDEX ) {
+		vring_add_buf ( vq, list, count, 0, iobuf, num_added );
+	} else {
+		vring_add_buf ( vq, list, 0, count, iobuf, num_added );
+	}
+}
+
+/** Make newly added iobufs visible to the device
+ *
+ * @v netdev		Network device
+ * @v vq_idx		Virtqueue index (RX_INDEX or TX_INDEX)
+ * @v num_added		Number of buffers added since the last kick
+ */
+static void virtnet_kick ( struct net_device *netdev, int vq_idx,
+			   int num_added ) {
+	struct virtnet_nic *virtnet = netdev->priv;
+
+	vring_kick ( ( virtnet->virtio_version ? &virtnet->vdev : NULL ),
+		     virtnet->ioaddr, &virtnet->virtqueue[vq_idx], num_added );
 }
 
 /** Try to keep rx virtqueue filled with iobufs
@@ -144,12 +200,15 @@ static void virtnet_enqueue_iob ( struct net_device *netdev,
  */
 static void virtnet_refill_rx_virtqueue ( struct net_device *netdev ) {
 	struct virtnet_nic *virtnet = netdev->priv;
+	size_t len = ( virtnet->mrg_rxbuf ?
+		       ( virtnet->hdr_len + RX_BUF_SIZE ) : RX_BUF_SIZE );
+	int num_added = 0;
 
-	while ( virtnet->rx_num_iobufs < NUM_RX_BUF ) {
+	while ( virtnet->rx_num_iobufs < virtnet->rx_max_iobufs ) {
 		struct io_buffer *iobuf;
 
 		/* Try to allocate a buffer, stop for now if out of memory */
-		iobuf = alloc_iob ( RX_BUF_SIZE );
+		iobuf = alloc_iob ( len );
 		if ( ! iobuf )
 			break;
 
@@ -157,19 +216,76 @@ static void virtnet_refill_rx_virtqueue ( struct net_device *netdev ) {
 		list_add ( &iobuf->list, &virtnet->rx_iobufs );
 
 		/* Mark packet length until we know the actual size */
-		iob_put ( iobuf, RX_BUF_SIZE );
+		iob_put ( iobuf, len );
 
-		virtnet_enqueue_iob ( netdev, RX_INDEX, iobuf );
+		virtnet_enqueue_iob ( netdev, RX_INDEX, iobuf, num_added++ );
 		virtnet->rx_num_iobufs++;
 	}
+
+	/* Hand over the whole batch with a single kick */
+	if ( num_added )
+		virtnet_kick ( netdev, RX_INDEX, num_added );
 }
 
-/** Open network device
+/** Record negotiated features
+ *
+ * @v netdev		Network device
+ * @v features		Negotiated features
+ */
+static void virtnet_set_features ( struct net_device *netdev,
+				   uint64_t features ) {
+	struct virtnet_nic *virtnet = netdev->priv;
+	unsigned int descs;
+	int i;
+
+	virtnet->mrg_rxbuf =
+		( ( features & ( 1ULL << VIRTIO_NET_F_MRG_RXBUF ) ) != 0 );
+	virtnet->hdr_len =
+		( ( features & ( ( 1ULL << VIRTIO_NET_F_MRG_RXBUF ) |
+				 ( 1ULL << VIRTIO_F_VERSION_1 ) ) ) ?
+		  sizeof ( struct virtio_net_hdr_modern ) :
+		  sizeof ( struct virtio_net_hdr ) );
+	for ( i = 0; i < QUEUE_NB; i++ ) {
+		virtnet->virtqueue[i].event_idx =
+			( ( features & ( 1ULL << VIRTIO_RING_F_EVENT_IDX ) ) != 0 );
+	}
+
+	/* Post as many rx buffers as the rx virtqueue can hold */
+	descs = ( virtnet->mrg_rxbuf ? 1 : 2 );
+	virtnet->rx_max_iobufs = ( virtnet->virtqueue[RX_INDEX].vring.num /
+				   descs );
+	if ( virtnet->rx_max_iobufs > NUM_RX_BUF )
+		virtnet->rx_max_iobufs = NUM_RX_BUF;
+
+	DBGC ( virtnet, "VIRTIO-NET %p features %#llx, %d rx buffers\n",
+	       virtnet, ( ( unsigned long long ) features ),
+	       virtnet->rx_max_iobufs );
+}
+
+/** Start receiving packets
+ *
+ * @v netdev		Network device
+ */
+static void virtnet_open_rx ( struct net_device *netdev ) {
+	struct virtnet_nic *virtnet = netdev->priv;
+
+	/* Initialize rx packets */
+	INIT_LIST_HEAD ( &virtnet->rx_iobufs );
+	virtnet->rx_num_iobufs = 0;
+	virtnet->rx_merge = NULL;
+	virtnet->rx_merge_remaining = 0;
+	virtnet_refill_rx_virtqueue ( netdev );
+
+	/* Disable interrupts before starting */
+	netdev_irq ( netdev, 0 );
+}
+
+/** Open legacy network device
  *
  * @v netdev	Network device
  * @ret rc	Return status code
  */
-static int virtnet_open ( struct net_device *netdev ) {
+static int virtnet_open_legacy ( struct net_device *netdev ) {
 	struct virtnet_nic *virtnet = netdev->priv;
 	unsigned long ioaddr = virtnet->ioaddr;
 	u32 features;
@@ -178,6 +294,12 @@ static int virtnet_open ( struct net_device *netdev ) {
 	/* Reset for sanity */
 	vp_reset ( ioaddr );
 
+	/* Negotiate features */
+	vp_set_status ( ioaddr, ( VIRTIO_CONFIG_S_ACKNOWLEDGE |
+				  VIRTIO_CONFIG_S_DRIVER ) );
+	features = ( vp_get_features ( ioaddr ) & VIRTNET_FEATURES );
+	vp_set_features ( ioaddr, features );
+
 	/* Allocate virtqueues */
 	virtnet->virtqueue = zalloc ( QUEUE_NB *
 				      sizeof ( *virtnet->virtqueue ) );
@@ -194,20 +316,94 @@ static int virtnet_open ( struct net_device *netdev ) {
 			return -ENOENT;
 		}
 	}
+	virtnet_set_features ( netdev, features );
 
 	/* Initialize rx packets */
-	INIT_LIST_HEAD ( &virtnet->rx_iobufs );
-	virtnet->rx_num_iobufs = 0;
-	virtnet_refill_rx_virtqueue ( netdev );
+	virtnet_open_rx ( netdev );
 
-	/* Disable interrupts before starting */
-	netdev_irq ( netdev, 0 );
+	/* Driver is ready */
+	vp_set_status ( ioaddr, ( VIRTIO_CONFIG_S_ACKNOWLEDGE |
+				  VIRTIO_CONFIG_S_DRIVER |
+				  VIRTIO_CONFIG_S_DRIVER_OK ) );
+	return 0;
+}
+
+/** Open modern network device
+ *
+ * @v netdev	Network device
+ * @ret rc	Return status code
+ */
+static int virtnet_open_modern ( struct net_device *netdev ) {
+	struct virtnet_nic *virtnet = netdev->priv;
+	uint64_t features;
+	int rc;
+
+	/* Reset for sanity */
+	vpm_reset ( &virtnet->vdev );
+
+	/* Negotiate features */
+	vpm_add_status ( &virtnet->vdev, ( VIRTIO_CONFIG_S_ACKNOWLEDGE |
+					   VIRTIO_CONFIG_S_DRIVER ) );
+	features = ( vpm_get_features ( &virtnet->vdev ) &
+		     ( VIRTNET_FEATURES | ( 1ULL << VIRTIO_F_VERSION_1 ) ) );
+	vpm_set_features ( &virtnet->vdev, features );
+	vpm_add_status ( &virtnet->vdev, VIRTIO_CONFIG_S_FEATURES_OK );
+	if ( ! ( vpm_get_status ( &virtnet->vdev ) &
+		 VIRTIO_CONFIG_S_FEATURES_OK ) ) {
+		DBGC ( virtnet, "VIRTIO-NET %p features %#llx not accepted\n",
+		       virtnet, ( ( unsigned long long ) features ) );
+		rc = -EINVAL;
+		goto err_features;
+	}
+
+	/* Allocate virtqueues */
+	virtnet->virtqueue = zalloc ( QUEUE_NB *
+				      sizeof ( *virtnet->virtqueue ) );
+	if ( ! virtnet->virtqueue ) {
+		rc = -ENOMEM;
+		goto err_alloc;
+	}
+
+	/* Initialize rx/tx virtqueues */
+	if ( ( rc = vpm_find_vqs ( &virtnet->vdev, QUEUE_NB,
+				   virtnet->virtqueue ) ) != 0 ) {
+		DBGC ( virtnet, "VIRTIO-NET %p cannot register queues: %s\n",
+		       virtnet, strerror ( rc ) );
+		goto err_find_vqs;
+	}
+	virtnet_set_features ( netdev, features );
+
+	/* Initialize rx packets */
+	virtnet_open_rx ( netdev );
 
 	/* Driver is ready */
-	features = vp_get_features ( ioaddr );
-	vp_set_features ( ioaddr, features & ( 1 << VIRTIO_NET_F_MAC ) );
-	vp_set_status ( ioaddr, VIRTIO_CONFIG_S_DRIVER | VIRTIO_CONFIG_S_DRIVER_OK );
+	vpm_add_status ( &virtnet->vdev, VIRTIO_CONFIG_S_DRIVER_OK );
 	return 0;
+
+ err_find_vqs:
+	/* Reset before freeing any partially configured virtqueues */
+	vpm_reset ( &virtnet->vdev );
+	free ( virtnet->virtqueue );
+	virtnet->virtqueue = NULL;
+ err_alloc:
+ err_features:
+	vpm_add_status ( &virtnet->vdev, VIRTIO_CONFIG_S_FAILED );
+	return rc;
+}
+
+/** Open network device
+ *
+ * @v netdev	Network device
+ * @ret rc	Return status code
+ */
+static int virtnet_open ( struct net_device *netdev ) {
+	struct virtnet_nic *virtnet = netdev->priv;
+
+	if ( virtnet->virtio_version ) {
+		return virtnet_open_modern ( netdev );
+	} else {
+		return virtnet_open_legacy ( netdev );
+	}
 }
 
 /** Close network device
@@ -218,10 +414,18 @@ static void virtnet_close ( struct net_device *netdev ) {
 	struct virtnet_nic *virtnet = netdev->priv;
 	struct io_buffer *iobuf;
 	struct io_buffer *next_iobuf;
+	int i;
 
-	vp_reset ( virtnet->ioaddr );
+	if ( virtnet->virtio_version ) {
+		vpm_reset ( &virtnet->vdev );
+	} else {
+		vp_reset ( virtnet->ioaddr );
+	}
 
 	/* Virtqueues can be freed now that NIC is reset */
+	for ( i = 0 ; i < QUEUE_NB ; i++ )
+		virtio_pci_unmap_capability (
+			&virtnet->virtqueue[i].notification );
 	free ( virtnet->virtqueue );
 	virtnet->virtqueue = NULL;
 
@@ -231,6 +435,9 @@ static void virtnet_close ( struct net_device *netdev ) {
 	}
 	INIT_LIST_HEAD ( &virtnet->rx_iobufs );
 	virtnet->rx_num_iobufs = 0;
+	free_iob ( virtnet->rx_merge );
+	virtnet->rx_merge = NULL;
+	virtnet->rx_merge_remaining = 0;
 }
 
 /** Transmit packet
@@ -241,7 +448,8 @@ static void virtnet_close ( struct net_device *netdev ) {
  */
 static int virtnet_transmit ( struct net_device *netdev,
 			      struct io_buffer *iobuf ) {
-	virtnet_enqueue_iob ( netdev, TX_INDEX, iobuf );
+	virtnet_enqueue_iob ( netdev, TX_INDEX, iobuf, 0 );
+	virtnet_kick ( netdev, TX_INDEX, 1 );
 	return 0;
 }
 
@@ -263,6 +471,66 @@ static void virtnet_process_tx_packets ( struct net_device *netdev ) {
 	}
 }
 
+/** Receive a mergeable rx buffer
+ *
+ * @v netdev	Network device
+ * @v iobuf	I/O buffer
+ *
+ * A packet may span several mergeable rx buffers, in which case the
+ * first buffer's header records how many buffers make up the packet.
+ */
+static void virtnet_rx_merge ( struct net_device *netdev,
+			       struct io_buffer *iobuf ) {
+	struct virtnet_nic *virtnet = netdev->priv;
+	struct virtio_net_hdr_modern *header = iobuf->data;
+	struct io_buffer *merged;
+	unsigned int num_buffers;
+
+	/* Gather continuation buffers, if any are outstanding */
+	if ( virtnet->rx_merge_remaining ) {
+		virtnet->rx_merge_remaining--;
+		merged = virtnet->rx_merge;
+		if ( merged ) {
+			memcpy ( iob_put ( merged, iob_len ( iobuf ) ),
+				 iobuf->data, iob_len ( iobuf ) );
+		}
+		free_iob ( iobuf );
+		if ( merged && ! virtnet->rx_merge_remaining ) {
+			virtnet->rx_merge = NULL;
+			netdev_rx ( netdev, merged );
+		}
+		return;
+	}
+
+	/* Strip header */
+	if ( iob_len ( iobuf ) < virtnet->hdr_len ) {
+		netdev_rx_err ( netdev, iobuf, -EINVAL );
+		return;
+	}
+	num_buffers = le16_to_cpu ( header->num_buffers );
+	iob_pull ( iobuf, virtnet->hdr_len );
+	if ( num_buffers <= 1 ) {
+		netdev_rx ( netdev, iobuf );
+		return;
+	}
+
+	/* Start gathering a packet which spans several buffers.  If
+	 * no memory is available, the remaining buffers are discarded.
+	 */
+	DBGC ( virtnet, "VIRTIO-NET %p rx packet spans %d buffers\n",
+	       virtnet, num_buffers );
+	virtnet->rx_merge_remaining = ( num_buffers - 1 );
+	merged = alloc_iob ( num_buffers * ( virtnet->hdr_len + RX_BUF_SIZE ) );
+	if ( ! merged ) {
+		netdev_rx_err ( netdev, iobuf, -ENOMEM );
+		return;
+	}
+	memcpy ( iob_put ( merged, iob_len ( iobuf ) ), iobuf->data,
+		 iob_len ( iobuf ) );
+	free_iob ( iobuf );
+	virtnet->rx_merge = merged;
+}
+
 /** Complete packet reception
  *
  * @v netdev	Network device
@@ -280,8 +548,13 @@ static void virtnet_process_rx_packets ( struct net_device *netdev ) {
 		virtnet->rx_num_iobufs--;
 
 		/* Update iobuf length */
-		iob_unput ( iobuf, RX_BUF_SIZE );
-		iob_put ( iobuf, len - sizeof ( struct virtio_net_hdr ) );
+		iob_unput ( iobuf, iob_len ( iobuf ) );
+		if ( virtnet->mrg_rxbuf ) {
+			iob_put ( iobuf, len );
+			virtnet_rx_merge ( netdev, iobuf );
+			continue;
+		}
+		iob_put ( iobuf, len - virtnet->hdr_len );
 
 		DBGC ( virtnet, "VIRTIO-NET %p rx complete iobuf %p len %zd\n",
 		       virtnet, iobuf, iob_len ( iobuf ) );
@@ -305,7 +578,11 @@ static void virtnet_poll ( struct net_device *netdev ) {
 	 * set (that flag is just a hint and the hypervisor not not have to
 	 * honor it).
 	 */
-	vp_get_isr ( virtnet->ioaddr );
+	if ( virtnet->virtio_version ) {
+		vpm_get_isr ( &virtnet->vdev );
+	} else {
+		vp_get_isr ( virtnet->ioaddr );
+	}
 
 	virtnet_process_tx_packets ( netdev );
 	virtnet_process_rx_packets ( netdev );
@@ -338,13 +615,12 @@ static struct net_device_operations virtnet_operations = {
 };
 
 /**
- * Probe PCI device
+ * Probe PCI device, legacy virtio 0.9.5
  *
  * @v pci	PCI device
- * @v id	PCI ID
  * @ret rc	Return status code
  */
-static int virtnet_probe ( struct pci_device *pci ) {
+static int virtnet_probe_legacy ( struct pci_device *pci ) {
 	unsigned long ioaddr = pci->ioaddr;
 	struct net_device *netdev;
 	struct virtnet_nic *virtnet;
@@ -394,6 +670,124 @@ static int virtnet_probe ( struct pci_device *pci ) {
 	return rc;
 }
 
+/**
+ * Probe PCI device, modern virtio 1.0
+ *
+ * @v pci		PCI device
+ * @v found_dev	Set to non-zero if modern device was found (probe may still fail)
+ * @ret rc	Return status code
+ */
+static int virtnet_probe_modern ( struct pci_device *pci, int *found_dev ) {
+	struct net_device *netdev;
+	struct virtnet_nic *virtnet;
+	uint64_t features;
+	int common, isr, notify, device;
+	int rc;
+
+	/* Look for the virtio 1.0 capabilities */
+	common = virtio_pci_find_capability ( pci, VIRTIO_PCI_CAP_COMMON_CFG );
+	if ( ! common ) {
+		DBG ( "Common virtio capability not found!\n" );
+		return -ENODEV;
+	}
+	*found_dev = 1;
+
+	isr = virtio_pci_find_capability ( pci, VIRTIO_PCI_CAP_ISR_CFG );
+	notify = virtio_pci_find_capability ( pci, VIRTIO_PCI_CAP_NOTIFY_CFG );
+	if ( ! isr || ! notify ) {
+		DBG ( "Missing virtio capabilities %i/%i/%i\n",
+		      common, isr, notify );
+		return -EINVAL;
+	}
+	device = virtio_pci_find_capability ( pci, VIRTIO_PCI_CAP_DEVICE_CFG );
+
+	/* Allocate and hook up net device */
+	netdev = alloc_etherdev ( sizeof ( *virtnet ) );
+	if ( ! netdev )
+		return -ENOMEM;
+	netdev_init ( netdev, &virtnet_operations );
+	virtnet = netdev->priv;
+	virtnet->virtio_version = 1;
+	virtnet->vdev.pci = pci;
+	virtnet->vdev.notify_cap_pos = notify;
+	pci_set_drvdata ( pci, netdev );
+	netdev->dev = &pci->dev;
+
+	DBGC ( virtnet, "VIRTIO-NET %p busaddr=%s irq=%d (virtio 1.0)\n",
+	       virtnet, pci->dev.name, pci->irq );
+
+	/* Map the configuration regions */
+	if ( ( rc = virtio_pci_map_capability ( pci, common,
+				sizeof ( struct virtio_pci_common_cfg ), 4,
+				0, sizeof ( struct virtio_pci_common_cfg ),
+				&virtnet->vdev.common ) ) != 0 )
+		goto err_map_common;
+	if ( ( rc = virtio_pci_map_capability ( pci, isr, sizeof ( u8 ), 1,
+						0, 1,
+						&virtnet->vdev.isr ) ) != 0 )
+		goto err_map_isr;
+	if ( device &&
+	     ( ( rc = virtio_pci_map_capability ( pci, device, 0, 4, 0,
+				sizeof ( struct virtio_net_config ),
+				&virtnet->vdev.device ) ) != 0 ) )
+		goto err_map_device;
+
+	/* Enable PCI bus master and reset NIC */
+	adjust_pci_device ( pci );
+	vpm_reset ( &virtnet->vdev );
+
+	/* Load MAC address */
+	features = vpm_get_features ( &virtnet->vdev );
+	if ( device && ( features & ( 1ULL << VIRTIO_NET_F_MAC ) ) ) {
+		vpm_get ( &virtnet->vdev,
+			  offsetof ( struct virtio_net_config, mac ),
+			  netdev->hw_addr, ETH_ALEN );
+		DBGC ( virtnet, "VIRTIO-NET %p mac=%s\n", virtnet,
+		       eth_ntoa ( netdev->hw_addr ) );
+	}
+
+	/* Register network device */
+	if ( ( rc = register_netdev ( netdev ) ) != 0 )
+		goto err_register_netdev;
+
+	/* Mark link as up, control virtqueue is not used */
+	netdev_link_up ( netdev );
+
+	return 0;
+
+	unregister_netdev ( netdev );
+ err_register_netdev:
+	vpm_reset ( &virtnet->vdev );
+	virtio_pci_unmap_capability ( &virtnet->vdev.device );
+ err_map_device:
+	virtio_pci_unmap_capability ( &virtnet->vdev.isr );
+ err_map_isr:
+	virtio_pci_unmap_capability ( &virtnet->vdev.common );
+ err_map_common:
+	netdev_nullify ( netdev );
+	netdev_put ( netdev );
+	return rc;
+}
+
+/**
+ * Probe PCI device
+ *
+ * @v pci	PCI device
+ * @ret rc	Return status code
+ */
+static int virtnet_probe ( struct pci_device *pci ) {
+	int found_modern = 0;
+	int rc;
+
+	/* Prefer the virtio 1.0 interface, if the device offers it */
+	rc = virtnet_probe_modern ( pci, &found_modern );
+	if ( ! found_modern && ( pci->device < 0x1040 ) ) {
+		/* fall back to the legacy probe */
+		rc = virtnet_probe_legacy ( pci );
+	}
+	return rc;
+}
+
 /**
  * Remove device
  *
@@ -401,14 +795,19 @@ static int virtnet_probe ( struct pci_device *pci ) {
  */
 static void virtnet_remove ( struct pci_device *pci ) {
 	struct net_device *netdev = pci_get_drvdata ( pci );
+	struct virtnet_nic *virtnet = netdev->priv;
 
 	unregister_netdev ( netdev );
+	virtio_pci_unmap_capability ( &virtnet->vdev.device );
+	virtio_pci_unmap_capability ( &virtnet->vdev.isr );
+	virtio_pci_unmap_capability ( &virtnet->vdev.common );
 	netdev_nullify ( netdev );
 	netdev_put ( netdev );
 }
 
 static struct pci_device_id virtnet_nics[] = {
 PCI_ROM(0x1af4, 0x1000, "virtio-net", "Virtio Network Interface", 0),
+PCI_ROM(0x1af4, 0x1041, "virtio-net", "Virtio Network Interface 1.0", 0),
 };
 
 struct pci_driver virtnet_driver __pci_driver = {
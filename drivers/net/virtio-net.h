@@ -14,6 +14,7 @@
 #define VIRTIO_NET_F_HOST_TSO6  12      /* Host can handle TSOv6 in. */
 #define VIRTIO_NET_F_HOST_ECN   13      /* Host can handle TSO[6] w/ ECN in. */
 #define VIRTIO_NET_F_HOST_UFO   14      /* Host can handle UFO in. */
+#define VIRTIO_NET_F_MRG_RXBUF  15      /* Host can merge receive buffers. */
 
 struct virtio_net_config
 {
@@ -41,4 +42,13 @@ struct virtio_net_hdr
    uint16_t csum_start;
    uint16_t csum_offset;
 };
+
+/* This is the header used when VIRTIO_NET_F_MRG_RXBUF or
+ * VIRTIO_F_VERSION_1 is negotiated. */
+struct virtio_net_hdr_modern
+{
+   struct virtio_net_hdr legacy;
+   /* Number of merged rx buffers */
+   uint16_t num_buffers;
+};
 #endif /* _VIRTIO_NET_H_ */
@@ -0,0 +1,109 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+FILE_LICENCE ( GPL2_OR_LATER );
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <ipxe/uri.h>
+#include <ipxe/command.h>
+#include <ipxe/parseopt.h>
+#include <usr/netbench.h>
+
+/** @file
+ *
+ * Network benchmarking commands
+ *
+ */
+
+/** "netbench" options */
+struct netbench_options {
+	/** Read as a block device */
+	int block;
+	/** Number of runs per URI */
+	unsigned int count;
+	/** Timeout */
+	unsigned long timeout;
+};
+
+/** "netbench" option list */
+static struct option_descriptor netbench_opts[] = {
+	OPTION_DESC ( "block", 'b', no_argument,
+		      struct netbench_options, block, parse_flag ),
+	OPTION_DESC ( "count", 'c', required_argument,
+		      struct netbench_options, count, parse_integer ),
+	OPTION_DESC ( "timeout", 't', required_argument,
+		      struct netbench_options, timeout, parse_timeout ),
+};
+
+/** "netbench" command descriptor */
+static struct command_descriptor netbench_cmd =
+	COMMAND_DESC ( struct netbench_options, netbench_opts, 1, MAX_ARGUMENTS,
+		       "<uri> [<uri>...]" );
+
+/**
+ * The "netbench" command
+ *
+ * @v argc		Argument count
+ * @v argv		Argument list
+ * @ret rc		Return status code
+ */
+static int netbench_exec ( int argc, char **argv ) {
+	struct netbench_options opts;
+	struct uri *uri;
+	unsigned int flags;
+	unsigned int i;
+	int rc;
+
+	/* Parse options */
+	if ( ( rc = parse_options ( argc, argv, &netbench_cmd, &opts ) ) != 0 )
+		return rc;
+	flags = ( opts.block ? NETBENCH_BLOCK : 0 );
+	if ( ! opts.count )
+		opts.count = 1;
+
+	/* Benchmark each URI in turn */
+	for ( ; optind < argc ; optind++ ) {
+
+		/* Parse URI */
+		uri = parse_uri ( argv[optind] );
+		if ( ! uri )
+			return -ENOMEM;
+
+		/* Run benchmark */
+		for ( i = 0 ; i < opts.count ; i++ ) {
+			if ( ( rc = netbench ( uri, flags,
+					       opts.timeout ) ) != 0 ) {
+				printf ( "Benchmark failed: %s\n",
+					 strerror ( rc ) );
+				uri_put ( uri );
+				return rc;
+			}
+		}
+		uri_put ( uri );
+	}
+
+	return 0;
+}
+
+/** Network benchmarking commands */
+struct command netbench_command __command = {
+	.name = "netbench",
+	.exec = netbench_exec,
+};
@@ -32,10 +32,24 @@ FILE_LICENCE ( GPL2_OR_LATER );
  */
 
 /** "profstat" options */
-struct profstat_options {};
+struct profstat_options {
+	/** Send statistics to system log */
+	int log;
+	/** Reset statistics after reporting */
+	int reset;
+	/** Do not print statistics */
+	int quiet;
+};
 
 /** "profstat" option list */
-static struct option_descriptor profstat_opts[] = {};
+static struct option_descriptor profstat_opts[] = {
+	OPTION_DESC ( "log", 'l', no_argument,
+		      struct profstat_options, log, parse_flag ),
+	OPTION_DESC ( "reset", 'r', no_argument,
+		      struct profstat_options, reset, parse_flag ),
+	OPTION_DESC ( "quiet", 'q', no_argument,
+		      struct profstat_options, quiet, parse_flag ),
+};
 
 /** "profstat" command descriptor */
 static struct command_descriptor profstat_cmd =
@@ -56,7 +70,15 @@ static int profstat_exec ( int argc, char **argv ) {
 	if ( ( rc = parse_options ( argc, argv, &profstat_cmd, &opts ) ) != 0 )
 		return rc;
 
-	profstat();
+	/* Take snapshot of statistics */
+	if ( ! opts.quiet )
+		profstat();
+	if ( opts.log )
+		profstat_log();
+
+	/* Start a new measurement interval, if applicable */
+	if ( opts.reset )
+		profstat_reset();
 
 	return 0;
 }
@@ -63,6 +63,9 @@ struct device_description {
 /** Xen bus type */
 #define BUS_TYPE_XEN 8
 
+/** Pipe bus type */
+#define BUS_TYPE_PIPE 9
+
 /** A hardware device */
 struct device {
 	/** Name */
@@ -141,6 +144,10 @@ static inline void devices_put ( void ) {
 	device_keep_count--;
 }
 
+extern void device_probe_begin ( struct device *dev );
+extern void device_probe_end ( struct device *dev, int rc );
+extern void device_probe_wait ( void );
+
 extern struct device * identify_device ( struct interface *intf );
 #define identify_device_TYPE( object_type ) \
 	typeof ( struct device * ( object_type ) )
@@ -238,6 +238,13 @@ struct dhcp_client_id {
 /** User class identifier */
 #define DHCP_USER_CLASS_ID 77
 
+/** Rapid Commit
+ *
+ * This zero-length option requests (in a DHCPDISCOVER) or indicates
+ * (in a DHCPACK) the use of a two-message exchange, as per RFC 4039.
+ */
+#define DHCP_RAPID_COMMIT 80
+
 /** Client system architecture */
 #define DHCP_CLIENT_ARCHITECTURE 93
 
@@ -650,6 +657,23 @@ struct dhcphdr {
 /** Maximum time that we will wait for Boot Server responses */
 #define PXEBS_MAX_TIMEOUT ( 3 * TICKS_PER_SEC )
 
+/** DHCP session timing
+ *
+ * All times are in ticks.
+ */
+struct dhcp_timing {
+	/** Time spent in discovery state */
+	unsigned long discover;
+	/** Time spent in request state */
+	unsigned long request;
+	/** Time spent in ProxyDHCP request state */
+	unsigned long proxy;
+	/** Time spent in PXE Boot Server Discovery state */
+	unsigned long pxebs;
+	/** Total time from start to completion */
+	unsigned long total;
+};
+
 /** Settings block name used for DHCP responses */
 #define DHCP_SETTINGS_NAME "dhcp"
 
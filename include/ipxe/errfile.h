@@ -78,6 +78,7 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #define ERRFILE_pci		     ( ERRFILE_DRIVER | 0x00040000 )
 #define ERRFILE_linux		     ( ERRFILE_DRIVER | 0x00050000 )
 #define ERRFILE_pcivpd		     ( ERRFILE_DRIVER | 0x00060000 )
+#define ERRFILE_virtio_pci	     ( ERRFILE_DRIVER | 0x00070000 )
 
 #define ERRFILE_nvs		     ( ERRFILE_DRIVER | 0x00100000 )
 #define ERRFILE_spi		     ( ERRFILE_DRIVER | 0x00110000 )
@@ -169,6 +170,7 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #define ERRFILE_qib7322		     ( ERRFILE_DRIVER | 0x00760000 )
 #define ERRFILE_golan		     ( ERRFILE_DRIVER | 0x00770000 )
 #define ERRFILE_hermon_settings	     ( ERRFILE_DRIVER | 0x00780000 )
+#define ERRFILE_pipe		     ( ERRFILE_DRIVER | 0x00790000 )
 
 #define ERRFILE_aoe			( ERRFILE_NET | 0x00000000 )
 #define ERRFILE_arp			( ERRFILE_NET | 0x00010000 )
@@ -231,6 +233,7 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #define ERRFILE_ping			( ERRFILE_NET | 0x003a0000 )
 #define ERRFILE_dhcpv6			( ERRFILE_NET | 0x003b0000 )
 #define ERRFILE_nfs_uri			( ERRFILE_NET | 0x003c0000 )
+#define ERRFILE_fragment		( ERRFILE_NET | 0x003d0000 )
 
 #define ERRFILE_image		      ( ERRFILE_IMAGE | 0x00000000 )
 #define ERRFILE_elf		      ( ERRFILE_IMAGE | 0x00010000 )
@@ -313,6 +316,8 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #define ERRFILE_efi_utils	      ( ERRFILE_OTHER | 0x00450000 )
 #define ERRFILE_efi_wrap	      ( ERRFILE_OTHER | 0x00460000 )
 #define ERRFILE_boot_menu_ui	      ( ERRFILE_OTHER | 0x00470000 )
+#define ERRFILE_netbench	      ( ERRFILE_OTHER | 0x00480000 )
+#define ERRFILE_netbench_cmd	      ( ERRFILE_OTHER | 0x00490000 )
 
 /** @} */
 
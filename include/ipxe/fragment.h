@@ -17,18 +17,47 @@ FILE_LICENCE ( GPL2_OR_LATER );
 /** Fragment reassembly timeout */
 #define FRAGMENT_TIMEOUT ( TICKS_PER_SEC / 2 )
 
+/** Maximum length of a reassembled payload */
+#define FRAGMENT_MAX_LEN 65535
+
+/** Fragment block size
+ *
+ * Both IPv4 and IPv6 express fragment offsets in units of eight
+ * bytes.
+ */
+#define FRAGMENT_BLOCK_SIZE 8
+
+/** Maximum number of fragment blocks within a reassembled payload */
+#define FRAGMENT_MAX_BLOCKS \
+	( ( FRAGMENT_MAX_LEN + FRAGMENT_BLOCK_SIZE - 1 ) / FRAGMENT_BLOCK_SIZE )
+
+/** Maximum number of concurrent reassemblies per reassembler */
+#define FRAGMENT_MAX_BUFFERS 4
+
 /** A fragment reassembly buffer */
 struct fragment {
 	/* List of fragment reassembly buffers */
 	struct list_head list;
-	/** Reassembled packet */
+	/** Reassembled packet, or NULL if this buffer is unused */
 	struct io_buffer *iobuf;
 	/** Length of non-fragmentable portion of reassembled packet */
 	size_t hdrlen;
+	/** Non-fragmentable portion was taken from the first fragment */
+	int have_first;
+	/** Payload capacity of reassembled packet */
+	size_t capacity;
+	/** Total payload length, or zero if final fragment not yet seen */
+	size_t total;
+	/** Highest payload offset seen so far */
+	size_t end;
+	/** Number of payload bytes received */
+	size_t received;
 	/** Reassembly timer */
 	struct retry_timer timer;
 	/** Fragment reassembler */
 	struct fragment_reassembler *fragments;
+	/** Bitmap of received payload blocks */
+	uint32_t blocks[ ( FRAGMENT_MAX_BLOCKS + 31 ) / 32 ];
 };
 
 /** A fragment reassembler */
@@ -61,8 +90,27 @@ struct fragment_reassembler {
 	 * @ret more_frags	More fragments exist
 	 */
 	int ( * more_fragments ) ( struct io_buffer *iobuf, size_t hdrlen );
+	/**
+	 * Get total payload length hint (optional)
+	 *
+	 * @v iobuf		I/O buffer
+	 * @v hdrlen		Length of non-fragmentable potion of I/O buffer
+	 * @ret len		Expected total payload length, or zero if unknown
+	 *
+	 * This is used to size the reassembly buffer when the final
+	 * fragment has not yet been seen.
+	 */
+	size_t ( * payload_len ) ( struct io_buffer *iobuf, size_t hdrlen );
 	/** Associated IP statistics */
 	struct ip_statistics *stats;
+	/** Preallocated fragment reassembly buffers
+	 *
+	 * This must point to an array of FRAGMENT_MAX_BUFFERS
+	 * buffers.  The array is kept separate from the (statically
+	 * initialised) reassembler so that it can be placed in
+	 * zero-initialised storage.
+	 */
+	struct fragment *buffers;
 };
 
 extern struct io_buffer *
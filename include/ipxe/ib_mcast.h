@@ -10,6 +10,7 @@
 FILE_LICENCE ( GPL2_OR_LATER );
 
 #include <ipxe/infiniband.h>
+#include <ipxe/process.h>
 
 struct ib_mad_transaction;
 
@@ -21,13 +22,16 @@ struct ib_mc_membership {
 	union ib_gid gid;
 	/** Multicast group join transaction */
 	struct ib_mad_transaction *madx;
+	/** Cached membership join completion process */
+	struct process process;
 	/** Handle join success/failure
 	 *
 	 * @v ibdev		Infiniband device
 	 * @v qp		Queue pair
 	 * @v membership	Multicast group membership
 	 * @v rc		Status code
-	 * @v mad		Response MAD (or NULL on error)
+	 * @v mad		Response MAD (or NULL on error or if a cached
+	 *			membership was reused)
 	 */
 	void ( * complete ) ( struct ib_device *ibdev, struct ib_queue_pair *qp,
 			      struct ib_mc_membership *membership, int rc,
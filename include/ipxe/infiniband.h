@@ -163,6 +163,15 @@ struct ib_queue_pair {
 	struct ib_device *ibdev;
 	/** List of queue pairs on this Infiniband device */
 	struct list_head list;
+	/** Queue pair number hash table chain */
+	struct list_head hash;
+	/** List of remapped queue pairs on this Infiniband device
+	 *
+	 * Only queue pairs whose externally-visible queue pair
+	 * number differs from the real queue pair number are present
+	 * on this list.
+	 */
+	struct list_head ext_list;
 	/** Queue pair number */
 	unsigned long qpn;
 	/** Externally-visible queue pair number
@@ -180,6 +189,14 @@ struct ib_queue_pair {
 	struct ib_work_queue send;
 	/** Receive queue */
 	struct ib_work_queue recv;
+	/** Send batch is open
+	 *
+	 * While a send batch is open, send work queue entries are
+	 * posted without notifying the hardware.
+	 */
+	int send_batch;
+	/** Number of send work queue entries not yet notified */
+	unsigned int send_pending;
 	/** List of multicast GIDs */
 	struct list_head mgids;
 	/** Address vector */
@@ -309,6 +326,18 @@ struct ib_device_operations {
 			      struct ib_queue_pair *qp,
 			      struct ib_address_vector *dest,
 			      struct io_buffer *iobuf );
+	/** Notify hardware of new send work queue entries
+	 *
+	 * @v ibdev		Infiniband device
+	 * @v qp		Queue pair
+	 *
+	 * This method is optional.  If present, post_send() need not
+	 * notify the hardware of each new work queue entry; this
+	 * method will be called once after each entry posted outside
+	 * of a send batch, and once when a send batch is committed.
+	 */
+	void ( * ring_send ) ( struct ib_device *ibdev,
+			       struct ib_queue_pair *qp );
 	/** Post receive work queue entry
 	 *
 	 * @v ibdev		Infiniband device
@@ -324,6 +353,18 @@ struct ib_device_operations {
 	int ( * post_recv ) ( struct ib_device *ibdev,
 			      struct ib_queue_pair *qp,
 			      struct io_buffer *iobuf );
+	/** Notify hardware of new receive work queue entries
+	 *
+	 * @v ibdev		Infiniband device
+	 * @v qp		Queue pair
+	 *
+	 * This method is optional.  If present, post_recv() need not
+	 * notify the hardware of each new work queue entry; this
+	 * method will be called once after a batch of entries has
+	 * been posted.
+	 */
+	void ( * ring_recv ) ( struct ib_device *ibdev,
+			       struct ib_queue_pair *qp );
 	/** Poll completion queue
 	 *
 	 * @v ibdev		Infiniband device
@@ -393,6 +434,28 @@ struct ib_device_operations {
 				   union ib_mad *mad );
 };
 
+/** Number of queue pair number hash buckets (must be a power of two) */
+#define IB_QPN_HASH_SIZE 16
+
+/**
+ * Calculate queue pair number hash bucket
+ *
+ * @v qpn		Queue pair number
+ * @ret bucket		Hash bucket index
+ *
+ * Some HCAs allocate queue pair numbers sequentially, while others
+ * randomise the high-order bits.  All bits of the 24-bit queue pair
+ * number are folded in so that both patterns spread across the table.
+ */
+static inline __attribute__ (( always_inline )) unsigned int
+ib_qpn_hash ( unsigned long qpn ) {
+
+	qpn ^= ( qpn >> 12 );
+	qpn ^= ( qpn >> 8 );
+	qpn ^= ( qpn >> 4 );
+	return ( qpn & ( IB_QPN_HASH_SIZE - 1 ) );
+}
+
 /** An Infiniband device */
 struct ib_device {
 	/** Reference counter */
@@ -407,12 +470,22 @@ struct ib_device {
 	struct list_head cqs;
 	/** List of queue pairs */
 	struct list_head qps;
+	/** Queue pairs hashed by queue pair number */
+	struct list_head qp_hash[IB_QPN_HASH_SIZE];
+	/** Queue pairs with remapped externally-visible queue pair numbers */
+	struct list_head ext_qps;
 	/** Infiniband operations */
 	struct ib_device_operations *op;
 	/** Port number */
 	unsigned int port;
 	/** Port open request counter */
 	unsigned int open_count;
+	/** Maximum number of send work queue entries (or zero if unlimited) */
+	unsigned int max_send_wqes;
+	/** Maximum number of receive work queue entries (or zero if unlimited) */
+	unsigned int max_recv_wqes;
+	/** Maximum number of completion queue entries (or zero if unlimited) */
+	unsigned int max_cqes;
 
 	/** Port state */
 	uint8_t port_state;
@@ -513,6 +586,8 @@ extern struct ib_work_queue * ib_find_wq ( struct ib_completion_queue *cq,
 extern int ib_post_send ( struct ib_device *ibdev, struct ib_queue_pair *qp,
 			  struct ib_address_vector *dest,
 			  struct io_buffer *iobuf );
+extern void ib_commit_send ( struct ib_device *ibdev,
+			     struct ib_queue_pair *qp );
 extern int ib_post_recv ( struct ib_device *ibdev, struct ib_queue_pair *qp,
 			  struct io_buffer *iobuf );
 extern void ib_complete_send ( struct ib_device *ibdev,
@@ -559,6 +634,19 @@ ib_link_ok ( struct ib_device *ibdev ) {
 	return ( ibdev->port_state == IB_PORT_STATE_ACTIVE );
 }
 
+/**
+ * Begin batch of send work queue entries
+ *
+ * @v qp		Queue pair
+ *
+ * Send work queue entries posted via ib_post_send() will not be
+ * notified to the hardware until ib_commit_send() is called.
+ */
+static inline __always_inline void
+ib_begin_send ( struct ib_queue_pair *qp ) {
+	qp->send_batch = 1;
+}
+
 /**
  * Check whether or not Infiniband device is open
  *
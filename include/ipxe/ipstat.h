@@ -108,6 +108,21 @@ struct ip_statistics {
 	 * combining them as they are received.
 	 */
 	unsigned long reasm_fails;
+	/** Reassembly timeouts
+	 *
+	 * The number of IP datagrams abandoned because not all
+	 * fragments arrived within the reassembly timeout.  This is
+	 * not part of the MIB; such failures are also included within
+	 * ipSystemStatsReasmFails.
+	 */
+	unsigned long reasm_timeouts;
+	/** Reassembly overlaps
+	 *
+	 * The number of IP fragments discarded because they overlapped
+	 * data already received for the same datagram.  This is not
+	 * part of the MIB.
+	 */
+	unsigned long reasm_overlaps;
 	/** ipSystemStatsInDelivers
 	 *
 	 * The total number of datagrams successfully delivered to IP
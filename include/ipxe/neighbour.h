@@ -39,6 +39,8 @@ struct neighbour {
 	struct refcnt refcnt;
 	/** List of neighbour cache entries */
 	struct list_head list;
+	/** Next entry in neighbour cache hash bucket */
+	struct neighbour *hash_next;
 
 	/** Network device */
 	struct net_device *netdev;
@@ -409,6 +409,8 @@ struct net_device {
 	struct list_head tx_deferred;
 	/** RX packet queue */
 	struct list_head rx_queue;
+	/** Number of packets in RX queue */
+	unsigned int rx_queue_len;
 	/** TX statistics */
 	struct net_device_stats tx_stats;
 	/** RX statistics */
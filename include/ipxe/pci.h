@@ -314,6 +314,13 @@ struct pci_device {
 	void *priv;
 	/** Driver device ID */
 	struct pci_device_id *id;
+	/** Probe status code
+	 *
+	 * This is -EINPROGRESS while an asynchronous probe is in
+	 * progress, and holds the final probe status code once the
+	 * probe has completed.
+	 */
+	int probe_rc;
 };
 
 /** A PCI driver */
@@ -327,12 +334,19 @@ struct pci_driver {
 	 *
 	 * @v pci	PCI device
 	 * @ret rc	Return status code
+	 *
+	 * The driver may return -EINPROGRESS to indicate that probing
+	 * will complete asynchronously, in which case it must later
+	 * call pci_probe_complete().
 	 */
 	int ( * probe ) ( struct pci_device *pci );
 	/**
 	 * Remove device
 	 *
 	 * @v pci	PCI device
+	 *
+	 * If the probe is still in progress, the driver must abort it
+	 * and call pci_probe_complete().
 	 */
 	void ( * remove ) ( struct pci_device *pci );
 };
@@ -389,8 +403,11 @@ extern int pci_read_config ( struct pci_device *pci );
 extern int pci_find_next ( struct pci_device *pci, unsigned int busdevfn );
 extern int pci_find_driver ( struct pci_device *pci );
 extern int pci_probe ( struct pci_device *pci );
+extern void pci_probe_complete ( struct pci_device *pci, int rc );
 extern void pci_remove ( struct pci_device *pci );
 extern int pci_find_capability ( struct pci_device *pci, int capability );
+extern int pci_find_next_capability ( struct pci_device *pci,
+				      int pos, int capability );
 extern unsigned long pci_bar_size ( struct pci_device *pci, unsigned int reg );
 
 /**
@@ -18,6 +18,13 @@ FILE_LICENCE ( GPL2_OR_LATER );
 /** Maximum file descriptor that will ever be allocated */
 #define POSIX_FD_MAX ( 31 )
 
+/** Maximum amount of received data to queue ahead of the reader
+ *
+ * Data transfer continues in the background of each read call until
+ * this much data is waiting to be read.
+ */
+#define POSIX_READAHEAD_MAX ( 256 * 1024 )
+
 /** File descriptor set as used for select() */
 typedef uint32_t fd_set;
 
@@ -11,6 +11,7 @@ FILE_LICENCE ( GPL2_OR_LATER );
 
 #include <bits/profile.h>
 #include <ipxe/tables.h>
+#include <config/general.h>
 
 #ifdef NDEBUG
 #define PROFILING 0
@@ -18,6 +19,27 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #define PROFILING 1
 #endif
 
+/** Number of linear sub-buckets per power of two (log2) */
+#define PROFILE_HIST_SUB_BITS 2
+
+/** Highest sample MSB with its own histogram buckets
+ *
+ * Larger samples are counted in the final bucket.
+ */
+#define PROFILE_HIST_MAX_MSB 31
+
+/** Number of buckets in a complete histogram */
+#define PROFILE_HIST_MAX_BUCKETS \
+	( ( PROFILE_HIST_MAX_MSB - PROFILE_HIST_SUB_BITS + 2U ) \
+	  << PROFILE_HIST_SUB_BITS )
+
+/** Number of histogram buckets recorded by each profiler */
+#ifdef PROFILE_HISTOGRAMS
+#define PROFILE_HIST_BUCKETS PROFILE_HIST_MAX_BUCKETS
+#else
+#define PROFILE_HIST_BUCKETS 0U
+#endif
+
 /**
  * A data structure for storing profiling information
  */
@@ -46,6 +68,15 @@ struct profiler {
 	 * (i.e. one less than would be returned by flsll(raw_accvar)).
 	 */
 	unsigned int accvar_msb;
+	/** Maximum sample value */
+	unsigned long max;
+	/** Log-linear sample histogram
+	 *
+	 * Samples below 2^(PROFILE_HIST_SUB_BITS+1) have a bucket
+	 * each; above that, each power of two is split into
+	 * 2^PROFILE_HIST_SUB_BITS equal buckets.
+	 */
+	unsigned int hist[PROFILE_HIST_BUCKETS];
 };
 
 /** Profiler table */
@@ -64,6 +95,16 @@ extern void profile_update ( struct profiler *profiler, unsigned long sample );
 extern unsigned long profile_mean ( struct profiler *profiler );
 extern unsigned long profile_variance ( struct profiler *profiler );
 extern unsigned long profile_stddev ( struct profiler *profiler );
+extern unsigned long profile_percentile ( struct profiler *profiler,
+					  unsigned int percent );
+extern void profile_reset ( struct profiler *profiler );
+extern unsigned int profile_hist_index ( unsigned long sample );
+extern unsigned long profile_hist_limit ( unsigned int index );
+extern unsigned long profile_hist_percentile ( const unsigned int *hist,
+					       unsigned int buckets,
+					       unsigned long count,
+					       unsigned long max,
+					       unsigned int percent );
 
 /**
  * Get start time
@@ -25,6 +25,26 @@ struct ip_statistics;
  */
 #define TCPIP_EMPTY_CSUM 0xffff
 
+/** Number of port demultiplexing hash buckets (must be a power of two) */
+#define TCPIP_PORT_HASH_SIZE 64
+
+/**
+ * Calculate port demultiplexing hash bucket
+ *
+ * @v port		Port number (in host byte order)
+ * @ret bucket		Hash bucket index
+ *
+ * Ports allocated by tcpip_bind() are consecutive, and so map to
+ * distinct buckets.  Higher-order bits are folded in so that ports
+ * sharing a common stride still spread across the table.
+ */
+static inline __attribute__ (( always_inline )) unsigned int
+tcpip_port_hash ( unsigned int port ) {
+
+	return ( ( port ^ ( port >> 6 ) ^ ( port >> 12 ) ) &
+		 ( TCPIP_PORT_HASH_SIZE - 1 ) );
+}
+
 /** TCP/IP address flags */
 enum tcpip_st_flags {
 	/** Bind to a privileged port (less than 1024)
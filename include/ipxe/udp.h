@@ -41,5 +41,7 @@ extern int udp_open_promisc ( struct interface *xfer );
 extern int udp_open ( struct interface *xfer, struct sockaddr *peer,
 		      struct sockaddr *local );
 
+extern struct tcpip_protocol udp_protocol __tcpip_protocol;
+
 #endif /* _IPXE_UDP_H */
 
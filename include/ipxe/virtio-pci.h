@@ -1,6 +1,10 @@
 #ifndef _VIRTIO_PCI_H_
 # define _VIRTIO_PCI_H_
 
+#include <unistd.h>
+#include <byteswap.h>
+#include <ipxe/io.h>
+
 /* A 32-bit r/o bitmask of the features supported by the host */
 #define VIRTIO_PCI_HOST_FEATURES        0
 
@@ -37,6 +41,92 @@
 /* Virtio ABI version, this must match exactly */
 #define VIRTIO_PCI_ABI_VERSION          0
 
+/* PCI capability types: */
+#define VIRTIO_PCI_CAP_COMMON_CFG       1  /* Common configuration */
+#define VIRTIO_PCI_CAP_NOTIFY_CFG       2  /* Notifications */
+#define VIRTIO_PCI_CAP_ISR_CFG          3  /* ISR access */
+#define VIRTIO_PCI_CAP_DEVICE_CFG       4  /* Device specific configuration */
+#define VIRTIO_PCI_CAP_PCI_CFG          5  /* PCI configuration access */
+
+/* This is the PCI capability header: */
+struct virtio_pci_cap {
+    u8 cap_vndr;                  /* Generic PCI field: PCI_CAP_ID_VNDR */
+    u8 cap_next;                  /* Generic PCI field: next ptr. */
+    u8 cap_len;                   /* Generic PCI field: capability length */
+    u8 cfg_type;                  /* Identifies the structure. */
+    u8 bar;                       /* Where to find it. */
+    u8 padding[3];                /* Pad to full dword. */
+    u32 offset;                   /* Offset within bar. */
+    u32 length;                   /* Length of the structure, in bytes. */
+};
+
+struct virtio_pci_notify_cap {
+    struct virtio_pci_cap cap;
+    u32 notify_off_multiplier;    /* Multiplier for queue_notify_off. */
+};
+
+/* Fields in VIRTIO_PCI_CAP_COMMON_CFG: */
+struct virtio_pci_common_cfg {
+    /* About the whole device. */
+    u32 device_feature_select;    /* read-write */
+    u32 device_feature;           /* read-only */
+    u32 guest_feature_select;     /* read-write */
+    u32 guest_feature;            /* read-write */
+    u16 msix_config;              /* read-write */
+    u16 num_queues;               /* read-only */
+    u8 device_status;             /* read-write */
+    u8 config_generation;         /* read-only */
+
+    /* About a specific virtqueue. */
+    u16 queue_select;             /* read-write */
+    u16 queue_size;               /* read-write, power of 2. */
+    u16 queue_msix_vector;        /* read-write */
+    u16 queue_enable;             /* read-write */
+    u16 queue_notify_off;         /* read-only */
+    u32 queue_desc_lo;            /* read-write */
+    u32 queue_desc_hi;            /* read-write */
+    u32 queue_avail_lo;           /* read-write */
+    u32 queue_avail_hi;           /* read-write */
+    u32 queue_used_lo;            /* read-write */
+    u32 queue_used_hi;            /* read-write */
+};
+
+/* Virtio 1.0 PCI region descriptor. We support memory mapped I/O
+ * and port I/O regions.
+ */
+struct virtio_pci_region {
+    void *base;
+    size_t length;
+    u8 bar;
+
+/* How to interpret the base field */
+#define VIRTIO_PCI_REGION_TYPE_MASK  0x00000003
+/* The base field is a memory address */
+#define VIRTIO_PCI_REGION_MEMORY     0x00000001
+/* The base field is a port address */
+#define VIRTIO_PCI_REGION_PORT       0x00000002
+    unsigned flags;
+};
+
+/* Virtio 1.0 device state */
+struct virtio_pci_modern_device {
+    struct pci_device *pci;
+
+    /* VIRTIO_PCI_CAP_NOTIFY_CFG position */
+    int notify_cap_pos;
+
+    /* Common configuration */
+    struct virtio_pci_region common;
+
+    /* Device-specific configuration */
+    struct virtio_pci_region device;
+
+    /* ISR status */
+    struct virtio_pci_region isr;
+};
+
+struct vring_virtqueue;
+
 static inline u32 vp_get_features(unsigned int ioaddr)
 {
    return inl(ioaddr + VIRTIO_PCI_HOST_FEATURES);
@@ -98,4 +188,142 @@ static inline void vp_del_vq(unsigned int ioaddr, int queue_index)
 
 int vp_find_vq(unsigned int ioaddr, int queue_index,
                struct vring_virtqueue *vq);
+
+/* Virtio 1.0 I/O routines abstract away the three possible HW access
+ * mechanisms - memory and port I/O.
+ */
+static inline u8 vpm_ioread8(struct virtio_pci_region *region, size_t offset)
+{
+   if (region->flags & VIRTIO_PCI_REGION_PORT)
+           return inb(region->base + offset);
+   return readb(region->base + offset);
+}
+
+static inline u16 vpm_ioread16(struct virtio_pci_region *region,
+                               size_t offset)
+{
+   if (region->flags & VIRTIO_PCI_REGION_PORT)
+           return le16_to_cpu(inw(region->base + offset));
+   return le16_to_cpu(readw(region->base + offset));
+}
+
+static inline u32 vpm_ioread32(struct virtio_pci_region *region,
+                               size_t offset)
+{
+   if (region->flags & VIRTIO_PCI_REGION_PORT)
+           return le32_to_cpu(inl(region->base + offset));
+   return le32_to_cpu(readl(region->base + offset));
+}
+
+static inline void vpm_iowrite8(struct virtio_pci_region *region,
+                                u8 data, size_t offset)
+{
+   if (region->flags & VIRTIO_PCI_REGION_PORT)
+           outb(data, region->base + offset);
+   else
+           writeb(data, region->base + offset);
+}
+
+static inline void vpm_iowrite16(struct virtio_pci_region *region,
+                                 u16 data, size_t offset)
+{
+   data = cpu_to_le16(data);
+   if (region->flags & VIRTIO_PCI_REGION_PORT)
+           outw(data, region->base + offset);
+   else
+           writew(data, region->base + offset);
+}
+
+static inline void vpm_iowrite32(struct virtio_pci_region *region,
+                                 u32 data, size_t offset)
+{
+   data = cpu_to_le32(data);
+   if (region->flags & VIRTIO_PCI_REGION_PORT)
+           outl(data, region->base + offset);
+   else
+           writel(data, region->base + offset);
+}
+
+static inline void vpm_iowrite64(struct virtio_pci_region *region,
+                                 u64 data, size_t offset_lo, size_t offset_hi)
+{
+   vpm_iowrite32(region, (u32)data, offset_lo);
+   vpm_iowrite32(region, data >> 32, offset_hi);
+}
+
+#define COMMON_OFFSET(field) offsetof(struct virtio_pci_common_cfg, field)
+
+static inline void vpm_reset(struct virtio_pci_modern_device *vdev)
+{
+   vpm_iowrite8(&vdev->common, 0, COMMON_OFFSET(device_status));
+   while (vpm_ioread8(&vdev->common, COMMON_OFFSET(device_status)))
+           mdelay(1);
+}
+
+static inline u8 vpm_get_status(struct virtio_pci_modern_device *vdev)
+{
+   return vpm_ioread8(&vdev->common, COMMON_OFFSET(device_status));
+}
+
+static inline void vpm_add_status(struct virtio_pci_modern_device *vdev,
+                                  u8 status)
+{
+   u8 curr_status;
+
+   curr_status = vpm_ioread8(&vdev->common, COMMON_OFFSET(device_status));
+   vpm_iowrite8(&vdev->common, (curr_status | status),
+                COMMON_OFFSET(device_status));
+}
+
+static inline u64 vpm_get_features(struct virtio_pci_modern_device *vdev)
+{
+   u32 features_lo, features_hi;
+
+   vpm_iowrite32(&vdev->common, 0, COMMON_OFFSET(device_feature_select));
+   features_lo = vpm_ioread32(&vdev->common, COMMON_OFFSET(device_feature));
+   vpm_iowrite32(&vdev->common, 1, COMMON_OFFSET(device_feature_select));
+   features_hi = vpm_ioread32(&vdev->common, COMMON_OFFSET(device_feature));
+
+   return ((u64)features_hi << 32) | features_lo;
+}
+
+static inline void vpm_set_features(struct virtio_pci_modern_device *vdev,
+                                    u64 features)
+{
+   u32 features_lo = (u32)features;
+   u32 features_hi = features >> 32;
+
+   vpm_iowrite32(&vdev->common, 0, COMMON_OFFSET(guest_feature_select));
+   vpm_iowrite32(&vdev->common, features_lo, COMMON_OFFSET(guest_feature));
+   vpm_iowrite32(&vdev->common, 1, COMMON_OFFSET(guest_feature_select));
+   vpm_iowrite32(&vdev->common, features_hi, COMMON_OFFSET(guest_feature));
+}
+
+static inline void vpm_get(struct virtio_pci_modern_device *vdev,
+                           unsigned offset, void *buf, unsigned len)
+{
+   u8 *ptr = buf;
+   unsigned i;
+
+   for (i = 0; i < len; i++)
+           ptr[i] = vpm_ioread8(&vdev->device, offset + i);
+}
+
+static inline u8 vpm_get_isr(struct virtio_pci_modern_device *vdev)
+{
+   return vpm_ioread8(&vdev->isr, 0);
+}
+
+void vpm_notify(struct vring_virtqueue *vq);
+
+int vpm_find_vqs(struct virtio_pci_modern_device *vdev,
+                 unsigned nvqs, struct vring_virtqueue *vqs);
+
+int virtio_pci_find_capability(struct pci_device *pci, uint8_t cfg_type);
+
+int virtio_pci_map_capability(struct pci_device *pci, int cap, size_t minlen,
+                              u32 align, u32 start, u32 size,
+                              struct virtio_pci_region *region);
+
+void virtio_pci_unmap_capability(struct virtio_pci_region *region);
 #endif /* _VIRTIO_PCI_H_ */
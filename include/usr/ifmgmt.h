@@ -25,4 +25,6 @@ extern void ifstat ( struct net_device *netdev );
 extern int iflinkwait ( struct net_device *netdev, unsigned long timeout );
 extern int ifnetwork_wait ( struct net_device *netdev, unsigned long link_to,
 					unsigned long network_to );
+extern int ifconf_race ( struct net_device * ( * select ) ( struct net_device * ),
+			 struct net_device **winner );
 #endif /* _USR_IFMGMT_H */
@@ -0,0 +1,20 @@
+#ifndef _USR_NETBENCH_H
+#define _USR_NETBENCH_H
+
+/** @file
+ *
+ * Network throughput benchmarking
+ *
+ */
+
+FILE_LICENCE ( GPL2_OR_LATER );
+
+struct uri;
+
+/** Read URI as a block device */
+#define NETBENCH_BLOCK 0x0001
+
+extern int netbench ( struct uri *uri, unsigned int flags,
+		      unsigned long timeout );
+
+#endif /* _USR_NETBENCH_H */
@@ -10,5 +10,7 @@
 FILE_LICENCE ( GPL2_OR_LATER );
 
 extern void profstat ( void );
+extern void profstat_log ( void );
+extern void profstat_reset ( void );
 
 #endif /* _USR_PROFSTAT_H */
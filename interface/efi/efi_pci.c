@@ -316,12 +316,26 @@ static int efipci_start ( struct efi_device *efidev ) {
 		       pci->id->name, strerror ( rc ) );
 		goto err_probe;
 	}
+
+	/* Wait for any asynchronous probe to complete.  Nothing else
+	 * will step the main loop before the EFI driver model expects
+	 * the device's protocols to have been installed.
+	 */
+	device_probe_wait();
+	if ( ( rc = pci->probe_rc ) != 0 ) {
+		DBGC ( device, "EFIPCI %p %s could not complete probe of "
+		       "driver \"%s\": %s\n", device,
+		       efi_handle_name ( device ), pci->id->name,
+		       strerror ( rc ) );
+		goto err_probe_complete;
+	}
 	DBGC ( device, "EFIPCI %p %s using driver \"%s\"\n",
 	       device, efi_handle_name ( device ), pci->id->name );
 
 	efidev_set_drvdata ( efidev, pci );
 	return 0;
 
+ err_probe_complete:
 	pci_remove ( pci );
  err_probe:
 	list_del ( &pci->dev.siblings );
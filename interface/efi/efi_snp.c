@@ -103,20 +103,18 @@ static void efi_snp_set_mode ( struct efi_snp_device *snpdev ) {
  * @v snpdev		SNP device
  */
 static void efi_snp_poll ( struct efi_snp_device *snpdev ) {
-	struct io_buffer *iobuf;
-	unsigned int before = 0;
-	unsigned int after = 0;
+	struct net_device *netdev = snpdev->netdev;
+	unsigned int before;
 	unsigned int arrived;
 
 	/* We have to report packet arrivals, and this is the easiest
-	 * way to fake it.
+	 * way to fake it.  Polling cannot remove packets from the RX
+	 * queue, so the change in queue length is the number of
+	 * arrivals.
 	 */
-	list_for_each_entry ( iobuf, &snpdev->netdev->rx_queue, list )
-		before++;
-	netdev_poll ( snpdev->netdev );
-	list_for_each_entry ( iobuf, &snpdev->netdev->rx_queue, list )
-		after++;
-	arrived = ( after - before );
+	before = netdev->rx_queue_len;
+	netdev_poll ( netdev );
+	arrived = ( netdev->rx_queue_len - before );
 
 	snpdev->rx_count_interrupts += arrived;
 	snpdev->rx_count_events += arrived;
@@ -672,8 +670,9 @@ efi_snp_receive ( EFI_SIMPLE_NETWORK_PROTOCOL *snp,
 	if ( efi_snp_claimed )
 		return EFI_NOT_READY;
 
-	/* Poll the network device */
-	efi_snp_poll ( snpdev );
+	/* Poll the network device, unless a packet is already waiting */
+	if ( ! snpdev->netdev->rx_queue_len )
+		efi_snp_poll ( snpdev );
 
 	/* Dequeue a packet, if one is available */
 	iobuf = netdev_rx_dequeue ( snpdev->netdev );
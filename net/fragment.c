@@ -22,6 +22,7 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <ipxe/retry.h>
 #include <ipxe/timer.h>
 #include <ipxe/ipstat.h>
@@ -31,7 +32,35 @@ FILE_LICENCE ( GPL2_OR_LATER );
  *
  * Fragment reassembly
  *
+ * Each reassembler owns a small pool of reassembly buffers.  The
+ * reassembled packet is allocated once, sized from the final
+ * fragment or from a protocol-supplied hint, and each fragment is
+ * copied directly into place as it arrives.  Fragments may therefore
+ * arrive in any order; received blocks are tracked using a bitmap.
+ *
+ */
+
+/** Additional headroom reserved in front of the reassembled packet
+ *
+ * The non-fragmentable portion is taken from whichever fragment
+ * arrives first, and is replaced by that of the first fragment when
+ * it arrives.  An IPv4 first fragment may carry up to 40 bytes of
+ * options which are not copied into subsequent fragments.
+ */
+#define FRAGMENT_HDR_SLACK 40
+
+/**
+ * Free fragment reassembly buffer
+ *
+ * @v fragment		Fragment reassembly buffer
  */
+static void fragment_free ( struct fragment *fragment ) {
+
+	stop_timer ( &fragment->timer );
+	free_iob ( fragment->iobuf );
+	fragment->iobuf = NULL;
+	list_del ( &fragment->list );
+}
 
 /**
  * Expire fragment reassembly buffer
@@ -42,12 +71,13 @@ FILE_LICENCE ( GPL2_OR_LATER );
 static void fragment_expired ( struct retry_timer *timer, int fail __unused ) {
 	struct fragment *fragment =
 		container_of ( timer, struct fragment, timer );
+	struct ip_statistics *stats = fragment->fragments->stats;
 
-	DBGC ( fragment, "FRAG %p expired\n", fragment );
-	free_iob ( fragment->iobuf );
-	list_del ( &fragment->list );
-	fragment->fragments->stats->reasm_fails++;
-	free ( fragment );
+	DBGC ( fragment, "FRAG %p expired with %zd bytes received\n",
+	       fragment, fragment->received );
+	fragment_free ( fragment );
+	stats->reasm_timeouts++;
+	stats->reasm_fails++;
 }
 
 /**
@@ -70,6 +100,149 @@ static struct fragment * fragment_find ( struct fragment_reassembler *fragments,
 	return NULL;
 }
 
+/**
+ * Resize fragment reassembly buffer
+ *
+ * @v fragment		Fragment reassembly buffer
+ * @v headroom		Headroom to reserve before non-fragmentable portion
+ * @v capacity		New payload capacity
+ * @ret rc		Return status code
+ *
+ * The non-fragmentable portion and any payload already received are
+ * preserved.
+ */
+static int fragment_resize ( struct fragment *fragment, size_t headroom,
+			     size_t capacity ) {
+	struct io_buffer *old_iobuf = fragment->iobuf;
+	struct io_buffer *new_iobuf;
+
+	/* Allocate new buffer */
+	new_iobuf = alloc_iob ( headroom + fragment->hdrlen + capacity );
+	if ( ! new_iobuf ) {
+		DBGC ( fragment, "FRAG %p could not allocate %zd-byte "
+		       "reassembly buffer\n", fragment, capacity );
+		return -ENOMEM;
+	}
+	iob_reserve ( new_iobuf, headroom );
+	iob_put ( new_iobuf, fragment->hdrlen );
+
+	/* Copy existing contents, if any */
+	if ( old_iobuf ) {
+		memcpy ( new_iobuf->data, old_iobuf->data,
+			 ( fragment->hdrlen + fragment->capacity ) );
+		free_iob ( old_iobuf );
+	}
+
+	fragment->iobuf = new_iobuf;
+	fragment->capacity = capacity;
+	return 0;
+}
+
+/**
+ * Create fragment reassembly buffer
+ *
+ * @v fragments		Fragment reassembler
+ * @v iobuf		I/O buffer
+ * @v hdrlen		Length of non-fragmentable potion of I/O buffer
+ * @v offset		Fragment offset
+ * @v end		Fragment end offset
+ * @v more_frags	More fragments exist
+ * @ret fragment	Fragment reassembly buffer, or NULL on error
+ */
+static struct fragment *
+fragment_create ( struct fragment_reassembler *fragments,
+		  struct io_buffer *iobuf, size_t hdrlen, size_t offset,
+		  size_t end, int more_frags ) {
+	struct fragment *fragment;
+	size_t capacity;
+	size_t hint;
+	unsigned int i;
+
+	/* Find an unused reassembly buffer */
+	for ( i = 0 ; i < FRAGMENT_MAX_BUFFERS ; i++ ) {
+		fragment = &fragments->buffers[i];
+		if ( ! fragment->iobuf )
+			break;
+	}
+	if ( i == FRAGMENT_MAX_BUFFERS ) {
+		DBGC ( fragments, "FRAG %p has no free reassembly buffers\n",
+		       fragments );
+		return NULL;
+	}
+	memset ( fragment, 0, sizeof ( *fragment ) );
+	fragment->hdrlen = hdrlen;
+	fragment->have_first = ( offset == 0 );
+	timer_init ( &fragment->timer, fragment_expired, NULL );
+	fragment->fragments = fragments;
+
+	/* Size the reassembled payload.  Use the exact length if this
+	 * is the final fragment, otherwise use the protocol's hint if
+	 * available, otherwise guess and grow later if necessary.
+	 */
+	if ( ! more_frags ) {
+		capacity = end;
+	} else {
+		hint = ( fragments->payload_len ?
+			 fragments->payload_len ( iobuf, hdrlen ) : 0 );
+		if ( ( hint >= end ) && ( hint <= FRAGMENT_MAX_LEN ) ) {
+			capacity = hint;
+		} else {
+			capacity = ( 2 * end );
+			if ( capacity > FRAGMENT_MAX_LEN )
+				capacity = FRAGMENT_MAX_LEN;
+		}
+	}
+
+	/* Allocate reassembled packet.  Preserve I/O buffer headroom
+	 * to allow for code which modifies and resends the buffer
+	 * (e.g. ICMP echo responses).
+	 */
+	if ( fragment_resize ( fragment, ( iob_headroom ( iobuf ) +
+					   FRAGMENT_HDR_SLACK ),
+			       capacity ) != 0 )
+		return NULL;
+	memcpy ( fragment->iobuf->data, iobuf->data, hdrlen );
+
+	list_add ( &fragment->list, &fragments->list );
+	DBGC ( fragment, "FRAG %p created with %zd-byte capacity\n",
+	       fragment, capacity );
+	return fragment;
+}
+
+/**
+ * Check if fragment blocks have already been received
+ *
+ * @v fragment		Fragment reassembly buffer
+ * @v first		First block
+ * @v last		Last block (exclusive)
+ * @ret overlaps	Some blocks have already been received
+ */
+static int fragment_overlaps ( struct fragment *fragment, unsigned int first,
+			       unsigned int last ) {
+	unsigned int block;
+
+	for ( block = first ; block < last ; block++ ) {
+		if ( fragment->blocks[ block / 32 ] & ( 1UL << ( block % 32 ) ) )
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Mark fragment blocks as received
+ *
+ * @v fragment		Fragment reassembly buffer
+ * @v first		First block
+ * @v last		Last block (exclusive)
+ */
+static void fragment_mark ( struct fragment *fragment, unsigned int first,
+			    unsigned int last ) {
+	unsigned int block;
+
+	for ( block = first ; block < last ; block++ )
+		fragment->blocks[ block / 32 ] |= ( 1UL << ( block % 32 ) );
+}
+
 /**
  * Reassemble packet
  *
@@ -85,87 +258,119 @@ struct io_buffer * fragment_reassemble ( struct fragment_reassembler *fragments,
 					 struct io_buffer *iobuf,
 					 size_t *hdrlen ) {
 	struct fragment *fragment;
-	struct io_buffer *new_iobuf;
-	size_t new_len;
 	size_t offset;
-	size_t expected_offset;
+	size_t len;
+	size_t end;
+	size_t capacity;
+	unsigned int first;
+	unsigned int last;
 	int more_frags;
 
 	/* Update statistics */
 	fragments->stats->reasm_reqds++;
 
-	/* Find matching fragment reassembly buffer, if any */
-	fragment = fragment_find ( fragments, iobuf, *hdrlen );
-
-	/* Drop out-of-order fragments */
+	/* Sanity check */
 	offset = fragments->fragment_offset ( iobuf, *hdrlen );
-	expected_offset = ( fragment ? ( iob_len ( fragment->iobuf ) -
-					 fragment->hdrlen ) : 0 );
-	if ( offset != expected_offset ) {
-		DBGC ( fragment, "FRAG %p dropping out-of-sequence fragment "
-		       "[%zd,%zd), expected [%zd,...)\n", fragment, offset,
-		       ( offset + iob_len ( iobuf ) - *hdrlen ),
-		       expected_offset );
+	more_frags = fragments->more_fragments ( iobuf, *hdrlen );
+	len = ( iob_len ( iobuf ) - *hdrlen );
+	end = ( offset + len );
+	if ( ( offset % FRAGMENT_BLOCK_SIZE ) ||
+	     ( more_frags && ( len % FRAGMENT_BLOCK_SIZE ) ) ||
+	     ( end > FRAGMENT_MAX_LEN ) ) {
+		DBGC ( fragments, "FRAG %p dropping malformed fragment "
+		       "[%zd,%zd)\n", fragments, offset, end );
 		goto drop;
 	}
 
-	/* Create or extend fragment reassembly buffer as applicable */
+	/* Find or create matching fragment reassembly buffer */
+	fragment = fragment_find ( fragments, iobuf, *hdrlen );
 	if ( ! fragment ) {
-
-		/* Create new fragment reassembly buffer */
-		fragment = zalloc ( sizeof ( *fragment ) );
+		fragment = fragment_create ( fragments, iobuf, *hdrlen,
+					     offset, end, more_frags );
 		if ( ! fragment )
 			goto drop;
-		list_add ( &fragment->list, &fragments->list );
-		fragment->iobuf = iobuf;
-		fragment->hdrlen = *hdrlen;
-		timer_init ( &fragment->timer, fragment_expired, NULL );
-		fragment->fragments = fragments;
-		DBGC ( fragment, "FRAG %p [0,%zd)\n", fragment,
-		       ( iob_len ( iobuf ) - *hdrlen ) );
+	}
 
-	} else {
+	/* Check consistency with the final fragment */
+	if ( ( fragment->total && ( end > fragment->total ) ) ||
+	     ( ( ! more_frags ) &&
+	       ( ( fragment->total && ( end != fragment->total ) ) ||
+		 ( end < fragment->end ) ) ) ) {
+		DBGC ( fragment, "FRAG %p dropping inconsistent fragment "
+		       "[%zd,%zd)%s\n", fragment, offset, end,
+		       ( more_frags ? "" : " final" ) );
+		goto drop;
+	}
 
-		/* Check if this is the final fragment */
-		more_frags = fragments->more_fragments ( iobuf, *hdrlen );
-		DBGC ( fragment, "FRAG %p [%zd,%zd)%s\n", fragment,
-		       offset, ( offset + iob_len ( iobuf ) - *hdrlen ),
-		       ( more_frags ? "" : " complete" ) );
-
-		/* Extend fragment reassembly buffer.  Preserve I/O
-		 * buffer headroom to allow for code which modifies
-		 * and resends the buffer (e.g. ICMP echo responses).
-		 */
-		iob_pull ( iobuf, *hdrlen );
-		new_len = ( iob_headroom ( fragment->iobuf ) +
-			    iob_len ( fragment->iobuf ) + iob_len ( iobuf ) );
-		new_iobuf = alloc_iob ( new_len );
-		if ( ! new_iobuf ) {
-			DBGC ( fragment, "FRAG %p could not extend reassembly "
-			       "buffer to %zd bytes\n", fragment, new_len );
-			goto drop;
-		}
-		iob_reserve ( new_iobuf, iob_headroom ( fragment->iobuf ) );
-		memcpy ( iob_put ( new_iobuf, iob_len ( fragment->iobuf ) ),
-			 fragment->iobuf->data, iob_len ( fragment->iobuf ) );
-		memcpy ( iob_put ( new_iobuf, iob_len ( iobuf ) ),
-			 iobuf->data, iob_len ( iobuf ) );
-		free_iob ( fragment->iobuf );
-		fragment->iobuf = new_iobuf;
+	/* Drop fragments overlapping data already received */
+	first = ( offset / FRAGMENT_BLOCK_SIZE );
+	last = ( ( end + FRAGMENT_BLOCK_SIZE - 1 ) / FRAGMENT_BLOCK_SIZE );
+	if ( fragment_overlaps ( fragment, first, last ) ) {
+		DBGC ( fragment, "FRAG %p dropping overlapping fragment "
+		       "[%zd,%zd)\n", fragment, offset, end );
+		fragments->stats->reasm_overlaps++;
 		free_iob ( iobuf );
+		return NULL;
+	}
+	if ( ! more_frags )
+		fragment->total = end;
 
-		/* Stop fragment reassembly timer */
-		stop_timer ( &fragment->timer );
-
-		/* If this is the final fragment, return it */
-		if ( ! more_frags ) {
-			iobuf = fragment->iobuf;
-			*hdrlen = fragment->hdrlen;
-			list_del ( &fragment->list );
-			free ( fragment );
-			fragments->stats->reasm_oks++;
-			return iobuf;
+	/* Grow reassembly buffer if our estimate was too small */
+	if ( end > fragment->capacity ) {
+		capacity = ( 2 * fragment->capacity );
+		if ( capacity > FRAGMENT_MAX_LEN )
+			capacity = FRAGMENT_MAX_LEN;
+		if ( capacity < end )
+			capacity = end;
+		if ( fragment->total )
+			capacity = fragment->total;
+		if ( fragment_resize ( fragment,
+				       iob_headroom ( fragment->iobuf ),
+				       capacity ) != 0 )
+			goto drop;
+	}
+
+	/* Use the first fragment's non-fragmentable portion, which
+	 * may differ in length from that of subsequent fragments.
+	 */
+	if ( ( offset == 0 ) && ( ! fragment->have_first ) ) {
+		if ( *hdrlen > ( fragment->hdrlen +
+				 iob_headroom ( fragment->iobuf ) ) ) {
+			DBGC ( fragment, "FRAG %p cannot accommodate %zd-byte "
+			       "header\n", fragment, *hdrlen );
+			goto drop;
 		}
+		iob_pull ( fragment->iobuf, fragment->hdrlen );
+		iob_push ( fragment->iobuf, *hdrlen );
+		memcpy ( fragment->iobuf->data, iobuf->data, *hdrlen );
+		fragment->hdrlen = *hdrlen;
+		fragment->have_first = 1;
+	}
+
+	/* Copy fragment directly into place */
+	memcpy ( ( fragment->iobuf->data + fragment->hdrlen + offset ),
+		 ( iobuf->data + *hdrlen ), len );
+	fragment_mark ( fragment, first, last );
+	fragment->received += len;
+	if ( end > fragment->end )
+		fragment->end = end;
+	free_iob ( iobuf );
+	DBGC ( fragment, "FRAG %p [%zd,%zd)%s\n", fragment, offset, end,
+	       ( more_frags ? "" : " final" ) );
+
+	/* Stop fragment reassembly timer */
+	stop_timer ( &fragment->timer );
+
+	/* If all fragments have been received, return the packet */
+	if ( fragment->total && ( fragment->received == fragment->total ) ) {
+		iobuf = fragment->iobuf;
+		iob_put ( iobuf, fragment->total );
+		*hdrlen = fragment->hdrlen;
+		fragment->iobuf = NULL;
+		list_del ( &fragment->list );
+		fragments->stats->reasm_oks++;
+		DBGC ( fragment, "FRAG %p complete\n", fragment );
+		return iobuf;
 	}
 
 	/* (Re)start fragment reassembly timer */
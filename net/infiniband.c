@@ -34,6 +34,7 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <ipxe/netdevice.h>
 #include <ipxe/iobuf.h>
 #include <ipxe/process.h>
+#include <ipxe/profile.h>
 #include <ipxe/infiniband.h>
 #include <ipxe/ib_mi.h>
 #include <ipxe/ib_sma.h>
@@ -50,6 +51,14 @@ struct list_head ib_devices = LIST_HEAD_INIT ( ib_devices );
 /** List of open Infiniband devices, in reverse order of opening */
 static struct list_head open_ib_devices = LIST_HEAD_INIT ( open_ib_devices );
 
+/** Send batch size profiler */
+static struct profiler ib_send_batch_profiler __profiler =
+	{ .name = "ib.send_batch" };
+
+/** Receive refill batch size profiler */
+static struct profiler ib_refill_profiler __profiler =
+	{ .name = "ib.refill" };
+
 /* Disambiguate the various possible EINPROGRESSes */
 #define EINPROGRESS_INIT __einfo_error ( EINFO_EINPROGRESS_INIT )
 #define EINFO_EINPROGRESS_INIT __einfo_uniqify \
@@ -245,8 +254,14 @@ struct ib_queue_pair * ib_create_qp ( struct ib_device *ibdev,
 	if ( qp->ext_qpn != qp->qpn ) {
 		DBGC ( ibdev, "IBDEV %p QPN %#lx has external QPN %#lx\n",
 		       ibdev, qp->qpn, qp->ext_qpn );
+		list_add ( &qp->ext_list, &ibdev->ext_qps );
+	} else {
+		INIT_LIST_HEAD ( &qp->ext_list );
 	}
 
+	/* Add to queue pair number hash table */
+	list_add ( &qp->hash, &ibdev->qp_hash[ ib_qpn_hash ( qp->qpn ) ] );
+
 	return qp;
 
 	ibdev->op->destroy_qp ( ibdev, qp );
@@ -314,6 +329,10 @@ void ib_destroy_qp ( struct ib_device *ibdev, struct ib_queue_pair *qp ) {
 	list_del ( &qp->send.list );
 	list_del ( &qp->recv.list );
 
+	/* Remove from queue pair number hash table */
+	list_del ( &qp->hash );
+	list_del ( &qp->ext_list );
+
 	/* Free QP */
 	list_del ( &qp->list );
 	free ( qp );
@@ -330,8 +349,13 @@ struct ib_queue_pair * ib_find_qp_qpn ( struct ib_device *ibdev,
 					unsigned long qpn ) {
 	struct ib_queue_pair *qp;
 
-	list_for_each_entry ( qp, &ibdev->qps, list ) {
-		if ( ( qpn == qp->qpn ) || ( qpn == qp->ext_qpn ) )
+	list_for_each_entry ( qp, &ibdev->qp_hash[ ib_qpn_hash ( qpn ) ],
+			      hash ) {
+		if ( qpn == qp->qpn )
+			return qp;
+	}
+	list_for_each_entry ( qp, &ibdev->ext_qps, ext_list ) {
+		if ( qpn == qp->ext_qpn )
 			return qp;
 	}
 	return NULL;
@@ -370,10 +394,16 @@ struct ib_queue_pair * ib_find_qp_mgid ( struct ib_device *ibdev,
  */
 struct ib_work_queue * ib_find_wq ( struct ib_completion_queue *cq,
 				    unsigned long qpn, int is_send ) {
+	struct ib_device *ibdev = cq->ibdev;
+	struct ib_queue_pair *qp;
 	struct ib_work_queue *wq;
 
-	list_for_each_entry ( wq, &cq->work_queues, list ) {
-		if ( ( wq->qp->qpn == qpn ) && ( wq->is_send == is_send ) )
+	list_for_each_entry ( qp, &ibdev->qp_hash[ ib_qpn_hash ( qpn ) ],
+			      hash ) {
+		if ( qp->qpn != qpn )
+			continue;
+		wq = ( is_send ? &qp->send : &qp->recv );
+		if ( wq->cq == cq )
 			return wq;
 	}
 	return NULL;
@@ -421,21 +451,52 @@ int ib_post_send ( struct ib_device *ibdev, struct ib_queue_pair *qp,
 		       "%s\n", ibdev, qp->qpn, strerror ( rc ) );
 		return rc;
 	}
-
 	qp->send.fill++;
+
+	/* Notify hardware, unless a send batch is open */
+	if ( ibdev->op->ring_send ) {
+		qp->send_pending++;
+		if ( ! qp->send_batch )
+			ib_commit_send ( ibdev, qp );
+	}
+
 	return 0;
 }
 
 /**
- * Post receive work queue entry
+ * Commit batch of send work queue entries
+ *
+ * @v ibdev		Infiniband device
+ * @v qp		Queue pair
+ *
+ * The hardware is notified of all send work queue entries posted
+ * since the batch was opened by ib_begin_send(), and the batch is
+ * closed.  It is safe to call this function when no batch is open.
+ */
+void ib_commit_send ( struct ib_device *ibdev, struct ib_queue_pair *qp ) {
+
+	/* Close batch */
+	qp->send_batch = 0;
+
+	/* Notify hardware of any pending entries */
+	if ( qp->send_pending ) {
+		profile_update ( &ib_send_batch_profiler, qp->send_pending );
+		ibdev->op->ring_send ( ibdev, qp );
+		qp->send_pending = 0;
+	}
+}
+
+/**
+ * Post receive work queue entry without notifying hardware
  *
  * @v ibdev		Infiniband device
  * @v qp		Queue pair
  * @v iobuf		I/O buffer
  * @ret rc		Return status code
  */
-int ib_post_recv ( struct ib_device *ibdev, struct ib_queue_pair *qp,
-		   struct io_buffer *iobuf ) {
+static int ib_post_recv_wqe ( struct ib_device *ibdev,
+			     struct ib_queue_pair *qp,
+			     struct io_buffer *iobuf ) {
 	int rc;
 
 	/* Check packet length */
@@ -463,6 +524,37 @@ int ib_post_recv ( struct ib_device *ibdev, struct ib_queue_pair *qp,
 	return 0;
 }
 
+/**
+ * Notify hardware of new receive work queue entries
+ *
+ * @v ibdev		Infiniband device
+ * @v qp		Queue pair
+ */
+static inline void ib_ring_recv ( struct ib_device *ibdev,
+				  struct ib_queue_pair *qp ) {
+
+	if ( ibdev->op->ring_recv )
+		ibdev->op->ring_recv ( ibdev, qp );
+}
+
+/**
+ * Post receive work queue entry
+ *
+ * @v ibdev		Infiniband device
+ * @v qp		Queue pair
+ * @v iobuf		I/O buffer
+ * @ret rc		Return status code
+ */
+int ib_post_recv ( struct ib_device *ibdev, struct ib_queue_pair *qp,
+		   struct io_buffer *iobuf ) {
+	int rc;
+
+	if ( ( rc = ib_post_recv_wqe ( ibdev, qp, iobuf ) ) != 0 )
+		return rc;
+	ib_ring_recv ( ibdev, qp );
+	return 0;
+}
+
 /**
  * Complete send work queue entry
  *
@@ -511,9 +603,14 @@ void ib_complete_recv ( struct ib_device *ibdev, struct ib_queue_pair *qp,
  *
  * @v ibdev		Infiniband device
  * @v qp		Queue pair
+ *
+ * All unfilled entries are posted as a single batch, and the
+ * hardware is notified (if the device supports deferred
+ * notification) only once per batch.
  */
 void ib_refill_recv ( struct ib_device *ibdev, struct ib_queue_pair *qp ) {
 	struct io_buffer *iobuf;
+	unsigned int posted = 0;
 	int rc;
 
 	/* Keep filling while unfilled entries remain */
@@ -524,17 +621,24 @@ void ib_refill_recv ( struct ib_device *ibdev, struct ib_queue_pair *qp ) {
 		if ( ! iobuf ) {
 			DBGC ( ibdev, "IBDEV %p failed to allocate new buffer\n", ibdev );
 			/* Non-fatal; we will refill on next attempt */
-			return;
+			break;
 		}
 
 		/* Post I/O buffer */
-		if ( ( rc = ib_post_recv ( ibdev, qp, iobuf ) ) != 0 ) {
+		if ( ( rc = ib_post_recv_wqe ( ibdev, qp, iobuf ) ) != 0 ) {
 			DBGC ( ibdev, "IBDEV %p could not refill: %s\n",
 			       ibdev, strerror ( rc ) );
 			free_iob ( iobuf );
 			/* Give up */
-			return;
+			break;
 		}
+		posted++;
+	}
+
+	/* Notify hardware of all newly posted entries */
+	if ( posted ) {
+		profile_update ( &ib_refill_profiler, posted );
+		ib_ring_recv ( ibdev, qp );
 	}
 }
 
@@ -898,6 +1002,7 @@ struct ib_device * alloc_ibdev ( size_t priv_size ) {
 	struct ib_device *ibdev;
 	void *drv_priv;
 	size_t total_len;
+	unsigned int i;
 
 	total_len = ( sizeof ( *ibdev ) + priv_size );
 	ibdev = zalloc ( total_len );
@@ -908,6 +1013,9 @@ struct ib_device * alloc_ibdev ( size_t priv_size ) {
 		INIT_LIST_HEAD ( &ibdev->open_list );
 		INIT_LIST_HEAD ( &ibdev->cqs );
 		INIT_LIST_HEAD ( &ibdev->qps );
+		for ( i = 0 ; i < IB_QPN_HASH_SIZE ; i++ )
+			INIT_LIST_HEAD ( &ibdev->qp_hash[i] );
+		INIT_LIST_HEAD ( &ibdev->ext_qps );
 		ibdev->port_state = IB_PORT_STATE_DOWN;
 		ibdev->lid = IB_LID_NONE;
 		ibdev->pkey = IB_PKEY_DEFAULT;
@@ -24,6 +24,8 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <byteswap.h>
 #include <errno.h>
 #include <ipxe/list.h>
+#include <ipxe/timer.h>
+#include <ipxe/process.h>
 #include <ipxe/infiniband.h>
 #include <ipxe/ib_mi.h>
 #include <ipxe/ib_mcast.h>
@@ -34,6 +36,158 @@ FILE_LICENCE ( GPL2_OR_LATER );
  *
  */
 
+/** Number of multicast membership cache entries */
+#define IB_NUM_CACHED_MCAST 4
+
+/** Multicast membership cache entry lifetime
+ *
+ * A successfully joined group is not left when the queue pair leaves
+ * it, so that reopening the device (e.g. when chainloading or
+ * rerunning DHCP) can reuse the membership without another subnet
+ * administration query.  The membership is reused only while the
+ * local port's LID and subnet manager LID are unchanged, and for at
+ * most this length of time.
+ */
+#define IB_MCAST_CACHE_TTL ( 300 * TICKS_PER_SEC )
+
+/** A cached multicast group membership */
+struct ib_cached_mcast {
+	/** Infiniband device, or NULL for an empty entry */
+	struct ib_device *ibdev;
+	/** Multicast GID */
+	union ib_gid gid;
+	/** Queue key */
+	unsigned long qkey;
+	/** Local port LID at time of joining */
+	uint16_t lid;
+	/** Subnet manager LID at time of joining */
+	uint16_t sm_lid;
+	/** Time of joining (in ticks) */
+	unsigned long joined;
+	/** Link has been active since the device was last opened */
+	int active;
+};
+
+/** Multicast membership cache */
+static struct ib_cached_mcast ib_mcast_cache[IB_NUM_CACHED_MCAST];
+
+/** Oldest multicast membership cache entry index */
+static unsigned int ib_mcast_cache_idx;
+
+/**
+ * Find valid multicast membership cache entry
+ *
+ * @v ibdev		Infiniband device
+ * @v gid		Multicast GID
+ * @ret cached		Multicast membership cache entry, or NULL
+ */
+static struct ib_cached_mcast * ib_find_mcast_cache_entry ( struct ib_device
+							    *ibdev,
+							    union ib_gid *gid ) {
+	struct ib_cached_mcast *cached;
+	unsigned int i;
+
+	for ( i = 0 ; i < IB_NUM_CACHED_MCAST ; i++ ) {
+		cached = &ib_mcast_cache[i];
+		if ( cached->ibdev != ibdev )
+			continue;
+		if ( memcmp ( &cached->gid, gid, sizeof ( cached->gid ) ) != 0 )
+			continue;
+		if ( ( cached->lid != ibdev->lid ) ||
+		     ( cached->sm_lid != ibdev->sm_lid ) ||
+		     ( ( currticks() - cached->joined ) >=
+		       IB_MCAST_CACHE_TTL ) ) {
+			/* Stale entry; discard it */
+			memset ( cached, 0, sizeof ( *cached ) );
+			return NULL;
+		}
+		return cached;
+	}
+	return NULL;
+}
+
+/**
+ * Record multicast membership in cache
+ *
+ * @v ibdev		Infiniband device
+ * @v gid		Multicast GID
+ * @v qkey		Queue key
+ */
+static void ib_add_mcast_cache_entry ( struct ib_device *ibdev,
+				       union ib_gid *gid, unsigned long qkey ) {
+	struct ib_cached_mcast *cached;
+	unsigned int i;
+
+	/* Reuse existing or empty entry, if any, otherwise the oldest */
+	cached = ib_find_mcast_cache_entry ( ibdev, gid );
+	for ( i = 0 ; ( ! cached ) && ( i < IB_NUM_CACHED_MCAST ) ; i++ ) {
+		if ( ! ib_mcast_cache[i].ibdev )
+			cached = &ib_mcast_cache[i];
+	}
+	if ( ! cached ) {
+		cached = &ib_mcast_cache[ ( ib_mcast_cache_idx++ ) %
+					  IB_NUM_CACHED_MCAST ];
+	}
+
+	/* Populate entry */
+	cached->ibdev = ibdev;
+	memcpy ( &cached->gid, gid, sizeof ( cached->gid ) );
+	cached->qkey = qkey;
+	cached->lid = ibdev->lid;
+	cached->sm_lid = ibdev->sm_lid;
+	cached->joined = currticks();
+	cached->active = 1;
+}
+
+/**
+ * Update multicast membership cache entries for a link state change
+ *
+ * @v ibdev		Infiniband device
+ *
+ * Memberships do not survive the link going down.  The link is also
+ * reported as down while the device is being opened (and the port
+ * trains up to the active state), which must not discard the
+ * memberships that the cache exists to preserve.  Entries are
+ * therefore discarded only if the link goes down after having been
+ * active since the device was opened.
+ */
+static void ib_update_mcast_cache ( struct ib_device *ibdev ) {
+	struct ib_cached_mcast *cached;
+	unsigned int i;
+
+	for ( i = 0 ; i < IB_NUM_CACHED_MCAST ; i++ ) {
+		cached = &ib_mcast_cache[i];
+		if ( cached->ibdev != ibdev )
+			continue;
+		if ( ! ib_is_open ( ibdev ) ) {
+			cached->active = 0;
+		} else if ( ib_link_ok ( ibdev ) ) {
+			cached->active = 1;
+		} else if ( cached->active ) {
+			DBGC ( ibdev, "IBDEV %p discarding membership of "
+			       IB_GID_FMT "\n", ibdev,
+			       IB_GID_ARGS ( &cached->gid ) );
+			memset ( cached, 0, sizeof ( *cached ) );
+		}
+	}
+}
+
+/**
+ * Discard multicast membership cache entries for a device
+ *
+ * @v ibdev		Infiniband device
+ */
+static void ib_flush_mcast_cache ( struct ib_device *ibdev ) {
+	struct ib_cached_mcast *cached;
+	unsigned int i;
+
+	for ( i = 0 ; i < IB_NUM_CACHED_MCAST ; i++ ) {
+		cached = &ib_mcast_cache[i];
+		if ( cached->ibdev == ibdev )
+			memset ( cached, 0, sizeof ( *cached ) );
+	}
+}
+
 /**
  * Generate multicast membership MAD
  *
@@ -110,6 +264,10 @@ static void ib_mcast_complete ( struct ib_device *ibdev,
 		goto out;
 	}
 
+	/* Record membership for reuse */
+	if ( joined )
+		ib_add_mcast_cache_entry ( ibdev, gid, qkey );
+
  out:
 	/* Destroy the completed transaction */
 	ib_destroy_madx ( ibdev, mi, madx );
@@ -124,6 +282,22 @@ static struct ib_mad_transaction_operations ib_mcast_op = {
 	.complete = ib_mcast_complete,
 };
 
+/**
+ * Complete join using cached multicast membership
+ *
+ * @v membership	Multicast group membership
+ */
+static void ib_mcast_cached_complete ( struct ib_mc_membership *membership ) {
+	struct ib_queue_pair *qp = membership->qp;
+
+	membership->complete ( qp->ibdev, qp, membership, 0, NULL );
+}
+
+/** Cached multicast membership completion process descriptor */
+static struct process_descriptor ib_mcast_cached_desc =
+	PROC_DESC_ONCE ( struct ib_mc_membership, process,
+			 ib_mcast_cached_complete );
+
 /**
  * Join multicast group
  *
@@ -140,6 +314,7 @@ int ib_mcast_join ( struct ib_device *ibdev, struct ib_queue_pair *qp,
 					  struct ib_queue_pair *qp,
 					  struct ib_mc_membership *membership,
 					  int rc, union ib_mad *mad ) ) {
+	struct ib_cached_mcast *cached;
 	union ib_mad mad;
 	int rc;
 
@@ -150,6 +325,8 @@ int ib_mcast_join ( struct ib_device *ibdev, struct ib_queue_pair *qp,
 	membership->qp = qp;
 	memcpy ( &membership->gid, gid, sizeof ( membership->gid ) );
 	membership->complete = complete;
+	process_init_stopped ( &membership->process, &ib_mcast_cached_desc,
+			       NULL );
 
 	/* Attach queue pair to multicast GID */
 	if ( ( rc = ib_mcast_attach ( ibdev, qp, gid ) ) != 0 ) {
@@ -158,6 +335,21 @@ int ib_mcast_join ( struct ib_device *ibdev, struct ib_queue_pair *qp,
 		goto err_mcast_attach;
 	}
 
+	/* Reuse cached membership, if available */
+	if ( ( cached = ib_find_mcast_cache_entry ( ibdev, gid ) ) ) {
+		DBGC ( ibdev, "IBDEV %p QPN %lx reusing membership of "
+		       IB_GID_FMT " qkey %lx\n", ibdev, qp->qpn,
+		       IB_GID_ARGS ( gid ), cached->qkey );
+		qp->qkey = cached->qkey;
+		if ( ( rc = ib_modify_qp ( ibdev, qp ) ) != 0 ) {
+			DBGC ( ibdev, "IBDEV %p QPN %lx could not modify "
+			       "qkey: %s\n", ibdev, qp->qpn, strerror ( rc ) );
+			goto err_modify_qp;
+		}
+		process_add ( &membership->process );
+		return 0;
+	}
+
 	/* Initiate multicast membership join */
 	ib_mcast_mad ( ibdev, gid, 1, &mad );
 	membership->madx = ib_create_madx ( ibdev, ibdev->gsi, &mad, NULL,
@@ -174,6 +366,7 @@ int ib_mcast_join ( struct ib_device *ibdev, struct ib_queue_pair *qp,
 
 	ib_destroy_madx ( ibdev, ibdev->gsi, membership->madx );
  err_create_madx:
+ err_modify_qp:
 	ib_mcast_detach ( ibdev, qp, gid );
  err_mcast_attach:
 	return rc;
@@ -199,11 +392,19 @@ void ib_mcast_leave ( struct ib_device *ibdev, struct ib_queue_pair *qp,
 	ib_mcast_detach ( ibdev, qp, &membership->gid );
 
 	/* Cancel multicast membership join, if applicable */
+	process_del ( &membership->process );
 	if ( membership->madx ) {
 		ib_destroy_madx ( ibdev, ibdev->gsi, membership->madx );
 		membership->madx = NULL;
 	}
 
+	/* Retain cached membership on the subnet for reuse */
+	if ( ib_find_mcast_cache_entry ( ibdev, gid ) ) {
+		DBGC ( ibdev, "IBDEV %p QPN %lx retaining membership of "
+		       IB_GID_FMT "\n", ibdev, qp->qpn, IB_GID_ARGS ( gid ) );
+		return;
+	}
+
 	/* Send a single group leave MAD */
 	ib_mcast_mad ( ibdev, &membership->gid, 0, &mad );
 	if ( ( rc = ib_mi_send ( ibdev, ibdev->gsi, &mad, NULL ) ) != 0 ) {
@@ -211,3 +412,44 @@ void ib_mcast_leave ( struct ib_device *ibdev, struct ib_queue_pair *qp,
 		       "%s\n", ibdev, qp->qpn, strerror ( rc ) );
 	}
 }
+
+/**
+ * Add device to multicast membership cache
+ *
+ * @v ibdev		Infiniband device
+ * @ret rc		Return status code
+ */
+static int ib_mcast_cache_probe ( struct ib_device *ibdev __unused ) {
+
+	/* Nothing to do */
+	return 0;
+}
+
+/**
+ * Handle device or link status change
+ *
+ * @v ibdev		Infiniband device
+ */
+static void ib_mcast_cache_notify ( struct ib_device *ibdev ) {
+
+	/* Discard memberships if the active link has gone down */
+	ib_update_mcast_cache ( ibdev );
+}
+
+/**
+ * Remove device from multicast membership cache
+ *
+ * @v ibdev		Infiniband device
+ */
+static void ib_mcast_cache_remove ( struct ib_device *ibdev ) {
+
+	ib_flush_mcast_cache ( ibdev );
+}
+
+/** Multicast membership cache Infiniband driver */
+struct ib_driver ib_mcast_cache_driver __ib_driver = {
+	.name = "Multicast cache",
+	.probe = ib_mcast_cache_probe,
+	.notify = ib_mcast_cache_notify,
+	.remove = ib_mcast_cache_remove,
+};
@@ -24,6 +24,7 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <string.h>
 #include <byteswap.h>
 #include <errno.h>
+#include <ipxe/timer.h>
 #include <ipxe/infiniband.h>
 #include <ipxe/ib_mi.h>
 #include <ipxe/ib_pathrec.h>
@@ -154,12 +155,30 @@ void ib_destroy_path ( struct ib_device *ibdev, struct ib_path *path ) {
  *
  * Must be a power of two.
  */
-#define IB_NUM_CACHED_PATHS 4
+#define IB_NUM_CACHED_PATHS 16
+
+/** Path cache entry lifetime
+ *
+ * Cached paths remain valid across closing and reopening the
+ * Infiniband device, provided that the local port's LID and subnet
+ * manager LID are unchanged, for this length of time.  A path that
+ * is still in use when its lifetime expires continues to be used
+ * while it is refreshed in the background.
+ */
+#define IB_PATH_CACHE_TTL ( 300 * TICKS_PER_SEC )
 
 /** A cached path */
 struct ib_cached_path {
 	/** Path */
 	struct ib_path *path;
+	/** Path refresh in progress, if any */
+	struct ib_path *refresh;
+	/** Local port LID at time of resolution */
+	uint16_t lid;
+	/** Subnet manager LID at time of resolution */
+	uint16_t sm_lid;
+	/** Time of resolution (in ticks) */
+	unsigned long resolved;
 };
 
 /** Path cache */
@@ -168,6 +187,35 @@ static struct ib_cached_path ib_path_cache[IB_NUM_CACHED_PATHS];
 /** Oldest path cache entry index */
 static unsigned int ib_path_cache_idx;
 
+/**
+ * Check if path cache entry is usable
+ *
+ * @v cached		Path cache entry
+ * @ret is_valid	Path cache entry is resolved and still valid
+ *
+ * A resolved path remains usable until the local port's LID or
+ * subnet manager LID changes.
+ */
+static int ib_cached_path_valid ( struct ib_cached_path *cached ) {
+	struct ib_device *ibdev = cached->path->ibdev;
+
+	return ( cached->path->av.lid &&
+		 ( cached->lid == ibdev->lid ) &&
+		 ( cached->sm_lid == ibdev->sm_lid ) );
+}
+
+/**
+ * Check if path cache entry is usable and within its lifetime
+ *
+ * @v cached		Path cache entry
+ * @ret is_fresh	Path cache entry is valid and does not need refreshing
+ */
+static int ib_cached_path_fresh ( struct ib_cached_path *cached ) {
+
+	return ( ib_cached_path_valid ( cached ) &&
+		 ( ( currticks() - cached->resolved ) < IB_PATH_CACHE_TTL ) );
+}
+
 /**
  * Find path cache entry
  *
@@ -195,6 +243,20 @@ ib_find_path_cache_entry ( struct ib_device *ibdev, union ib_gid *dgid ) {
 	return NULL;
 }
 
+/**
+ * Erase path cache entry
+ *
+ * @v cached		Path cache entry
+ */
+static void ib_erase_path_cache_entry ( struct ib_cached_path *cached ) {
+
+	if ( cached->refresh )
+		ib_destroy_path ( cached->refresh->ibdev, cached->refresh );
+	if ( cached->path )
+		ib_destroy_path ( cached->path->ibdev, cached->path );
+	memset ( cached, 0, sizeof ( *cached ) );
+}
+
 /**
  * Handle cached path transaction completion
  *
@@ -208,14 +270,31 @@ static void ib_cached_path_complete ( struct ib_device *ibdev,
 				      struct ib_address_vector *av __unused ) {
 	struct ib_cached_path *cached = ib_path_get_ownerdata ( path );
 
+	/* Complete refresh, if applicable.  If the refresh failed,
+	 * continue to use the existing path.
+	 */
+	if ( path == cached->refresh ) {
+		cached->refresh = NULL;
+		if ( rc != 0 ) {
+			ib_destroy_path ( ibdev, path );
+			return;
+		}
+		ib_destroy_path ( ibdev, cached->path );
+		cached->path = path;
+	}
+
 	/* If the transaction failed, erase the cache entry */
 	if ( rc != 0 ) {
 		/* Destroy the old cache entry */
-		ib_destroy_path ( ibdev, path );
-		memset ( cached, 0, sizeof ( *cached ) );
+		ib_erase_path_cache_entry ( cached );
 		return;
 	}
 
+	/* Record validity of resolved path */
+	cached->lid = ibdev->lid;
+	cached->sm_lid = ibdev->sm_lid;
+	cached->resolved = currticks();
+
 	/* Do not destroy the completed transaction; we still need to
 	 * refer to the resolved path.
 	 */
@@ -226,6 +305,63 @@ static struct ib_path_operations ib_cached_path_op = {
 	.complete = ib_cached_path_complete,
 };
 
+/**
+ * Start path lookup for cache entry
+ *
+ * @v ibdev		Infiniband device
+ * @v cached		Path cache entry
+ * @v av		Address vector to complete
+ * @ret rc		Return status code
+ */
+static int ib_cached_path_lookup ( struct ib_device *ibdev,
+				   struct ib_cached_path *cached,
+				   struct ib_address_vector *av ) {
+
+	/* Destroy the old cache entry */
+	ib_erase_path_cache_entry ( cached );
+
+	/* Create new path */
+	cached->path = ib_create_path ( ibdev, av, &ib_cached_path_op );
+	if ( ! cached->path ) {
+		DBGC ( ibdev, "IBDEV %p could not create path\n",
+		       ibdev );
+		return -ENOMEM;
+	}
+	ib_path_set_ownerdata ( cached->path, cached );
+
+	return 0;
+}
+
+/**
+ * Start background refresh of path cache entry
+ *
+ * @v ibdev		Infiniband device
+ * @v cached		Path cache entry
+ *
+ * The existing path remains in use until the refresh completes.
+ */
+static void ib_cached_path_refresh ( struct ib_device *ibdev,
+				     struct ib_cached_path *cached ) {
+	struct ib_address_vector av;
+
+	/* Do nothing if a refresh is already in progress */
+	if ( cached->refresh )
+		return;
+
+	/* Create new path */
+	DBGC ( ibdev, "IBDEV %p refreshing path to " IB_GID_FMT "\n",
+	       ibdev, IB_GID_ARGS ( &cached->path->av.gid ) );
+	memset ( &av, 0, sizeof ( av ) );
+	av.gid_present = 1;
+	memcpy ( &av.gid, &cached->path->av.gid, sizeof ( av.gid ) );
+	cached->refresh = ib_create_path ( ibdev, &av, &ib_cached_path_op );
+	if ( ! cached->refresh ) {
+		DBGC ( ibdev, "IBDEV %p could not create path\n", ibdev );
+		return;
+	}
+	ib_path_set_ownerdata ( cached->refresh, cached );
+}
+
 /**
  * Resolve path
  *
@@ -240,6 +376,8 @@ int ib_resolve_path ( struct ib_device *ibdev, struct ib_address_vector *av ) {
 	union ib_gid *gid = &av->gid;
 	struct ib_cached_path *cached;
 	unsigned int cache_idx;
+	unsigned int i;
+	int rc;
 
 	/* Sanity check */
 	if ( ! av->gid_present ) {
@@ -250,40 +388,131 @@ int ib_resolve_path ( struct ib_device *ibdev, struct ib_address_vector *av ) {
 
 	/* Look in cache for a matching entry */
 	cached = ib_find_path_cache_entry ( ibdev, gid );
-	if ( cached && cached->path->av.lid ) {
+	if ( cached && ib_cached_path_valid ( cached ) ) {
 		/* Populated entry found */
 		av->lid = cached->path->av.lid;
 		av->rate = cached->path->av.rate;
 		av->sl = cached->path->av.sl;
 		DBGC2 ( ibdev, "IBDEV %p cache hit for " IB_GID_FMT "\n",
 			ibdev, IB_GID_ARGS ( gid ) );
+		if ( ! ib_cached_path_fresh ( cached ) )
+			ib_cached_path_refresh ( ibdev, cached );
 		return 0;
 	}
 	DBGC ( ibdev, "IBDEV %p cache miss for " IB_GID_FMT "%s\n", ibdev,
-	       IB_GID_ARGS ( gid ), ( cached ? " (in progress)" : "" ) );
+	       IB_GID_ARGS ( gid ),
+	       ( ( cached && cached->path->madx ) ? " (in progress)" :
+		 ( cached ? " (stale)" : "" ) ) );
 
 	/* If lookup is already in progress, do nothing */
-	if ( cached )
+	if ( cached && cached->path->madx )
 		return -ENOENT;
 
-	/* Locate a new cache entry to use */
-	cache_idx = ( (ib_path_cache_idx++) % IB_NUM_CACHED_PATHS );
-	cached = &ib_path_cache[cache_idx];
-
-	/* Destroy the old cache entry */
-	if ( cached->path )
-		ib_destroy_path ( ibdev, cached->path );
-	memset ( cached, 0, sizeof ( *cached ) );
-
-	/* Create new path */
-	cached->path = ib_create_path ( ibdev, av, &ib_cached_path_op );
-	if ( ! cached->path ) {
-		DBGC ( ibdev, "IBDEV %p could not create path\n",
-		       ibdev );
-		return -ENOMEM;
+	/* Locate a cache entry to use, preferring empty or stale
+	 * entries over the oldest entry.
+	 */
+	if ( ! cached ) {
+		for ( i = 0 ; i < IB_NUM_CACHED_PATHS ; i++ ) {
+			cached = &ib_path_cache[i];
+			if ( ! cached->path )
+				break;
+			if ( ( ! cached->path->madx ) && ( ! cached->refresh ) &&
+			     ( ! ib_cached_path_fresh ( cached ) ) )
+				break;
+		}
+		if ( i == IB_NUM_CACHED_PATHS ) {
+			cache_idx = ( (ib_path_cache_idx++) %
+				      IB_NUM_CACHED_PATHS );
+			cached = &ib_path_cache[cache_idx];
+		}
 	}
-	ib_path_set_ownerdata ( cached->path, cached );
+
+	/* Start lookup */
+	if ( ( rc = ib_cached_path_lookup ( ibdev, cached, av ) ) != 0 )
+		return rc;
 
 	/* Not found yet */
 	return -ENOENT;
 }
+
+/**
+ * Refresh stale cached paths
+ *
+ * @v ibdev		Infiniband device
+ *
+ * Paths resolved during a previous opening of the device (e.g. the
+ * path to the default gateway) are looked up again in parallel as
+ * soon as the link comes up, rather than on the first transmission.
+ * Paths that are no longer valid (or that have outlived their
+ * lifetime while the device was closed) are discarded.
+ */
+static void ib_refresh_paths ( struct ib_device *ibdev ) {
+	struct ib_address_vector av;
+	struct ib_cached_path *cached;
+	unsigned int i;
+
+	for ( i = 0 ; i < IB_NUM_CACHED_PATHS ; i++ ) {
+		cached = &ib_path_cache[i];
+		if ( ! cached->path )
+			continue;
+		if ( cached->path->ibdev != ibdev )
+			continue;
+		if ( cached->path->madx || cached->refresh ||
+		     ib_cached_path_fresh ( cached ) )
+			continue;
+		DBGC ( ibdev, "IBDEV %p refreshing path to " IB_GID_FMT "\n",
+		       ibdev, IB_GID_ARGS ( &cached->path->av.gid ) );
+		memset ( &av, 0, sizeof ( av ) );
+		av.gid_present = 1;
+		memcpy ( &av.gid, &cached->path->av.gid, sizeof ( av.gid ) );
+		ib_cached_path_lookup ( ibdev, cached, &av );
+	}
+}
+
+/**
+ * Add device to path cache
+ *
+ * @v ibdev		Infiniband device
+ * @ret rc		Return status code
+ */
+static int ib_path_cache_probe ( struct ib_device *ibdev __unused ) {
+
+	/* Nothing to do */
+	return 0;
+}
+
+/**
+ * Handle device or link status change
+ *
+ * @v ibdev		Infiniband device
+ */
+static void ib_path_cache_notify ( struct ib_device *ibdev ) {
+
+	/* Refresh stale paths when link comes up */
+	if ( ib_is_open ( ibdev ) && ib_link_ok ( ibdev ) )
+		ib_refresh_paths ( ibdev );
+}
+
+/**
+ * Remove device from path cache
+ *
+ * @v ibdev		Infiniband device
+ */
+static void ib_path_cache_remove ( struct ib_device *ibdev ) {
+	struct ib_cached_path *cached;
+	unsigned int i;
+
+	for ( i = 0 ; i < IB_NUM_CACHED_PATHS ; i++ ) {
+		cached = &ib_path_cache[i];
+		if ( cached->path && ( cached->path->ibdev == ibdev ) )
+			ib_erase_path_cache_entry ( cached );
+	}
+}
+
+/** Path cache Infiniband driver */
+struct ib_driver ib_path_cache_driver __ib_driver = {
+	.name = "Path cache",
+	.probe = ib_path_cache_probe,
+	.notify = ib_path_cache_notify,
+	.remove = ib_path_cache_remove,
+};
@@ -12,6 +12,7 @@
 #include <ipxe/netdevice.h>
 #include <ipxe/ip.h>
 #include <ipxe/tcpip.h>
+#include <ipxe/udp.h>
 #include <ipxe/dhcp.h>
 #include <ipxe/settings.h>
 #include <ipxe/fragment.h>
@@ -29,9 +30,34 @@ FILE_LICENCE ( GPL2_OR_LATER );
 /* Unique IP datagram identification number (high byte) */
 static uint8_t next_ident_high = 0;
 
-/** List of IPv4 miniroutes */
+/** List of IPv4 miniroutes (in order of decreasing prefix length) */
 struct list_head ipv4_miniroutes = LIST_HEAD_INIT ( ipv4_miniroutes );
 
+/** Number of IPv4 route cache entries (must be a power of two) */
+#define IPV4_ROUTE_CACHE_SIZE 16
+
+/** An IPv4 route cache entry */
+struct ipv4_route_cache {
+	/** Routing table generation for which this entry is valid */
+	unsigned int generation;
+	/** Final destination address */
+	struct in_addr dest;
+	/** Next hop destination address */
+	struct in_addr next_hop;
+	/** Routing table entry */
+	struct ipv4_miniroute *miniroute;
+};
+
+/** IPv4 route cache */
+static struct ipv4_route_cache ipv4_route_cache[IPV4_ROUTE_CACHE_SIZE];
+
+/** IPv4 routing table generation
+ *
+ * This is incremented whenever the routing table (or the state of
+ * any network device) changes, invalidating all route cache entries.
+ */
+static unsigned int ipv4_route_generation = 1;
+
 /** IPv4 statistics */
 static struct ip_statistics ipv4_stats;
 
@@ -61,6 +87,7 @@ static struct ipv4_miniroute * __malloc
 add_ipv4_miniroute ( struct net_device *netdev, struct in_addr address,
 		     struct in_addr netmask, struct in_addr gateway ) {
 	struct ipv4_miniroute *miniroute;
+	struct ipv4_miniroute *tmp;
 
 	DBGC ( netdev, "IPv4 add %s", inet_ntoa ( address ) );
 	DBGC ( netdev, "/%s ", inet_ntoa ( netmask ) );
@@ -80,15 +107,20 @@ add_ipv4_miniroute ( struct net_device *netdev, struct in_addr address,
 	miniroute->address = address;
 	miniroute->netmask = netmask;
 	miniroute->gateway = gateway;
-		
-	/* Add to end of list if we have a gateway, otherwise
-	 * to start of list.
+
+	/* Add to list in order of decreasing prefix length, so that
+	 * the first matching local route is the longest prefix match.
+	 * A (contiguous) subnet mask has a longer prefix if and only
+	 * if its host-endian value is numerically greater.
 	 */
-	if ( gateway.s_addr ) {
-		list_add_tail ( &miniroute->list, &ipv4_miniroutes );
-	} else {
-		list_add ( &miniroute->list, &ipv4_miniroutes );
+	list_for_each_entry ( tmp, &ipv4_miniroutes, list ) {
+		if ( ntohl ( tmp->netmask.s_addr ) < ntohl ( netmask.s_addr ) )
+			break;
 	}
+	list_add_tail ( &miniroute->list, &tmp->list );
+
+	/* Invalidate route cache */
+	ipv4_route_generation++;
 
 	return miniroute;
 }
@@ -110,6 +142,9 @@ static void del_ipv4_miniroute ( struct ipv4_miniroute *miniroute ) {
 	netdev_put ( miniroute->netdev );
 	list_del ( &miniroute->list );
 	free ( miniroute );
+
+	/* Invalidate route cache */
+	ipv4_route_generation++;
 }
 
 /**
@@ -123,27 +158,67 @@ static void del_ipv4_miniroute ( struct ipv4_miniroute *miniroute ) {
  * address will be overwritten with the gateway address.
  */
 static struct ipv4_miniroute * ipv4_route ( struct in_addr *dest ) {
+	struct ipv4_route_cache *cache;
 	struct ipv4_miniroute *miniroute;
+	struct ipv4_miniroute *gw_route = NULL;
+	uint32_t hash;
 	int local;
-	int has_gw;
 
-	/* Find first usable route in routing table */
+	/* Check route cache */
+	hash = ntohl ( dest->s_addr );
+	hash ^= ( hash >> 16 );
+	hash ^= ( hash >> 8 );
+	cache = &ipv4_route_cache[ hash & ( IPV4_ROUTE_CACHE_SIZE - 1 ) ];
+	if ( ( cache->generation == ipv4_route_generation ) &&
+	     ( cache->dest.s_addr == dest->s_addr ) ) {
+		*dest = cache->next_hop;
+		return cache->miniroute;
+	}
+	cache->dest = *dest;
+
+	/* Find longest-prefix local route, and first usable gateway */
 	list_for_each_entry ( miniroute, &ipv4_miniroutes, list ) {
 		if ( ! netdev_is_open ( miniroute->netdev ) )
 			continue;
 		local = ( ( ( dest->s_addr ^ miniroute->address.s_addr )
 			    & miniroute->netmask.s_addr ) == 0 );
-		has_gw = ( miniroute->gateway.s_addr );
-		if ( local || has_gw ) {
-			if ( ! local )
-				*dest = miniroute->gateway;
-			return miniroute;
-		}
+		if ( local )
+			goto found;
+		if ( miniroute->gateway.s_addr && ( ! gw_route ) )
+			gw_route = miniroute;
 	}
 
-	return NULL;
+	/* Fall back to using a gateway, if any */
+	miniroute = gw_route;
+	if ( miniroute )
+		*dest = miniroute->gateway;
+
+ found:
+	/* Record in route cache */
+	cache->generation = ipv4_route_generation;
+	cache->next_hop = *dest;
+	cache->miniroute = miniroute;
+	return miniroute;
+}
+
+/**
+ * Invalidate IPv4 route cache on network device state change
+ *
+ * @v netdev		Network device
+ */
+static void ipv4_route_flush ( struct net_device *netdev __unused ) {
+
+	/* Routes are usable only via open network devices */
+	ipv4_route_generation++;
 }
 
+/** IPv4 route cache network device driver */
+struct net_driver ipv4_route_driver __net_driver = {
+	.name = "IPv4 route cache",
+	.notify = ipv4_route_flush,
+	.remove = ipv4_route_flush,
+};
+
 /**
  * Determine transmitting network device
  *
@@ -209,13 +284,41 @@ static int ipv4_more_fragments ( struct io_buffer *iobuf,
 	return ( iphdr->frags & htons ( IP_MASK_MOREFRAGS ) );
 }
 
+/**
+ * Get total IPv4 payload length hint
+ *
+ * @v iobuf		I/O buffer
+ * @v hdrlen		Length of non-fragmentable potion of I/O buffer
+ * @ret len		Expected total payload length, or zero if unknown
+ *
+ * The first fragment of a UDP datagram carries the UDP header, which
+ * records the length of the whole datagram.
+ */
+static size_t ipv4_payload_len ( struct io_buffer *iobuf, size_t hdrlen ) {
+	struct iphdr *iphdr = iobuf->data;
+	struct udp_header *udphdr = ( iobuf->data + hdrlen );
+
+	if ( iphdr->frags & htons ( IP_MASK_OFFSET ) )
+		return 0;
+	if ( iphdr->protocol != IP_UDP )
+		return 0;
+	if ( iob_len ( iobuf ) < ( hdrlen + sizeof ( *udphdr ) ) )
+		return 0;
+	return ntohs ( udphdr->len );
+}
+
+/** IPv4 fragment reassembly buffers */
+static struct fragment ipv4_fragments[FRAGMENT_MAX_BUFFERS];
+
 /** IPv4 fragment reassembler */
 static struct fragment_reassembler ipv4_reassembler = {
 	.list = LIST_HEAD_INIT ( ipv4_reassembler.list ),
 	.is_fragment = ipv4_is_fragment,
 	.fragment_offset = ipv4_fragment_offset,
 	.more_fragments = ipv4_more_fragments,
+	.payload_len = ipv4_payload_len,
 	.stats = &ipv4_stats,
+	.buffers = ipv4_fragments,
 };
 
 /**
@@ -278,8 +278,10 @@ int ipv6_set_address ( struct net_device *netdev, struct in6_addr *address ) {
 static struct ipv6_miniroute * ipv6_route ( unsigned int scope_id,
 					    struct in6_addr **dest ) {
 	struct ipv6_miniroute *miniroute;
+	struct ipv6_miniroute *on_link = NULL;
+	struct ipv6_miniroute *gw_route = NULL;
 
-	/* Find first usable route in routing table */
+	/* Find longest-prefix on-link route, and first usable router */
 	list_for_each_entry ( miniroute, &ipv6_miniroutes, list ) {
 
 		/* Skip closed network devices */
@@ -302,23 +304,34 @@ static struct ipv6_miniroute * ipv6_route ( unsigned int scope_id,
 		} else {
 
 			/* If destination is an on-link global
-			 * address, then use this route.
+			 * address, then consider this route.
 			 */
-			if ( ipv6_is_on_link ( miniroute, *dest ) )
-				return miniroute;
+			if ( ipv6_is_on_link ( miniroute, *dest ) &&
+			     ( ( ! on_link ) ||
+			       ( miniroute->prefix_len >
+				 on_link->prefix_len ) ) ) {
+				on_link = miniroute;
+			}
 
 			/* If destination is an off-link global
 			 * address, and we have a default gateway,
-			 * then use this route.
+			 * then consider this route.
 			 */
-			if ( miniroute->flags & IPV6_HAS_ROUTER ) {
-				*dest = &miniroute->router;
-				return miniroute;
+			if ( ( miniroute->flags & IPV6_HAS_ROUTER ) &&
+			     ( ! gw_route ) ) {
+				gw_route = miniroute;
 			}
 		}
 	}
 
-	return NULL;
+	/* Prefer the longest matching on-link prefix */
+	if ( on_link )
+		return on_link;
+
+	/* Otherwise, use the default gateway (if any) */
+	if ( gw_route )
+		*dest = &gw_route->router;
+	return gw_route;
 }
 
 /**
@@ -422,6 +435,9 @@ static int ipv6_more_fragments ( struct io_buffer *iobuf, size_t hdrlen ) {
 	return ( fhdr->offset_more & htons ( IPV6_MASK_MOREFRAGS ) );
 }
 
+/** IPv6 fragment reassembly buffers */
+static struct fragment ipv6_fragments[FRAGMENT_MAX_BUFFERS];
+
 /** Fragment reassembler */
 static struct fragment_reassembler ipv6_reassembler = {
 	.list = LIST_HEAD_INIT ( ipv6_reassembler.list ),
@@ -429,6 +445,7 @@ static struct fragment_reassembler ipv6_reassembler = {
 	.fragment_offset = ipv6_fragment_offset,
 	.more_fragments = ipv6_more_fragments,
 	.stats = &ipv6_stats,
+	.buffers = ipv6_fragments,
 };
 
 /**
@@ -47,22 +47,70 @@ FILE_LICENCE ( GPL2_OR_LATER );
 /** Neighbour discovery maximum timeout */
 #define NEIGHBOUR_MAX_TIMEOUT ( TICKS_PER_SEC * 3 )
 
-/** The neighbour cache */
+/** Number of neighbour cache hash buckets (must be a power of two) */
+#define NEIGHBOUR_HASH_SIZE 32
+
+/** The neighbour cache (in least-recently-used order) */
 struct list_head neighbours = LIST_HEAD_INIT ( neighbours );
 uint32_t total_neighbours = 0;
 #define NEIGHBOUR_DROP_MIN_CACHE_ENTRY 3
 
+/** Neighbour cache hash table */
+static struct neighbour *neighbour_hash[NEIGHBOUR_HASH_SIZE];
+
 static void neighbour_expired ( struct retry_timer *timer, int over );
 
+/**
+ * Calculate neighbour cache hash bucket
+ *
+ * @v netdev		Network device
+ * @v net_protocol	Network-layer protocol
+ * @v net_dest		Destination network-layer address
+ * @ret bucket		Hash bucket
+ *
+ * The least significant bytes of the network-layer address are the
+ * ones most likely to differ between neighbours, so they are folded
+ * in last.
+ */
+static struct neighbour ** neighbour_bucket ( struct net_device *netdev,
+					      struct net_protocol *net_protocol,
+					      const void *net_dest ) {
+	const uint8_t *byte = net_dest;
+	unsigned int hash = netdev->index;
+	unsigned int i;
+
+	for ( i = 0 ; i < net_protocol->net_addr_len ; i++ )
+		hash = ( ( hash * 31 ) + byte[i] );
+	hash ^= ( hash >> 8 );
+	return &neighbour_hash[ hash & ( NEIGHBOUR_HASH_SIZE - 1 ) ];
+}
+
 static int neighbor_add_to_list ( struct neighbour *neighbour ) {
+	struct neighbour **bucket;
+
 	list_add ( &neighbour->list, &neighbours );
+	bucket = neighbour_bucket ( neighbour->netdev, neighbour->net_protocol,
+				    neighbour->net_dest );
+	neighbour->hash_next = *bucket;
+	*bucket = neighbour;
 	total_neighbours++;
 	return total_neighbours;
 }
 
 static int neighbor_remove_from_list ( struct neighbour *neighbour ) {
+	struct neighbour **prev;
+
 	if ( total_neighbours > 0 ) {
 		list_del ( &neighbour->list );
+		prev = neighbour_bucket ( neighbour->netdev,
+					  neighbour->net_protocol,
+					  neighbour->net_dest );
+		for ( ; *prev ; prev = &(*prev)->hash_next ) {
+			if ( *prev == neighbour ) {
+				*prev = neighbour->hash_next;
+				break;
+			}
+		}
 		total_neighbours--;
 	}
 	return total_neighbours;
@@ -135,7 +183,8 @@ static struct neighbour * neighbour_find ( struct net_device *netdev,
 					   const void *net_dest ) {
 	struct neighbour *neighbour;
 
-	list_for_each_entry ( neighbour, &neighbours, list ) {
+	for ( neighbour = *neighbour_bucket ( netdev, net_protocol, net_dest ) ;
+	      neighbour ; neighbour = neighbour->hash_next ) {
 		if ( ( neighbour->netdev == netdev ) &&
 		     ( neighbour->net_protocol == net_protocol ) &&
 		     ( memcmp ( neighbour->net_dest, net_dest,
@@ -121,6 +121,7 @@ static int netdev_fetch_bustype ( struct net_device *netdev, void *data,
 		[BUS_TYPE_MCA] = "MCA",
 		[BUS_TYPE_ISA] = "ISA",
 		[BUS_TYPE_TAP] = "TAP",
+		[BUS_TYPE_PIPE] = "PIPE",
 	};
 	struct device_description *desc = &netdev->dev->desc;
 	const char *bustype;
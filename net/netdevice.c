@@ -420,6 +420,7 @@ void netdev_rx ( struct net_device *netdev, struct io_buffer *iobuf ) {
 
 	/* Enqueue packet */
 	list_add_tail ( &iobuf->list, &netdev->rx_queue );
+	netdev->rx_queue_len++;
 
 	/* Update statistics counter */
 	netdev_record_stat ( &netdev->rx_stats, 0 );
@@ -482,6 +483,8 @@ struct io_buffer * netdev_rx_dequeue ( struct net_device *netdev ) {
 		return NULL;
 
 	list_del ( &iobuf->list );
+	assert ( netdev->rx_queue_len > 0 );
+	netdev->rx_queue_len--;
 	return iobuf;
 }
 
@@ -34,6 +34,8 @@ struct tcp_connection {
 	struct refcnt refcnt;
 	/** List of TCP connections */
 	struct list_head list;
+	/** Next TCP connection in port hash chain */
+	struct tcp_connection *hash_next;
 
 	/** Flags */
 	unsigned int flags;
@@ -159,6 +161,9 @@ struct tcp_rx_queued_header {
  */
 static LIST_HEAD ( tcp_conns );
 
+/** TCP connections hashed by local port */
+static struct tcp_connection *tcp_hash[TCPIP_PORT_HASH_SIZE];
+
 /** Transmit profiler */
 static struct profiler tcp_tx_profiler __profiler = { .name = "tcp.tx" };
 
@@ -265,6 +270,7 @@ static int tcp_open ( struct interface *xfer, struct sockaddr *peer,
 		      struct sockaddr *local ) {
 	struct sockaddr_tcpip *st_peer = ( struct sockaddr_tcpip * ) peer;
 	struct sockaddr_tcpip *st_local = ( struct sockaddr_tcpip * ) local;
+	struct tcp_connection **bucket;
 	struct tcp_connection *tcp;
 	size_t mtu;
 	int port;
@@ -321,6 +327,9 @@ static int tcp_open ( struct interface *xfer, struct sockaddr *peer,
 	 */
 	intf_plug_plug ( &tcp->xfer, xfer );
 	list_add ( &tcp->list, &tcp_conns );
+	bucket = &tcp_hash[ tcpip_port_hash ( tcp->local_port ) ];
+	tcp->hash_next = *bucket;
+	*bucket = tcp;
 	return 0;
 
  err:
@@ -338,6 +347,7 @@ static int tcp_open ( struct interface *xfer, struct sockaddr *peer,
  * a suitable state, the connection will be deleted.
  */
 static void tcp_close ( struct tcp_connection *tcp, int rc ) {
+	struct tcp_connection **prev;
 	struct io_buffer *iobuf;
 	struct io_buffer *tmp;
 
@@ -378,6 +388,13 @@ static void tcp_close ( struct tcp_connection *tcp, int rc ) {
 		stop_timer ( &tcp->timer );
 		stop_timer ( &tcp->wait );
 		list_del ( &tcp->list );
+		for ( prev = &tcp_hash[ tcpip_port_hash ( tcp->local_port ) ] ;
+		      *prev ; prev = &(*prev)->hash_next ) {
+			if ( *prev == tcp ) {
+				*prev = tcp->hash_next;
+				break;
+			}
+		}
 		ref_put ( &tcp->refcnt );
 		DBGC ( tcp, "TCP %p connection deleted\n", tcp );
 		return;
@@ -766,7 +783,8 @@ static int tcp_xmit_reset ( struct tcp_connection *tcp,
 static struct tcp_connection * tcp_demux ( unsigned int local_port ) {
 	struct tcp_connection *tcp;
 
-	list_for_each_entry ( tcp, &tcp_conns, list ) {
+	for ( tcp = tcp_hash[ tcpip_port_hash ( local_port ) ] ; tcp ;
+	      tcp = tcp->hash_next ) {
 		if ( tcp->local_port == local_port )
 			return tcp;
 	}
@@ -26,8 +26,8 @@ FILE_LICENCE ( GPL2_OR_LATER );
 struct udp_connection {
 	/** Reference counter */
 	struct refcnt refcnt;
-	/** List of UDP connections */
-	struct list_head list;
+	/** Next UDP connection in port hash chain */
+	struct udp_connection *hash_next;
 
 	/** Data transfer interface */
 	struct interface xfer;
@@ -39,14 +39,28 @@ struct udp_connection {
 };
 
 /**
- * List of registered UDP connections
+ * Registered UDP connections, hashed by local port
+ *
+ * Promiscuous connections have a local port of zero, and so are
+ * always found in the bucket for port zero.
  */
-static LIST_HEAD ( udp_conns );
+static struct udp_connection *udp_hash[TCPIP_PORT_HASH_SIZE];
 
 /* Forward declatations */
 static struct interface_descriptor udp_xfer_desc;
 struct tcpip_protocol udp_protocol __tcpip_protocol;
 
+/**
+ * Calculate UDP connection hash bucket
+ *
+ * @v port		Local port (in network byte order)
+ * @ret bucket		Hash bucket
+ */
+static struct udp_connection ** udp_bucket ( uint16_t port ) {
+
+	return &udp_hash[ tcpip_port_hash ( ntohs ( port ) ) ];
+}
+
 /**
  * Check if local UDP port is available
  *
@@ -56,7 +70,8 @@ struct tcpip_protocol udp_protocol __tcpip_protocol;
 static int udp_port_available ( int port ) {
 	struct udp_connection *udp;
 
-	list_for_each_entry ( udp, &udp_conns, list ) {
+	for ( udp = *udp_bucket ( htons ( port ) ) ; udp ;
+	      udp = udp->hash_next ) {
 		if ( udp->local.st_port == htons ( port ) )
 			return -EADDRINUSE;
 	}
@@ -77,6 +92,7 @@ static int udp_open_common ( struct interface *xfer,
 			     int promisc ) {
 	struct sockaddr_tcpip *st_peer = ( struct sockaddr_tcpip * ) peer;
 	struct sockaddr_tcpip *st_local = ( struct sockaddr_tcpip * ) local;
+	struct udp_connection **bucket;
 	struct udp_connection *udp;
 	int port;
 	int rc;
@@ -108,10 +124,12 @@ static int udp_open_common ( struct interface *xfer,
 	}
 
 	/* Attach parent interface, transfer reference to connection
-	 * list and return
+	 * hash table and return
 	 */
 	intf_plug_plug ( &udp->xfer, xfer );
-	list_add ( &udp->list, &udp_conns );
+	bucket = udp_bucket ( udp->local.st_port );
+	udp->hash_next = *bucket;
+	*bucket = udp;
 	return 0;
 
  err:
@@ -152,12 +170,19 @@ int udp_open_promisc ( struct interface *xfer ) {
  * @v rc		Reason for close
  */
 static void udp_close ( struct udp_connection *udp, int rc ) {
+	struct udp_connection **prev;
 
 	/* Close data transfer interface */
 	intf_shutdown ( &udp->xfer, rc );
 
-	/* Remove from list of connections and drop list's reference */
-	list_del ( &udp->list );
+	/* Remove from hash table and drop hash table's reference */
+	for ( prev = udp_bucket ( udp->local.st_port ) ; *prev ;
+	      prev = &(*prev)->hash_next ) {
+		if ( *prev == udp ) {
+			*prev = udp->hash_next;
+			break;
+		}
+	}
 	ref_put ( &udp->refcnt );
 
 	DBGC ( udp, "UDP %p closed\n", udp );
@@ -218,26 +243,49 @@ static int udp_tx ( struct udp_connection *udp, struct io_buffer *iobuf,
 	return 0;
 }
 
+/**
+ * Check if UDP connection matches local address
+ *
+ * @v udp		UDP connection
+ * @v local		Local address
+ * @ret matches		Connection matches local address
+ */
+static int udp_matches ( struct udp_connection *udp,
+			 struct sockaddr_tcpip *local ) {
+	static const struct sockaddr_tcpip empty_sockaddr = { .pad = { 0, } };
+
+	return ( ( ( udp->local.st_family == local->st_family ) ||
+		   ( udp->local.st_family == 0 ) ) &&
+		 ( ( udp->local.st_port == local->st_port ) ||
+		   ( udp->local.st_port == 0 ) ) &&
+		 ( ( memcmp ( udp->local.pad, local->pad,
+			      sizeof ( udp->local.pad ) ) == 0 ) ||
+		   ( memcmp ( udp->local.pad, empty_sockaddr.pad,
+			      sizeof ( udp->local.pad ) ) == 0 ) ) );
+}
+
 /**
  * Identify UDP connection by local address
  *
  * @v local		Local address
  * @ret udp		UDP connection, or NULL
+ *
+ * Connections bound to the destination port take precedence over
+ * promiscuous connections.
  */
 static struct udp_connection * udp_demux ( struct sockaddr_tcpip *local ) {
-	static const struct sockaddr_tcpip empty_sockaddr = { .pad = { 0, } };
+	struct udp_connection **bucket = udp_bucket ( local->st_port );
+	struct udp_connection **wildcard = udp_bucket ( 0 );
 	struct udp_connection *udp;
 
-	list_for_each_entry ( udp, &udp_conns, list ) {
-		if ( ( ( udp->local.st_family == local->st_family ) ||
-		       ( udp->local.st_family == 0 ) ) &&
-		     ( ( udp->local.st_port == local->st_port ) ||
-		       ( udp->local.st_port == 0 ) ) &&
-		     ( ( memcmp ( udp->local.pad, local->pad,
-				  sizeof ( udp->local.pad ) ) == 0 ) ||
-		       ( memcmp ( udp->local.pad, empty_sockaddr.pad,
-				  sizeof ( udp->local.pad ) ) == 0 ) ) ) {
+	for ( udp = *bucket ; udp ; udp = udp->hash_next ) {
+		if ( udp_matches ( udp, local ) )
 			return udp;
+	}
+	if ( bucket != wildcard ) {
+		for ( udp = *wildcard ; udp ; udp = udp->hash_next ) {
+			if ( udp_matches ( udp, local ) )
+				return udp;
 		}
 	}
 	return NULL;
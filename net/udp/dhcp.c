@@ -46,6 +46,8 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <ipxe/dhcp_arch.h>
 #include <ipxe/features.h>
 #include <ipxe/if_arp.h>
+#include <ipxe/profile.h>
+#include <config/dhcp.h>
 
 /** @file
  *
@@ -56,6 +58,20 @@ FILE_LICENCE ( GPL2_OR_LATER );
 struct dhcp_session;
 static int dhcp_tx ( struct dhcp_session *dhcp );
 
+/** Request two-message exchange via the Rapid Commit option */
+#ifdef DHCP_RAPID_COMMIT_MODE
+#define DHCP_USE_RAPID_COMMIT 1
+#else
+#define DHCP_USE_RAPID_COMMIT 0
+#endif
+
+/** Commit to an offer carrying a boot filename without waiting */
+#ifdef DHCP_FAST_OFFER_MODE
+#define DHCP_USE_FAST_OFFER 1
+#else
+#define DHCP_USE_FAST_OFFER 0
+#endif
+
 /**
  * DHCP operation types
  *
@@ -111,6 +127,26 @@ const struct setting dhcp_server_setting __setting ( SETTING_MISC,
  */
 uint32_t dhcp_last_xid;
 
+/** DHCP discovery state profiler */
+static struct profiler dhcp_discover_profiler __profiler =
+	{ .name = "dhcp.discover" };
+
+/** DHCP request state profiler */
+static struct profiler dhcp_request_profiler __profiler =
+	{ .name = "dhcp.request" };
+
+/** ProxyDHCP request state profiler */
+static struct profiler dhcp_proxy_profiler __profiler =
+	{ .name = "dhcp.proxy" };
+
+/** PXE Boot Server Discovery state profiler */
+static struct profiler dhcp_pxebs_profiler __profiler =
+	{ .name = "dhcp.pxebs" };
+
+/** DHCP session profiler */
+static struct profiler dhcp_session_profiler __profiler =
+	{ .name = "dhcp.session" };
+
 /**
  * Name a DHCP packet type
  *
@@ -175,6 +211,10 @@ struct dhcp_session_state {
 	uint8_t tx_msgtype;
 	/** Apply minimum timeout */
 	uint8_t apply_min_timeout;
+	/** Offset of time accumulator within struct dhcp_timing */
+	size_t timing;
+	/** Profiler for time spent in this state */
+	struct profiler *profiler;
 };
 
 static struct dhcp_session_state dhcp_state_discover;
@@ -206,6 +246,10 @@ struct dhcp_session {
 	struct in_addr server;
 	/** DHCP offer priority */
 	int priority;
+	/** DHCP offer carries a boot filename */
+	int complete;
+	/** Rapid Commit DHCPACK, if any */
+	struct dhcp_packet *rapid_ack;
 
 	/** ProxyDHCP protocol extensions should be ignored */
 	int no_pxedhcp;
@@ -229,6 +273,12 @@ struct dhcp_session {
 	unsigned int count;
 	/** Start time of the current state (in ticks) */
 	unsigned long start;
+	/** Time spent in each state */
+	struct dhcp_timing timing;
+	/** Profiling timestamp at start of the current state */
+	unsigned long state_stamp;
+	/** Profiling timestamp at start of the session */
+	unsigned long session_stamp;
 };
 
 /**
@@ -242,9 +292,34 @@ static void dhcp_free ( struct refcnt *refcnt ) {
 
 	netdev_put ( dhcp->netdev );
 	dhcppkt_put ( dhcp->proxy_offer );
+	dhcppkt_put ( dhcp->rapid_ack );
 	free ( dhcp );
 }
 
+/**
+ * Account for time spent in current DHCP session state
+ *
+ * @v dhcp		DHCP session
+ */
+static void dhcp_account ( struct dhcp_session *dhcp ) {
+	unsigned long now = currticks();
+	unsigned long elapsed = ( now - dhcp->start );
+	unsigned long stamp = profile_timestamp();
+	unsigned long *accumulator;
+
+	if ( ! dhcp->state )
+		return;
+	accumulator = ( ( ( void * ) &dhcp->timing ) + dhcp->state->timing );
+	*accumulator += elapsed;
+	dhcp->timing.total += elapsed;
+	dhcp->start = now;
+	profile_update ( dhcp->state->profiler,
+			 ( stamp - dhcp->state_stamp ) );
+	dhcp->state_stamp = stamp;
+	DBGC ( dhcp, "DHCP %p spent %ld ticks in %s state\n",
+	       dhcp, elapsed, dhcp->state->name );
+}
+
 /**
  * Mark DHCP session as complete
  *
@@ -256,6 +331,19 @@ static void dhcp_finished ( struct dhcp_session *dhcp, int rc ) {
 	/* Stop retry timer */
 	stop_timer ( &dhcp->timer );
 
+	/* Record session timing */
+	dhcp_account ( dhcp );
+	if ( dhcp->state ) {
+		DBGC ( dhcp, "DHCP %p finished after %ld ticks (discovery %ld, "
+		       "request %ld, ProxyDHCP %ld, PXEBS %ld)\n", dhcp,
+		       dhcp->timing.total, dhcp->timing.discover,
+		       dhcp->timing.request, dhcp->timing.proxy,
+		       dhcp->timing.pxebs );
+		profile_update ( &dhcp_session_profiler,
+				 ( dhcp->state_stamp - dhcp->session_stamp ) );
+		dhcp->state = NULL;
+	}
+
 	/* Shut down interfaces */
 	intf_shutdown ( &dhcp->xfer, rc );
 	intf_shutdown ( &dhcp->job, rc );
@@ -271,6 +359,11 @@ static void dhcp_set_state ( struct dhcp_session *dhcp,
 			     struct dhcp_session_state *state ) {
 
 	DBGC ( dhcp, "DHCP %p entering %s state\n", dhcp, state->name );
+	dhcp_account ( dhcp );
+	if ( ! dhcp->state ) {
+		dhcp->state_stamp = profile_timestamp();
+		dhcp->session_stamp = dhcp->state_stamp;
+	}
 	dhcp->state = state;
 	dhcp->start = currticks();
 	stop_timer ( &dhcp->timer );
@@ -322,6 +415,80 @@ static int dhcp_has_pxeopts ( struct dhcp_packet *dhcppkt ) {
  *
  */
 
+/**
+ * Use DHCP lease
+ *
+ * @v dhcp		DHCP session
+ * @v dhcppkt		DHCPACK packet
+ */
+static void dhcp_lease ( struct dhcp_session *dhcp,
+			 struct dhcp_packet *dhcppkt ) {
+	struct settings *parent;
+	struct settings *settings;
+	int rc;
+
+	/* Record assigned address */
+	dhcp->local.sin_addr = dhcppkt->dhcphdr->yiaddr;
+
+	/* Register settings */
+	parent = netdev_settings ( dhcp->netdev );
+	settings = &dhcppkt->settings;
+	if ( ( rc = register_settings ( settings, parent,
+					DHCP_SETTINGS_NAME ) ) != 0 ) {
+		DBGC ( dhcp, "DHCP %p could not register settings: %s\n",
+		       dhcp, strerror ( rc ) );
+		dhcp_finished ( dhcp, rc );
+		return;
+	}
+
+	/* Perform ProxyDHCP if applicable */
+	if ( dhcp->proxy_offer /* Have ProxyDHCP offer */ &&
+	     ( ! dhcp->no_pxedhcp ) /* ProxyDHCP not disabled */ ) {
+		DBGC ( dhcp, "DHCP %p Performing proxy DHCP\n", dhcp);
+		if ( dhcp_has_pxeopts ( dhcp->proxy_offer ) ) {
+			DBGC ( dhcp, "DHCP %p Proxy options already exists.\n", dhcp);
+			/* PXE options already present; register settings
+			 * without performing a ProxyDHCPREQUEST
+			 */
+			settings = &dhcp->proxy_offer->settings;
+			if ( ( rc = register_settings ( settings, parent,
+					   PROXYDHCP_SETTINGS_NAME ) ) != 0 ) {
+				DBGC ( dhcp, "DHCP %p could not register "
+				       "proxy settings: %s\n",
+				       dhcp, strerror ( rc ) );
+				dhcp_finished ( dhcp, rc );
+				return;
+			}
+		} else {
+			/* PXE options not present; use a ProxyDHCPREQUEST */
+			DBGC ( dhcp, "DHCP %p PXE options not present; use a ProxyDHCPREQUEST\n", dhcp);
+			dhcp_set_state ( dhcp, &dhcp_state_proxy );
+			return;
+		}
+	}
+
+	/* Terminate DHCP */
+	dhcp_finished ( dhcp, 0 );
+}
+
+/**
+ * Leave DHCP discovery state
+ *
+ * @v dhcp		DHCP session
+ *
+ * Transitions to the DHCPREQUEST state, or uses the Rapid Commit
+ * DHCPACK directly if the selected offer was one.
+ */
+static void dhcp_discovery_complete ( struct dhcp_session *dhcp ) {
+
+	if ( dhcp->rapid_ack ) {
+		DBGC ( dhcp, "DHCP %p using rapid commit DHCPACK\n", dhcp );
+		dhcp_lease ( dhcp, dhcp->rapid_ack );
+	} else {
+		dhcp_set_state ( dhcp, &dhcp_state_request );
+	}
+}
+
 /**
  * Construct transmitted packet for DHCP discovery
  *
@@ -330,10 +497,30 @@ static int dhcp_has_pxeopts ( struct dhcp_packet *dhcppkt ) {
  * @v peer		Destination address
  */
 static int dhcp_discovery_tx ( struct dhcp_session *dhcp,
-			       struct dhcp_packet *dhcppkt __unused,
+			       struct dhcp_packet *dhcppkt,
 			       struct sockaddr_in *peer ) {
+	struct dhcp_options *options = &dhcppkt->options;
+	uint8_t *end;
 
-	DBGC ( dhcp, "DHCP %p DHCPDISCOVER\n", dhcp );
+	DBGC ( dhcp, "DHCP %p DHCPDISCOVER%s\n", dhcp,
+	       ( DHCP_USE_RAPID_COMMIT ? " with rapid commit" : "" ) );
+
+	/* Request two-message exchange, if applicable.  The Rapid
+	 * Commit option has no data, and so cannot be created via
+	 * dhcppkt_store() (which treats zero-length data as a
+	 * deletion).  Insert it in place of the end-of-options
+	 * marker instead.
+	 */
+	if ( DHCP_USE_RAPID_COMMIT ) {
+		if ( ( options->used_len + 2 ) > options->alloc_len )
+			return -ENOSPC;
+		end = ( options->data + options->used_len - 1 );
+		assert ( *end == DHCP_END );
+		*(end++) = DHCP_RAPID_COMMIT;
+		*(end++) = 0;
+		*end = DHCP_END;
+		options->used_len += 2;
+	}
 
 	/* Set server address */
 	peer->sin_addr.s_addr = INADDR_BROADCAST;
@@ -342,6 +529,21 @@ static int dhcp_discovery_tx ( struct dhcp_session *dhcp,
 	return 0;
 }
 
+/**
+ * Check if DHCP packet is a Rapid Commit DHCPACK
+ *
+ * @v dhcppkt		DHCP packet
+ * @v msgtype		DHCP message type
+ * @ret is_rapid_ack	DHCP packet is a Rapid Commit DHCPACK
+ */
+static int dhcp_is_rapid_ack ( struct dhcp_packet *dhcppkt,
+			       uint8_t msgtype ) {
+
+	return ( DHCP_USE_RAPID_COMMIT && ( msgtype == DHCPACK ) &&
+		 ( dhcppkt_fetch ( dhcppkt, DHCP_RAPID_COMMIT,
+				   NULL, 0 ) >= 0 ) );
+}
+
 /**
  * Handle received packet during DHCP discovery
  *
@@ -359,6 +561,8 @@ static void dhcp_discovery_rx ( struct dhcp_session *dhcp,
 	char vci[9]; /* "PXEClient" */
 	int vci_len;
 	int has_pxeclient;
+	int is_rapid_ack;
+	int complete;
 	int8_t priority = 0;
 	uint8_t no_pxedhcp = 0;
 	unsigned long elapsed;
@@ -374,6 +578,18 @@ static void dhcp_discovery_rx ( struct dhcp_session *dhcp,
 	if ( ip.s_addr )
 		DBGC ( dhcp, " for %s", inet_ntoa ( ip ) );
 
+	/* Identify Rapid Commit DHCPACK */
+	is_rapid_ack = dhcp_is_rapid_ack ( dhcppkt, msgtype );
+	if ( is_rapid_ack )
+		DBGC ( dhcp, " rapid" );
+
+	/* Identify offers that already carry a boot filename */
+	complete = ( DHCP_USE_FAST_OFFER &&
+		     ( dhcppkt_fetch ( dhcppkt, DHCP_BOOTFILE_NAME,
+				       NULL, 0 ) > 0 ) );
+	if ( complete )
+		DBGC ( dhcp, " complete" );
+
 	/* Identify "PXEClient" vendor class */
 	vci_len = dhcppkt_fetch ( dhcppkt, DHCP_VENDOR_CLASS_ID,
 				  vci, sizeof ( vci ) );
@@ -382,7 +598,7 @@ static void dhcp_discovery_rx ( struct dhcp_session *dhcp,
 	if ( has_pxeclient ) {
 		DBGC ( dhcp, "%s",
 		       ( dhcp_has_pxeopts ( dhcppkt ) ? " pxe" : " proxy" ) );
-	} else {
+	} else if ( ! ( complete || is_rapid_ack ) ) {
 		/* Ignore two first DHCP Offers w/o option 60 */
 		if ( ( dhcp->timer.timeout / TICKS_PER_SEC ) < 8 )
 			return;
@@ -401,15 +617,23 @@ static void dhcp_discovery_rx ( struct dhcp_session *dhcp,
 		DBGC ( dhcp, " nopxe" );
 	DBGC ( dhcp, "\n" );
 
-	/* Select as DHCP offer, if applicable */
+	/* Select as DHCP offer, if applicable.  A Rapid Commit
+	 * DHCPACK is treated as an offer which has already been
+	 * committed, and so needs no DHCPREQUEST.
+	 */
 	if ( ip.s_addr && ( peer->sin_port == htons ( BOOTPS_PORT ) ) &&
-	     ( ( msgtype == DHCPOFFER ) || ( ! msgtype /* BOOTP */ ) ) &&
+	     ( ( msgtype == DHCPOFFER ) || ( ! msgtype /* BOOTP */ ) ||
+	       is_rapid_ack ) &&
 	     ( priority >= dhcp->priority ) ) {
 		DBGC ( dhcp, "DHCP %p Valid DHCP offer\n", dhcp);
 		dhcp->offer = ip;
 		dhcp->server = server_id;
 		dhcp->priority = priority;
 		dhcp->no_pxedhcp = no_pxedhcp;
+		dhcp->complete = complete;
+		dhcppkt_put ( dhcp->rapid_ack );
+		dhcp->rapid_ack = ( is_rapid_ack ? dhcppkt_get ( dhcppkt ) :
+				    NULL );
 	}
 
 	/* Select as ProxyDHCP offer, if applicable */
@@ -426,6 +650,8 @@ static void dhcp_discovery_rx ( struct dhcp_session *dhcp,
 	 *
 	 *  o  The DHCPOFFER instructs us to ignore ProxyDHCPOFFERs, or
 	 *  o  We have a valid ProxyDHCPOFFER, or
+	 *  o  The DHCPOFFER already carries a boot filename and we
+	 *     are configured to commit to such offers immediately, or
 	 *  o  We have allowed sufficient time for ProxyDHCPOFFERs.
 	 */
 
@@ -437,14 +663,14 @@ static void dhcp_discovery_rx ( struct dhcp_session *dhcp,
 
 	/* If we can't yet transition to DHCPREQUEST, do nothing */
 	elapsed = ( currticks() - dhcp->start );
-	if ( ! ( dhcp->no_pxedhcp || dhcp->proxy_offer ||
+	if ( ! ( dhcp->no_pxedhcp || dhcp->proxy_offer || dhcp->complete ||
 		 ( elapsed > PROXYDHCP_MAX_TIMEOUT ) ) ) {
 		DBGC ( dhcp, "DHCP %p Cant yet transition to DHCP Request. Do nothing...\n", dhcp);
 		return;
 	}
 
-	/* Transition to DHCPREQUEST */
-	dhcp_set_state ( dhcp, &dhcp_state_request );
+	/* Transition to DHCPREQUEST, or use Rapid Commit DHCPACK */
+	dhcp_discovery_complete ( dhcp );
 }
 
 /**
@@ -457,7 +683,7 @@ static void dhcp_discovery_expired ( struct dhcp_session *dhcp ) {
 
 	/* Give up waiting for ProxyDHCP before we reach the failure point */
 	if ( dhcp->offer.s_addr && ( elapsed > PROXYDHCP_MAX_TIMEOUT ) ) {
-		dhcp_set_state ( dhcp, &dhcp_state_request );
+		dhcp_discovery_complete ( dhcp );
 		return;
 	}
 
@@ -473,6 +699,8 @@ static struct dhcp_session_state dhcp_state_discover = {
 	.expired		= dhcp_discovery_expired,
 	.tx_msgtype		= DHCPDISCOVER,
 	.apply_min_timeout	= 2,
+	.timing			= offsetof ( struct dhcp_timing, discover ),
+	.profiler		= &dhcp_discover_profiler,
 };
 
 /**
@@ -524,9 +752,6 @@ static void dhcp_request_rx ( struct dhcp_session *dhcp,
 			      struct sockaddr_in *peer, uint8_t msgtype,
 			      struct in_addr server_id ) {
 	struct in_addr ip;
-	struct settings *parent;
-	struct settings *settings;
-	int rc;
 
 	DBGC ( dhcp, "DHCP %p %s from %s:%d", dhcp,
 	       dhcp_msgtype_name ( msgtype ), inet_ntoa ( peer->sin_addr ),
@@ -562,48 +787,8 @@ static void dhcp_request_rx ( struct dhcp_session *dhcp,
 		return;
 	}
 
-	/* Record assigned address */
-	dhcp->local.sin_addr = ip;
-
-	/* Register settings */
-	parent = netdev_settings ( dhcp->netdev );
-	settings = &dhcppkt->settings;
-	if ( ( rc = register_settings ( settings, parent,
-					DHCP_SETTINGS_NAME ) ) != 0 ) {
-		DBGC ( dhcp, "DHCP %p could not register settings: %s\n",
-		       dhcp, strerror ( rc ) );
-		dhcp_finished ( dhcp, rc );
-		return;
-	}
-
-	/* Perform ProxyDHCP if applicable */
-	if ( dhcp->proxy_offer /* Have ProxyDHCP offer */ &&
-	     ( ! dhcp->no_pxedhcp ) /* ProxyDHCP not disabled */ ) {
-		DBGC ( dhcp, "DHCP %p Performing proxy DHCP\n", dhcp);
-		if ( dhcp_has_pxeopts ( dhcp->proxy_offer ) ) {
-			DBGC ( dhcp, "DHCP %p Proxy options already exists.\n", dhcp);
-			/* PXE options already present; register settings
-			 * without performing a ProxyDHCPREQUEST
-			 */
-			settings = &dhcp->proxy_offer->settings;
-			if ( ( rc = register_settings ( settings, parent,
-					   PROXYDHCP_SETTINGS_NAME ) ) != 0 ) {
-				DBGC ( dhcp, "DHCP %p could not register "
-				       "proxy settings: %s\n",
-				       dhcp, strerror ( rc ) );
-				dhcp_finished ( dhcp, rc );
-				return;
-			}
-		} else {
-			/* PXE options not present; use a ProxyDHCPREQUEST */
-			DBGC ( dhcp, "DHCP %p PXE options not present; use a ProxyDHCPREQUEST\n", dhcp);
-			dhcp_set_state ( dhcp, &dhcp_state_proxy );
-			return;
-		}
-	}
-
-	/* Terminate DHCP */
-	dhcp_finished ( dhcp, 0 );
+	/* Use lease */
+	dhcp_lease ( dhcp, dhcppkt );
 }
 
 /**
@@ -625,6 +810,8 @@ static struct dhcp_session_state dhcp_state_request = {
 	.expired		= dhcp_request_expired,
 	.tx_msgtype		= DHCPREQUEST,
 	.apply_min_timeout	= 0,
+	.timing			= offsetof ( struct dhcp_timing, request ),
+	.profiler		= &dhcp_request_profiler,
 };
 
 /**
@@ -739,6 +926,8 @@ static struct dhcp_session_state dhcp_state_proxy = {
 	.expired		= dhcp_proxy_expired,
 	.tx_msgtype		= DHCPREQUEST,
 	.apply_min_timeout	= 0,
+	.timing			= offsetof ( struct dhcp_timing, proxy ),
+	.profiler		= &dhcp_proxy_profiler,
 };
 
 /**
@@ -886,6 +1075,8 @@ static struct dhcp_session_state dhcp_state_pxebs = {
 	.expired		= dhcp_pxebs_expired,
 	.tx_msgtype		= DHCPREQUEST,
 	.apply_min_timeout	= 1,
+	.timing			= offsetof ( struct dhcp_timing, pxebs ),
+	.profiler		= &dhcp_pxebs_profiler,
 };
 
 /****************************************************************************
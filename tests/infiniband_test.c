@@ -0,0 +1,716 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+FILE_LICENCE ( GPL2_OR_LATER );
+
+/** @file
+ *
+ * Infiniband self-tests
+ *
+ */
+
+/* Forcibly enable assertions */
+#undef NDEBUG
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <byteswap.h>
+#include <ipxe/test.h>
+#include <ipxe/iobuf.h>
+#include <ipxe/device.h>
+#include <ipxe/process.h>
+#include <ipxe/profile.h>
+#include <ipxe/infiniband.h>
+#include <ipxe/ib_mi.h>
+#include <ipxe/ib_mcast.h>
+#include <ipxe/ib_pathrec.h>
+
+/** Number of sample iterations for profiling */
+#define PROFILE_COUNT 16
+
+/** Maximum number of queue pairs used for lookup tests */
+#define IB_TEST_MAX_QPS 64
+
+/** Next queue pair number to be allocated by test device */
+static unsigned long ib_test_next_qpn;
+
+/** Stride between queue pair numbers allocated by test device */
+static unsigned long ib_test_qpn_stride;
+
+/** Number of times the test device's send doorbell has been rung */
+static unsigned int ib_test_send_rings;
+
+/** Number of pending send work queue entries at last doorbell ring */
+static unsigned int ib_test_send_rung;
+
+/** Number of completed multicast group joins */
+static unsigned int ib_test_joins;
+
+/** Status code of last completed multicast group join */
+static int ib_test_join_rc;
+
+/** Test underlying device */
+static struct device ib_test_dev = {
+	.name = "ib-test",
+	.siblings = LIST_HEAD_INIT ( ib_test_dev.siblings ),
+	.children = LIST_HEAD_INIT ( ib_test_dev.children ),
+};
+
+/** Test multicast GID */
+static union ib_gid ib_test_mgid = {
+	.bytes = { 0xff, 0x12, 0x40, 0x1b, 0xff, 0xff, 0x00, 0x00,
+		   0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff },
+};
+
+/** Test unicast GID */
+static union ib_gid ib_test_gid = {
+	.bytes = { 0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		   0x00, 0x02, 0xc9, 0x03, 0x00, 0x12, 0x34, 0x56 },
+};
+
+/**
+ * Create test completion queue
+ *
+ * @v ibdev		Infiniband device
+ * @v cq		Completion queue
+ * @ret rc		Return status code
+ */
+static int ib_test_create_cq ( struct ib_device *ibdev __unused,
+			       struct ib_completion_queue *cq __unused ) {
+	return 0;
+}
+
+/**
+ * Destroy test completion queue
+ *
+ * @v ibdev		Infiniband device
+ * @v cq		Completion queue
+ */
+static void ib_test_destroy_cq ( struct ib_device *ibdev __unused,
+				 struct ib_completion_queue *cq __unused ) {
+	/* Nothing to do */
+}
+
+/**
+ * Create test queue pair
+ *
+ * @v ibdev		Infiniband device
+ * @v qp		Queue pair
+ * @ret rc		Return status code
+ */
+static int ib_test_create_qp ( struct ib_device *ibdev __unused,
+			       struct ib_queue_pair *qp ) {
+	qp->qpn = ib_test_next_qpn;
+	ib_test_next_qpn += ib_test_qpn_stride;
+	return 0;
+}
+
+/**
+ * Destroy test queue pair
+ *
+ * @v ibdev		Infiniband device
+ * @v qp		Queue pair
+ */
+static void ib_test_destroy_qp ( struct ib_device *ibdev __unused,
+				 struct ib_queue_pair *qp __unused ) {
+	/* Nothing to do */
+}
+
+/**
+ * Modify test queue pair
+ *
+ * @v ibdev		Infiniband device
+ * @v qp		Queue pair
+ * @ret rc		Return status code
+ */
+static int ib_test_modify_qp ( struct ib_device *ibdev __unused,
+			       struct ib_queue_pair *qp __unused ) {
+	return 0;
+}
+
+/**
+ * Post send work queue entry to test device
+ *
+ * @v ibdev		Infiniband device
+ * @v qp		Queue pair
+ * @v dest		Destination address vector
+ * @v iobuf		I/O buffer
+ * @ret rc		Return status code
+ *
+ * The test device never completes work queue entries, so the fill
+ * level identifies the next unused entry.  Any remaining I/O buffers
+ * are freed when the queue pair is destroyed.
+ */
+static int ib_test_post_send ( struct ib_device *ibdev __unused,
+			       struct ib_queue_pair *qp,
+			       struct ib_address_vector *dest __unused,
+			       struct io_buffer *iobuf ) {
+	assert ( qp->send.iobufs[qp->send.fill] == NULL );
+	qp->send.iobufs[qp->send.fill] = iobuf;
+	return 0;
+}
+
+/**
+ * Post receive work queue entry to test device
+ *
+ * @v ibdev		Infiniband device
+ * @v qp		Queue pair
+ * @v iobuf		I/O buffer
+ * @ret rc		Return status code
+ */
+static int ib_test_post_recv ( struct ib_device *ibdev __unused,
+			       struct ib_queue_pair *qp,
+			       struct io_buffer *iobuf ) {
+	assert ( qp->recv.iobufs[qp->recv.fill] == NULL );
+	qp->recv.iobufs[qp->recv.fill] = iobuf;
+	return 0;
+}
+
+/**
+ * Ring test device send doorbell
+ *
+ * @v ibdev		Infiniband device
+ * @v qp		Queue pair
+ */
+static void ib_test_ring_send ( struct ib_device *ibdev __unused,
+				struct ib_queue_pair *qp ) {
+	ib_test_send_rings++;
+	ib_test_send_rung = qp->send_pending;
+}
+
+/**
+ * Open test device port
+ *
+ * @v ibdev		Infiniband device
+ * @ret rc		Return status code
+ */
+static int ib_test_open ( struct ib_device *ibdev __unused ) {
+	return 0;
+}
+
+/**
+ * Close test device port
+ *
+ * @v ibdev		Infiniband device
+ */
+static void ib_test_close ( struct ib_device *ibdev __unused ) {
+	/* Nothing to do */
+}
+
+/**
+ * Attach test queue pair to multicast group
+ *
+ * @v ibdev		Infiniband device
+ * @v qp		Queue pair
+ * @v gid		Multicast GID
+ * @ret rc		Return status code
+ */
+static int ib_test_mcast_attach ( struct ib_device *ibdev __unused,
+				  struct ib_queue_pair *qp __unused,
+				  union ib_gid *gid __unused ) {
+	return 0;
+}
+
+/**
+ * Detach test queue pair from multicast group
+ *
+ * @v ibdev		Infiniband device
+ * @v qp		Queue pair
+ * @v gid		Multicast GID
+ */
+static void ib_test_mcast_detach ( struct ib_device *ibdev __unused,
+				   struct ib_queue_pair *qp __unused,
+				   union ib_gid *gid __unused ) {
+	/* Nothing to do */
+}
+
+/** Test device operations */
+static struct ib_device_operations ib_test_operations = {
+	.create_cq = ib_test_create_cq,
+	.destroy_cq = ib_test_destroy_cq,
+	.create_qp = ib_test_create_qp,
+	.modify_qp = ib_test_modify_qp,
+	.destroy_qp = ib_test_destroy_qp,
+	.post_send = ib_test_post_send,
+	.ring_send = ib_test_ring_send,
+	.post_recv = ib_test_post_recv,
+	.open = ib_test_open,
+	.close = ib_test_close,
+	.mcast_attach = ib_test_mcast_attach,
+	.mcast_detach = ib_test_mcast_detach,
+};
+
+/** Test completion queue operations */
+static struct ib_completion_queue_operations ib_test_cq_op;
+
+/** Test queue pair operations */
+static struct ib_queue_pair_operations ib_test_qp_op;
+
+/**
+ * Find work queue by walking completion queue's work queue list
+ *
+ * @v cq		Completion queue
+ * @v qpn		Queue pair number
+ * @v is_send		Find send work queue (rather than receive)
+ * @ret wq		Work queue, or NULL if not found
+ *
+ * This is the original linear lookup, retained for comparison.
+ */
+static struct ib_work_queue * ib_test_find_wq_linear ( struct
+						       ib_completion_queue *cq,
+						       unsigned long qpn,
+						       int is_send ) {
+	struct ib_work_queue *wq;
+
+	list_for_each_entry ( wq, &cq->work_queues, list ) {
+		if ( ( wq->qp->qpn == qpn ) && ( wq->is_send == is_send ) )
+			return wq;
+	}
+	return NULL;
+}
+
+/**
+ * Report work queue lookup test result
+ *
+ * @v count		Number of queue pairs
+ * @v base		First queue pair number
+ * @v stride		Distance between queue pair numbers
+ * @v file		Test code file
+ * @v line		Test code line
+ */
+static void ib_find_okx ( unsigned int count, unsigned long base,
+			  unsigned long stride, const char *file,
+			  unsigned int line ) {
+	struct ib_queue_pair *qps[IB_TEST_MAX_QPS];
+	struct profiler hashed;
+	struct profiler linear;
+	struct ib_device *ibdev;
+	struct ib_completion_queue *send_cq;
+	struct ib_completion_queue *recv_cq;
+	struct ib_queue_pair *qp;
+	unsigned long qpn;
+	unsigned int i;
+
+	/* Sanity check */
+	assert ( count <= IB_TEST_MAX_QPS );
+
+	/* Create device and completion queues */
+	ibdev = alloc_ibdev ( 0 );
+	okx ( ibdev != NULL, file, line );
+	if ( ! ibdev )
+		return;
+	ibdev->op = &ib_test_operations;
+	send_cq = ib_create_cq ( ibdev, 1, &ib_test_cq_op );
+	okx ( send_cq != NULL, file, line );
+	recv_cq = ib_create_cq ( ibdev, 1, &ib_test_cq_op );
+	okx ( recv_cq != NULL, file, line );
+
+	/* Create queue pairs, including a remapped GSI queue pair */
+	ib_test_next_qpn = base;
+	ib_test_qpn_stride = stride;
+	for ( i = 0 ; i < count ; i++ ) {
+		qps[i] = ib_create_qp ( ibdev, ( i ? IB_QPT_UD : IB_QPT_GSI ),
+					1, send_cq, 1, recv_cq,
+					&ib_test_qp_op );
+		okx ( qps[i] != NULL, file, line );
+	}
+
+	/* Verify that each work queue and queue pair can be found */
+	for ( i = 0 ; i < count ; i++ ) {
+		qp = qps[i];
+		okx ( ib_find_wq ( send_cq, qp->qpn, 1 ) == &qp->send,
+		      file, line );
+		okx ( ib_find_wq ( recv_cq, qp->qpn, 0 ) == &qp->recv,
+		      file, line );
+		okx ( ib_find_wq ( send_cq, qp->qpn, 0 ) == NULL, file, line );
+		okx ( ib_find_wq ( recv_cq, qp->qpn, 1 ) == NULL, file, line );
+		okx ( ib_find_qp_qpn ( ibdev, qp->qpn ) == qp, file, line );
+	}
+	okx ( ib_find_qp_qpn ( ibdev, IB_QPN_GSI ) == qps[0], file, line );
+	okx ( ib_find_wq ( recv_cq, ( base + ( count * stride ) ), 0 ) == NULL,
+	      file, line );
+
+	/* Profile lookup of the oldest queue pair, which is at the
+	 * tail of the work queue lists.
+	 */
+	qpn = qps[0]->qpn;
+	memset ( &hashed, 0, sizeof ( hashed ) );
+	memset ( &linear, 0, sizeof ( linear ) );
+	for ( i = 0 ; i < PROFILE_COUNT ; i++ ) {
+		profile_start ( &hashed );
+		ib_find_wq ( recv_cq, qpn, 0 );
+		profile_stop ( &hashed );
+		profile_start ( &linear );
+		ib_test_find_wq_linear ( recv_cq, qpn, 0 );
+		profile_stop ( &linear );
+	}
+	DBG ( "INFINIBAND found work queue among %d queue pairs in %ld +/- "
+	      "%ld ticks (linear %ld +/- %ld ticks)\n", count,
+	      profile_mean ( &hashed ), profile_stddev ( &hashed ),
+	      profile_mean ( &linear ), profile_stddev ( &linear ) );
+
+	/* Destroy queue pairs and verify they can no longer be found */
+	for ( i = 0 ; i < count ; i++ ) {
+		qpn = qps[i]->qpn;
+		ib_destroy_qp ( ibdev, qps[i] );
+		okx ( ib_find_wq ( recv_cq, qpn, 0 ) == NULL, file, line );
+		okx ( ib_find_qp_qpn ( ibdev, qpn ) == NULL, file, line );
+	}
+	okx ( ib_find_qp_qpn ( ibdev, IB_QPN_GSI ) == NULL, file, line );
+
+	/* Destroy completion queues and device */
+	ib_destroy_cq ( ibdev, recv_cq );
+	ib_destroy_cq ( ibdev, send_cq );
+	ibdev_put ( ibdev );
+}
+#define ib_find_ok( count, base, stride ) \
+	ib_find_okx ( count, base, stride, __FILE__, __LINE__ )
+
+/**
+ * Report send batching test result
+ *
+ * @v count		Number of entries to post within batch
+ * @v file		Test code file
+ * @v line		Test code line
+ */
+static void ib_batch_okx ( unsigned int count, const char *file,
+			   unsigned int line ) {
+	struct ib_device *ibdev;
+	struct ib_completion_queue *cq;
+	struct ib_queue_pair *qp;
+	struct io_buffer *iobuf;
+	unsigned int i;
+
+	/* Create device, completion queue and queue pair.  Posted I/O
+	 * buffers are freed when the queue pair is destroyed.
+	 */
+	ibdev = alloc_ibdev ( 0 );
+	okx ( ibdev != NULL, file, line );
+	if ( ! ibdev )
+		return;
+	ibdev->op = &ib_test_operations;
+	cq = ib_create_cq ( ibdev, 1, &ib_test_cq_op );
+	okx ( cq != NULL, file, line );
+	ib_test_next_qpn = 0x48;
+	ib_test_qpn_stride = 1;
+	qp = ib_create_qp ( ibdev, IB_QPT_UD, ( 2 * count ), cq, 1, cq,
+			    &ib_test_qp_op );
+	okx ( qp != NULL, file, line );
+	if ( ! ( cq && qp ) )
+		goto err;
+
+	/* Check that each entry posted outside a batch rings once */
+	ib_test_send_rings = 0;
+	for ( i = 0 ; i < count ; i++ ) {
+		iobuf = alloc_iob ( 1 );
+		okx ( iobuf != NULL, file, line );
+		okx ( ib_post_send ( ibdev, qp, NULL, iobuf ) == 0,
+		      file, line );
+		okx ( ib_test_send_rings == ( i + 1 ), file, line );
+		okx ( ib_test_send_rung == 1, file, line );
+		okx ( qp->send_pending == 0, file, line );
+	}
+
+	/* Check that entries posted within a batch ring once on commit */
+	ib_test_send_rings = 0;
+	ib_begin_send ( qp );
+	for ( i = 0 ; i < count ; i++ ) {
+		iobuf = alloc_iob ( 1 );
+		okx ( iobuf != NULL, file, line );
+		okx ( ib_post_send ( ibdev, qp, NULL, iobuf ) == 0,
+		      file, line );
+		okx ( qp->send_pending == ( i + 1 ), file, line );
+	}
+	okx ( ib_test_send_rings == 0, file, line );
+	ib_commit_send ( ibdev, qp );
+	okx ( ib_test_send_rings == 1, file, line );
+	okx ( ib_test_send_rung == count, file, line );
+	okx ( qp->send_pending == 0, file, line );
+	okx ( qp->send_batch == 0, file, line );
+
+	/* Check that committing an empty batch does not ring */
+	ib_test_send_rings = 0;
+	ib_begin_send ( qp );
+	ib_commit_send ( ibdev, qp );
+	okx ( ib_test_send_rings == 0, file, line );
+	okx ( qp->send_batch == 0, file, line );
+
+	/* Check that committing with no batch open does not ring */
+	ib_commit_send ( ibdev, qp );
+	okx ( ib_test_send_rings == 0, file, line );
+
+ err:
+	if ( qp )
+		ib_destroy_qp ( ibdev, qp );
+	if ( cq )
+		ib_destroy_cq ( ibdev, cq );
+	ibdev_put ( ibdev );
+}
+#define ib_batch_ok( count ) ib_batch_okx ( count, __FILE__, __LINE__ )
+
+/**
+ * Handle test multicast group join completion
+ *
+ * @v ibdev		Infiniband device
+ * @v qp		Queue pair
+ * @v membership	Multicast group membership
+ * @v rc		Status code
+ * @v mad		Response MAD (or NULL on error)
+ */
+static void ib_test_joined ( struct ib_device *ibdev __unused,
+			     struct ib_queue_pair *qp __unused,
+			     struct ib_mc_membership *membership __unused,
+			     int rc, union ib_mad *mad __unused ) {
+	ib_test_joins++;
+	ib_test_join_rc = rc;
+}
+
+/**
+ * Set test device port state
+ *
+ * @v ibdev		Infiniband device
+ * @v port_state	Port state
+ */
+static void ib_test_port_state ( struct ib_device *ibdev,
+				 unsigned int port_state ) {
+	ibdev->port_state = port_state;
+	ib_link_state_changed ( ibdev );
+}
+
+/**
+ * Open test device and train port up to the active state
+ *
+ * @v ibdev		Infiniband device
+ * @ret rc		Return status code
+ */
+static int ib_test_up ( struct ib_device *ibdev ) {
+	int rc;
+
+	if ( ( rc = ib_open ( ibdev ) ) != 0 )
+		return rc;
+	ib_test_port_state ( ibdev, IB_PORT_STATE_INIT );
+	ib_test_port_state ( ibdev, IB_PORT_STATE_ARMED );
+	ib_test_port_state ( ibdev, IB_PORT_STATE_ACTIVE );
+	return 0;
+}
+
+/**
+ * Respond to oldest outstanding subnet administration request
+ *
+ * @v ibdev		Infiniband device
+ * @v mad		Response MAD
+ * @ret responded	A request was outstanding
+ */
+static int ib_test_respond ( struct ib_device *ibdev, union ib_mad *mad ) {
+	struct ib_mad_transaction *madx;
+
+	madx = list_first_entry ( &ibdev->gsi->madx,
+				  struct ib_mad_transaction, list );
+	if ( ! madx )
+		return 0;
+	mad->hdr.status = htons ( IB_MGMT_STATUS_OK );
+	mad->hdr.method = IB_MGMT_METHOD_GET_RESP;
+	madx->op->complete ( ibdev, ibdev->gsi, madx, 0, mad, NULL );
+	return 1;
+}
+
+/**
+ * Allocate and register test device
+ *
+ * @ret ibdev		Infiniband device, or NULL on error
+ */
+static struct ib_device * ib_test_register ( void ) {
+	struct ib_device *ibdev;
+
+	ibdev = alloc_ibdev ( 0 );
+	if ( ! ibdev )
+		return NULL;
+	ibdev->op = &ib_test_operations;
+	ibdev->dev = &ib_test_dev;
+	ibdev->port_state = IB_PORT_STATE_DOWN;
+	ibdev->lid = 0x0011;
+	ibdev->sm_lid = 0x0001;
+	memcpy ( &ibdev->gid, &ib_test_gid, sizeof ( ibdev->gid ) );
+	if ( register_ibdev ( ibdev ) != 0 ) {
+		ibdev_put ( ibdev );
+		return NULL;
+	}
+	return ibdev;
+}
+
+/**
+ * Unregister and free test device
+ *
+ * @v ibdev		Infiniband device
+ */
+static void ib_test_unregister ( struct ib_device *ibdev ) {
+
+	unregister_ibdev ( ibdev );
+	ibdev_put ( ibdev );
+}
+
+/**
+ * Perform multicast membership cache tests
+ *
+ */
+static void ib_mcast_cache_test ( void ) {
+	struct ib_mc_membership membership;
+	struct ib_device *ibdev;
+	struct ib_completion_queue *cq;
+	struct ib_queue_pair *qp;
+	union ib_mad mad;
+
+	/* Create and open device */
+	ibdev = ib_test_register();
+	ok ( ibdev != NULL );
+	if ( ! ibdev )
+		return;
+	ok ( ib_test_up ( ibdev ) == 0 );
+	cq = ib_create_cq ( ibdev, 1, &ib_test_cq_op );
+	ok ( cq != NULL );
+	qp = ib_create_qp ( ibdev, IB_QPT_UD, 1, cq, 1, cq, &ib_test_qp_op );
+	ok ( qp != NULL );
+
+	/* Join group via subnet administrator */
+	memset ( &membership, 0, sizeof ( membership ) );
+	ib_test_joins = 0;
+	ok ( ib_mcast_join ( ibdev, qp, &membership, &ib_test_mgid,
+			     ib_test_joined ) == 0 );
+	ok ( membership.madx != NULL );
+	memset ( &mad, 0, sizeof ( mad ) );
+	mad.sa.sa_data.mc_member_record.qkey = htonl ( 0x12345678UL );
+	ok ( ib_test_respond ( ibdev, &mad ) );
+	ok ( ib_test_joins == 1 );
+	ok ( ib_test_join_rc == 0 );
+	ok ( qp->qkey == 0x12345678UL );
+	ib_mcast_leave ( ibdev, qp, &membership );
+	ib_destroy_qp ( ibdev, qp );
+
+	/* Reopen device, and check that the port training up to the
+	 * active state does not discard the cached membership.
+	 */
+	ib_close ( ibdev );
+	ok ( ib_test_up ( ibdev ) == 0 );
+	qp = ib_create_qp ( ibdev, IB_QPT_UD, 1, cq, 1, cq, &ib_test_qp_op );
+	ok ( qp != NULL );
+	ok ( ib_mcast_join ( ibdev, qp, &membership, &ib_test_mgid,
+			     ib_test_joined ) == 0 );
+	ok ( membership.madx == NULL );
+	ok ( qp->qkey == 0x12345678UL );
+	while ( process_running ( &membership.process ) )
+		step();
+	ok ( ib_test_joins == 2 );
+	ok ( ib_test_join_rc == 0 );
+	ib_mcast_leave ( ibdev, qp, &membership );
+
+	/* Check that losing the active link discards the membership */
+	ib_test_port_state ( ibdev, IB_PORT_STATE_DOWN );
+	ib_test_port_state ( ibdev, IB_PORT_STATE_ACTIVE );
+	ok ( ib_mcast_join ( ibdev, qp, &membership, &ib_test_mgid,
+			     ib_test_joined ) == 0 );
+	ok ( membership.madx != NULL );
+	ib_mcast_leave ( ibdev, qp, &membership );
+
+	/* Destroy queue pair, completion queue and device */
+	ib_destroy_qp ( ibdev, qp );
+	ib_destroy_cq ( ibdev, cq );
+	ib_close ( ibdev );
+	ib_test_unregister ( ibdev );
+}
+
+/**
+ * Perform path cache tests
+ *
+ */
+static void ib_path_cache_test ( void ) {
+	struct ib_address_vector av;
+	struct ib_device *ibdev;
+	union ib_mad mad;
+
+	/* Create and open device */
+	ibdev = ib_test_register();
+	ok ( ibdev != NULL );
+	if ( ! ibdev )
+		return;
+	ok ( ib_test_up ( ibdev ) == 0 );
+
+	/* Resolve path via subnet administrator */
+	memset ( &av, 0, sizeof ( av ) );
+	av.gid_present = 1;
+	memcpy ( &av.gid, &ib_test_gid, sizeof ( av.gid ) );
+	ok ( ib_resolve_path ( ibdev, &av ) != 0 );
+	memset ( &mad, 0, sizeof ( mad ) );
+	mad.sa.sa_data.path_record.dlid = htons ( 0x0022 );
+	mad.sa.sa_data.path_record.reserved__sl = 3;
+	ok ( ib_test_respond ( ibdev, &mad ) );
+	ok ( ib_resolve_path ( ibdev, &av ) == 0 );
+	ok ( av.lid == 0x0022 );
+	ok ( av.sl == 3 );
+	ok ( list_empty ( &ibdev->gsi->madx ) );
+
+	/* Check that the path survives reopening the device */
+	ib_close ( ibdev );
+	ok ( ib_test_up ( ibdev ) == 0 );
+	ok ( list_empty ( &ibdev->gsi->madx ) );
+	av.lid = 0;
+	ok ( ib_resolve_path ( ibdev, &av ) == 0 );
+	ok ( av.lid == 0x0022 );
+	ok ( list_empty ( &ibdev->gsi->madx ) );
+
+	/* Check that a change of local LID invalidates the path */
+	ibdev->lid = 0x0012;
+	ok ( ib_resolve_path ( ibdev, &av ) != 0 );
+	mad.sa.sa_data.path_record.dlid = htons ( 0x0023 );
+	ok ( ib_test_respond ( ibdev, &mad ) );
+	ok ( ib_resolve_path ( ibdev, &av ) == 0 );
+	ok ( av.lid == 0x0023 );
+
+	/* Close and destroy device */
+	ib_close ( ibdev );
+	ib_test_unregister ( ibdev );
+}
+
+/**
+ * Perform Infiniband self-tests
+ *
+ */
+static void infiniband_test_exec ( void ) {
+
+	/* Sequentially allocated queue pair numbers */
+	ib_find_ok ( 1, 0x48, 1 );
+	ib_find_ok ( 8, 0x48, 1 );
+	ib_find_ok ( IB_TEST_MAX_QPS, 0x48, 1 );
+
+	/* Queue pair numbers differing only in high-order bits */
+	ib_find_ok ( IB_TEST_MAX_QPS, 0x40, 0x1000 );
+	ib_find_ok ( IB_TEST_MAX_QPS, 0x40, 0x10000 );
+
+	/* Send batching */
+	ib_batch_ok ( 1 );
+	ib_batch_ok ( 8 );
+
+	/* Path and multicast membership caches */
+	ib_mcast_cache_test();
+	ib_path_cache_test();
+}
+
+/** Infiniband self-test */
+struct self_test infiniband_test __self_test = {
+	.name = "infiniband",
+	.exec = infiniband_test_exec,
+};
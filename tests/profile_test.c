@@ -117,6 +117,81 @@ static void profile_okx ( struct profile_test *test, const char *file,
 }
 #define profile_ok( test ) profile_okx ( test, __FILE__, __LINE__ )
 
+/**
+ * Report a profiling histogram bucket test result
+ *
+ * @v sample		Sample value
+ * @v file		Test code file
+ * @v line		Test code line
+ */
+static void profile_hist_okx ( unsigned long sample, const char *file,
+			       unsigned int line ) {
+	unsigned int index;
+
+	/* Check that sample lies within its bucket */
+	index = profile_hist_index ( sample );
+	okx ( index < PROFILE_HIST_MAX_BUCKETS, file, line );
+	okx ( sample <= profile_hist_limit ( index ), file, line );
+	if ( index )
+		okx ( sample > profile_hist_limit ( index - 1 ), file, line );
+}
+#define profile_hist_ok( sample )					\
+	profile_hist_okx ( sample, __FILE__, __LINE__ )
+
+/**
+ * Report a profiling percentile test result
+ *
+ * @v count		Number of samples (1 to count inclusive)
+ * @v p50		Expected 50th percentile
+ * @v p99		Expected 99th percentile
+ * @v file		Test code file
+ * @v line		Test code line
+ */
+static void profile_percentile_okx ( unsigned long count, unsigned long p50,
+				     unsigned long p99, const char *file,
+				     unsigned int line ) {
+	static unsigned int hist[PROFILE_HIST_MAX_BUCKETS];
+	struct profiler profiler;
+	unsigned long i;
+
+	/* Initialise profiler and histogram */
+	memset ( &profiler, 0, sizeof ( profiler ) );
+	memset ( hist, 0, sizeof ( hist ) );
+
+	/* Record sample values */
+	for ( i = 1 ; i <= count ; i++ ) {
+		profile_update ( &profiler, i );
+		hist[ profile_hist_index ( i ) ]++;
+	}
+
+	/* Check histogram percentiles (independent of whether or not
+	 * profilers record histograms in this build).
+	 */
+	okx ( profile_hist_percentile ( hist, PROFILE_HIST_MAX_BUCKETS, count,
+					count, 50 ) == p50, file, line );
+	okx ( profile_hist_percentile ( hist, PROFILE_HIST_MAX_BUCKETS, count,
+					count, 99 ) == p99, file, line );
+	okx ( profile_hist_percentile ( hist, PROFILE_HIST_MAX_BUCKETS, count,
+					count, 100 ) == count, file, line );
+	okx ( profile_hist_percentile ( hist, PROFILE_HIST_MAX_BUCKETS, count,
+					count, 0 ) == 0, file, line );
+
+	/* Check resulting statistics */
+	okx ( profiler.max == count, file, line );
+	if ( PROFILE_HIST_BUCKETS ) {
+		okx ( profile_percentile ( &profiler, 50 ) == p50, file, line );
+		okx ( profile_percentile ( &profiler, 99 ) == p99, file, line );
+	}
+
+	/* Check reset */
+	profile_reset ( &profiler );
+	okx ( profiler.count == 0, file, line );
+	okx ( profiler.max == 0, file, line );
+	okx ( profile_percentile ( &profiler, 99 ) == 0, file, line );
+}
+#define profile_percentile_ok( count, p50, p99 )			\
+	profile_percentile_okx ( count, p50, p99, __FILE__, __LINE__ )
+
 /**
  * Perform profiling self-tests
  *
@@ -131,6 +206,22 @@ static void profile_test_exec ( void ) {
 	profile_ok ( &small );
 	profile_ok ( &random );
 	profile_ok ( &large );
+
+	/* Perform histogram bucket tests */
+	profile_hist_ok ( 0 );
+	profile_hist_ok ( 7 );
+	profile_hist_ok ( 8 );
+	profile_hist_ok ( 9 );
+	profile_hist_ok ( 511 );
+	profile_hist_ok ( 512 );
+	profile_hist_ok ( 1000 );
+	profile_hist_ok ( 0x7fffffffUL );
+
+	/* Perform percentile tests */
+	profile_percentile_ok ( 1, 1, 1 );
+	profile_percentile_ok ( 7, 4, 7 );
+	profile_percentile_ok ( 100, 55, 100 );
+	profile_percentile_ok ( 1000, 511, 1000 );
 }
 
 /** Profiling self-test */
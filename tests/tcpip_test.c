@@ -32,13 +32,40 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <byteswap.h>
 #include <ipxe/test.h>
 #include <ipxe/profile.h>
+#include <ipxe/iobuf.h>
+#include <ipxe/in.h>
+#include <ipxe/interface.h>
+#include <ipxe/xfer.h>
+#include <ipxe/device.h>
+#include <ipxe/open.h>
+#include <ipxe/netdevice.h>
+#include <ipxe/ethernet.h>
+#include <ipxe/settings.h>
 #include <ipxe/tcpip.h>
+#include <ipxe/udp.h>
+#include <ipxe/tcp.h>
 
 /** Number of sample iterations for profiling */
 #define PROFILE_COUNT 16
 
+/** Maximum number of connections used for demultiplexing tests */
+#define TCPIP_DEMUX_MAX 256
+
+/** First local port used for demultiplexing tests */
+#define TCPIP_DEMUX_PORT 0xc000
+
+/** Local IPv4 address of TCP demultiplexing test network device */
+#define TCPIP_DEMUX_LOCAL 0xc0a80001UL
+
+/** Peer IPv4 address used for TCP demultiplexing tests */
+#define TCPIP_DEMUX_PEER 0xc0a80002UL
+
+/** Netmask of TCP demultiplexing test network device */
+#define TCPIP_DEMUX_NETMASK 0xffffff00UL
+
 /** A TCP/IP fixed-data test */
 struct tcpip_test {
 	/** Data */
@@ -214,11 +241,410 @@ static void tcpip_random_okx ( struct tcpip_random_test *test,
 }
 #define tcpip_random_ok( test ) tcpip_random_okx ( test, __FILE__, __LINE__ )
 
+/**
+ * Report port hash distribution test result
+ *
+ * @v count		Number of ports
+ * @v base		First port
+ * @v stride		Distance between ports
+ * @v file		Test code file
+ * @v line		Test code line
+ *
+ * The longest hash chain (and hence the per-packet demultiplexing
+ * cost) must not exceed the minimum possible for the number of ports.
+ */
+static void tcpip_hash_okx ( unsigned int count, unsigned int base,
+			     unsigned int stride, const char *file,
+			     unsigned int line ) {
+	unsigned int chains[TCPIP_PORT_HASH_SIZE];
+	unsigned int longest = 0;
+	unsigned int bucket;
+	unsigned int i;
+
+	memset ( chains, 0, sizeof ( chains ) );
+	for ( i = 0 ; i < count ; i++ ) {
+		bucket = tcpip_port_hash ( ( base + ( i * stride ) ) & 0xffff );
+		okx ( bucket < TCPIP_PORT_HASH_SIZE, file, line );
+		if ( ++chains[bucket] > longest )
+			longest = chains[bucket];
+	}
+	okx ( longest <= ( ( count + TCPIP_PORT_HASH_SIZE - 1 ) /
+			   TCPIP_PORT_HASH_SIZE ), file, line );
+}
+#define tcpip_hash_ok( count, base, stride ) \
+	tcpip_hash_okx ( count, base, stride, __FILE__, __LINE__ )
+
+/** A UDP demultiplexing test receiver */
+struct tcpip_demux_sink {
+	/** Data transfer interface */
+	struct interface xfer;
+	/** Number of datagrams received */
+	unsigned int count;
+};
+
+/** UDP demultiplexing test receivers */
+static struct tcpip_demux_sink tcpip_demux_sinks[TCPIP_DEMUX_MAX];
+
+/**
+ * Receive datagram on UDP demultiplexing test receiver
+ *
+ * @v sink		Test receiver
+ * @v iobuf		I/O buffer
+ * @v meta		Data transfer metadata
+ * @ret rc		Return status code
+ */
+static int tcpip_demux_deliver ( struct tcpip_demux_sink *sink,
+				 struct io_buffer *iobuf,
+				 struct xfer_metadata *meta __unused ) {
+
+	sink->count++;
+	free_iob ( iobuf );
+	return 0;
+}
+
+/** UDP demultiplexing test receiver interface operations */
+static struct interface_operation tcpip_demux_operations[] = {
+	INTF_OP ( xfer_deliver, struct tcpip_demux_sink *,
+		  tcpip_demux_deliver ),
+};
+
+/** UDP demultiplexing test receiver interface descriptor */
+static struct interface_descriptor tcpip_demux_desc =
+	INTF_DESC ( struct tcpip_demux_sink, xfer, tcpip_demux_operations );
+
+/**
+ * Deliver UDP test datagram
+ *
+ * @v port		Destination port
+ * @ret rc		Return status code
+ */
+static int tcpip_demux_rx ( unsigned int port ) {
+	struct sockaddr_tcpip st_src;
+	struct sockaddr_tcpip st_dest;
+	struct udp_header *udphdr;
+	struct io_buffer *iobuf;
+
+	iobuf = alloc_iob ( sizeof ( *udphdr ) );
+	assert ( iobuf != NULL );
+	udphdr = iob_put ( iobuf, sizeof ( *udphdr ) );
+	udphdr->src = htons ( 69 );
+	udphdr->dest = htons ( port );
+	udphdr->len = htons ( sizeof ( *udphdr ) );
+	udphdr->chksum = 0;
+	memset ( &st_src, 0, sizeof ( st_src ) );
+	st_src.st_family = AF_INET;
+	memset ( &st_dest, 0, sizeof ( st_dest ) );
+	st_dest.st_family = AF_INET;
+	return udp_protocol.rx ( iobuf, NULL, &st_src, &st_dest,
+				 TCPIP_EMPTY_CSUM );
+}
+
+/**
+ * Report UDP demultiplexing test result
+ *
+ * @v count		Number of open UDP connections
+ * @v file		Test code file
+ * @v line		Test code line
+ */
+static void tcpip_demux_okx ( unsigned int count, const char *file,
+			      unsigned int line ) {
+	struct tcpip_demux_sink *sink;
+	struct sockaddr_tcpip peer;
+	struct sockaddr_tcpip local;
+	struct profiler profiler;
+	unsigned int i;
+
+	/* Sanity check */
+	assert ( count <= TCPIP_DEMUX_MAX );
+
+	/* Open connections */
+	memset ( &peer, 0, sizeof ( peer ) );
+	peer.st_family = AF_INET;
+	peer.st_port = htons ( 69 );
+	for ( i = 0 ; i < count ; i++ ) {
+		sink = &tcpip_demux_sinks[i];
+		memset ( sink, 0, sizeof ( *sink ) );
+		intf_init ( &sink->xfer, &tcpip_demux_desc, NULL );
+		memset ( &local, 0, sizeof ( local ) );
+		local.st_port = htons ( TCPIP_DEMUX_PORT + i );
+		okx ( udp_open ( &sink->xfer, ( struct sockaddr * ) &peer,
+				 ( struct sockaddr * ) &local ) == 0,
+		      file, line );
+	}
+
+	/* Verify that each datagram reaches the correct connection */
+	for ( i = 0 ; i < count ; i++ ) {
+		okx ( tcpip_demux_rx ( TCPIP_DEMUX_PORT + i ) == 0,
+		      file, line );
+		okx ( tcpip_demux_sinks[i].count == 1, file, line );
+	}
+
+	/* Profile demultiplexing to the oldest connection */
+	memset ( &profiler, 0, sizeof ( profiler ) );
+	for ( i = 0 ; i < PROFILE_COUNT ; i++ ) {
+		profile_start ( &profiler );
+		tcpip_demux_rx ( TCPIP_DEMUX_PORT );
+		profile_stop ( &profiler );
+	}
+	okx ( tcpip_demux_sinks[0].count == ( 1 + PROFILE_COUNT ), file, line );
+	tcpip_hash_okx ( count, TCPIP_DEMUX_PORT, 1, file, line );
+	DBG ( "UDP demultiplexed among %d connections in %ld +/- %ld "
+	      "ticks\n", count, profile_mean ( &profiler ),
+	      profile_stddev ( &profiler ) );
+
+	/* Close connections */
+	for ( i = 0 ; i < count ; i++ )
+		intf_shutdown ( &tcpip_demux_sinks[i].xfer, 0 );
+
+	/* Verify that closed connections no longer receive data */
+	okx ( tcpip_demux_rx ( TCPIP_DEMUX_PORT ) != 0, file, line );
+}
+#define tcpip_demux_ok( count ) tcpip_demux_okx ( count, __FILE__, __LINE__ )
+
+/**
+ * Open TCP demultiplexing test network device
+ *
+ * @v netdev		Network device
+ * @ret rc		Return status code
+ */
+static int tcpip_demux_netdev_open ( struct net_device *netdev __unused ) {
+	return 0;
+}
+
+/**
+ * Close TCP demultiplexing test network device
+ *
+ * @v netdev		Network device
+ */
+static void tcpip_demux_netdev_close ( struct net_device *netdev __unused ) {
+	/* Nothing to do */
+}
+
+/**
+ * Transmit packet via TCP demultiplexing test network device
+ *
+ * @v netdev		Network device
+ * @v iobuf		I/O buffer
+ * @ret rc		Return status code
+ */
+static int tcpip_demux_netdev_transmit ( struct net_device *netdev,
+					 struct io_buffer *iobuf ) {
+
+	/* Discard packet */
+	netdev_tx_complete ( netdev, iobuf );
+	return 0;
+}
+
+/**
+ * Poll TCP demultiplexing test network device
+ *
+ * @v netdev		Network device
+ */
+static void tcpip_demux_netdev_poll ( struct net_device *netdev __unused ) {
+	/* Nothing to do */
+}
+
+/** TCP demultiplexing test network device operations */
+static struct net_device_operations tcpip_demux_netdev_operations = {
+	.open = tcpip_demux_netdev_open,
+	.close = tcpip_demux_netdev_close,
+	.transmit = tcpip_demux_netdev_transmit,
+	.poll = tcpip_demux_netdev_poll,
+};
+
+/** TCP demultiplexing test device */
+static struct device tcpip_demux_dev = {
+	.name = "tcpip-test",
+	.siblings = LIST_HEAD_INIT ( tcpip_demux_dev.siblings ),
+	.children = LIST_HEAD_INIT ( tcpip_demux_dev.children ),
+};
+
+/**
+ * Create TCP demultiplexing test network device
+ *
+ * @ret netdev		Network device, or NULL on error
+ *
+ * TCP connections can be opened only to a routable peer, so the
+ * test network device is given an address on the peer's subnet.
+ */
+static struct net_device * tcpip_demux_netdev_create ( void ) {
+	static const uint8_t hw_addr[ETH_ALEN] =
+		{ 0x02, 0x00, 0x00, 0x00, 0x7c, 0x50 };
+	struct net_device *netdev;
+	struct settings *settings;
+	struct in_addr address;
+	struct in_addr netmask;
+
+	/* Allocate and register network device */
+	netdev = alloc_etherdev ( 0 );
+	if ( ! netdev )
+		goto err_alloc;
+	netdev_init ( netdev, &tcpip_demux_netdev_operations );
+	netdev->dev = &tcpip_demux_dev;
+	memcpy ( netdev->hw_addr, hw_addr, sizeof ( hw_addr ) );
+	if ( register_netdev ( netdev ) != 0 )
+		goto err_register;
+	if ( netdev_open ( netdev ) != 0 )
+		goto err_open;
+
+	/* Configure IPv4 address, thereby creating a route */
+	settings = netdev_settings ( netdev );
+	address.s_addr = htonl ( TCPIP_DEMUX_LOCAL );
+	netmask.s_addr = htonl ( TCPIP_DEMUX_NETMASK );
+	if ( ( store_setting ( settings, &ip_setting, &address,
+			       sizeof ( address ) ) != 0 ) ||
+	     ( store_setting ( settings, &netmask_setting, &netmask,
+			       sizeof ( netmask ) ) != 0 ) )
+		goto err_settings;
+
+	return netdev;
+
+ err_settings:
+ err_open:
+	unregister_netdev ( netdev );
+ err_register:
+	netdev_nullify ( netdev );
+	netdev_put ( netdev );
+ err_alloc:
+	return NULL;
+}
+
+/**
+ * Destroy TCP demultiplexing test network device
+ *
+ * @v netdev		Network device
+ */
+static void tcpip_demux_netdev_destroy ( struct net_device *netdev ) {
+
+	unregister_netdev ( netdev );
+	netdev_nullify ( netdev );
+	netdev_put ( netdev );
+}
+
+/**
+ * Deliver TCP test segment
+ *
+ * @v port		Destination port
+ * @ret rc		Return status code
+ *
+ * The segment carries no flags and no data, and so is accepted and
+ * discarded by any connection bound to the destination port.
+ */
+static int tcpip_tcp_demux_rx ( unsigned int port ) {
+	struct sockaddr_tcpip st_src;
+	struct sockaddr_tcpip st_dest;
+	struct tcp_header *tcphdr;
+	struct io_buffer *iobuf;
+
+	iobuf = alloc_iob ( sizeof ( *tcphdr ) );
+	assert ( iobuf != NULL );
+	tcphdr = iob_put ( iobuf, sizeof ( *tcphdr ) );
+	memset ( tcphdr, 0, sizeof ( *tcphdr ) );
+	tcphdr->src = htons ( 80 );
+	tcphdr->dest = htons ( port );
+	tcphdr->hlen = ( ( sizeof ( *tcphdr ) / 4 ) << 4 );
+	tcphdr->csum = tcpip_chksum ( tcphdr, sizeof ( *tcphdr ) );
+	memset ( &st_src, 0, sizeof ( st_src ) );
+	st_src.st_family = AF_INET;
+	memset ( &st_dest, 0, sizeof ( st_dest ) );
+	st_dest.st_family = AF_INET;
+	return tcp_protocol.rx ( iobuf, NULL, &st_src, &st_dest,
+				 TCPIP_EMPTY_CSUM );
+}
+
+/**
+ * Report TCP demultiplexing test result
+ *
+ * @v netdev		Network device providing route to peer
+ * @v count		Number of open TCP connections
+ * @v file		Test code file
+ * @v line		Test code line
+ */
+static void tcpip_tcp_demux_okx ( struct net_device *netdev,
+				  unsigned int count, const char *file,
+				  unsigned int line ) {
+	struct tcpip_demux_sink *sink;
+	struct sockaddr_in peer;
+	struct sockaddr_in local;
+	struct profiler profiler;
+	unsigned int i;
+
+	/* Sanity check */
+	assert ( count <= TCPIP_DEMUX_MAX );
+	okx ( netdev != NULL, file, line );
+	if ( ! netdev )
+		return;
+
+	/* Open connections */
+	memset ( &peer, 0, sizeof ( peer ) );
+	peer.sin_family = AF_INET;
+	peer.sin_addr.s_addr = htonl ( TCPIP_DEMUX_PEER );
+	peer.sin_port = htons ( 80 );
+	for ( i = 0 ; i < count ; i++ ) {
+		sink = &tcpip_demux_sinks[i];
+		memset ( sink, 0, sizeof ( *sink ) );
+		intf_init ( &sink->xfer, &tcpip_demux_desc, NULL );
+		memset ( &local, 0, sizeof ( local ) );
+		local.sin_family = AF_INET;
+		local.sin_port = htons ( TCPIP_DEMUX_PORT + i );
+		okx ( xfer_open_socket ( &sink->xfer, SOCK_STREAM,
+					 ( struct sockaddr * ) &peer,
+					 ( struct sockaddr * ) &local ) == 0,
+		      file, line );
+	}
+
+	/* Verify that each segment finds a connection, and that
+	 * segments to unbound ports do not.
+	 */
+	for ( i = 0 ; i < count ; i++ ) {
+		okx ( tcpip_tcp_demux_rx ( TCPIP_DEMUX_PORT + i ) == 0,
+		      file, line );
+	}
+	okx ( tcpip_tcp_demux_rx ( TCPIP_DEMUX_PORT + count ) != 0,
+	      file, line );
+	okx ( tcpip_tcp_demux_rx ( TCPIP_DEMUX_PORT - 1 ) != 0, file, line );
+
+	/* Check that the lookup cost is bounded for these ports */
+	tcpip_hash_okx ( count, TCPIP_DEMUX_PORT, 1, file, line );
+
+	/* Profile demultiplexing to the oldest connection */
+	memset ( &profiler, 0, sizeof ( profiler ) );
+	for ( i = 0 ; i < PROFILE_COUNT ; i++ ) {
+		profile_start ( &profiler );
+		tcpip_tcp_demux_rx ( TCPIP_DEMUX_PORT );
+		profile_stop ( &profiler );
+	}
+	DBG ( "TCP demultiplexed among %d connections in %ld +/- %ld "
+	      "ticks\n", count, profile_mean ( &profiler ),
+	      profile_stddev ( &profiler ) );
+
+	/* Close every other connection, and verify that only the
+	 * remaining connections are still found.
+	 */
+	for ( i = 0 ; i < count ; i += 2 )
+		intf_shutdown ( &tcpip_demux_sinks[i].xfer, 0 );
+	for ( i = 0 ; i < count ; i++ ) {
+		okx ( ( tcpip_tcp_demux_rx ( TCPIP_DEMUX_PORT + i ) == 0 ) ==
+		      ( i & 1 ), file, line );
+	}
+
+	/* Close remaining connections */
+	for ( i = 1 ; i < count ; i += 2 )
+		intf_shutdown ( &tcpip_demux_sinks[i].xfer, 0 );
+	for ( i = 0 ; i < count ; i++ ) {
+		okx ( tcpip_tcp_demux_rx ( TCPIP_DEMUX_PORT + i ) != 0,
+		      file, line );
+	}
+}
+#define tcpip_tcp_demux_ok( netdev, count ) \
+	tcpip_tcp_demux_okx ( netdev, count, __FILE__, __LINE__ )
+
 /**
  * Perform TCP/IP self-tests
  *
  */
 static void tcpip_test_exec ( void ) {
+	struct net_device *netdev;
 
 	tcpip_ok ( &empty );
 	tcpip_ok ( &one_byte );
@@ -230,6 +656,19 @@ static void tcpip_test_exec ( void ) {
 	tcpip_random_ok ( &random_unaligned_2 );
 	tcpip_random_ok ( &random_aligned_truncated );
 	tcpip_random_ok ( &partial );
+	tcpip_hash_ok ( TCPIP_PORT_HASH_SIZE, 1024, 1 );
+	tcpip_hash_ok ( TCPIP_PORT_HASH_SIZE, 49152, 64 );
+	tcpip_hash_ok ( 16, 0, 4096 );
+	tcpip_hash_ok ( 1024, 32768, 1 );
+	tcpip_demux_ok ( 1 );
+	tcpip_demux_ok ( 16 );
+	tcpip_demux_ok ( TCPIP_DEMUX_MAX );
+	netdev = tcpip_demux_netdev_create();
+	tcpip_tcp_demux_ok ( netdev, 1 );
+	tcpip_tcp_demux_ok ( netdev, 16 );
+	tcpip_tcp_demux_ok ( netdev, TCPIP_DEMUX_MAX );
+	if ( netdev )
+		tcpip_demux_netdev_destroy ( netdev );
 }
 
 /** TCP/IP self-test */
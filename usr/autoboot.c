@@ -39,6 +39,7 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <ipxe/image.h>
 #include <ipxe/timer.h>
 #include <ipxe/vlan.h>
+#include <ipxe/device.h>
 #include <usr/ifmgmt.h>
 #include <usr/route.h>
 #include <usr/imgmgmt.h>
@@ -69,11 +70,21 @@ static struct device_description autoboot_desc;
 /** Autoboot device tester */
 static int ( * is_autoboot_device ) ( struct net_device *netdev );
 
+/** Network device already configured by concurrent autoconfiguration */
+static struct net_device *autoboot_configured;
+
 /* Disambiguate the various error causes */
 #define ENOENT_BOOT __einfo_error ( EINFO_ENOENT_BOOT )
 #define EINFO_ENOENT_BOOT \
 	__einfo_uniqify ( EINFO_ENOENT, 0x01, "Nothing to boot" )
 
+/** Concurrent autoconfiguration is enabled */
+#ifdef AUTOBOOT_CONCURRENT
+#define AUTOBOOT_CONCURRENT_ENABLED 1
+#else
+#define AUTOBOOT_CONCURRENT_ENABLED 0
+#endif
+
 #define NORMAL	"\033[0m"
 #define BOLD	"\033[1m"
 #define CYAN	"\033[36m"
@@ -470,6 +481,12 @@ int netboot ( struct net_device *netdev ) {
 		/* Give some time to the network to settle.
 		 * Switches may be still building their routing tables */
 		ifnetwork_wait ( netdev, LINK_WAIT_TIMEOUT, NETWORK_WAIT_TIMEOUT );
+	} else if ( netdev == autoboot_configured ) {
+		/* Already configured concurrently with other devices;
+		 * any retry must configure the device afresh.
+		 */
+		autoboot_configured = NULL;
+		rc = 0;
 	} else {
 		rc = ifconf ( netdev, NULL );
 	}
@@ -631,14 +648,74 @@ void set_autoboot_ll_addr ( const void *ll_addr, size_t len ) {
 	is_autoboot_device = is_autoboot_ll_addr;
 }
 
+/**
+ * Check if network device boots from a statically configured iSCSI target
+ *
+ * @v netdev		Network device
+ * @ret is_static	Network device does not use DHCP
+ */
+static int is_static_iscsi_device ( struct net_device *netdev ) {
+	struct settings *driver_settings;
+	char buf[20] = { 0 };
+	int rc;
+
+	if ( ! nv_settings_root )
+		return 0;
+	driver_settings = driver_settings_from_netdev ( netdev );
+	if ( driver_settings_get_boot_prot_val ( driver_settings ) !=
+	     BOOT_PROTOCOL_ISCSI )
+		return 0;
+	rc = fetchf_setting ( driver_settings, &dhcp_ip_setting, NULL, NULL,
+			      buf, sizeof ( buf ) );
+	return ( ! ( ( rc > 0 ) && ( buf[0] == 'E' ) ) );
+}
+
+/**
+ * Select network device for concurrent autoconfiguration
+ *
+ * @v netdev		Network device
+ * @ret candidate	Network device to configure, or NULL to skip
+ */
+static struct net_device * autoboot_candidate ( struct net_device *netdev ) {
+	struct net_device *vlan;
+
+	/* Skip any non-matching devices, if applicable */
+	if ( is_autoboot_device && ( ! is_autoboot_device ( netdev ) ) )
+		return NULL;
+
+	/* Use the VLAN device in place of the trunk device */
+	if ( ( vlan = vlan_present ( netdev ) ) )
+		netdev = vlan;
+	else if ( vlan_tag ( netdev ) )
+		return NULL;
+
+	/* Skip devices which do not use DHCP */
+	if ( is_static_iscsi_device ( netdev ) )
+		return NULL;
+
+	return netdev;
+}
+
 /**
  * Boot the system
  */
 static int autoboot ( void ) {
 	struct net_device *netdev;
 	struct net_device *vlan;
+	struct net_device *winner = NULL;
 	int rc = -ENODEV;
 
+	/* Configure all candidate devices concurrently, if enabled,
+	 * and attempt booting from the first device to complete
+	 * configuration.  Fall back to trying each remaining device
+	 * in turn.
+	 */
+	if ( AUTOBOOT_CONCURRENT_ENABLED &&
+	     ( ifconf_race ( autoboot_candidate, &winner ) == 0 ) ) {
+		autoboot_configured = winner;
+		rc = netboot ( winner );
+	}
+
 	/* Try booting from each network device.  If we have a
 	 * specified autoboot device location, then use only devices
 	 * matching that location.
@@ -651,13 +728,18 @@ static int autoboot ( void ) {
 		/* Skip trunk device and boot from the VLAN device */
 		if ( ( vlan = vlan_present ( netdev ) ) ) {
 			printf ( "VLAN is present on %s. Skipping trunk net device...\n", netdev->name );
-			rc = netboot ( vlan );
+			if ( vlan != winner )
+				rc = netboot ( vlan );
 			continue;
 		} else if ( vlan_tag ( netdev ) ) {
 			/* Skip the VLAN device - we already tried to boot from it before */
 			continue;
 		}
 
+		/* Skip the device we already tried to boot from */
+		if ( netdev == winner )
+			continue;
+
 		/* Attempt booting from this device */
 		rc = netboot ( netdev );
 	}
@@ -672,20 +754,27 @@ static int autoboot ( void ) {
  * @ret	enter_shell	User wants to enter shell
  */
 static int show_banner_and_get_key ( void ) {
+	int key;
+
 	if ( boot_post_shell ) {
 		/* Remove the key press from the buffer */
 		if ( iskey() )
 			getchar();
-		return CTRL_B;
+		key = CTRL_B;
+	} else if ( BANNER_TIMEOUT <= 0 ) {
+		/* Skip prompt if timeout is zero */
+		key = 0;
+	} else {
+		/* Prompt user */
+		printf ( "\n" );
+		key = prompt_any ( "Press Ctrl-B for FlexBoot setup, or ESC to skip boot...",
+				   ( ( BANNER_TIMEOUT * TICKS_PER_SEC ) / 10 ) );
 	}
-	/* Skip prompt if timeout is zero */
-	if ( BANNER_TIMEOUT <= 0 )
-		return 0;
 
-	/* Prompt user */
-	printf ( "\n" );
-	return ( prompt_any ( "Press Ctrl-B for FlexBoot setup, or ESC to skip boot...",
-			  ( ( BANNER_TIMEOUT * TICKS_PER_SEC ) / 10 ) ) );
+	/* Allow any device probes overlapped with the prompt to complete */
+	device_probe_wait();
+
+	return key;
 }
 
 
@@ -723,6 +812,7 @@ void ipxe ( struct net_device *netdev ) {
 	/* Boot system */
 	if ( ( image = first_image() ) != NULL ) {
 		/* We have an embedded image; execute it */
+		device_probe_wait();
 		image_exec ( image );
 	} else if ( ( key_pressed = show_banner_and_get_key () ) == CTRL_B ) {
 		/* User wants shell; just give them a shell */
@@ -21,6 +21,7 @@
 FILE_LICENCE ( GPL2_OR_LATER );
 
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
@@ -30,6 +31,8 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <ipxe/job.h>
 #include <ipxe/monojob.h>
 #include <ipxe/timer.h>
+#include <ipxe/settings.h>
+#include <ipxe/dhcp.h>
 #include <usr/ifmgmt.h>
 #include <ipxe/if_ether.h>
 
@@ -333,3 +336,217 @@ int ifconf ( struct net_device *netdev,
 		 netdev->name, netdev->ll_protocol->ntoa ( netdev->ll_addr ) );
 	return ifpoller_wait ( netdev, configurator, 0, ifconf_progress );
 }
+
+/** A network device taking part in concurrent configuration */
+struct ifrace_candidate {
+	/** Network device */
+	struct net_device *netdev;
+	/** Configuration has been started */
+	int started;
+	/** Candidate has finished (successfully or otherwise) */
+	int finished;
+};
+
+/** Concurrent network device configuration */
+struct ifrace {
+	/** Job control interface */
+	struct interface job;
+	/** Candidate network devices */
+	struct ifrace_candidate *candidates;
+	/** Number of candidate network devices */
+	unsigned int count;
+	/** Start time (in ticks) */
+	unsigned long start;
+	/** Winning network device, if any */
+	struct net_device *winner;
+};
+
+/**
+ * Check concurrent configuration progress
+ *
+ * @v ifrace		Concurrent configuration
+ * @v progress		Progress report to fill in
+ * @ret ongoing_rc	Ongoing job status code (if known)
+ */
+static int ifrace_progress ( struct ifrace *ifrace,
+			     struct job_progress *progress __unused ) {
+	struct ifrace_candidate *candidate;
+	struct net_device *netdev;
+	unsigned long elapsed = ( currticks() - ifrace->start );
+	unsigned int remaining = 0;
+	unsigned int i;
+	int rc;
+
+	for ( i = 0 ; i < ifrace->count ; i++ ) {
+		candidate = &ifrace->candidates[i];
+		netdev = candidate->netdev;
+		if ( candidate->finished )
+			continue;
+
+		/* Start configuration once link is up, or give up
+		 * waiting for link-up after the usual timeout.
+		 */
+		if ( ! candidate->started ) {
+			if ( netdev_link_ok ( netdev ) ) {
+				DBGC ( ifrace, "IFRACE %s link up after %ld "
+				       "ticks\n", netdev->name, elapsed );
+				if ( ( rc = netdev_configure_all ( netdev ) )
+				     != 0 ) {
+					candidate->finished = 1;
+					continue;
+				}
+				candidate->started = 1;
+			} else if ( elapsed >= LINK_WAIT_TIMEOUT ) {
+				DBGC ( ifrace, "IFRACE %s link down: %s\n",
+				       netdev->name,
+				       strerror ( netdev->link_rc ) );
+				candidate->finished = 1;
+				continue;
+			}
+			remaining++;
+			continue;
+		}
+
+		/* Wait for configuration to complete */
+		if ( netdev_configuration_in_progress ( netdev ) ) {
+			remaining++;
+			continue;
+		}
+		candidate->finished = 1;
+
+		/* First successfully configured device wins */
+		if ( netdev_configuration_ok ( netdev ) ) {
+			ifrace->winner = netdev;
+			intf_close ( &ifrace->job, 0 );
+			return 0;
+		}
+		DBGC ( ifrace, "IFRACE %s configuration failed after %ld "
+		       "ticks\n", netdev->name, elapsed );
+	}
+
+	/* Fail if no candidates remain */
+	if ( ! remaining )
+		intf_close ( &ifrace->job, -EADDRNOTAVAIL_CONFIG );
+
+	return 0;
+}
+
+/** Concurrent configuration job control interface operations */
+static struct interface_operation ifrace_job_op[] = {
+	INTF_OP ( job_progress, struct ifrace *, ifrace_progress ),
+};
+
+/** Concurrent configuration job control interface descriptor */
+static struct interface_descriptor ifrace_job_desc =
+	INTF_DESC ( struct ifrace, job, ifrace_job_op );
+
+/**
+ * Cancel configuration of a losing network device
+ *
+ * @v netdev		Network device
+ *
+ * Closes the network device (thereby terminating any ongoing
+ * configuration) and discards any DHCP settings that it may already
+ * have acquired, so that they cannot be picked up in preference to
+ * those of the winning device.
+ */
+static void ifrace_cancel ( struct net_device *netdev ) {
+	static const char *names[] = {
+		DHCP_SETTINGS_NAME, PROXYDHCP_SETTINGS_NAME,
+		PXEBS_SETTINGS_NAME,
+	};
+	struct settings *settings;
+	unsigned int i;
+
+	netdev_close ( netdev );
+	for ( i = 0 ; i < ( sizeof ( names ) / sizeof ( names[0] ) ) ; i++ ) {
+		settings = find_child_settings ( netdev_settings ( netdev ),
+						 names[i] );
+		if ( settings )
+			unregister_settings ( settings );
+	}
+}
+
+/**
+ * Perform concurrent configuration of multiple network devices
+ *
+ * @v select		Candidate selector
+ * @ret winner		First network device to complete configuration
+ * @ret rc		Return status code
+ *
+ * Opens every network device accepted by the candidate selector,
+ * starts all applicable configurators on each as soon as its link
+ * comes up, and waits for the first device to complete
+ * configuration successfully.  All other candidates are closed.
+ *
+ * The candidate selector may return a different network device
+ * (e.g. a VLAN device in place of its trunk device), or NULL to skip
+ * the network device.
+ */
+int ifconf_race ( struct net_device * ( * select ) ( struct net_device * ),
+		  struct net_device **winner ) {
+	static struct ifrace ifrace = {
+		.job = INTF_INIT ( ifrace_job_desc ),
+	};
+	struct ifrace_candidate *candidates;
+	struct net_device *netdev;
+	struct net_device *candidate;
+	unsigned long elapsed;
+	unsigned int count = 0;
+	unsigned int i;
+	int rc;
+
+	/* Allocate candidate list */
+	for_each_netdev ( netdev )
+		count++;
+	candidates = zalloc ( count * sizeof ( candidates[0] ) );
+	if ( ! candidates ) {
+		rc = -ENOMEM;
+		goto err_alloc;
+	}
+
+	/* Open all candidate network devices */
+	memset ( &ifrace, 0, sizeof ( ifrace ) );
+	intf_init ( &ifrace.job, &ifrace_job_desc, NULL );
+	ifrace.candidates = candidates;
+	ifrace.start = currticks();
+	printf ( "Configuring" );
+	for_each_netdev ( netdev ) {
+		if ( ! ( candidate = select ( netdev ) ) )
+			continue;
+		if ( ifopen ( candidate ) != 0 )
+			continue;
+		candidates[ifrace.count++].netdev = netdev_get ( candidate );
+		printf ( " %s", candidate->name );
+	}
+	if ( ! ifrace.count ) {
+		printf ( "\n" );
+		rc = -ENODEV;
+		goto err_no_candidates;
+	}
+
+	/* Wait for first network device to complete configuration */
+	intf_plug_plug ( &monojob, &ifrace.job );
+	if ( ( rc = monojob_wait ( "", 0 ) ) != 0 )
+		goto err_wait;
+
+	/* Report time to first lease */
+	elapsed = ( currticks() - ifrace.start );
+	printf ( "Configured %s in %ld.%02ld seconds\n", ifrace.winner->name,
+		 ( elapsed / TICKS_PER_SEC ),
+		 ( ( ( elapsed % TICKS_PER_SEC ) * 100 ) / TICKS_PER_SEC ) );
+	*winner = ifrace.winner;
+
+ err_wait:
+	/* Cancel all losing network devices */
+	for ( i = 0 ; i < ifrace.count ; i++ ) {
+		candidate = candidates[i].netdev;
+		if ( candidate != ifrace.winner )
+			ifrace_cancel ( candidate );
+		netdev_put ( candidate );
+	}
+ err_no_candidates:
+	free ( candidates );
+ err_alloc:
+	return rc;
+}
@@ -48,9 +48,11 @@ void ipstat ( void ) {
 			 "InUnknownProtos:%ld InTruncatedPkts:%ld\n",
 			 stats->in_hdr_errors, stats->in_addr_errors,
 			 stats->in_unknown_protos, stats->in_truncated_pkts );
-		printf ( "  ReasmReqds:%ld ReasmOKs:%ld ReasmFails:%ld\n",
+		printf ( "  ReasmReqds:%ld ReasmOKs:%ld ReasmFails:%ld "
+			 "ReasmTimeouts:%ld ReasmOverlaps:%ld\n",
 			 stats->reasm_reqds, stats->reasm_oks,
-			 stats->reasm_fails );
+			 stats->reasm_fails, stats->reasm_timeouts,
+			 stats->reasm_overlaps );
 		printf ( "  InDelivers:%ld OutRequests:%ld OutNoRoutes:%ld\n",
 			 stats->in_delivers, stats->out_requests,
 			 stats->out_no_routes );
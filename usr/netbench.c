@@ -0,0 +1,476 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+FILE_LICENCE ( GPL2_OR_LATER );
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ipxe/refcnt.h>
+#include <ipxe/interface.h>
+#include <ipxe/xfer.h>
+#include <ipxe/iobuf.h>
+#include <ipxe/job.h>
+#include <ipxe/monojob.h>
+#include <ipxe/open.h>
+#include <ipxe/uri.h>
+#include <ipxe/process.h>
+#include <ipxe/blockdev.h>
+#include <ipxe/umalloc.h>
+#include <ipxe/malloc.h>
+#include <ipxe/timer.h>
+#include <ipxe/profile.h>
+#include <ipxe/netdevice.h>
+#include <usr/netbench.h>
+
+/** @file
+ *
+ * Network throughput benchmarking
+ *
+ * A benchmark run transfers the content of a URI, discarding the
+ * data as it arrives, and reports the achieved throughput along with
+ * packet rates, CPU cost and heap usage.  Stream protocols (TFTP,
+ * HTTP, NFS, etc) are read via the data transfer interface; block
+ * protocols (iSCSI, etc) are read sequentially via the block device
+ * interface.
+ *
+ * On the Linux userspace build this allows the whole stack to be
+ * benchmarked against ordinary servers running on the host, reached
+ * via a tap device.
+ */
+
+/** Maximum length of a single block device read */
+#define NETBENCH_BLOCK_LEN ( 64 * 1024 )
+
+/** A benchmark statistics sample */
+struct netbench_sample {
+	/** Timer ticks */
+	unsigned long ticks;
+	/** CPU timestamp */
+	uint64_t tsc;
+	/** Packets received */
+	unsigned long rx;
+	/** Packets transmitted */
+	unsigned long tx;
+	/** Heap memory in use */
+	size_t usedmem;
+};
+
+/** A network benchmark */
+struct netbench {
+	/** Reference count */
+	struct refcnt refcnt;
+	/** Job control interface */
+	struct interface job;
+	/** Data transfer (or block device control) interface */
+	struct interface xfer;
+	/** Block device command interface */
+	struct interface block;
+	/** Block device read process */
+	struct process process;
+
+	/** Block device capacity */
+	struct block_device_capacity capacity;
+	/** Block device read buffer */
+	userptr_t buffer;
+	/** Number of blocks per read */
+	unsigned int count;
+	/** Next logical block address to read */
+	uint64_t lba;
+	/** Block device command is in progress */
+	int busy;
+	/** Length of block device read in progress (if any) */
+	size_t pending;
+
+	/** Total length of data received */
+	size_t len;
+	/** Total length of data expected (if known) */
+	size_t total;
+
+	/** Benchmark has finished */
+	int finished;
+	/** Sample taken at end of benchmark */
+	struct netbench_sample end;
+};
+
+/**
+ * Record statistics sample
+ *
+ * @v sample		Sample to fill in
+ */
+static void netbench_sample ( struct netbench_sample *sample ) {
+	struct net_device *netdev;
+
+	memset ( sample, 0, sizeof ( *sample ) );
+	for_each_netdev ( netdev ) {
+		sample->rx += netdev->rx_stats.good;
+		sample->tx += netdev->tx_stats.good;
+	}
+	sample->usedmem = usedmem;
+	sample->ticks = currticks();
+	sample->tsc = profile_timestamp();
+}
+
+/**
+ * Free benchmark
+ *
+ * @v refcnt		Reference count
+ */
+static void netbench_free ( struct refcnt *refcnt ) {
+	struct netbench *bench =
+		container_of ( refcnt, struct netbench, refcnt );
+
+	ufree ( bench->buffer );
+	free ( bench );
+}
+
+/**
+ * Terminate benchmark
+ *
+ * @v bench		Benchmark
+ * @v rc		Reason for termination
+ */
+static void netbench_finished ( struct netbench *bench, int rc ) {
+
+	/* Take final sample before tearing down the connection, so
+	 * that memory freed by teardown is not credited to the
+	 * benchmark.
+	 */
+	if ( ! bench->finished ) {
+		netbench_sample ( &bench->end );
+		bench->finished = 1;
+	}
+
+	/* Stop process */
+	process_del ( &bench->process );
+
+	/* Shut down interfaces */
+	intf_shutdown ( &bench->block, rc );
+	intf_shutdown ( &bench->xfer, rc );
+	intf_shutdown ( &bench->job, rc );
+}
+
+/****************************************************************************
+ *
+ * Job control interface
+ *
+ */
+
+/**
+ * Report benchmark progress
+ *
+ * @v bench		Benchmark
+ * @v progress		Progress report to fill in
+ * @ret ongoing_rc	Ongoing job status code (if known)
+ */
+static int netbench_progress ( struct netbench *bench,
+			       struct job_progress *progress ) {
+
+	progress->completed = bench->len;
+	progress->total = bench->total;
+	return 0;
+}
+
+/** Benchmark job control interface operations */
+static struct interface_operation netbench_job_op[] = {
+	INTF_OP ( job_progress, struct netbench *, netbench_progress ),
+	INTF_OP ( intf_close, struct netbench *, netbench_finished ),
+};
+
+/** Benchmark job control interface descriptor */
+static struct interface_descriptor netbench_job_desc =
+	INTF_DESC ( struct netbench, job, netbench_job_op );
+
+/****************************************************************************
+ *
+ * Data transfer interface
+ *
+ */
+
+/**
+ * Receive data
+ *
+ * @v bench		Benchmark
+ * @v iobuf		I/O buffer
+ * @v meta		Data transfer metadata
+ * @ret rc		Return status code
+ */
+static int netbench_deliver ( struct netbench *bench,
+			      struct io_buffer *iobuf,
+			      struct xfer_metadata *meta __unused ) {
+
+	/* Count and discard data */
+	bench->len += iob_len ( iobuf );
+	free_iob ( iobuf );
+
+	return 0;
+}
+
+/** Benchmark data transfer interface operations */
+static struct interface_operation netbench_xfer_op[] = {
+	INTF_OP ( xfer_deliver, struct netbench *, netbench_deliver ),
+	INTF_OP ( intf_close, struct netbench *, netbench_finished ),
+};
+
+/** Benchmark data transfer interface descriptor */
+static struct interface_descriptor netbench_xfer_desc =
+	INTF_DESC ( struct netbench, xfer, netbench_xfer_op );
+
+/****************************************************************************
+ *
+ * Block device interface
+ *
+ */
+
+/**
+ * Record block device capacity
+ *
+ * @v bench		Benchmark
+ * @v capacity		Block device capacity
+ */
+static void netbench_capacity ( struct netbench *bench,
+				struct block_device_capacity *capacity ) {
+	unsigned int count;
+
+	/* Record capacity */
+	memcpy ( &bench->capacity, capacity, sizeof ( bench->capacity ) );
+	bench->total = ( capacity->blocks * capacity->blksize );
+
+	/* Calculate number of blocks per read */
+	count = ( NETBENCH_BLOCK_LEN / capacity->blksize );
+	if ( count > capacity->max_count )
+		count = capacity->max_count;
+	if ( ! count )
+		count = 1;
+	bench->count = count;
+
+	/* Allocate read buffer */
+	bench->buffer = umalloc ( count * capacity->blksize );
+	if ( ! bench->buffer )
+		netbench_finished ( bench, -ENOMEM );
+}
+
+/**
+ * Handle completion of block device command
+ *
+ * @v bench		Benchmark
+ * @v rc		Reason for completion
+ */
+static void netbench_block_close ( struct netbench *bench, int rc ) {
+
+	/* Restart interface for the next command */
+	intf_restart ( &bench->block, rc );
+
+	/* Abort on error */
+	if ( rc != 0 ) {
+		netbench_finished ( bench, rc );
+		return;
+	}
+
+	/* Count completed data */
+	bench->len += bench->pending;
+	bench->pending = 0;
+	bench->busy = 0;
+}
+
+/** Benchmark block device interface operations */
+static struct interface_operation netbench_block_op[] = {
+	INTF_OP ( intf_close, struct netbench *, netbench_block_close ),
+	INTF_OP ( block_capacity, struct netbench *, netbench_capacity ),
+};
+
+/** Benchmark block device interface descriptor */
+static struct interface_descriptor netbench_block_desc =
+	INTF_DESC ( struct netbench, block, netbench_block_op );
+
+/**
+ * Issue block device commands
+ *
+ * @v bench		Benchmark
+ */
+static void netbench_step ( struct netbench *bench ) {
+	struct block_device_capacity *capacity = &bench->capacity;
+	unsigned int count;
+	size_t len;
+	int rc;
+
+	/* Wait for any command in progress to complete, and for the
+	 * block device to become ready.
+	 */
+	if ( bench->busy )
+		return;
+	if ( xfer_window ( &bench->xfer ) == 0 )
+		return;
+
+	/* Read capacity if not yet known */
+	if ( ! capacity->blksize ) {
+		if ( ( rc = block_read_capacity ( &bench->xfer,
+						  &bench->block ) ) != 0 ) {
+			netbench_finished ( bench, rc );
+			return;
+		}
+		bench->busy = 1;
+		return;
+	}
+
+	/* Finish when all blocks have been read */
+	if ( bench->lba >= capacity->blocks ) {
+		netbench_finished ( bench, 0 );
+		return;
+	}
+
+	/* Read next group of blocks */
+	count = bench->count;
+	if ( count > ( capacity->blocks - bench->lba ) )
+		count = ( capacity->blocks - bench->lba );
+	len = ( count * capacity->blksize );
+	if ( ( rc = block_read ( &bench->xfer, &bench->block, bench->lba,
+				 count, bench->buffer, len ) ) != 0 ) {
+		netbench_finished ( bench, rc );
+		return;
+	}
+	bench->lba += count;
+	bench->pending = len;
+	bench->busy = 1;
+}
+
+/** Benchmark block device process descriptor */
+static struct process_descriptor netbench_process_desc =
+	PROC_DESC ( struct netbench, process, netbench_step );
+
+/****************************************************************************
+ *
+ * Benchmark runner
+ *
+ */
+
+/**
+ * Report benchmark results
+ *
+ * @v name		Benchmark name
+ * @v len		Length of data transferred
+ * @v start		Sample taken at start of benchmark
+ * @v end		Sample taken at end of benchmark
+ * @v peak		Peak heap memory in use during benchmark
+ */
+static void netbench_report ( const char *name, size_t len,
+			      struct netbench_sample *start,
+			      struct netbench_sample *end, size_t peak ) {
+	unsigned long long bytes = len;
+	unsigned long long cycles = ( end->tsc - start->tsc );
+	unsigned long rx = ( end->rx - start->rx );
+	unsigned long tx = ( end->tx - start->tx );
+	unsigned long ms;
+	unsigned long rate;
+	unsigned long cpb;
+
+	/* Calculate elapsed time, avoiding division by zero */
+	ms = ( ( ( end->ticks - start->ticks ) * 1000UL ) / TICKS_PER_SEC );
+	if ( ! ms )
+		ms = 1;
+
+	/* Calculate throughput in units of 0.01MB/s and CPU cost in
+	 * units of 0.01 cycles per byte.
+	 */
+	rate = ( bytes / ( 10 * ms ) );
+	cpb = ( bytes ? ( ( cycles * 100 ) / bytes ) : 0 );
+
+	printf ( "%s: %zd bytes in %ld.%03lds\n", name, len,
+		 ( ms / 1000 ), ( ms % 1000 ) );
+	printf ( "  %ld.%02ld MB/s, %ld.%02ld cycles/byte\n",
+		 ( rate / 100 ), ( rate % 100 ), ( cpb / 100 ), ( cpb % 100 ) );
+	printf ( "  RX %ld packets (%ld/s), TX %ld packets (%ld/s)\n", rx,
+		 ( ( rx * 1000UL ) / ms ), tx, ( ( tx * 1000UL ) / ms ) );
+	printf ( "  heap peak %zdkB, %ld bytes not freed\n",
+		 ( ( peak - start->usedmem ) / 1024 ),
+		 ( ( long ) ( end->usedmem - start->usedmem ) ) );
+}
+
+/**
+ * Run network benchmark
+ *
+ * @v uri		URI
+ * @v flags		Benchmark flags
+ * @v timeout		Timeout (or zero for no timeout)
+ * @ret rc		Return status code
+ */
+int netbench ( struct uri *uri, unsigned int flags, unsigned long timeout ) {
+	struct netbench_sample start;
+	struct netbench_sample end;
+	struct netbench *bench;
+	const char *password;
+	char *name;
+	size_t len;
+	int rc;
+
+	/* Construct redacted URI */
+	password = uri->password;
+	if ( password )
+		uri->password = "***";
+	name = format_uri_alloc ( uri );
+	uri->password = password;
+	if ( ! name ) {
+		rc = -ENOMEM;
+		goto err_name;
+	}
+
+	/* Take initial sample */
+	netbench_sample ( &start );
+	maxusedmem = usedmem;
+
+	/* Allocate and initialise structure */
+	bench = zalloc ( sizeof ( *bench ) );
+	if ( ! bench ) {
+		rc = -ENOMEM;
+		goto err_alloc;
+	}
+	ref_init ( &bench->refcnt, netbench_free );
+	intf_init ( &bench->job, &netbench_job_desc, &bench->refcnt );
+	intf_init ( &bench->xfer, &netbench_xfer_desc, &bench->refcnt );
+	intf_init ( &bench->block, &netbench_block_desc, &bench->refcnt );
+	process_init_stopped ( &bench->process, &netbench_process_desc,
+			       &bench->refcnt );
+
+	/* Open URI */
+	if ( ( rc = xfer_open_uri ( &bench->xfer, uri ) ) != 0 ) {
+		printf ( "Could not open %s: %s\n", name, strerror ( rc ) );
+		goto err_open;
+	}
+	if ( flags & NETBENCH_BLOCK )
+		process_add ( &bench->process );
+
+	/* Attach to job control interface and wait for completion */
+	intf_plug_plug ( &bench->job, &monojob );
+	rc = monojob_wait ( name, timeout );
+
+ err_open:
+	netbench_finished ( bench, rc );
+	len = bench->len;
+	memcpy ( &end, &bench->end, sizeof ( end ) );
+	ref_put ( &bench->refcnt );
+
+	/* Report results */
+	if ( rc == 0 ) {
+		netbench_report ( name, len, &start, &end, maxusedmem );
+	}
+ err_alloc:
+	free ( name );
+ err_name:
+	return rc;
+}
@@ -20,6 +20,7 @@
 FILE_LICENCE ( GPL2_OR_LATER );
 
 #include <stdio.h>
+#include <syslog.h>
 #include <ipxe/profile.h>
 #include <usr/profstat.h>
 
@@ -37,8 +38,56 @@ void profstat ( void ) {
 	struct profiler *profiler;
 
 	for_each_table_entry ( profiler, PROFILERS ) {
-		printf ( "%s: %ld +/- %ld ticks (%d samples)\n",
+		printf ( "%s: %ld +/- %ld ticks (%d samples)",
 			 profiler->name, profile_mean ( profiler ),
 			 profile_stddev ( profiler ), profiler->count );
+		if ( PROFILE_HIST_BUCKETS ) {
+			printf ( " p50 %ld p99 %ld",
+				 profile_percentile ( profiler, 50 ),
+				 profile_percentile ( profiler, 99 ) );
+		}
+		printf ( " max %ld\n", profiler->max );
 	}
 }
+
+/**
+ * Send profiling statistics to system log
+ *
+ * Each profiler with at least one sample is logged as a single
+ * compact line of space-separated "key=value" fields, suitable for
+ * collection by a remote syslog server.  Percentiles are included
+ * only if PROFILE_HISTOGRAMS is enabled.
+ */
+void profstat_log ( void ) {
+	struct profiler *profiler;
+
+	for_each_table_entry ( profiler, PROFILERS ) {
+		if ( ! profiler->count )
+			continue;
+		if ( PROFILE_HIST_BUCKETS ) {
+			syslog ( LOG_INFO, "profile %s n=%d mean=%ld sd=%ld "
+				 "p50=%ld p99=%ld max=%ld\n", profiler->name,
+				 profiler->count, profile_mean ( profiler ),
+				 profile_stddev ( profiler ),
+				 profile_percentile ( profiler, 50 ),
+				 profile_percentile ( profiler, 99 ),
+				 profiler->max );
+		} else {
+			syslog ( LOG_INFO, "profile %s n=%d mean=%ld sd=%ld "
+				 "max=%ld\n", profiler->name, profiler->count,
+				 profile_mean ( profiler ),
+				 profile_stddev ( profiler ), profiler->max );
+		}
+	}
+}
+
+/**
+ * Reset profiling statistics
+ *
+ */
+void profstat_reset ( void ) {
+	struct profiler *profiler;
+
+	for_each_table_entry ( profiler, PROFILERS )
+		profile_reset ( profiler );
+}